@@ -491,6 +491,9 @@ module Top = struct
   let to_list s c =
     let c = (Uint32.to_int c) in
     HeavyHitters.top c s |> Array.of_list
+
+  (* Combine the tops computed over two parts of a stream: *)
+  let merge = HeavyHitters.merge
 end
 
 let hash x = Hashtbl.hash x |> Int64.of_int
@@ -1208,3 +1211,19 @@ struct
     let get, _ = map () in
     try Some (get k) with Not_found -> None
 end
+
+(* Of the top-level columns of an ORC file, given as the position of each in
+ * field masks, tells which ones must be read to serve those field masks.
+ * Returns the empty array, meaning all of them, if no field mask is known: *)
+let orc_columns_of_fieldmasks mask_indices = function
+  | [] -> [||]
+  | fieldmasks ->
+      let is_read i = function
+        | DessserMasks.Skip | SetNull -> false
+        | Copy | Replace _ | Insert _ -> true
+        | Recurse fms ->
+            i < Array.length fms &&
+            (match fms.(i) with
+            | DessserMasks.Skip | SetNull -> false
+            | _ -> true) in
+      Array.map (fun i -> List.exists (is_read i) fieldmasks) mask_indices
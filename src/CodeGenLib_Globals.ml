@@ -23,8 +23,26 @@ let init ?max_globals ?max_readers globals_dir =
   db_path := globals_dir ;
   Files.mkdir_all globals_dir
 
+(* An Lmdb environment must not be used across a fork, so a process forked
+ * after the environment or some maps have been opened must call
+ * [reinit_after_fork] to open its own before using any global variable: *)
+let generation = ref 0
+
+let reinit_after_fork () =
+  incr generation
+
+let memoize_per_process f =
+  let cache = ref None in
+  fun () ->
+    match !cache with
+    | Some (g, v) when g = !generation -> v
+    | _ ->
+        let v = f () in
+        cache := Some (!generation, v) ;
+        v
+
 let get_env =
-  memoize (fun () ->
+  memoize_per_process (fun () ->
     assert (not (N.is_empty !db_path)) ;
     Lmdb.Env.(create Rw ~max_maps:!max_global_variables
                      ?max_readers:!max_global_readers
@@ -54,7 +72,7 @@ struct
     (* Avoid initializing the database before it's needed (as [init] has to be
      * called first, and the worker may be run just for info, archive
      * conversion, as a replayer or a top-half *)
-    memoize (fun () ->
+    memoize_per_process (fun () ->
       let env = get_env () in
       let key = Conf.k_conv and value = Conf.v_conv in
       let name = Conf.scope_id ^"/"^ var_name in
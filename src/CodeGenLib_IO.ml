@@ -5,14 +5,43 @@ open Legacy.Unix
 open RamenHelpersNoLog
 open RamenHelpers
 open RamenConsts
+module Default = RamenConstsDefault
 module N = RamenName
 module Files = RamenFiles
 
+(* Copy whole CSV records from the mapped file into the buffer, and find
+ * where records start (see ringbuf/csv.c): *)
+external csv_copy_records :
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  int -> int -> Bytes.t -> int -> int = "wrap_csv_copy_records"
+
+external csv_next_record :
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  int -> int -> int -> int = "wrap_csv_next_record"
+
+(* How to parse the chunks of a plain CSV file in parallel, set by
+ * CodeGenLib_Skeletons.read when the ParallelCsvParsing experiment is on.
+ * [fork_parser f] starts a process that calls [f] with its own [while_]
+ * function and a function to call at the end of each chunk it parses,
+ * while [merge_chunks n] outputs, from the main process, the tuples of all
+ * the [n] chunks in order. Chunk number [c] is parsed by the parser number
+ * [c mod num_parsers]: *)
+type chunk_parsers =
+  { num_parsers : int ;
+    fork_parser :
+      (while_:(unit -> bool) -> end_chunk:(unit -> unit) -> unit) -> unit ;
+    merge_chunks : int -> unit }
+
+let chunk_parsers : chunk_parsers option ref = ref None
+
 (* [k] is the reader that's passed the chunks of external data
  * as a byte string, the offset and length to consume, and a flag
  * telling if more data is to be expected; And it answers with the
- * offset of the first byte not consumed, or raise Exit *)
-let read_file ~while_ ~do_unlink filename preprocessor watchdog k =
+ * offset of the first byte not consumed, or raise Exit.
+ * If the file is CSV then [csv] tells the quote character, if any, so
+ * that plain regular files can be mapped and split into whole records
+ * before they are parsed. *)
+let read_file ?csv ~while_ ~do_unlink filename preprocessor watchdog k =
   !logger.debug "read_file: Importing file %a" N.path_print filename ;
   let open_file =
     if preprocessor = "" then (
@@ -49,8 +78,108 @@ let read_file ~while_ ~do_unlink filename preprocessor watchdog k =
   | fd, close_file ->
     !logger.debug "read_file: Start reading %a" N.path_print filename ;
     (* Everything is stored into a circular buffer of fixed size that is
-     * rearranged from time to time to keep it simple for the callback. *)
-    let buffer = Bytes.create read_buffer_size in
+     * rearranged from time to time to keep it simple for the callback.
+     * Regular files are read with a larger buffer, as large as the whole
+     * file if possible, so that large files are read with few syscalls and
+     * few scrolling of the buffer: *)
+    let is_regular, buffer_size =
+      match fstat fd with
+      | exception _ ->
+          false, read_buffer_size
+      | { st_kind = S_REG ; st_size ; _ } ->
+          (* +1 to read the EOF along with the last bytes: *)
+          true,
+          min max_read_file_buffer_size (st_size + 1) |>
+          max read_buffer_size
+      | _ ->
+          false, read_buffer_size in
+    let buffer = Bytes.create buffer_size in
+    (* Returns whether EOF was reached and the new [stop].
+     * Regular files are read until the buffer is full, while pipes are
+     * consumed as the data comes: *)
+    let rec read_into stop =
+      let len = Bytes.length buffer - stop in
+      if len = 0 then false, stop else
+      let sz = Unix.restart_on_EINTR (read fd buffer stop) len in
+      !logger.debug "read_file: Read %d/%d bytes @%d" sz len stop ;
+      if sz = 0 then true, stop else
+      if is_regular then read_into (stop + sz) else false, stop + sz in
+    let consume tot_consumed start stop has_more =
+      try
+        let consumed = k buffer start stop has_more in
+        if consumed = 0 && not has_more then
+          raise (Failure "Reader makes no progress") ;
+        consumed
+      with e ->
+        let bt = Printexc.get_raw_backtrace () in
+        let filename_save = N.cat filename (N.path ".bad") in
+        !logger.error "While reading file %a at %d: %s\n%s. Saving as %a."
+          N.path_print filename
+          tot_consumed
+          (Printexc.to_string e)
+          (Printexc.raw_backtrace_to_string bt)
+          N.path_print filename_save ;
+        Files.cp filename filename_save ;
+        Printexc.raise_with_backtrace e bt in
+    (* Plain regular CSV files are mapped rather than read, and copied into
+     * the buffer by chunks of whole records so that the parser never has to
+     * wait for the end of a record.
+     * Then, large files can also be split into chunks of whole records that
+     * are parsed in a pool of processes: *)
+    let read_mapped quote =
+      let src =
+        map_file fd Bigarray.char Bigarray.c_layout false [| -1 |] |>
+        Bigarray.array1_of_genarray in
+      let src_len = Bigarray.Array1.dim src in
+      let quote = Option.map_default Char.code (-1) quote in
+      (* Parse the records from [offs] to [stop]: *)
+      let rec read_chunk ~while_ offs stop =
+        if offs < stop && while_ () then (
+          let len = csv_copy_records src offs stop buffer quote in
+          !logger.debug "read_file: Copied %d bytes of records @%d" len offs ;
+          if len = 0 then
+            Printf.sprintf "CSV record @%d larger than %d bytes"
+              offs (Bytes.length buffer) |>
+            failwith ;
+          let has_more = offs + len < stop in
+          let rec parse start =
+            if start >= len || not (while_ ()) then start else
+            match consume (offs + start) start len has_more with
+            | 0 -> start
+            | consumed -> parse (start + consumed) in
+          let consumed = parse 0 in
+          if consumed = 0 && while_ () then
+            failwith "Reader makes no progress" ;
+          read_chunk ~while_ (offs + consumed) stop
+        ) in
+      (* Returns the offsets of the chunks, followed by the file length: *)
+      let rec split_chunks starts start =
+        let starts = start :: starts in
+        let next =
+          if start + Default.csv_chunk_size >= src_len then src_len else
+          csv_next_record src start (start + Default.csv_chunk_size) quote in
+        if next >= src_len then Array.of_list (List.rev (src_len :: starts))
+        else split_chunks starts next in
+      match !chunk_parsers with
+      | Some cp when src_len > Default.csv_chunk_size ->
+          let bounds = split_chunks [] 0 in
+          let num_chunks = Array.length bounds - 1 in
+          let num_parsers = min cp.num_parsers num_chunks in
+          !logger.info "Parsing %a in %d chunks with %d processes"
+            N.path_print filename num_chunks num_parsers ;
+          for i = 0 to num_parsers - 1 do
+            cp.fork_parser (fun ~while_ ~end_chunk ->
+              let rec loop c =
+                if c < num_chunks && while_ () then (
+                  read_chunk ~while_ bounds.(c) bounds.(c + 1) ;
+                  end_chunk () ;
+                  loop (c + num_parsers)
+                ) in
+              loop i)
+          done ;
+          cp.merge_chunks num_chunks
+      | _ ->
+          read_chunk ~while_ 0 src_len in
     finally
       (fun () ->
         !logger.debug "read_file: Finished reading %a" N.path_print filename ;
@@ -66,53 +195,39 @@ let read_file ~while_ ~do_unlink filename preprocessor watchdog k =
          * If we used a preprocessor we must wait for EOF before
          * unlinking the file. *)
         RamenWatchdog.enable watchdog ;
-        let rec read_more tot_consumed start stop has_more =
-          (* TODO: read in a loop until buffer is full or not has_more *)
-          let has_more, stop =
-            let len = Bytes.length buffer - stop in
-            if has_more && len > 0 then (
-              let sz = read fd buffer stop len in
-              !logger.debug "read_file: Read %d/%d bytes @%d" sz len stop ;
-              sz > 0, stop + sz
-            ) else
-              has_more, stop
-          in
-          let consumed =
-            if stop > start then
-              try
-                let consumed = k buffer start stop has_more in
-                if consumed = 0 && not has_more then
-                  raise (Failure "Reader makes no progress") ;
-                consumed
-              with e ->
-                let bt = Printexc.get_raw_backtrace () in
-                let filename_save = N.cat filename (N.path ".bad") in
-                !logger.error "While reading file %a at %d: %s\n%s. Saving as %a."
-                  N.path_print filename
-                  tot_consumed
-                  (Printexc.to_string e)
-                  (Printexc.raw_backtrace_to_string bt)
-                  N.path_print filename_save ;
-                Files.cp filename filename_save ;
-                Printexc.raise_with_backtrace e bt
-            else
-              0 in
-          !logger.debug "read_file: Consumed %d/%d bytes"
-            consumed (stop - start) ;
-          let start = start + consumed in
-          if while_ () && (has_more || stop > start) then
-            (* Before reading more data, scroll everything back to the buffer's
-             * beginning if we get too close to the buffer's end: *)
-            let start, stop =
-              if has_more && Bytes.length buffer - start < max_external_msg_size
-              then (
-                !logger.debug "read_file: Scrolling buffer" ;
-                Bytes.blit buffer start buffer 0 (stop - start) ;
-                0, stop - start
-              ) else
-                start, stop in
-            read_more (tot_consumed + consumed) start stop has_more in
-        read_more 0 0 0 true
+        match csv with
+        | Some quote when is_regular && preprocessor = "" ->
+            read_mapped quote
+        | _ ->
+            let rec read_more tot_consumed start stop has_more =
+              let has_more, stop =
+                if has_more then
+                  let eof, stop = read_into stop in
+                  not eof, stop
+                else
+                  has_more, stop
+              in
+              let consumed =
+                if stop > start then consume tot_consumed start stop has_more
+                else 0 in
+              !logger.debug "read_file: Consumed %d/%d bytes"
+                consumed (stop - start) ;
+              let start = start + consumed in
+              if while_ () && (has_more || stop > start) then
+                (* Before reading more data, scroll everything back to the
+                 * buffer's beginning if we get too close to the buffer's
+                 * end: *)
+                let start, stop =
+                  if has_more &&
+                     Bytes.length buffer - start < max_external_msg_size
+                  then (
+                    !logger.debug "read_file: Scrolling buffer" ;
+                    Bytes.blit buffer start buffer 0 (stop - start) ;
+                    0, stop - start
+                  ) else
+                    start, stop in
+                read_more (tot_consumed + consumed) start stop has_more in
+            read_more 0 0 0 true
       ) ()
 
 let check_file_exists kind kind_name path =
@@ -132,7 +247,7 @@ let check_dir_exists = check_file_exists S_DIR "directory"
 let watchdog = ref None
 
 (* Calls [k] with buffered data repeatedly *)
-let read_glob_file path preprocessor do_unlink quit_flag while_ k =
+let read_glob_file ?csv path preprocessor do_unlink quit_flag while_ k =
   let dirname = Filename.dirname path |> N.path
   and glob_str = Filename.basename path in
   let glob = Globs.compile glob_str in
@@ -142,7 +257,7 @@ let read_glob_file path preprocessor do_unlink quit_flag while_ k =
   let import_file_if_match (filename : N.path) =
     if Globs.matches glob (filename :> string) then
       try
-        read_file ~while_ ~do_unlink (N.path_cat [dirname ; filename ])
+        read_file ?csv ~while_ ~do_unlink (N.path_cat [dirname ; filename ])
                   preprocessor watchdog k
       with exn ->
         !logger.error "Exception while reading file %a: %s\n%s"
@@ -23,6 +23,7 @@ open RamenLog
 open RamenSync
 module C = CodeGenLib_Config
 module CltCmd = Sync_client_cmd.DessserGen
+module Default = RamenConstsDefault
 module DT = DessserTypes
 module DO = Output_specs.DessserGen
 module DWO = Output_specs_wire.DessserGen
@@ -244,6 +245,8 @@ let filter_tuple scalar_extractors filters tuple =
 (* For non-wrapping buffers we need to know the value for the time, as
  * the min/max times per slice are saved, along the first/last tuple
  * sequence number. *)
+let sample_serialize = Stats.Stage.sampler ()
+
 let output_to_rb rb serialize_tuple sersize_of_tuple fieldmask
                  (* Those last parameters change at every tuple: *)
                  start_stop head tuple_opt =
@@ -256,6 +259,7 @@ let output_to_rb rb serialize_tuple sersize_of_tuple fieldmask
    * value! *)
   if tuple_opt = None (* ie sending a message *) || tuple_sersize > 0 then (
     IntCounter.add Stats.write_bytes sersize ;
+    let t0 = sample_serialize () in
     let tx = enqueue_alloc rb sersize in
     let offs =
       RingBufLib.write_message_header tx 0 head ;
@@ -267,12 +271,38 @@ let output_to_rb rb serialize_tuple sersize_of_tuple fieldmask
     (* start = stop = 0. => times are unset *)
     let start, stop = Option.default (0., 0.) start_stop in
     enqueue_commit tx start stop ;
+    ignore (Stats.Stage.lap Stats.Stage.serialize t0) ;
     if offs' <> sersize then
       !logger.error "Outputing to %d@%s, offs=%d whereas sersize=%d"
         offs (RingBuf.tx_fname tx) offs' sersize ;
     assert (offs' = sersize)
   )
 
+(* Same as above for a burst of messages, that are all written with a
+ * single allocation and commit in the ringbuf. [msgs] come with their
+ * serialized sizes and have been filtered already: *)
+let output_batch_to_rb rb serialize_tuple fieldmask msgs =
+  let sersizes = Array.map (fun (_, _, _, sersize) -> sersize) msgs in
+  Array.iter (IntCounter.add Stats.write_bytes) sersizes ;
+  let t0 = sample_serialize () in
+  (* Fail rather than wait, the caller takes care of retrying: *)
+  RingBufLib.with_enqueue_batch_tx ~max_retry:1 rb sersizes (fun tx i ->
+    let start_stop, head, tuple_opt, sersize = msgs.(i) in
+    let offs =
+      RingBufLib.write_message_header tx 0 head ;
+      RingBufLib.message_header_sersize head in
+    let offs' =
+      match tuple_opt with
+      | Some tuple -> serialize_tuple fieldmask tx offs tuple
+      | None -> offs in
+    if offs' <> sersize then
+      !logger.error "Outputing to %d@%s, offs=%d whereas sersize=%d"
+        offs (RingBuf.tx_fname tx) offs' sersize ;
+    assert (offs' = sersize) ;
+    (* start = stop = 0. => times are unset *)
+    Option.default (0., 0.) start_stop) ;
+  ignore (Stats.Stage.lap Stats.Stage.serialize t0)
+
 type 'a out_rb =
   { fname : N.path ;
     (* To detect when the file that's been mmapped has been replaced on disk
@@ -286,25 +316,36 @@ type 'a out_rb =
     mutable quarantine_until : float ;
     mutable quarantine_delay : float ;
     rate_limit_log_writes : unit -> bool ;
-    rate_limit_log_drops : unit -> bool }
-
-let write_to_rb ~while_ out_rb file_spec
-                serialize_tuple sersize_of_tuple
-                dest_channel start_stop head tuple_opt =
-  let print_event_time =
-    Option.print (Tuple2.print print_as_date print_as_date) in
-  if dest_channel <> Channel.live && out_rb.rate_limit_log_writes () then
-    !logger.debug "Write a %s to channel %a"
-      (if tuple_opt = None then "message"
-       else ("tuple of etime="^ IO.to_string print_event_time start_stop))
-      Channel.print dest_channel ;
-  (* Note: we retry only on NoMoreRoom so that's OK to keep trying; in
-   * case the ringbuf disappear altogether because the child is
-   * terminated then we won't deadloop.  Also, if one child is full
-   * then we will not write to next children until we can eventually
-   * write to this one. This is actually desired to have proper message
-   * ordering along the stream and avoid ending up with many threads
-   * retrying to write to the same child. *)
+    rate_limit_log_drops : unit -> bool ;
+    (* Messages waiting to be written at once (see [with_output_batch]),
+     * last first, with their serialized size: *)
+    mutable batch :
+      ((float * float) option * RingBufLib.message_header * 'a option * int)
+        list ;
+    mutable batch_len : int ;
+    mutable batch_sersize : int ;
+    (* The fieldmask of the batched tuples: *)
+    mutable batch_fieldmask : DessserMasks.t ;
+    (* Flush a batch before it uses that many bytes: *)
+    max_batch_sersize : int }
+
+(* Whether outputs to ringbufs are currently being batched: *)
+let output_batching = ref false
+
+(* Functions flushing the ringbufs that have some batched messages: *)
+let batch_flushers = ref []
+
+(* Protects the outputers (see [start_zmq_client]), and therefore also the
+ * batches of messages pending in them: *)
+let outputers_lock = Mutex.create ()
+
+(* The field masks of all current outputers, so that readers can skip the
+ * fields no one needs: *)
+let out_fieldmasks = ref []
+
+(* Retry [f] for as long as [out_rb] has no room for [sersize ()] bytes,
+ * quarantining that ringbuf when that lasts for too long: *)
+let retry_out_rb ~while_ out_rb sersize f =
   retry
     ~on:(function
       | RingBuf.NoMoreRoom ->
@@ -332,7 +373,99 @@ let write_to_rb ~while_ out_rb file_spec
         )
       | _ -> false)
     ~while_ ~first_delay:0.001 ~max_delay:1. ~delay_rec:Stats.sleep_out
-    (fun () ->
+    ~sleep:(fun delay ->
+      (* Block until the reader makes some room (or delay expires): *)
+      let sersize = sersize () in
+      (* Waits are not sampled since they are both rare and expensive: *)
+      let t0 = Stats.Stage.now () in
+      RingBuf.wait_for_room out_rb.rb sersize delay ;
+      Stats.Stage.record Stats.Stage.wait_out (Stats.Stage.now () - t0))
+    f ()
+
+let output_succeeded out_rb =
+  out_rb.last_successful_output <- !CodeGenLib.now ;
+  if out_rb.quarantine_delay > 0. then (
+    !logger.info "Resuming output to %a"
+      N.path_print out_rb.fname ;
+    out_rb.quarantine_delay <- 0.)
+
+(* Write the batched messages of [out_rb], if any. Must be called with the
+ * outputers_lock. *)
+let flush_rb_batch ~while_ out_rb serialize_tuple =
+  if out_rb.batch <> [] then (
+    let msgs = array_of_list_rev out_rb.batch_len out_rb.batch
+    and fieldmask = out_rb.batch_fieldmask
+    and tot_sersize =
+      (* Each record but the first also comes with its size word: *)
+      out_rb.batch_sersize +
+      (out_rb.batch_len - 1) * DessserRamenRingBuffer.word_size in
+    out_rb.batch <- [] ;
+    out_rb.batch_len <- 0 ;
+    out_rb.batch_sersize <- 0 ;
+    try
+      retry_out_rb ~while_ out_rb (fun () -> tot_sersize) (fun () ->
+        output_batch_to_rb out_rb.rb serialize_tuple fieldmask msgs) ;
+      output_succeeded out_rb
+    with
+      (* Same as in writer_to_file: *)
+      | RingBuf.NoMoreRoom | Exit -> ())
+
+(* Run [f] while batching the outputs to ringbufs, which are then written
+ * with one allocation and commit per ringbuf. For bursts of output tuples,
+ * such as those decoded from a single datagram. *)
+let with_output_batch f =
+  if !output_batching then f () else (
+    output_batching := true ;
+    finally (fun () ->
+      output_batching := false ;
+      with_lock outputers_lock (fun () ->
+        let flushers = !batch_flushers in
+        batch_flushers := [] ;
+        List.iter (fun flush -> flush ()) flushers))
+      f ())
+
+let write_to_rb ~while_ out_rb file_spec
+                serialize_tuple sersize_of_tuple
+                dest_channel start_stop head tuple_opt =
+  let print_event_time =
+    Option.print (Tuple2.print print_as_date print_as_date) in
+  if dest_channel <> Channel.live && out_rb.rate_limit_log_writes () then
+    !logger.debug "Write a %s to channel %a"
+      (if tuple_opt = None then "message"
+       else ("tuple of etime="^ IO.to_string print_event_time start_stop))
+      Channel.print dest_channel ;
+  let fieldmask = file_spec.DO.fieldmask in
+  let sersize () =
+    RingBufLib.message_header_sersize head +
+    Option.map_default (sersize_of_tuple fieldmask) 0 tuple_opt in
+  let add_to_batch () =
+    (* Same as output_to_rb, skip tuples with no output: *)
+    let tuple_sersize =
+      Option.map_default (sersize_of_tuple fieldmask) 0 tuple_opt in
+    if tuple_opt = None || tuple_sersize > 0 then (
+      let sersize = RingBufLib.message_header_sersize head + tuple_sersize in
+      if out_rb.batch <> [] &&
+         (out_rb.batch_fieldmask != fieldmask ||
+          out_rb.batch_sersize + sersize > out_rb.max_batch_sersize ||
+          out_rb.batch_len >= max_tuples_per_batch)
+      then
+        flush_rb_batch ~while_ out_rb serialize_tuple ;
+      if out_rb.batch = [] then (
+        out_rb.batch_fieldmask <- fieldmask ;
+        batch_flushers :=
+          (fun () -> flush_rb_batch ~while_ out_rb serialize_tuple) ::
+            !batch_flushers) ;
+      out_rb.batch <- (start_stop, head, tuple_opt, sersize) :: out_rb.batch ;
+      out_rb.batch_len <- out_rb.batch_len + 1 ;
+      out_rb.batch_sersize <- out_rb.batch_sersize + sersize) in
+  (* Note: we retry only on NoMoreRoom so that's OK to keep trying; in
+   * case the ringbuf disappear altogether because the child is
+   * terminated then we won't deadloop.  Also, if one child is full
+   * then we will not write to next children until we can eventually
+   * write to this one. This is actually desired to have proper message
+   * ordering along the stream and avoid ending up with many threads
+   * retrying to write to the same child. *)
+  retry_out_rb ~while_ out_rb sersize (fun () ->
       match Hashtbl.find file_spec.DO.channels dest_channel with
       | exception Not_found ->
           (* Can happen at leaf functions after a replay, or when replaying
@@ -344,14 +477,13 @@ let write_to_rb ~while_ out_rb file_spec
           if not (OutRef.timed_out !CodeGenLib.now timeo) then (
             if out_rb.quarantine_until < !CodeGenLib.now then (
               if Option.map_default out_rb.tup_filter true tuple_opt then (
-                output_to_rb
-                  out_rb.rb serialize_tuple sersize_of_tuple
-                  file_spec.DO.fieldmask start_stop head tuple_opt ;
-                out_rb.last_successful_output <- !CodeGenLib.now ;
-                if out_rb.quarantine_delay > 0. then (
-                  !logger.info "Resuming output to %a"
-                    N.path_print out_rb.fname ;
-                  out_rb.quarantine_delay <- 0.)
+                if !output_batching then
+                  add_to_batch ()
+                else (
+                  output_to_rb
+                    out_rb.rb serialize_tuple sersize_of_tuple
+                    fieldmask start_stop head tuple_opt ;
+                  output_succeeded out_rb)
               ) else ( (* tuple did not pass filter *)
                 !logger.debug "Skipping output to %a (filtered)"
                   N.path_print out_rb.fname ;
@@ -366,7 +498,32 @@ let write_to_rb ~while_ out_rb file_spec
             if out_rb.rate_limit_log_drops () then
               !logger.debug "Drop a tuple for %a outdated channel %a"
                 N.path_print out_rb.fname Channel.print dest_channel
-          )) ()
+          ))
+
+(* Returns the ORC writer queue depth, number of batches written, and total
+ * and max time spent writing a batch: *)
+external orc_handler_stats : 'handler -> int * int * float * float =
+  "orc_handler_stats"
+
+(* Must match the order of orc_codecs in orc/wrappers.cc: *)
+let orc_codec_of_compression = function
+  | DWO.NoCompression -> 0
+  | DWO.Zlib -> 1
+  | DWO.Snappy -> 2
+  | DWO.Lz4 -> 3
+  | DWO.Zstd -> 4
+
+(* The options tuple passed to orc_make_handler: *)
+let orc_options compression compression_block_size stripe_size
+                dictionary_threshold =
+  orc_codec_of_compression compression,
+  compression_block_size,
+  stripe_size,
+  dictionary_threshold
+
+let default_orc_options =
+  orc_options DWO.Zlib Default.orc_compression_block_size
+              Default.orc_stripe_size Default.orc_dictionary_threshold
 
 let writer_to_file ~while_ fname spec scalar_extractors
                    serialize_tuple sersize_of_tuple
@@ -383,7 +540,12 @@ let writer_to_file ~while_ fname spec scalar_extractors
           quarantine_until = 0. ;
           quarantine_delay = 0. ;
           rate_limit_log_writes = rate_limiter 10 1. ;
-          rate_limit_log_drops = rate_limiter 10 1. } in
+          rate_limit_log_drops = rate_limiter 10 1. ;
+          batch = [] ; batch_len = 0 ; batch_sersize = 0 ;
+          batch_fieldmask = spec.DO.fieldmask ;
+          (* So that a batch always fits: *)
+          max_batch_sersize =
+            stats.capacity * DessserRamenRingBuffer.word_size / 8 } in
       (fun file_spec dest_channel start_stop head tuple_opt ->
           try write_to_rb ~while_ out_rb file_spec
                           serialize_tuple sersize_of_tuple
@@ -396,13 +558,27 @@ let writer_to_file ~while_ fname spec scalar_extractors
              * the recipient is no more in our out_ref: *)
             | Exit -> ()),
       (fun () ->
+        flush_rb_batch ~while_ out_rb serialize_tuple ;
         RingBuf.may_archive_and_unload rb)
-  | Orc { with_index ; batch_size ; num_batches } ->
+  | Orc { with_index ; batch_size ; num_batches ; compression ;
+          compression_block_size ; stripe_size ; dictionary_threshold } ->
       let batch_size = Uint32.to_int batch_size
-      and num_batches = Uint32.to_int num_batches in
+      and num_batches = Uint32.to_int num_batches
+      and options =
+        orc_options compression (Uint32.to_int compression_block_size)
+                    (Uint64.to_int stripe_size) dictionary_threshold in
       let hdr =
-        orc_make_handler fname with_index batch_size num_batches true in
+        orc_make_handler fname with_index options batch_size num_batches true
+                         Default.orc_async_writes in
+      let sample_orc_stats = rate_limiter 1 1.
+      and sample_orc_write = Stats.Stage.sampler () in
       (fun file_spec dest_channel start_stop head tuple_opt ->
+        if sample_orc_stats () then (
+          let depth, num_flushes, tot_time, max_time = orc_handler_stats hdr in
+          IntGauge.set Stats.orc_write_queue depth ;
+          IntGauge.set Stats.orc_flushes num_flushes ;
+          FloatCounter.set Stats.orc_flush_time tot_time ;
+          FloatGauge.set Stats.orc_max_flush_time max_time) ;
         match head, tuple_opt with
         | RingBufLib.DataTuple chn, Some tuple ->
             assert (chn = dest_channel) ; (* by definition *)
@@ -411,7 +587,9 @@ let writer_to_file ~while_ fname spec scalar_extractors
             | timeo, _num_sources, _pids ->
                 if not (OutRef.timed_out !CodeGenLib.now timeo) then
                   let start, stop = Option.default (0., 0.) start_stop in
-                  orc_write hdr tuple start stop)
+                  let t0 = sample_orc_write () in
+                  orc_write hdr tuple start stop ;
+                  ignore (Stats.Stage.lap Stats.Stage.orc_write t0))
         | _ -> ()),
       (fun () -> orc_close hdr)
 
@@ -556,7 +734,10 @@ let publish_stats stats_key init_stats stats =
                        stats.tot_extinguished_notifs ;
           tot_cpu = init.tot_cpu +. stats.tot_cpu ;
           cur_ram = stats.cur_ram ;
-          max_ram = max init.max_ram stats.max_ram } in
+          max_ram = max init.max_ram stats.max_ram ;
+          (* Percentiles cannot be combined, so only the latencies since the
+           * last startup are reported: *)
+          stage_latencies = stats.stage_latencies } in
   let v = Value.RuntimeStats tot_stats in
   add_cmd (CltCmd.SetKey (stats_key, v))
 
@@ -602,8 +783,7 @@ let start_zmq_client conf ~while_ quit
   (* Prepare for measuring average full tuple size: *)
   let last_full_out_measurement = ref 0. in
   (* The outputer hash specialized for the given type of tuples: *)
-  let outputers = ref (Hashtbl.create 10)
-  and outputers_lock = Mutex.create () in
+  let outputers = ref (Hashtbl.create 10) in
   (*
    * The callbacks updating the outputers:
    *)
@@ -699,6 +879,10 @@ let start_zmq_client conf ~while_ quit
       if num_outputers <> prev_num_outputers then
         !logger.info "Has now %d outputers (had %d)"
           num_outputers prev_num_outputers ;
+      out_fieldmasks :=
+        Hashtbl.fold (fun _ (spec, _, _) fms ->
+          spec.DO.fieldmask :: fms
+        ) outputers' [] ;
       outputers := outputers') in
   (* Called by the ZMQ thread after the key referenced by an IndirectFile
    * has been deleted. Time to terminate the corresponding outputer. *)
@@ -15,6 +15,7 @@ module Channel = RamenChannel
 module Default = RamenConstsDefault
 module FieldMask = RamenFieldMask
 module Files = RamenFiles
+module GroupTable = RamenGroupTable
 module Heap = RamenHeap
 module IO = CodeGenLib_IO
 module N = RamenName
@@ -98,7 +99,8 @@ let may_publish_stats =
         tot_extinguished_notifs =
           Uint64.of_int (IntCounter.get Stats.extinguished_notif_count) ;
         tot_cpu = FloatCounter.get Stats.cpu ;
-        cur_ram ; max_ram } in
+        cur_ram ; max_ram ;
+        stage_latencies = Stats.Stage.latencies () } in
       publish_stats stats
     )
 
@@ -125,6 +127,8 @@ let worker_start conf time_of_tuple factors_of_tuple scalar_extractors
     try Some (Sys.getenv "LMDB_MAX_READERS" |> int_of_string)
     with _ -> None in
   CodeGenLib_Globals.init ?max_readers globals_dir ;
+  Option.may (CountryOfIp.set_index_file % N.path)
+    (Sys.getenv_opt "country_index") ;
   (* Must call this once before get_binocle_tuple because cpu/ram gauges
    * must not be NULL: *)
   Stats.update () ;
@@ -174,11 +178,204 @@ let worker_start conf time_of_tuple factors_of_tuple scalar_extractors
       ~first_delay:30. ~min_delay:30. ~max_delay:300. ~max_retry:30
       (k publish_stats)) outputer
 
+let log_rb_error =
+  let last_err = ref 0
+  and err_count = ref 0 in
+  fun ?at_exit tx e what ->
+    let open RingBuf in
+    (* Subtract one word from the start of the TX to get to the length
+     * of the message, which is a nicer starting position to dump: *)
+    let startw = tx_start tx - 1
+    and sz = tx_size tx
+    and fname = tx_fname tx in
+    assert (sz land 3 = 0) ;
+    let stopw = tx_start tx + (sz / 4) in
+    !logger.error "While %s from %S at words %d..%d(excl): %s"
+        what fname startw stopw (Printexc.to_string e) ;
+    let now = int_of_float (Unix.time ()) in
+    if now = !last_err then (
+      incr err_count ;
+      if !err_count > 5 then (
+        Option.may (fun f -> f ()) at_exit ;
+        exit ExitCodes.damaged_ringbuf
+      )
+    ) else (
+      last_err := now ;
+      err_count := 0
+    )
+
+(*
+ * Decoders: forked processes that write whole tuples into their own ringbuf
+ * for the worker to read them back, each run of tuples being followed by an
+ * EndOfReplay message (see the parallel replays and chunk parsers below).
+ *)
+
+type decoder = { pid : int ; rb : RingBuf.t ; fname : N.path }
+
+type decoding = Decoding | Decoded | Died
+
+let write_decoded ~while_ sersize_of_tuple serialize_tuple rb start_stop
+                  tuple =
+  let head = RingBufLib.DataTuple Channel.live in
+  let head_sz = RingBufLib.message_header_sersize head in
+  let sz = head_sz + sersize_of_tuple FieldMask.all_fields tuple in
+  let tx =
+    RingBufLib.retry_for_ringbuf ~while_
+      ~sleep:(RingBuf.wait_for_room rb sz) (RingBuf.enqueue_alloc rb) sz in
+  RingBufLib.write_message_header tx 0 head ;
+  let offs = serialize_tuple FieldMask.all_fields tx head_sz tuple in
+  let start, stop = Option.default (0., 0.) start_stop in
+  RingBuf.enqueue_commit tx start stop ;
+  assert (offs = sz)
+
+let write_end_of_decoding ~while_ rb =
+  let eor = RingBufLib.EndOfReplay (Channel.live, 0) in
+  let sz = RingBufLib.message_header_sersize eor in
+  let tx =
+    RingBufLib.retry_for_ringbuf ~while_
+      ~sleep:(RingBuf.wait_for_room rb sz) (RingBuf.enqueue_alloc rb) sz in
+  RingBufLib.write_message_header tx 0 eor ;
+  RingBuf.enqueue_commit tx 0. 0.
+
+(* Fork a decoder that calls [decode] with the ringbuf to write into (a new
+ * one named [fname]) and its own [while_] function, that also stops if the
+ * worker is gone: *)
+let fork_decoder ~while_ ~what fname decode =
+  let parent_pid = Unix.getpid () in
+  Files.safe_unlink fname ;
+  RingBuf.create fname ;
+  let rb = RingBuf.load fname in
+  flush_all () ;
+  (* Some other thread might be logging, and the child must not inherit a
+   * locked logger: *)
+  Mutex.lock log_lock ;
+  let pid = Unix.fork () in
+  Mutex.unlock log_lock ;
+  match pid with
+  | 0 ->
+      CodeGenLib_Globals.reinit_after_fork () ;
+      let while_ () = while_ () && Unix.getppid () = parent_pid in
+      let status =
+        try
+          decode ~while_ rb ;
+          ExitCodes.terminated
+        with e ->
+          print_exception ~what e ;
+          ExitCodes.uncaught_exception in
+      RingBuf.unload rb ;
+      flush_all () ;
+      (* Skip the at_exit handlers of the worker: *)
+      sys_exit status
+  | pid ->
+      { pid ; rb ; fname }
+
+(* Read one batch of tuples from that decoder, and tells if it's done
+ * decoding: *)
+let read_decoded ?(max_records=max_records_per_read_batch) read_tuple d k =
+  match RingBuf.dequeue_alloc_batch d.rb max_records with
+  | exception RingBuf.Empty ->
+      (* Maybe the decoder died? *)
+      (match Unix.(restart_on_EINTR (waitpid [ WNOHANG ])) d.pid with
+      | 0, _ ->
+          Decoding
+      | _, status ->
+          !logger.error "Decoder %d %s before the end of its output"
+            d.pid (string_of_process_status status) ;
+          Died)
+  | tx ->
+      let rec each decoding =
+        let decoding =
+          match RingBufLib.read_message_header tx 0 with
+          | exception e ->
+              log_rb_error tx e "reading decoded message header" ;
+              decoding
+          | RingBufLib.DataTuple _ as m ->
+              let offs = RingBufLib.message_header_sersize m in
+              (match read_tuple tx offs with
+              | exception e ->
+                  log_rb_error tx e "reading decoded tuple"
+              | tuple ->
+                  k tuple) ;
+              decoding
+          | RingBufLib.EndOfReplay _ ->
+              Decoded in
+        if RingBuf.batch_next tx then each decoding else decoding in
+      let decoding = each Decoding in
+      RingBuf.dequeue_commit tx ;
+      decoding
+
+let wait_for_decoded d =
+  if RingBuf.((stats d.rb).alloced_words = 0) then
+    RingBuf.wait_for_data d.rb 0.1
+
+let stop_decoder d =
+  log_and_ignore_exceptions ~what:"Stopping decoder"
+    (Unix.kill d.pid) Sys.sigterm
+
+let release_decoder d =
+  RingBuf.unload d.rb ;
+  Files.safe_unlink d.fname ;
+  (* Decoders that have not exited already will shortly: *)
+  log_and_ignore_exceptions ~what:"Waiting for decoder" (fun pid ->
+    Unix.(restart_on_EINTR (waitpid [])) pid |> ignore) d.pid
+
+(* Chunk parsers: with the ParallelCsvParsing experiment, large plain CSV
+ * files are split into chunks of whole records that are parsed by a pool of
+ * decoders (see CodeGenLib_IO.read_file), which output is then read back
+ * one chunk after the other to keep the file order.
+ * While parsing, [emit] is redirected to the decoder's ringbuf. Decoders do
+ * not publish stats, so the worker counts the tuples as it reads them back
+ * and [while_] is only used by the worker. *)
+let chunk_parsers conf ~while_ read_tuple sersize_of_tuple time_of_tuple
+                  serialize_tuple emit output =
+  let parsers = ref [||] in
+  let fork_parser parse =
+    let i = Array.length !parsers in
+    let fname =
+      N.cat conf.C.state_file (N.path (Printf.sprintf ".chunks%d" i)) in
+    let d =
+      fork_decoder ~while_:not_quit ~what:"Parsing CSV chunks" fname
+                   (fun ~while_ rb ->
+        emit := (fun tuple ->
+          write_decoded ~while_ sersize_of_tuple serialize_tuple rb
+                        (time_of_tuple tuple) tuple) ;
+        let end_chunk () = write_end_of_decoding ~while_ rb in
+        parse ~while_ ~end_chunk) in
+    parsers := Array.append !parsers [| d |]
+  and merge_chunks num_chunks =
+    let ds = !parsers in
+    parsers := [||] ;
+    let rec loop c =
+      if c < num_chunks then
+        if not (while_ ()) then
+          Array.iter stop_decoder ds
+        else
+          let d = ds.(c mod Array.length ds) in
+          (* One record at a time, as a batch could go past the end of that
+           * chunk: *)
+          match read_decoded ~max_records:1 read_tuple d output with
+          | Decoding ->
+              wait_for_decoded d ;
+              loop c
+          | Decoded ->
+              loop (c + 1)
+          | Died ->
+              Printf.sprintf "Parser of the CSV chunk #%d died" c |>
+              failwith in
+    finally
+      (fun () -> Array.iter release_decoder ds)
+      (fun () ->
+        try loop 0
+        with e ->
+          Array.iter stop_decoder ds ;
+          raise e) () in
+  IO.{ num_parsers = Default.csv_parsers ; fork_parser ; merge_chunks }
+
 (*
  * Operations that funcs may run: read a data source.
  *)
 
-let read read_source parse_data sersize_of_tuple time_of_tuple
+let read read_source parse_data read_tuple sersize_of_tuple time_of_tuple
          factors_of_tuple scalar_extractors serialize_tuple ocamlify_tuple
          orc_make_handler orc_write orc_close =
   let conf = C.make_conf () in
@@ -190,17 +387,27 @@ let read read_source parse_data sersize_of_tuple time_of_tuple
       let now = Unix.gettimeofday () in
       may_publish_stats conf publish_stats now ;
       not_quit () in
-    read_source quit while_ (parse_data (fun tuple ->
+    let output tuple =
       CodeGenLib.on_each_input_pre () ;
       IntCounter.inc Stats.in_tuple_count ;
-      outputer (RingBufLib.DataTuple Channel.live) (Some tuple))))
+      outputer (RingBufLib.DataTuple Channel.live) (Some tuple) in
+    (* Where parsed tuples go (chunk parsers redirect them): *)
+    let emit = ref output in
+    if CodeGenLib.get_variant "ParallelCsvParsing" = Some "on" then
+      IO.chunk_parsers :=
+        Some (chunk_parsers conf ~while_ read_tuple sersize_of_tuple
+                            time_of_tuple serialize_tuple emit output) ;
+    read_source quit while_ (parse_data (fun tuple -> !emit tuple))))
 
 (*
  * Operations that funcs may run: listen to some known protocol.
  *)
 
 let listen_on
-      (collector : ?while_:(unit -> bool) -> ('a -> unit) -> unit)
+      (collector : ?while_:(unit -> bool) -> ?receivers:int ->
+                   ?recv_batch:int -> ?on_drops:(int -> unit) ->
+                   ?with_batch:((unit -> unit) -> unit) ->
+                   ('a -> unit) -> unit)
       proto_name
       sersize_of_tuple time_of_tuple factors_of_tuple
       scalar_extractors serialize_tuple ocamlify_tuple
@@ -215,11 +422,28 @@ let listen_on
       let now = Unix.gettimeofday () in
       may_publish_stats conf publish_stats now ;
       not_quit () in
-    collector ~while_ (fun tup ->
+    let receivers, recv_batch =
+      if CodeGenLib.get_variant "MultiUdpReceivers" = Some "on" then
+        Default.udp_receivers, Default.udp_recv_batch
+      else 0, 1 in
+    let on_drops = IntGauge.set Stats.udp_rx_drops in
+    (* Give the GC some time every so many tuples rather than after every
+     * single one: *)
+    let gc_every = 64 in
+    let num_tuples = ref 0 in
+    let sample_output = Stats.Stage.sampler () in
+    (* Write all the tuples of a datagram at once: *)
+    let with_batch = Publish.with_output_batch in
+    collector ~while_ ~receivers ~recv_batch ~on_drops ~with_batch (fun tup ->
       CodeGenLib.on_each_input_pre () ;
       IntCounter.inc Stats.in_tuple_count ;
+      let t0 = sample_output () in
       outputer (RingBufLib.DataTuple Channel.live) (Some tup) ;
-      ignore (Gc.major_slice 0)))
+      ignore (Stats.Stage.lap Stats.Stage.listen_output t0) ;
+      incr num_tuples ;
+      if !num_tuples >= gc_every then (
+        num_tuples := 0 ;
+        ignore (Gc.major_slice 0))))
 
 (*
  * Operations that funcs may run: aggregate operation.
@@ -290,7 +514,7 @@ type ('key, 'local_state, 'tuple_in, 'minimal_out, 'generator_out, 'global_state
     global_state : 'global_state ;
     (* The hash of all groups: *)
     mutable groups :
-      ('key, ('key, 'local_state, 'tuple_in, 'minimal_out, 'generator_out, 'group_order) group) Hashtbl.t ;
+      ('key, ('key, 'local_state, 'tuple_in, 'minimal_out, 'generator_out, 'group_order) group) GroupTable.t ;
     (* The optional heap of groups used to speed up commit condition checks
      * on all groups: *)
     mutable groups_heap :
@@ -315,6 +539,10 @@ type ('tuple_in, 'sort_by) sort_by_fun =
   'tuple_in (* sort.smallest *) ->
   'tuple_in (* sort.greatest *) -> 'sort_by
 
+(* Outcome of the where_fast filter when it has been evaluated ahead of time
+ * on a whole batch of input tuples, along with the key of selected ones: *)
+type 'key prefiltered = Rejected | Selected of 'key
+
 (* From time to time emits a test alert: *)
 (* Note: weird signature because we have to help type-checker with polymorphism here: *)
 let may_test_alert conf default_out get_notifications time_of_tuple =
@@ -339,35 +567,12 @@ let may_test_alert conf default_out get_notifications time_of_tuple =
       with Exit -> ()
     )
 
-let log_rb_error =
-  let last_err = ref 0
-  and err_count = ref 0 in
-  fun ?at_exit tx e what ->
-    let open RingBuf in
-    (* Subtract one word from the start of the TX to get to the length
-     * of the message, which is a nicer starting position to dump: *)
-    let startw = tx_start tx - 1
-    and sz = tx_size tx
-    and fname = tx_fname tx in
-    assert (sz land 3 = 0) ;
-    let stopw = tx_start tx + (sz / 4) in
-    !logger.error "While %s from %S at words %d..%d(excl): %s"
-        what fname startw stopw (Printexc.to_string e) ;
-    let now = int_of_float (Unix.time ()) in
-    if now = !last_err then (
-      incr err_count ;
-      if !err_count > 5 then (
-        Option.may (fun f -> f ()) at_exit ;
-        exit ExitCodes.damaged_ringbuf
-      )
-    ) else (
-      last_err := now ;
-      err_count := 0
-    )
-
 (* [on_tup] is the continuation for tuples while [on_else] is the
- * continuation for non tuples: *)
-let read_single_rb conf ?while_ ?delay_rec
+ * continuation for non tuples.
+ * If [on_run] is given then it is called instead of [on_tup] with all the
+ * consecutive tuples of a batch that belong to the same channel, along with
+ * their size: *)
+let read_single_rb conf ?while_ ?delay_rec ?prefilter ?on_run
                    read_tuple time_of_tuple default_out
                    get_notifications rb_in publish_stats on_tup on_else =
   let may_test_alert =
@@ -379,26 +584,62 @@ let read_single_rb conf ?while_ ?delay_rec
     may_publish_stats conf publish_stats now ;
     may_test_alert now ;
     match while_ with Some f -> f () | None -> true in
-  RingBufLib.read_ringbuf ~while_ ?delay_rec rb_in (fun tx ->
+  (* Records are dequeued by batches, deserialized, and only processed once
+   * the whole batch has been committed so that the space is given back to
+   * writers as soon as possible: *)
+  let pending = ref [] in
+  let sample_read = Stats.Stage.sampler () in
+  let run_chan = ref Channel.live
+  and run = ref [] in
+  let flush_run () =
+    match on_run, !run with
+    | Some f, (_ :: _ as tuples) ->
+        let chan = !run_chan
+        and tuples = Array.of_list (List.rev tuples) in
+        run := [] ;
+        pending := (fun () -> f chan tuples) :: !pending
+    | _ -> () in
+  let after_batch () =
+    flush_run () ;
+    let todo = List.rev !pending in
+    pending := [] ;
+    (* Outputs of a whole input batch are also written by batches: *)
+    Publish.with_output_batch (fun () ->
+      List.iter (fun k -> k ()) todo) in
+  RingBufLib.read_ringbuf_batch ~while_ ?delay_rec ~after_batch
+                                ~max_records:max_records_per_read_batch
+                                rb_in (fun tx ->
     match RingBufLib.read_message_header tx 0 with
     | exception e ->
-        log_rb_error tx e "reading message header" ;
-        RingBuf.dequeue_commit tx
+        log_rb_error tx e "reading message header"
     | RingBufLib.DataTuple chan as m ->
         let tx_size = RingBuf.tx_size tx in
         let start_offs = RingBufLib.message_header_sersize m in
-        (match read_tuple tx start_offs with
+        (* Skip deserialization entirely for tuples that the prefilter can
+         * already tell will be filtered out: *)
+        (match Option.map_default (fun f -> f tx start_offs) true prefilter with
         | exception e ->
-            (* Note: dequeue_commit throws no exceptions (just  abort on
-             * error) so we can ignore exceptions here: *)
-            log_rb_error tx e "deserializing tuple" ;
-            RingBuf.dequeue_commit tx
-        | tuple ->
-            RingBuf.dequeue_commit tx ;
-            on_tup tx_size chan tuple)
+            log_rb_error tx e "prefiltering tuple"
+        | false ->
+            if chan = Channel.live then (
+              IntCounter.inc Stats.in_tuple_count ;
+              IntCounter.add Stats.read_bytes tx_size)
+        | true ->
+            let t0 = sample_read () in
+            (match read_tuple tx start_offs with
+            | exception e ->
+                log_rb_error tx e "deserializing tuple"
+            | tuple ->
+                ignore (Stats.Stage.lap Stats.Stage.read_tuple t0) ;
+                if Option.is_none on_run then
+                  pending := (fun () -> on_tup tx_size chan tuple) :: !pending
+                else (
+                  if chan <> !run_chan then flush_run () ;
+                  run_chan := chan ;
+                  run := (tx_size, tuple) :: !run)))
     | m ->
-        RingBuf.dequeue_commit tx ;
-        on_else m)
+        flush_run () ;
+        pending := (fun () -> on_else m) :: !pending)
 
 let yield_every conf ~while_
                 time_of_tuple default_in default_out get_notifications
@@ -431,6 +672,13 @@ let yield_every conf ~while_
   loop ()
 
 let aggregate
+      (* Optional filter evaluated straight from the ringbuffer, before the
+       * input tuple is deserialized: *)
+      ?(prefilter : (RingBuf.tx -> int -> bool) option)
+      (* Whether where_fast and the key depend only on the input tuple, so
+       * that they can be evaluated on a whole batch of tuples at once before
+       * those are aggregated: *)
+      ?(vectorized=false)
       (read_tuple : RingBuf.tx -> int -> 'tuple_in)
       (sersize_of_tuple : DessserMasks.t -> 'tuple_out -> int)
       (time_of_tuple : 'tuple_out -> (float * float) option)
@@ -569,7 +817,7 @@ let aggregate
           global_state = global_state () ;
           groups =
             (* Try to make the state as small as possible: *)
-            Hashtbl.create (if is_single_key then 1 else 701) ;
+            GroupTable.create (if is_single_key then 1 else 701) ;
           groups_heap = Heap.empty ;
           sort_buf = SortBuf.empty ;
           last_used = Unix.time () } in
@@ -605,11 +853,17 @@ let aggregate
         let on _ =
           ignore (Gc.major_slice 0) ;
           true in
-        retry ~on ~min_delay:1.0 RingBuf.load fname
+        let rb = retry ~on ~min_delay:1.0 RingBuf.load fname in
+        (* Every reader of a shared input ringbuf must have its own slot: *)
+        if (RingBuf.stats rb).max_consumers > 0 then
+          RingBuf.register_consumer rb ;
+        rb
       ) rb_in_fname
     in
-    (* The big function that aggregate a single tuple *)
-    let aggregate_one channel_id s in_tuple =
+    let sample_stages = Stats.Stage.sampler () in
+    (* The big function that aggregate a single tuple.
+     * [prefiltered] is given when where_fast has been evaluated already: *)
+    let aggregate_one ?prefiltered channel_id s in_tuple =
       (* Define some short-hand values and functions we will keep
        * referring to: *)
       (* When committing other groups, this is used to skip the current
@@ -689,7 +943,7 @@ let aggregate
           g.local_state <- group_init s.global_state ;
           may_relocate_group_in_heap g
         ) else (
-          Hashtbl.remove s.groups g.key
+          GroupTable.remove s.groups g.key
           (* g Has been removed from the heap already, in theory *)
         )
       in
@@ -707,26 +961,42 @@ let aggregate
        * whether the group is a new one or not. *)
       (* 1. Filtering (fast path) *)
       let perf = ref (Perf.start ()) in
+      let stage_start = ref (sample_stages ()) in
+      let lap perf_counter stage =
+        perf := Perf.add_and_transfer perf_counter !perf ;
+        stage_start := Stats.Stage.lap stage !stage_start in
+      let selected =
+        match prefiltered with
+        | Some sel ->
+            sel
+        | None ->
+            let pass = where_fast s.global_state in_tuple s.global_last_out in
+            lap Stats.perf_where_fast Stats.Stage.where_fast ;
+            if pass then (
+              let k = key_of_input in_tuple in
+              perf := Perf.add_and_transfer Stats.perf_key_of_input !perf ;
+              Selected k
+            ) else Rejected in
       let aggr_opt =
         (* maybe the key and group that has been updated: *)
-        if where_fast s.global_state in_tuple s.global_last_out
-        then (
-          perf := Perf.add_and_transfer Stats.perf_where_fast !perf ;
+        match selected with
+        | Rejected ->
+            None
+        | Selected k ->
           (* 2. Retrieve the group *)
           if channel_id = Channel.live then
-            IntGauge.set Stats.group_count (Hashtbl.length s.groups) ;
-          let k = key_of_input in_tuple in
+            IntGauge.set Stats.group_count (GroupTable.length s.groups) ;
           (* Update/create the group if it passes where_slow. *)
-          match Hashtbl.find s.groups k with
+          (match GroupTable.find s.groups k with
           | exception Not_found ->
             (* The group does not exist for that key. *)
             let local_state = group_init s.global_state in
-            perf := Perf.add_and_transfer Stats.perf_find_group !perf ;
+            lap Stats.perf_find_group Stats.Stage.find_group ;
             (* 3. Filtering (slow path) - for new group *)
             if where_slow s.global_state in_tuple s.global_last_out None
                  local_state
             then (
-              perf := Perf.add_and_transfer Stats.perf_where_slow !perf ;
+              lap Stats.perf_where_slow Stats.Stage.where_slow ;
               (* 4. Compute new minimal_out (and new group) *)
               let current_out =
                 minimal_tuple_of_aggr
@@ -745,25 +1015,25 @@ let aggregate
                     cond0_right_op current_out None None local_state s.global_state
                   ) else None } in
               (* Add this group: *)
-              Hashtbl.add s.groups k g ;
+              GroupTable.replace s.groups k g ;
               if has_commit_cond0 then (
                 let cmp = cmp_g0 cond0_cmp in
                 s.groups_heap <- Heap.add cmp g s.groups_heap) ;
-              perf := Perf.add_and_transfer Stats.perf_update_group !perf ;
+              lap Stats.perf_update_group Stats.Stage.update_group ;
               Some g
             ) else ( (* in-tuple does not pass where_slow *)
-              perf := Perf.add_and_transfer Stats.perf_where_slow !perf ;
+              lap Stats.perf_where_slow Stats.Stage.where_slow ;
               None
             )
           | g ->
             (* The group already exists. *)
-            perf := Perf.add_and_transfer Stats.perf_find_group !perf ;
+            lap Stats.perf_find_group Stats.Stage.find_group ;
             (* 3. Filtering (slow path) - for existing group *)
             if where_slow s.global_state in_tuple s.global_last_out
                  g.local_last_out g.local_state
             then (
               (* 4. Compute new current_out (and update the group) *)
-              perf := Perf.add_and_transfer Stats.perf_where_slow !perf ;
+              lap Stats.perf_where_slow Stats.Stage.where_slow ;
               (* current_out and last_in are better updated only after we called the
                * various clauses receiving g *)
               g.last_in <- in_tuple ;
@@ -774,16 +1044,12 @@ let aggregate
                   g.last_in s.global_last_out g.local_last_out g.local_state
                   s.global_state ;
               may_relocate_group_in_heap g ;
-              perf := Perf.add_and_transfer Stats.perf_update_group !perf ;
+              lap Stats.perf_update_group Stats.Stage.update_group ;
               Some g
             ) else ( (* in-tuple does not pass where_slow *)
-              perf := Perf.add_and_transfer Stats.perf_where_slow !perf ;
+              lap Stats.perf_where_slow Stats.Stage.where_slow ;
               None
-            )
-          ) else ( (* in-tuple does not pass where_fast *)
-            perf := Perf.add_and_transfer Stats.perf_where_fast !perf ;
-            None
-          ) in
+            )) in
       (match aggr_opt with
       | Some g ->
         (* 5. Post-condition to commit and flush *)
@@ -806,7 +1072,7 @@ let aggregate
           update_states g.last_in s.global_last_out g.local_last_out
                         g.local_state s.global_state g.current_out
       | None -> () (* in_tuple failed filtering *)) ;
-      perf := Perf.add_and_transfer Stats.perf_commit_incoming !perf ;
+      lap Stats.perf_commit_incoming Stats.Stage.commit ;
       (* Now there is also the possibility that we need to commit or flush
        * *other* groups for every single input tuple :-< *)
       if check_commit_for_all then (
@@ -847,7 +1113,7 @@ let aggregate
             to_commit
           else
             (* Slow version without the help of the Heap: *)
-            Hashtbl.fold (fun _ g to_commit ->
+            GroupTable.fold (fun _ g to_commit ->
               if Option.map_default ((==) g) false aggr_opt then
                 to_commit (* Already handled *)
               else
@@ -871,6 +1137,47 @@ let aggregate
     in
     (* The event loop: *)
     let rate_limit_log_reads = rate_limiter 1 1. in
+    (* When vectorized, tuples of the same channel are handled by runs so
+     * that the filter and then the key are computed in tight loops over the
+     * whole run before the groups are updated, and the state is retrieved
+     * only once: *)
+    let on_run channel_id tuples =
+      if channel_id <> Channel.live && rate_limit_log_reads () then
+        !logger.debug "Read %d tuples from channel %a"
+          (Array.length tuples) Channel.print channel_id ;
+      with_state channel_id (fun s ->
+        CodeGenLib.on_each_input_pre () ;
+        if channel_id = Channel.live then (
+          IntCounter.add Stats.in_tuple_count (Array.length tuples) ;
+          IntCounter.add Stats.read_bytes
+            (Array.fold_left (fun sz (tx_size, _) -> sz + tx_size) 0 tuples)) ;
+        (* Each stage is still timed once per tuple, so that perf counters
+         * do not depend on the length of the runs. The per-tuple counter
+         * then only covers aggregate_one, the filter and the key having been
+         * accounted for already: *)
+        let timed counter f x =
+          let perf = Perf.start () in
+          let y = f x in
+          Perf.add counter (Perf.stop perf) ;
+          y in
+        let selection =
+          Array.map (timed Stats.perf_where_fast (fun (_, in_tuple) ->
+            where_fast s.global_state in_tuple s.global_last_out)
+          ) tuples in
+        let prefiltered =
+          Array.mapi (fun i (_, in_tuple) ->
+            if selection.(i) then
+              Selected (timed Stats.perf_key_of_input key_of_input in_tuple)
+            else Rejected
+          ) tuples in
+        Array.fold_lefti (fun s i (_, in_tuple) ->
+          let aggregate s =
+            aggregate_one ~prefiltered:prefiltered.(i) channel_id s in_tuple in
+          if channel_id = Channel.live then
+            timed Stats.perf_per_tuple aggregate s
+          else
+            aggregate s
+        ) s tuples) in
     let tuple_reader =
       match rb_in with
       | None -> (* yield expression *)
@@ -878,8 +1185,10 @@ let aggregate
                       time_of_tuple default_in default_out get_notifications
                       every publish_stats
       | Some rb_in ->
+          let on_run =
+            if vectorized && sort_last <= 1 then Some on_run else None in
           read_single_rb conf ~while_:not_quit ~delay_rec:Stats.sleep_in
-                         read_tuple time_of_tuple default_out
+                         ?prefilter ?on_run read_tuple time_of_tuple default_out
                          get_notifications rb_in publish_stats
     and on_tup tx_size channel_id in_tuple =
       let perf_per_tuple = Perf.start () in
@@ -952,14 +1261,20 @@ let top_half
                (fun publish_stats _outputer ->
     let rb_in_fname = N.path (getenv "input_ringbuf") in
     !logger.debug "Will read ringbuffer %a" N.path_print rb_in_fname ;
+    let codec =
+      CodeGenLib.get_variant "TunnelCompression" |>
+      Option.map_default RamenCopy.codec_of_string RamenCopy.NoCompression in
     let forwarders =
       List.map (fun t ->
-        RamenCopyClt.copy_client
+        RamenCopyClt.copy_client ~codec
           conf.site t.host t.port conf.C.fq t.parent_num
       ) tunnelds in
     let forward_bytes b =
       !logger.debug "Forwarding %d bytes to tunneld" (Bytes.length b) ;
-      List.iter (fun forwarder -> forwarder b) forwarders in
+      List.iter (fun forwarder -> RamenCopyClt.append forwarder b) forwarders
+    (* Send each batch read from the input as soon as it is processed: *)
+    and after_batch () =
+      List.iter RamenCopyClt.flush forwarders in
     let rb_in =
       let on _ =
         ignore (Gc.major_slice 0) ;
@@ -989,22 +1304,22 @@ let top_half
       let now = Unix.gettimeofday () in
       may_publish_stats conf publish_stats now ;
       not_quit () in
-    RingBufLib.read_ringbuf ~while_ ~delay_rec:Stats.sleep_in rb_in (fun tx ->
+    RingBufLib.read_ringbuf_batch ~while_ ~delay_rec:Stats.sleep_in
+                                  ~after_batch
+                                  ~max_records:max_records_per_read_batch
+                                  rb_in (fun tx ->
       let perf_per_tuple = Perf.start () in
       let tx_size = RingBuf.tx_size tx in
       match RingBufLib.read_message_header tx 0 with
       | exception e ->
-          log_rb_error tx e "reading message header" ;
-          RingBuf.dequeue_commit tx
+          log_rb_error tx e "reading message header"
       | RingBufLib.DataTuple chan as m ->
           let start_offs = RingBufLib.message_header_sersize m in
           (match read_tuple tx start_offs with
           | exception e ->
-              log_rb_error tx e "deserializing tuple" ;
-              RingBuf.dequeue_commit tx
+              log_rb_error tx e "deserializing tuple"
           | tuple ->
               let to_forward = on_tup tx tx_size chan tuple in
-              RingBuf.dequeue_commit tx ;
               Option.may (fun to_forward ->
                 IntCounter.add Stats.write_bytes (Bytes.length to_forward) ;
                 forward_bytes to_forward
@@ -1014,17 +1329,24 @@ let top_half
       | _ ->
           (match RingBuf.read_raw_tx tx with
           | exception e ->
-              log_rb_error tx e "reading raw tx" ;
-              RingBuf.dequeue_commit tx
+              log_rb_error tx e "reading raw tx"
           | to_forward ->
-              RingBuf.dequeue_commit tx ;
               IntCounter.add Stats.write_bytes (Bytes.length to_forward) ;
-              forward_bytes to_forward ;
-              RingBuf.dequeue_commit tx)))
+              forward_bytes to_forward)))
 
-let read_whole_archive ?at_exit ?(while_=always) read_tuple rb k =
+(* With [time_range], only those parts of the archive that may contain
+ * tuples overlapping that time range (according to the index of the
+ * archive) are read: *)
+let read_whole_archive ?at_exit ?(while_=always) ?time_range read_tuple rb k =
+  let read_buf =
+    match time_range with
+    | None ->
+        RingBufLib.read_buf ~wait_for_more:false ~while_ rb
+    | Some (since, until) ->
+        let ranges = RingBufLib.index_ranges rb since until in
+        RingBufLib.read_buf_ranges ~while_ rb ranges in
   if while_ () then
-    RingBufLib.read_buf ~wait_for_more:false ~while_ rb () (fun () tx ->
+    read_buf () (fun () tx ->
       match RingBufLib.read_message_header tx 0 with
       | exception e ->
           log_rb_error tx e "reading archived message header" ;
@@ -1047,6 +1369,138 @@ let read_whole_archive ?at_exit ?(while_=always) read_tuple rb k =
       | _ ->
           (), true)
 
+(* Parallel replays: archive files are decoded by a pool of decoders, each
+ * of them writing the tuples of all its files into its own ringbuf.
+ * The replayer then merges those ringbufs, reordering the tuples of each
+ * decoder in a bounded heap to output them in event time order (as much as
+ * the window allows, since tuples are not ordered within an archive file to
+ * begin with). *)
+
+let decode_archives ~while_ read_tuple sersize_of_tuple time_of_tuple
+                    serialize_tuple orc_read time_overlap since until files rb =
+  let write tuple =
+    let start_stop = time_of_tuple tuple in
+    match start_stop with
+    | Some (t1, t2) when not (time_overlap t1 t2) ->
+        ()
+    | _ ->
+        write_decoded ~while_ sersize_of_tuple serialize_tuple rb start_stop
+                      tuple in
+  List.iter (fun (arc_typ, fname) ->
+    if while_ () then
+      match arc_typ with
+      | RingBufLib.RingBuf ->
+          (match RingBuf.load fname with
+          | exception e ->
+              let what = "Reading archive "^ (fname :> string) in
+              print_exception ~what e
+          | arc ->
+              finally (fun () -> RingBuf.unload arc)
+                (read_whole_archive ~while_ ~time_range:(since, until)
+                                    read_tuple arc) write)
+      | RingBufLib.Orc ->
+          (* Decoders serialize whole tuples: *)
+          let num_lines, num_errs =
+            orc_read fname Default.orc_rows_per_batch [] write in
+          if num_errs <> 0 then
+            !logger.error "%d/%d errors" num_errs num_lines
+  ) files ;
+  write_end_of_decoding ~while_ rb
+
+(* Fork [num_decoders] processes sharing the given files, that must be
+ * sorted by time so that decoders progress more or less at the same pace: *)
+let start_decoders ~while_ read_tuple sersize_of_tuple time_of_tuple
+                   serialize_tuple orc_read time_overlap since until
+                   rb_archive replayer_id num_decoders files =
+  List.init num_decoders (fun i ->
+    let fname =
+      N.cat rb_archive
+        (N.path (Printf.sprintf ".replay%d_%d" replayer_id i)) in
+    let my_files =
+      Array.to_list files |>
+      List.filteri (fun j _ -> j mod num_decoders = i) in
+    let d =
+      fork_decoder ~while_ ~what:"Decoding archives" fname (fun ~while_ rb ->
+        decode_archives ~while_ read_tuple sersize_of_tuple time_of_tuple
+                        serialize_tuple orc_read time_overlap since until
+                        my_files rb) in
+    !logger.debug "Decoder #%d for %d files running as pid %d"
+      i (List.length my_files) d.pid ;
+    d)
+
+(* Each decoder has its own heap of tuples, to reorder them by event time
+ * within the window. The earliest head is output only once every decoder
+ * still running has filled its window, so that no decoder can be overtaken
+ * by faster ones: *)
+type 'tuple merged_decoder =
+  { decoder : decoder ;
+    mutable pending : (float * 'tuple) Heap.t ;
+    mutable num_pending : int ;
+    mutable eof : bool }
+
+let merge_decoded ~while_ read_tuple time_of_tuple decoders k =
+  let cmp (t1, _) (t2, _) = Float.compare t1 t2 in
+  let mds =
+    List.map (fun decoder ->
+      { decoder ; pending = Heap.empty ; num_pending = 0 ; eof = false }
+    ) decoders in
+  let full md = md.num_pending >= Default.replay_merge_window in
+  let rec output_heads () =
+    if while_ () && List.for_all (fun md -> md.eof || full md) mds then
+      let earliest =
+        List.fold_left (fun earliest md ->
+          if md.num_pending = 0 then earliest else
+          match earliest with
+          | Some e when cmp (Heap.min e.pending) (Heap.min md.pending) <= 0 ->
+              earliest
+          | _ ->
+              Some md
+        ) None mds in
+      match earliest with
+      | None ->
+          ()
+      | Some md ->
+          let (_, tuple), h = Heap.pop_min cmp md.pending in
+          md.pending <- h ;
+          md.num_pending <- md.num_pending - 1 ;
+          k tuple ;
+          output_heads () in
+  let add md tuple =
+    match time_of_tuple tuple with
+    | None ->
+        k tuple
+    | Some (t1, _) ->
+        md.pending <- Heap.add cmp (t1, tuple) md.pending ;
+        md.num_pending <- md.num_pending + 1 in
+  (* Returns true if that decoder has done decoding: *)
+  let read_decoder md =
+    match read_decoded read_tuple md.decoder (add md) with
+    | Decoding -> false
+    | Decoded | Died -> true in
+  let rec loop () =
+    match List.filter (fun md -> not md.eof) mds with
+    | [] ->
+        ()
+    | running when not (while_ ()) ->
+        List.iter (fun md -> stop_decoder md.decoder) running
+    | running ->
+        (* Read only from the decoders which window is not full yet, which
+         * there is at least one of since heads are output as soon as they
+         * all are: *)
+        let to_read = List.filter (fun md -> not (full md)) running in
+        let was_empty md = RingBuf.((stats md.decoder.rb).alloced_words = 0) in
+        (match to_read with
+        | md :: _ when List.for_all was_empty to_read ->
+            RingBuf.wait_for_data md.decoder.rb 0.1
+        | _ -> ()) ;
+        List.iter (fun md -> if read_decoder md then md.eof <- true) to_read ;
+        output_heads () ;
+        loop () in
+  loop () ;
+  (* Once all decoders are done, output what's left: *)
+  output_heads () ;
+  List.iter release_decoder decoders
+
 (* Special node that reads the output history instead of computing it.
  * Takes from the env the ringbuf location and the since/until dates to
  * replay, as well as the channel id. Then it must follow the instructions
@@ -1104,16 +1558,35 @@ let replay
     print_as_date since
     print_as_date until ;
   let num_replayed_tuples = ref 0 in
+  let dir = RingBufLib.arc_dir_of_bname rb_archive in
+  let time_overlap t1 t2 =
+    (* Non-strict on both ends because of when t1=t2: *)
+    since <= t2 && until >= t1 in
+  (* Decoders must be forked before any thread is started: *)
+  let decoders =
+    if CodeGenLib.get_variant "ParallelReplay" <> Some "on" then [] else
+    let files =
+      RingBufLib.arc_files_of dir //
+      (fun (_s1, _s2, t1, t2, _typ, _fname) -> time_overlap t1 t2) |>
+      Array.of_enum in
+    if Array.length files < 2 then [] else (
+      Array.fast_sort (fun (_, _, t1, _, _, _) (_, _, t1', _, _, _) ->
+        Float.compare t1 t1') files ;
+      let files =
+        Array.map (fun (_s1, _s2, _t1, _t2, typ, fname) -> typ, fname) files in
+      let num_decoders = min Default.replay_decoders (Array.length files) in
+      !logger.info "Decoding %d archive files with %d processes"
+        (Array.length files) num_decoders ;
+      start_decoders ~while_:not_quit read_tuple sersize_of_tuple time_of_tuple
+                     serialize_tuple orc_read time_overlap since until
+                     rb_archive replayer_id num_decoders files
+    ) in
   let _publish_stats, outputer =
     Publish.start_zmq_client conf ~while_:not_quit quit
                              time_of_tuple factors_of_tuple scalar_extractors
                              serialize_tuple sersize_of_tuple ocamlify_tuple
                              orc_make_handler orc_write orc_close in
-  let dir = RingBufLib.arc_dir_of_bname rb_archive in
   let files = RingBufLib.arc_files_of dir in
-  let time_overlap t1 t2 =
-    (* Non-strict on both ends because of when t1=t2: *)
-    since <= t2 && until >= t1 in
   let at_exit () =
     (* TODO: it would be nice to send an error code with the EndOfReplay
      * so that the client would know if everything was alright. *)
@@ -1132,13 +1605,14 @@ let replay
     | _ ->
         CodeGenLib.on_each_input_pre () ;
         incr num_replayed_tuples ;
-        (* As tuples are not ordered in the archive file we have
-         * to read it all: *)
         List.iter (fun channel_id ->
           outputer (RingBufLib.DataTuple channel_id) (Some tuple)
         ) channel_ids in
   let loop_tuples rb =
-    read_whole_archive ~at_exit ~while_:not_quit read_tuple rb output_tuple in
+    (* As tuples are not ordered in the archive file we would have to read
+     * it all, but for its index: *)
+    read_whole_archive ~at_exit ~while_:not_quit ~time_range:(since, until)
+                       read_tuple rb output_tuple in
   let loop_tuples_of_ringbuf fname =
     !logger.debug "Reading archive %a" N.path_print_quoted fname ;
     match RingBuf.load fname with
@@ -1165,8 +1639,10 @@ let replay
             | RingBufLib.RingBuf ->
                 loop_tuples_of_ringbuf fname
             | RingBufLib.Orc ->
+                (* Decode only the fields the current outputs need: *)
                 let num_lines, num_errs =
-                  orc_read fname Default.orc_rows_per_batch output_tuple in
+                  orc_read fname Default.orc_rows_per_batch
+                           !Publish.out_fieldmasks output_tuple in
                 if num_errs <> 0 then
                   !logger.error "%d/%d errors" num_errs num_lines
           ) else (
@@ -1176,7 +1652,12 @@ let replay
           loop_files ()
   in
   !logger.debug "Reading the past archives..." ;
-  loop_files () ;
+  (match decoders with
+  | [] ->
+      loop_files ()
+  | decoders ->
+      merge_decoded ~while_:not_quit read_tuple time_of_tuple decoders
+                    output_tuple) ;
   (* Finish with the current archive: *)
   !logger.debug "Reading current archive" ;
   loop_tuples_of_ringbuf rb_archive ;
@@ -1240,7 +1721,7 @@ let convert
               k tuple))
     | Casing.ORC ->
         (fun f ->
-          let num_lines, num_errs = orc_read in_fname 1000 f in
+          let num_lines, num_errs = orc_read in_fname 1000 [] f in
           if num_errs <> 0 then
             !logger.error "%d/%d errors" num_errs num_lines)
     | Casing.RB ->
@@ -1257,9 +1738,10 @@ let convert
     | Casing.ORC ->
         let with_index = false (* CLI parameters for those *)
         and batch_size = Default.orc_rows_per_batch
-        and num_batches = Default.orc_batches_per_file in
-        let hdr = orc_make_handler out_fname with_index batch_size
-                                   num_batches false in
+        and num_batches = Default.orc_batches_per_file
+        and options = Publish.default_orc_options in
+        let hdr = orc_make_handler out_fname with_index options batch_size
+                                   num_batches false Default.orc_async_writes in
         orc_handler := Some hdr ;
         (fun tuple ->
           let start_stop = time_of_tuple tuple in
@@ -18,6 +18,7 @@
 open Stdint
 open RamenHelpersNoLog
 open RamenLog
+module Default = RamenConstsDefault
 module Metric = RamenConstsMetric
 
 open Binocle
@@ -121,6 +122,45 @@ let relocated_groups =
   IntCounter.make Metric.Names.relocated_groups
     Metric.Docs.relocated_groups
 
+(* Asynchronous ORC writer, sampled from the C++ side: *)
+let orc_write_queue =
+  IntGauge.make Metric.Names.orc_write_queue
+    Metric.Docs.orc_write_queue
+
+let orc_flushes =
+  IntGauge.make Metric.Names.orc_flushes
+    Metric.Docs.orc_flushes
+
+let orc_flush_time =
+  FloatCounter.make Metric.Names.orc_flush_time
+    Metric.Docs.orc_flush_time
+
+let orc_max_flush_time =
+  FloatGauge.make Metric.Names.orc_max_flush_time
+    Metric.Docs.orc_max_flush_time
+
+(* Garbage collector activity, to tell how much the groups (or any other
+ * long lived values) cost to maintain: *)
+let gc_minor_collections =
+  IntGauge.make Metric.Names.gc_minor_collections
+    Metric.Docs.gc_minor_collections
+
+let gc_major_collections =
+  IntGauge.make Metric.Names.gc_major_collections
+    Metric.Docs.gc_major_collections
+
+let gc_compactions =
+  IntGauge.make Metric.Names.gc_compactions
+    Metric.Docs.gc_compactions
+
+let gc_top_heap =
+  IntGauge.make Metric.Names.gc_top_heap
+    Metric.Docs.gc_top_heap
+
+let udp_rx_drops =
+  IntGauge.make Metric.Names.udp_rx_drops
+    Metric.Docs.udp_rx_drops
+
 (* Perf counters: *)
 let perf_per_tuple =
   Perf.make Metric.Names.perf_per_tuple Metric.Docs.perf_per_tuple
@@ -128,6 +168,9 @@ let perf_per_tuple =
 let perf_where_fast =
   Perf.make Metric.Names.perf_where_fast Metric.Docs.perf_where_fast
 
+let perf_key_of_input =
+  Perf.make Metric.Names.perf_key_of_input Metric.Docs.perf_key_of_input
+
 let perf_find_group =
   Perf.make Metric.Names.perf_find_group Metric.Docs.perf_find_group
 
@@ -153,6 +196,89 @@ let perf_commit_others =
 let perf_flush_others =
   Perf.make Metric.Names.perf_flush_others Metric.Docs.perf_flush_others
 
+(* Sampled durations of the main processing stages of a tuple, to tell where
+ * the time goes when a worker falls behind.
+ * Only one tuple every [Default.stage_timing_sample] is actually timed (all
+ * its stages), others only pay for a counter decrement. Each stage keeps its
+ * own fixed-layout histogram (in nanoseconds) for the runtime stats, and all
+ * stages also feed a Binocle histogram (in seconds) labelled with the stage
+ * name. *)
+module Stage =
+struct
+  type t =
+    { name : string ;
+      hist : RamenHdrHistogram.t }
+
+  let all = ref []
+
+  let make name =
+    let t = { name ; hist = RamenHdrHistogram.make () } in
+    all := t :: !all ;
+    t
+
+  let read_tuple = make "read_tuple"
+  let where_fast = make "where_fast"
+  let find_group = make "find_group"
+  let where_slow = make "where_slow"
+  let update_group = make "update_group"
+  let commit = make "commit"
+  let serialize = make "serialize"
+  let wait_out = make "wait_out"
+  let listen_output = make "listen_output"
+  let orc_write = make "orc_write"
+
+  let latency =
+    Histogram.make Metric.Names.stage_latency Metric.Docs.stage_latency
+      Histogram.powers_of_two
+
+  (* Stages are timed with a monotonic clock, in nanoseconds, since most of
+   * them last less than a microsecond: *)
+  external now : unit -> int = "wrap_monotonic_ns" [@@noalloc]
+
+  (* [dt] is in nanoseconds: *)
+  let record t dt =
+    RamenHdrHistogram.add t.hist dt ;
+    Histogram.add latency ~labels:[ "stage", t.name ] (float_of_int dt *. 1e-9)
+
+  (* Returns a function that returns the current time once every
+   * [Default.stage_timing_sample] calls and 0 otherwise. Each sampling site
+   * has its own so that they do not skew each others: *)
+  let sampler () =
+    let countdown = ref 1 in
+    fun () ->
+      decr countdown ;
+      if !countdown > 0 then 0 else (
+        countdown := Default.stage_timing_sample ;
+        now ())
+
+  (* If [t0] is not 0, record the time spent in stage [t] since then and
+   * return the new start time for the next stage: *)
+  let lap t t0 =
+    if t0 = 0 then 0 else
+      let now = now () in
+      record t (now - t0) ;
+      now
+
+  let to_s ns = float_of_int ns *. 1e-9
+
+  (* For the runtime stats (in creation order): *)
+  let latencies () =
+    List.fold_left (fun lst t ->
+      let h = t.hist in
+      if h.RamenHdrHistogram.count = 0 then lst else
+        let p = RamenHdrHistogram.percentile h in
+        RamenSync.Value.RuntimeStats.{
+          stage = t.name ;
+          samples = Uint64.of_int h.count ;
+          tot_time = to_s h.sum ;
+          p50 = to_s (p 50.) ;
+          p90 = to_s (p 90.) ;
+          p99 = to_s (p 99.) ;
+          max_time = to_s h.max } :: lst
+    ) [] !all |>
+    Array.of_list
+end
+
 let measure_full_out sz =
   !logger.debug "Measured fully fledged out tuple of size %d" sz ;
   tot_full_bytes := Uint64.(add !tot_full_bytes (of_int sz)) ;
@@ -167,17 +293,18 @@ let tot_cpu_time () =
   let pt = times () in
   pt.tms_utime +. pt.tms_stime +. pt.tms_cutime +. pt.tms_cstime
 
-let tot_ram_usage =
-  let word_size = Sys.word_size / 8 in
-  fun () ->
-    let stat = Gc.quick_stat () in
-    stat.Gc.heap_words * word_size
+let word_size = Sys.word_size / 8
 
 (* Unfortunately, we cannot distinguish that easily between CPU/RAM usage for
  * live channel and others: *)
 let update () =
   FloatCounter.set cpu (tot_cpu_time ()) ;
-  IntGauge.set ram (tot_ram_usage ())
+  let stat = Gc.quick_stat () in
+  IntGauge.set ram (stat.Gc.heap_words * word_size) ;
+  IntGauge.set gc_minor_collections stat.Gc.minor_collections ;
+  IntGauge.set gc_major_collections stat.Gc.major_collections ;
+  IntGauge.set gc_compactions stat.Gc.compactions ;
+  IntGauge.set gc_top_heap (stat.Gc.top_heap_words * word_size)
 
 let gauge_current (_mi, x, _ma) = x
 let gauge_max (_mi, _x, ma) = ma
@@ -0,0 +1,230 @@
+(* Code generator for the few parts of the legacy workers that can be
+ * compiled natively.
+ *
+ * For now this is limited to the prefilter of aggregations, ie. the part of
+ * the WHERE clause that can be evaluated right from the ringbuffer before the
+ * input tuple is deserialized (see CodeGen_OCaml.prefilter_expr), which is
+ * the hot path of any selective filter.
+ * The generated C++ function has the same signature and the same semantic as
+ * the one CodeGen_OCaml.emit_prefilter would generate, so that workers can be
+ * built with either one. Only a subset of expressions is supported; anything
+ * else raises Not_implemented, and then the caller should fall back to the
+ * OCaml version. *)
+open Batteries
+open Stdint
+
+open RamenHelpersNoLog
+module DT = DessserTypes
+module E = RamenExpr
+module N = RamenName
+module T = RamenTypes
+open Raql_binding_key.DessserGen
+
+(* The C type used to represent a peekable field, and the number of bytes it
+ * occupies in the ringbuffer: *)
+let ctype_of_typ = function
+  | DT.TFloat -> "double", 8
+  | TChar -> "uint8_t", 4
+  | TBool -> "bool", 4
+  | TU8 -> "uint8_t", 1
+  | TU16 -> "uint16_t", 2
+  | TU24 -> "uint32_t", 3
+  | TU32 | TUsr { name = "Ip4" ; _ } -> "uint32_t", 4
+  | TU40 -> "uint64_t", 5
+  | TU48 | TUsr { name = "Eth" ; _ } -> "uint64_t", 6
+  | TU56 -> "uint64_t", 7
+  | TU64 -> "uint64_t", 8
+  | TI8 -> "int8_t", 1
+  | TI16 -> "int16_t", 2
+  | TI24 -> "int32_t", 3
+  | TI32 -> "int32_t", 4
+  | TI40 -> "int64_t", 5
+  | TI48 -> "int64_t", 6
+  | TI56 -> "int64_t", 7
+  | TI64 -> "int64_t", 8
+  | t ->
+      Printf.sprintf2 "Native peeking of %a" DT.print t |>
+      todo
+
+let emit_float oc f =
+  match classify_float f with
+  | FP_nan -> String.print oc "NAN"
+  | FP_infinite -> String.print oc (if f > 0. then "INFINITY" else "-INFINITY")
+  | _ -> Printf.fprintf oc "%h" f
+
+let emit_const oc = function
+  | T.VBool b -> Bool.print oc b
+  | VFloat f -> emit_float oc f
+  | VChar c -> Printf.fprintf oc "uint8_t(%d)" (Char.code c)
+  | VU8 n -> Printf.fprintf oc "uint8_t(%sU)" (Uint8.to_string n)
+  | VU16 n -> Printf.fprintf oc "uint16_t(%sU)" (Uint16.to_string n)
+  | VU24 n -> Printf.fprintf oc "uint32_t(%sU)" (Uint24.to_string n)
+  | VU32 n -> Printf.fprintf oc "uint32_t(%sU)" (Uint32.to_string n)
+  | VU40 n -> Printf.fprintf oc "uint64_t(%sULL)" (Uint40.to_string n)
+  | VU48 n -> Printf.fprintf oc "uint64_t(%sULL)" (Uint48.to_string n)
+  | VU56 n -> Printf.fprintf oc "uint64_t(%sULL)" (Uint56.to_string n)
+  | VU64 n -> Printf.fprintf oc "uint64_t(%sULL)" (Uint64.to_string n)
+  | VEth n -> Printf.fprintf oc "uint64_t(%sULL)" (Uint48.to_string n)
+  | VIpv4 n -> Printf.fprintf oc "uint32_t(%sU)" (Uint32.to_string n)
+  | VI8 n -> Printf.fprintf oc "int8_t(%s)" (Int8.to_string n)
+  | VI16 n -> Printf.fprintf oc "int16_t(%s)" (Int16.to_string n)
+  | VI24 n -> Printf.fprintf oc "int32_t(%s)" (Int24.to_string n)
+  | VI32 n -> Printf.fprintf oc "int32_t(%sL)" (Int32.to_string n)
+  | VI40 n -> Printf.fprintf oc "int64_t(%sLL)" (Int40.to_string n)
+  | VI48 n -> Printf.fprintf oc "int64_t(%sLL)" (Int48.to_string n)
+  | VI56 n -> Printf.fprintf oc "int64_t(%sLL)" (Int56.to_string n)
+  | VI64 n when n = Int64.min_int -> String.print oc "INT64_MIN"
+  | VI64 n -> Printf.fprintf oc "int64_t(%sLL)" (Int64.to_string n)
+  | v ->
+      Printf.sprintf2 "Native constant %a" T.print v |>
+      todo
+
+let id_of_field n =
+  "in_"^ (n : N.field :> string) ^"_" |>
+  RamenOCamlCompiler.make_valid_ocaml_identifier
+
+(* Only the operators that are both trivial and frequent in filters: *)
+let rec emit_expr oc e =
+  match e.E.text with
+  | Stateless (SL0 (Const v)) ->
+      emit_const oc v
+  | Stateless (SL0 (Binding (RecordField (In, n)))) ->
+      String.print oc (id_of_field n)
+  | Stateless (SL1 (Not, e1)) ->
+      Printf.fprintf oc "(! %a)" emit_expr e1
+  | Stateless (SL2 (And, e1, e2)) ->
+      Printf.fprintf oc "(%a && %a)" emit_expr e1 emit_expr e2
+  | Stateless (SL2 (Or, e1, e2)) ->
+      Printf.fprintf oc "(%a || %a)" emit_expr e1 emit_expr e2
+  | Stateless (SL2 (Eq, e1, e2)) ->
+      Printf.fprintf oc "eq_(%a, %a)" emit_expr e1 emit_expr e2
+  | Stateless (SL2 (Gt, e1, e2)) ->
+      Printf.fprintf oc "gt_(%a, %a)" emit_expr e1 emit_expr e2
+  | Stateless (SL2 (Ge, e1, e2)) ->
+      Printf.fprintf oc "ge_(%a, %a)" emit_expr e1 emit_expr e2
+  | _ ->
+      Printf.sprintf2 "Native expression %a" (E.print false) e |>
+      todo
+
+let emit_intro oc =
+  let p fmt = emit oc 0 fmt in
+  p "/* This code is automatically generated. Edition is futile. */" ;
+  p "#include <cmath>" ;
+  p "#include <cstdint>" ;
+  p "#include <cstring>" ;
+  p "#include <type_traits>" ;
+  p "extern \"C\" {" ;
+  p "#  define CAML_NAME_SPACE" ;
+  p "#  include <caml/mlvalues.h>" ;
+  p "/* From ringbuf/wrappers.c: */" ;
+  p "uint8_t const *wrap_ringbuf_tx_record(value, size_t *);" ;
+  p "}" ;
+  p "using namespace std;" ;
+  p "" ;
+  p "/* Values are serialized in little endian, and N bytes integers take no" ;
+  p " * more than N bytes: */" ;
+  p "template<class T, unsigned N>" ;
+  p "static inline T peek_(uint8_t const *p)" ;
+  p "{" ;
+  p "  if constexpr (is_floating_point_v<T>) {" ;
+  p "    T v;" ;
+  p "    memcpy(&v, p, sizeof v);" ;
+  p "    return v;" ;
+  p "  } else {" ;
+  p "    uint64_t v = 0;" ;
+  p "    memcpy(&v, p, N);" ;
+  p "    if constexpr (is_signed_v<T> && N < 8) {" ;
+  p "      unsigned const shift = 64 - 8 * N;" ;
+  p "      return T(int64_t(v << shift) >> shift);" ;
+  p "    } else {" ;
+  p "      return T(v);" ;
+  p "    }" ;
+  p "  }" ;
+  p "}" ;
+  p "" ;
+  p "/* Comparisons of numbers of distinct signedness, as OCaml would do" ;
+  p " * after converting both to the larger type: */" ;
+  p "template<class A, class B>" ;
+  p "static inline bool eq_(A a, B b)" ;
+  p "{" ;
+  p "  if constexpr (is_floating_point_v<A> || is_floating_point_v<B>)" ;
+  p "    return double(a) == double(b);" ;
+  p "  else if constexpr (is_signed_v<A> == is_signed_v<B>)" ;
+  p "    return a == b;" ;
+  p "  else if constexpr (is_signed_v<A>)" ;
+  p "    return a >= 0 && make_unsigned_t<A>(a) == b;" ;
+  p "  else" ;
+  p "    return b >= 0 && a == make_unsigned_t<B>(b);" ;
+  p "}" ;
+  p "" ;
+  p "template<class A, class B>" ;
+  p "static inline bool gt_(A a, B b)" ;
+  p "{" ;
+  p "  if constexpr (is_floating_point_v<A> || is_floating_point_v<B>)" ;
+  p "    return double(a) > double(b);" ;
+  p "  else if constexpr (is_signed_v<A> == is_signed_v<B>)" ;
+  p "    return a > b;" ;
+  p "  else if constexpr (is_signed_v<A>)" ;
+  p "    return a > 0 && make_unsigned_t<A>(a) > b;" ;
+  p "  else" ;
+  p "    return b < 0 || a > make_unsigned_t<B>(b);" ;
+  p "}" ;
+  p "" ;
+  p "template<class A, class B>" ;
+  p "static inline bool ge_(A a, B b)" ;
+  p "{" ;
+  p "  if constexpr (is_floating_point_v<A> || is_floating_point_v<B>)" ;
+  p "    return double(a) >= double(b);" ;
+  p "  else if constexpr (is_signed_v<A> == is_signed_v<B>)" ;
+  p "    return a >= b;" ;
+  p "  else if constexpr (is_signed_v<A>)" ;
+  p "    return a >= 0 && make_unsigned_t<A>(a) >= b;" ;
+  p "  else" ;
+  p "    return b < 0 || a >= make_unsigned_t<B>(b);" ;
+  p "}" ;
+  p ""
+
+(* Emit the C++ equivalent of what CodeGen_OCaml.emit_prefilter emits, as an
+ * external function named [name] taking the tx and the offset of the input
+ * tuple. Unlike the OCaml version, it does not raise when the tuple is too
+ * short but lets it through, so that the deserializer reports the error.
+ * Callers are supposed to declare it [@@noalloc]. *)
+let emit_prefilter name in_typ oc expr =
+  let p fmt = emit oc 0 fmt in
+  let peekable = CodeGen_OCaml.peekable_fields in_typ in
+  let used =
+    E.fold (fun _ used e ->
+      match e.E.text with
+      | Stateless (SL0 (Binding (RecordField (In, n))))
+        when not (List.mem_assoc n used) ->
+          (n, List.assoc n peekable) :: used
+      | _ -> used
+    ) [] expr in
+  (* Fail before emitting anything: *)
+  let body = IO.to_string emit_expr expr in
+  let used =
+    List.map (fun (n, (t, offs)) -> n, ctype_of_typ t, offs) used in
+  emit_intro oc ;
+  p "extern \"C\" value %s(value tx_, value start_offs_)" name ;
+  p "{" ;
+  if used <> [] then (
+    let end_offs =
+      List.fold_left (fun m (_, (_, sz), offs) ->
+        max m (offs + sz)
+      ) 0 used in
+    p "  size_t size_;" ;
+    p "  uint8_t const *rec_ = wrap_ringbuf_tx_record(tx_, &size_);" ;
+    p "  size_t const start_ = Long_val(start_offs_);" ;
+    p "  if (start_ >= size_) return Val_true;" ;
+    p "  size_t const offs_ = start_ + %d * rec_[start_];"
+      DessserRamenRingBuffer.word_size ;
+    p "  if (offs_ + %d > size_) return Val_true;" end_offs ;
+    List.iter (fun (n, (ctyp, sz), offs) ->
+      p "  %s const %s = peek_<%s, %d>(rec_ + offs_ + %d);"
+        ctyp (id_of_field n) ctyp sz offs
+    ) used
+  ) else (
+    p "  (void)tx_; (void)start_offs_;"
+  ) ;
+  p "  return Val_bool(%s);" body ;
+  p "}"
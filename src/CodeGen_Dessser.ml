@@ -1546,7 +1546,7 @@ let emit_aggregate ~r_env compunit func_op func_name in_type params =
 let unchecked_t = DT.void
 
 (* Generate a data provider that reads blocks of bytes from a file: *)
-let emit_read_file ~r_env compunit field_of_params func_name specs =
+let emit_read_file ~r_env compunit field_of_params func_name format specs =
   let compunit, _, _ =
     fail_with_context "coding the unlink condition" (fun () ->
       RaQL2DIL.expression ~r_env specs.O.unlink |>
@@ -1578,7 +1578,9 @@ let emit_read_file ~r_env compunit field_of_params func_name specs =
           p "                  [ \"env\" ], Sys.getenv ] in" ;
           p "  let preprocessor_ =" ;
           p "    RamenHelpers.subst_tuple_fields tuples_ preprocessor_ in" ;
-          p "  CodeGenLib_IO.read_glob_file filename_ preprocessor_ unlink_\n\n"
+          p "  CodeGenLib_IO.read_glob_file%s"
+            (CodeGen_OCaml.csv_arg_of_format format) ;
+          p "    filename_ preprocessor_ unlink_\n\n"
         ) in
   compunit
 
@@ -1707,6 +1709,7 @@ let call_read compunit id_name reader_name parser_name =
       DT.func [|
         DE.type_of l (identifier reader_name) ;
         DE.type_of l (identifier parser_name) ;
+        DE.type_of l (identifier "read_out_tuple_") ;
         DE.type_of l (identifier "sersize_of_tuple_") ;
         DE.type_of l (identifier "time_of_tuple_") ;
         DE.type_of l (identifier "factors_of_tuple_") ;
@@ -1725,6 +1728,7 @@ let call_read compunit id_name reader_name parser_name =
       apply (ext_identifier f_name) [
         identifier reader_name ;
         identifier parser_name ;
+        identifier "read_out_tuple_" ;
         identifier "sersize_of_tuple_" ;
         identifier "time_of_tuple_" ;
         identifier "factors_of_tuple_" ;
@@ -1793,7 +1797,8 @@ let emit_reader ~r_env compunit field_of_params func_op
   let compunit =
     match source with
     | O.File specs ->
-        emit_read_file ~r_env compunit field_of_params reader_name specs
+        emit_read_file ~r_env compunit field_of_params reader_name format
+                       specs
     | O.Kafka specs ->
         emit_read_kafka ~r_env compunit field_of_params reader_name specs in
   let compunit =
@@ -1834,17 +1839,42 @@ let orc_wrapper out_type orc_write_func orc_read_func ps oc =
        RamenName.path -> int -> (%s -> unit) -> (int * int) = %S"
     (DessserBackEndOCaml.type_identifier ps pub.DT.typ)
     orc_read_func ;
+  p "type orc_batch_view" ;
+  p "external orc_read_batch_pub : \
+       RamenName.path -> int -> bool array -> \
+       (orc_batch_view -> int -> unit) -> (int * int) = \"%s_batch\""
+    orc_read_func ;
+  p "external orc_read_row_pub : orc_batch_view -> int -> %s = \"%s_batch_row\""
+    (DessserBackEndOCaml.type_identifier ps pub.DT.typ)
+    orc_read_func ;
   (* Destructor do not seems to be called when the OCaml program exits: *)
   p "external orc_close : handler -> unit = \"orc_handler_close\"" ;
   p "" ;
-  p "(* Parameters: schema * path * index * row per batch * batches per file * archive *)" ;
+  p "(* Parameters: schema * path * index * options * row per batch * batches per file * archive * async *)" ;
+  p "(* Options: codec * compression block size * stripe size * dictionary threshold *)" ;
   p "external orc_make_handler : \
-       string -> RamenName.path -> bool -> int -> int -> bool -> handler =" ;
-  p "  \"orc_handler_create_bytecode_lol\" \"orc_handler_create\"" ;
+       string -> RamenName.path -> bool -> (int * int * int * float) -> \
+       int -> int -> bool -> bool -> handler =" ;
+  p "  \"orc_handler_create_bytecode\" \"orc_handler_create\"" ;
   p "" ;
-  (* A wrapper that inject missing private fields: *)
-  p "let orc_read fname_ batch_sz_ k_ =" ;
-  p "  orc_read_pub fname_ batch_sz_ (fun t_ -> k_ (out_of_pub_ t_))" ;
+  (* Position of each ORC column in the field masks: *)
+  p "let orc_mask_indices_ = %a"
+    (Array.print ~first:"[| " ~last:" |]" ~sep:" ; " Int.print)
+      (CodeGen_OCaml.orc_mask_indices out_type) ;
+  (* A wrapper that inject missing private fields. Only the columns
+   * required by [fieldmasks_] are read (all of them if it's empty): *)
+  p "let orc_read fname_ batch_sz_ fieldmasks_ k_ =" ;
+  p "  let include_ =" ;
+  p "    CodeGenLib.orc_columns_of_fieldmasks orc_mask_indices_ fieldmasks_ in" ;
+  p "  (* As with orc_read_pub, an error on a row must not abort the batch: *)" ;
+  p "  let errs_ = ref 0 in" ;
+  p "  let lines_, batch_errs_ =" ;
+  p "    orc_read_batch_pub fname_ batch_sz_ include_ (fun view_ num_rows_ ->" ;
+  p "      for row_ = 0 to num_rows_ - 1 do" ;
+  p "        try k_ (out_of_pub_ (orc_read_row_pub view_ row_))" ;
+  p "        with _ -> incr errs_" ;
+  p "      done) in" ;
+  p "  lines_, batch_errs_ + !errs_" ;
   p ""
 
 let make_orc_handler name out_type oc _ps =
@@ -1905,9 +1935,9 @@ let out_of_pub out_type pub_type =
     full out_type pub) |>
   comment cmt
 
-(* A function that reads the history and writes it according to some out_ref
- * under a given channel: *)
-let replay compunit id_name pub_type =
+(* A function that reads an output tuple back from a ringbuf, as written by
+ * the worker, for replays and parsers of chunks of CSV: *)
+let read_out_tuple compunit pub_type =
   let compunit, _, _ =
     fail_with_context "coding for tuple reader" (fun () ->
       let compunit, e = deserialize_tuple "pub" pub_type compunit in
@@ -1921,6 +1951,12 @@ let replay compunit id_name pub_type =
         (* Add private fields: *)
         apply (identifier "out_of_pub_") [ tup ]) |>
       DU.add_identifier_of_expression compunit ~name:"read_out_tuple_") in
+  compunit
+
+(* A function that reads the history and writes it according to some out_ref
+ * under a given channel: *)
+let replay compunit id_name =
+  let open DE.Ops in
   let f_name = "CodeGenLib_Skeletons.replay" in
   let l = DU.environment compunit in
   let compunit =
@@ -2187,6 +2223,9 @@ let generate_function
           func0 (fun () -> nop) |>
           DU.add_identifier_of_expression compunit ~name:EntryPoints.top_half in
         compunit in
+  (* Coding for the reader of output tuples, for the replay and read
+   * workers: *)
+  let compunit = read_out_tuple compunit pub_type in
   (* Coding for all functions required to implement the worker: *)
   let compunit =
     match func_op with
@@ -2200,7 +2239,7 @@ let generate_function
   (* Coding for replay worker: *)
   let compunit =
     fail_with_context "coding for replay function" (fun () ->
-      replay compunit EntryPoints.replay pub_type) in
+      replay compunit EntryPoints.replay) in
   (* Coding for archive convert functions: *)
   (* TODO *)
   (* Now write all those definitions into a file and compile it: *)
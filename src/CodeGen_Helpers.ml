@@ -65,6 +65,21 @@ let check_commit_for_all expr =
   with Exit ->
     true
 
+(* Tells whether the fast filter and the key of an aggregation can be
+ * evaluated over a whole batch of input tuples ahead of aggregating any of
+ * them, ie. whether they depend on nothing else than the input tuple: *)
+let can_aggregate_by_batch where_fast = function
+  | O.Aggregate { sort = None ; key ; _ } ->
+      let only_input e =
+        E.is_pure e &&
+        not (expr_needs_tuple_from
+              [ GroupState ; GlobalState ; GlobalLastOut ; LocalLastOut ;
+                Out ; SortFirst ; SortSmallest ; SortGreatest ; GlobalVar ] e) in
+      E.forall only_input where_fast &&
+      List.for_all (E.forall only_input) key
+  | _ ->
+      false
+
 (* Takes an expression and if that expression is equivalent to
  * f(in) op g(out) then returns [f], [neg], [op], [g] where [neg] is true
  * if [op] is meant to be negated, or raise Not_found: *)
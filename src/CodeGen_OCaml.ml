@@ -56,7 +56,9 @@ type op_context =
      * parameters or input fields) we do not generate the constant hash
      * several times. *)
     mutable gen_consts : Uint32.t Set.t ;
-    dessser_mod_name : string option }
+    dessser_mod_name : string option ;
+    (* Name of the natively compiled prefilter, if any (see CodeGen_CPP): *)
+    native_prefilter : string option }
 
 let id_of_prefix tuple =
   String.nreplace (Variable.to_string tuple) "." "_"
@@ -3592,8 +3594,17 @@ let emit_scalar_extractors name func_op oc =
   ) ;
   String.print oc "|]\n\n"
 
+(* When reading CSV without escape sequences, records end at the first
+ * newline that's not quoted, which allows CodeGenLib_IO.read_file to find
+ * them before parsing: *)
+let csv_arg_of_format = function
+  | O.CSV { O.may_quote ; O.escape_seq = "" ; _ } ->
+      if may_quote then " ~csv:(Some '\"')" else " ~csv:None"
+  | _ ->
+      ""
+
 (* Generate a data provider that reads blocks of bytes from a file: *)
-let emit_read_file opc param_env env_env globals_env name specs =
+let emit_read_file opc param_env env_env globals_env name format specs =
   let open Raql_select_field.DessserGen in
   let open Raql_operation.DessserGen in
   let env = param_env @ env_env @ globals_env
@@ -3614,7 +3625,8 @@ let emit_read_file opc param_env env_env globals_env name specs =
       | Some pre -> emit_expr ~context:Finalize ~opc ~env oc pre)
         specs.preprocessor) ;
   p "  in" ;
-  p "  CodeGenLib_IO.read_glob_file filename_ preprocessor_ unlink_\n\n"
+  p "  CodeGenLib_IO.read_glob_file%s filename_ preprocessor_ unlink_\n\n"
+    (csv_arg_of_format format)
 
 (* Generate a data provider that reads blocks of bytes from a kafka topic: *)
 let emit_read_kafka opc param_env env_env globals_env name specs =
@@ -3727,7 +3739,7 @@ let emit_read opc name source_name parser_name =
     p "  CodeGenLib_Skeletons.read" ;
     p "    (%s field_of_params_)" source_name ;
     p "    (%s field_of_params_)" parser_name ;
-    p "    sersize_of_tuple_ time_of_tuple_" ;
+    p "    read_out_tuple_ sersize_of_tuple_ time_of_tuple_" ;
     p "    factors_of_tuple_ scalar_extractors_" ;
     p "    serialize_tuple_ ocamlify_tuple_" ;
     p "    orc_make_handler_ orc_write orc_close\n\n")
@@ -4031,6 +4043,99 @@ let emit_where ?(with_group=false) ~env name in_typ ~opc expr =
   Printf.fprintf opc.code "\t%a\n\n"
     (emit_expr ~env ~context:Finalize ~opc) expr
 
+(* Input fields which location within the serialized tuple is known
+ * statically (once past the nullmask), and which can therefore be peeked
+ * directly from the ringbuffer without deserializing the whole input tuple.
+ * Since fields are serialized in that order and null values take no room,
+ * this is the prefix of non-nullable, fixed-size scalar fields.
+ * Returns an assoc list from field name to type and offset. *)
+let peekable_fields typ =
+  let is_peekable = function
+    | DT.TFloat | TChar | TBool
+    | TU8 | TU16 | TU24 | TU32 | TU40 | TU48 | TU56 | TU64 | TU128
+    | TI8 | TI16 | TI24 | TI32 | TI40 | TI48 | TI56 | TI64 | TI128
+    | TUsr { name = "Eth" | "Ip4" | "Ip6" ; _ } -> true
+    | _ -> false in
+  let rec loop offs fields = function
+    | ft :: rest
+      when not ft.RamenTuple.typ.DT.nullable && is_peekable ft.typ.typ ->
+        let fields = (ft.name, (ft.typ.typ, offs)) :: fields in
+        loop (offs + RingBufLib.sersize_of_fixsz_typ ft.typ.typ) fields rest
+    | _ ->
+        List.rev fields in
+  loop 0 [] typ
+
+(* Tells whether that expression can be evaluated before the input tuple is
+ * read, using only peekable fields: *)
+let can_prefilter peekable e =
+  E.is_pure e &&
+  match e.E.text with
+  | Stateless (SL0 (Binding (RecordField (In, n)))) ->
+      List.mem_assoc n peekable
+  | Stateless (SL0 (Binding (RecordField ((Param | Env), _)))) ->
+      true
+  (* CodeGenLib.now is not yet set for the peeked tuple: *)
+  | Stateless (SL0 (Binding _ | Variable _ | Path _ |
+                    Now | Random | EventStart | EventStop))
+  | Stateless (SL1 (Age, _))
+  | Generator _ ->
+      false
+  | _ ->
+      true
+
+(* Emit a function that takes a tx and the offset of an input tuple and
+ * evaluates [expr] reading only the fields it needs straight from the
+ * ringbuffer. Bounds are checked once for all those fields. *)
+let emit_prefilter ~env name in_typ ~opc expr =
+  let p fmt = emit opc.code 0 fmt in
+  let peekable = peekable_fields in_typ in
+  let used =
+    E.fold (fun _ used e ->
+      match e.E.text with
+      | Stateless (SL0 (Binding (RecordField (In, n))))
+        when not (List.mem_assoc n used) ->
+          (n, List.assoc n peekable) :: used
+      | _ -> used
+    ) [] expr in
+  p "let %s tx_ start_offs_ =" name ;
+  if used <> [] then (
+    let end_offs =
+      List.fold_left (fun m (_, (t, offs)) ->
+        max m (offs + RingBufLib.sersize_of_fixsz_typ t)
+      ) 0 used in
+    p "  let nullmask_words_ = RingBuf.read_u8 tx_ start_offs_ |> Uint8.to_int in" ;
+    p "  let offs_ = start_offs_ + %d * nullmask_words_ in"
+      DessserRamenRingBuffer.word_size ;
+    p "  RingBuf.check_range tx_ offs_ %d ;" end_offs ;
+    List.iter (fun (n, (t, offs)) ->
+      p "  let %s = RingBuf.peek_%s tx_ (offs_ + %d) in"
+        (id_of_field_name ~tuple:In n) (Helpers.id_of_typ t) offs
+    ) used
+  ) else (
+    p "  ignore tx_ ; ignore start_offs_ ;"
+  ) ;
+  let env =
+    List.fold_left (fun env (n, _) ->
+      (RecordField (In, n), id_of_field_name ~tuple:In n) :: env
+    ) env used in
+  p "  %a\n"
+    (emit_expr ~env ~context:Finalize ~opc) expr
+
+(* The part of the WHERE clause of aggregation [op] that can be evaluated
+ * before the input tuple is even deserialized, peeking only at the fields it
+ * needs (true if there is none). Tuples must not skip the sort buffer nor the
+ * commit conditions of other groups though: *)
+let prefilter_expr op in_typ =
+  match op with
+  | O.Aggregate { sort ; where ; commit_cond ; _ }
+    when sort = None && not (Helpers.check_commit_for_all commit_cond) ->
+      let where_fast, _ =
+        E.and_partition (not % Helpers.expr_needs_group) where in
+      fst (E.and_partition (can_prefilter (peekable_fields in_typ))
+                           where_fast)
+  | _ ->
+      E.of_bool true
+
 let emit_field_selection
       (* If true, we update the env and finalize as few fields as
        * possible (only those required by commit_cond and update_states).
@@ -4569,6 +4674,18 @@ let emit_aggregate opc global_state_env group_state_env
   fail_with_context "where-fast function" (fun () ->
     emit_where ~env:(global_state_env @ base_env) "where_fast_" in_typ ~opc
       where_fast) ;
+  (* Part of where_fast can be evaluated before the tuple is even
+   * deserialized, possibly by native code: *)
+  let where_pre = prefilter_expr op in_typ in
+  if not (E.is_true where_pre) then
+    fail_with_context "prefilter function" (fun () ->
+      match opc.native_prefilter with
+      | Some sym ->
+          emit opc.code 0
+            "external prefilter_ : RingBuf.tx -> int -> bool = %S [@@noalloc]\n"
+            sym
+      | None ->
+          emit_prefilter ~env:base_env "prefilter_" in_typ ~opc where_pre) ;
   fail_with_context "where-slow function" (fun () ->
     emit_where ~env:(group_state_env @ global_state_env @ base_env) "where_slow_"
                in_typ ~opc ~with_group:true where_slow) ;
@@ -4621,7 +4738,10 @@ let emit_aggregate opc global_state_env group_state_env
   let p fmt = emit opc.code 0 fmt in
   fail_with_context "aggregate function" (fun () ->
     p "let %s () =" name ;
-    p "  CodeGenLib_Skeletons.aggregate" ;
+    p "  CodeGenLib_Skeletons.aggregate%s%s"
+      (if E.is_true where_pre then "" else " ~prefilter:prefilter_")
+      (if Helpers.can_aggregate_by_batch where_fast op then " ~vectorized:true"
+       else "") ;
     p "    read_in_tuple_ sersize_of_tuple_ time_of_tuple_" ;
     p "    factors_of_tuple_" ;
     p "    scalar_extractors_" ;
@@ -4737,7 +4857,7 @@ struct
     let opc =
       { op = None ; event_time = None ; func_name = None ;
         params = [] ; code ; consts ; typ = [] ; gen_consts = Set.empty ;
-        dessser_mod_name = None } in
+        dessser_mod_name = None ; native_prefilter = None } in
     let indent = 0 in
     let p fmt = emit opc.consts indent fmt in
     fail_with_context "globals accessors" (fun () ->
@@ -4857,7 +4977,7 @@ let emit_running_condition oc params env cond =
   let opc =
     { op = None ; event_time = None ; func_name = None ;
       params ; code ; consts ; typ = [] ; gen_consts = Set.empty ;
-      dessser_mod_name = None } in
+      dessser_mod_name = None ; native_prefilter = None } in
   fail_with_context "running condition" (fun () ->
     Printf.fprintf opc.code "let run_condition_ () =\n\t%a\n\n"
       (emit_expr ~env ~context:Finalize ~opc) cond ;
@@ -4897,7 +5017,8 @@ let emit_operation name top_half_name func_op in_type
       match format with CSV _ -> "CSV" | RowBinary _ -> "RowBinary" in
     (match source with
     | File specs ->
-        emit_read_file opc param_env env_env globals_env source_name specs
+        emit_read_file opc param_env env_env globals_env source_name format
+                       specs
     | Kafka specs ->
         emit_read_kafka opc param_env env_env globals_env source_name specs) ;
     emit_parse_external opc parser_name format_name ;
@@ -4909,15 +5030,20 @@ let emit_operation name top_half_name func_op in_type
                    env_env param_env globals_env
                    name top_half_name in_type
 
-(* A function that reads the history and write it according to some out_ref
- * under a given channel: *)
-let emit_replay name func_op opc =
+(* A function that reads an output tuple back from a ringbuf, as written by
+ * the worker, for replays and parsers of chunks of CSV: *)
+let emit_read_out_tuple func_op opc =
   let p fmt = emit opc.code 0 fmt in
   let ser = O.out_type_of_operation ~with_priv:false func_op in
   emit_deserialize_function 0 "read_pub_tuple_" ~opc ser ;
   p "let read_out_tuple_ tx_ start_offs_ =" ;
   p "  let tup_ = read_pub_tuple_ tx_ start_offs_ in" ;
-  p "  out_of_pub_ tup_\n" ;
+  p "  out_of_pub_ tup_\n"
+
+(* A function that reads the history and write it according to some out_ref
+ * under a given channel: *)
+let emit_replay name opc =
+  let p fmt = emit opc.code 0 fmt in
   p "let %s () =" name ;
   p "  CodeGenLib_Skeletons.replay read_out_tuple_" ;
   p "    sersize_of_tuple_ time_of_tuple_ factors_of_tuple_" ;
@@ -5014,6 +5140,20 @@ let emit_dummies_for_private opc =
     )
   ) opc.typ
 
+(* The position in field masks of each column of the ORC files, ie. of each
+ * public field of the output record [rtyp]: *)
+let orc_mask_indices rtyp =
+  match DT.develop rtyp.DT.typ with
+  | DT.TRec kts ->
+      Array.enum kts |>
+      Enum.foldi (fun i (k, _) l ->
+        if N.(is_private (field k)) then l else i :: l
+      ) [] |>
+      List.rev |>
+      Array.of_list
+  | _ ->
+      [| 0 |]
+
 let emit_orc_wrapper func_op orc_write_func orc_read_func oc =
   let p fmt = emit oc 0 fmt in
   let rtyp = O.out_record_of_operation ~with_priv:true func_op in
@@ -5029,17 +5169,42 @@ let emit_orc_wrapper func_op orc_write_func orc_read_func oc =
        RamenName.path -> int -> (%a -> unit) -> (int * int) = %S"
     otype_of_type pub
     orc_read_func ;
+  p "type orc_batch_view" ;
+  p "external orc_read_batch_pub : \
+       RamenName.path -> int -> bool array -> \
+       (orc_batch_view -> int -> unit) -> (int * int) = \"%s_batch\""
+    orc_read_func ;
+  p "external orc_read_row_pub : orc_batch_view -> int -> %a = \"%s_batch_row\""
+    otype_of_type pub
+    orc_read_func ;
   (* Destructor do not seems to be called when the OCaml program exits: *)
   p "external orc_close : handler -> unit = \"orc_handler_close\"" ;
   p "" ;
-  p "(* Parameters: schema * path * index * row per batch * batches per file * archive *)" ;
+  p "(* Parameters: schema * path * index * options * row per batch * batches per file * archive * async *)" ;
+  p "(* Options: codec * compression block size * stripe size * dictionary threshold *)" ;
   p "external orc_make_handler : \
-       string -> RamenName.path -> bool -> int -> int -> bool -> handler =" ;
-  p "  \"orc_handler_create_bytecode_lol\" \"orc_handler_create\"" ;
+       string -> RamenName.path -> bool -> (int * int * int * float) -> \
+       int -> int -> bool -> bool -> handler =" ;
+  p "  \"orc_handler_create_bytecode\" \"orc_handler_create\"" ;
   p "" ;
-  (* A wrapper that inject missing private fields: *)
-  p "let orc_read fname_ batch_sz_ k_ =" ;
-  p "  orc_read_pub fname_ batch_sz_ (fun t_ -> k_ (out_of_pub_ t_))" ;
+  (* Position of each ORC column in the field masks: *)
+  p "let orc_mask_indices_ = %a"
+    (Array.print ~first:"[| " ~last:" |]" ~sep:" ; " Int.print)
+      (orc_mask_indices rtyp) ;
+  (* A wrapper that inject missing private fields. Only the columns
+   * required by [fieldmasks_] are read (all of them if it's empty): *)
+  p "let orc_read fname_ batch_sz_ fieldmasks_ k_ =" ;
+  p "  let include_ =" ;
+  p "    CodeGenLib.orc_columns_of_fieldmasks orc_mask_indices_ fieldmasks_ in" ;
+  p "  (* As with orc_read_pub, an error on a row must not abort the batch: *)" ;
+  p "  let errs_ = ref 0 in" ;
+  p "  let lines_, batch_errs_ =" ;
+  p "    orc_read_batch_pub fname_ batch_sz_ include_ (fun view_ num_rows_ ->" ;
+  p "      for row_ = 0 to num_rows_ - 1 do" ;
+  p "        try k_ (out_of_pub_ (orc_read_row_pub view_ row_))" ;
+  p "        with _ -> incr errs_" ;
+  p "      done) in" ;
+  p "  lines_, batch_errs_ + !errs_" ;
   p ""
 
 let emit_make_orc_handler name func_op oc =
@@ -5078,7 +5243,7 @@ let emit_convert name func_op oc =
 let generate_code
       conf func_name func_op in_type
       env_env param_env globals_env global_state_env group_state_env
-      obj_name params_mod_name dessser_mod_name
+      obj_name params_mod_name dessser_mod_name native_prefilter
       orc_write_func orc_read_func params
       globals_mod_name =
   (* The code might need some global constant parameters, thus the two strings
@@ -5090,7 +5255,7 @@ let generate_code
   let opc =
     { op = Some func_op ; func_name = Some func_name ; params ; code ; consts ;
       typ ; event_time = O.event_time_of_operation func_op ;
-      gen_consts = Set.empty ; dessser_mod_name } in
+      gen_consts = Set.empty ; dessser_mod_name ; native_prefilter } in
   let src_file =
     RamenOCamlCompiler.with_code_file_for
       obj_name conf.C.reuse_prev_files (fun oc ->
@@ -5112,12 +5277,14 @@ let generate_code
           emit_factors_of_tuple "factors_of_tuple_" func_op opc.code) ;
         fail_with_context "scalar extractors" (fun () ->
           emit_scalar_extractors "scalar_extractors_" func_op opc.code) ;
+        fail_with_context "output tuple reader" (fun () ->
+          emit_read_out_tuple func_op opc) ;
         fail_with_context "operation" (fun () ->
           emit_operation EntryPoints.worker EntryPoints.top_half func_op
                          in_type global_state_env group_state_env env_env
                          param_env globals_env opc) ;
         fail_with_context "replay function" (fun () ->
-          emit_replay EntryPoints.replay func_op opc) ;
+          emit_replay EntryPoints.replay opc) ;
         fail_with_context "tuple conversion function" (fun () ->
           emit_convert EntryPoints.convert func_op opc.code) ;
         Printf.fprintf oc "\n(* Global constants: *)\n\n%s\n\
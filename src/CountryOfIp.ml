@@ -1,8 +1,65 @@
 open Stdint
 open DessserOCamlBackEndHelpers
+open RamenLog
+module Default = RamenConstsDefault
+module Files = RamenFiles
+module N = RamenName
 
-external of_ipv4_exn : uint32 -> string = "wrap_country_of_ipv4"
-external of_ipv6_exn : uint128 -> string = "wrap_country_of_ipv6"
+external of_ipv4_exn_ : uint32 -> string = "wrap_country_of_ipv4"
+external of_ipv6_exn_ : uint128 -> string = "wrap_country_of_ipv6"
+
+(* Build an index file from the given IpToCountry CSV files (for v4 and v6),
+ * that can later replace the compiled in database: *)
+external build_index : string -> string -> string -> unit =
+  "wrap_country_of_ip_build_index"
+
+external load_index : string -> unit = "wrap_country_of_ip_load_index"
+
+(* When set, the index file is reloaded whenever it changes: *)
+let index_file = ref (N.path "")
+let index_mtime = ref 0.
+let last_check = ref 0.
+let num_lookups = ref 0
+
+let check_index () =
+  let now = Unix.gettimeofday () in
+  if now -. !last_check >= Default.country_index_check_period then (
+    last_check := now ;
+    match Files.mtime !index_file with
+    | exception _ ->
+        (* Keep whatever was loaded last: *)
+        ()
+    | mtime ->
+        if mtime <> !index_mtime then (
+          (* Do not retry before the file changes again: *)
+          index_mtime := mtime ;
+          match load_index (!index_file :> string) with
+          | exception e ->
+              !logger.error "Cannot load country index %a: %s"
+                N.path_print !index_file
+                (Printexc.to_string e)
+          | () ->
+              !logger.info "Loaded country index %a"
+                N.path_print !index_file))
+
+(* The index is only loaded at first lookup: *)
+let set_index_file fname =
+  index_file := fname ;
+  last_check := 0. ;
+  num_lookups := 0
+
+let may_check_index () =
+  if not (N.is_empty !index_file) then (
+    if !num_lookups land 1023 = 0 then check_index () ;
+    incr num_lookups)
+
+let of_ipv4_exn ip =
+  may_check_index () ;
+  of_ipv4_exn_ ip
+
+let of_ipv6_exn ip =
+  may_check_index () ;
+  of_ipv6_exn_ ip
 
 let of_ipv4 ip =
   try Some (of_ipv4_exn ip)
@@ -15,3 +72,116 @@ let of_ipv6 ip =
 let of_ip = function
   | RamenIp.V4 u -> of_ipv4 u
   | RamenIp.V6 u -> of_ipv6 u
+
+(* Test the index, from the flattening of the ranges to the lookups, against
+ * a linear scan of the original ranges: *)
+
+(*$inject
+  open Stdint
+
+  (* Index those ranges [(from, to, cc)] of the 32 bits space, both as v4
+   * ranges and as v6 ranges of the same /32 prefixes, and load it: *)
+  let load_ranges rs =
+    let v4_csv = Filename.temp_file "country_v4_" ".csv"
+    and v6_csv = Filename.temp_file "country_v6_" ".csv"
+    and index = Filename.temp_file "country_" ".idx" in
+    let v6_of x = Uint128.(shift_left (of_int x) 96) in
+    let write fname line =
+      let oc = open_out fname in
+      List.iter (line oc) rs ;
+      close_out oc in
+    write v4_csv (fun oc (f, t, cc) ->
+      Printf.fprintf oc "\"%d\",\"%d\",\"test\",\"0\",\"%s\",\"%sX\",\"Test\"\n"
+        f t cc cc) ;
+    write v6_csv (fun oc (f, t, cc) ->
+      Printf.fprintf oc "%s-%s,%s,test,0\n"
+        (RamenIpv6.to_string (v6_of f))
+        (RamenIpv6.to_string Uint128.(pred (v6_of (t + 1)))) cc) ;
+    build_index v4_csv v6_csv index ;
+    load_index index ;
+    List.iter Sys.remove [ v4_csv ; v6_csv ; index ]
+
+  (* The innermost range containing [x] wins, and among identical ranges
+   * the unknown country (ZZ) loses: *)
+  let reference rs x =
+    List.fold_left (fun best (f, t, cc as r) ->
+      if x < f || x > t then best else
+      match best with
+      | Some (f', t', cc') when
+          compare (f', -t', cc' <> "ZZ", cc') (f, -t, cc <> "ZZ", cc) > 0 ->
+          best
+      | _ -> Some r
+    ) None rs |>
+    function None -> None | Some (_, _, cc) -> Some cc
+
+  (* Lookup [x] as a v4 address, and as the first and last v6 addresses of
+   * that prefix: *)
+  let lookups x =
+    of_ipv4 (Uint32.of_int x),
+    of_ipv6 Uint128.(shift_left (of_int x) 96),
+    of_ipv6 Uint128.(pred (shift_left (of_int (x + 1)) 96))
+
+  let max_ip = 0xffff_ffff
+
+  (* Random ranges, which are either disjoint (some adjacent) or nested
+   * within each others, with some duplicates of unknown country: *)
+  let gen_ranges seed =
+    let rnd = Random.State.make [| seed |] in
+    let rand n =
+      if n <= 1 then 0 else
+      Int64.to_int (Random.State.int64 rnd (Int64.of_int n)) in
+    let ccs = [| "FR" ; "US" ; "DE" ; "JP" ; "BR" |] in
+    let rs = ref [] in
+    let rec fill depth nested lo hi =
+      let span = hi - lo + 1 in
+      let rec loop pos =
+        let start =
+          if Random.State.bool rnd then pos else pos + rand (span / 8) in
+        if start <= hi then (
+          let len = 1 + rand (min (hi - start + 1) (span / 3 + 1)) in
+          let stop = start + len - 1 in
+          if not nested || (start, stop) <> (lo, hi) then (
+            rs := (start, stop, ccs.(rand (Array.length ccs))) :: !rs ;
+            if rand 10 = 0 then rs := (start, stop, "ZZ") :: !rs) ;
+          if depth < 2 && len > 1 then fill (depth + 1) true start stop ;
+          if stop < hi then loop (stop + 1)
+        ) in
+      loop lo in
+    (* Sometimes cover the whole space, up to the last address: *)
+    if seed land 1 = 0 then (
+      rs := [ 0, max_ip, "EU" ] ;
+      fill 0 true 0 max_ip
+    ) else
+      fill 0 false 0 max_ip ;
+    !rs
+
+  (* Both ends of every range and their neighbours, and then some: *)
+  let probes seed rs =
+    let rnd = Random.State.make [| seed |] in
+    let clip x = max 0 (min max_ip x) in
+    0 :: max_ip ::
+    List.init 1000 (fun _ ->
+      Int64.to_int (Random.State.int64 rnd (Int64.of_int (max_ip + 1)))) @
+    List.concat (List.map (fun (f, t, _) ->
+      List.map clip [ f - 1 ; f ; t ; t + 1 ]) rs)
+*)
+
+(*$T load_ranges
+  List.for_all (fun seed -> \
+    let rs = gen_ranges seed in \
+    load_ranges rs ; \
+    List.for_all (fun x -> \
+      let exp = reference rs x in \
+      lookups x = (exp, exp, exp) \
+    ) (probes seed rs) \
+  ) [ 1 ; 2 ; 3 ; 4 ; 5 ; 6 ]
+*)
+
+(* Partially overlapping ranges are clipped: *)
+(*$T load_ranges
+  load_ranges [ 10, 20, "FR" ; 15, 30, "US" ; 31, 40, "US" ] ; \
+  List.map lookups [ 9 ; 10 ; 14 ; 15 ; 20 ; 21 ; 30 ; 31 ; 40 ; 41 ] = \
+    List.map (fun cc -> cc, cc, cc) \
+      [ None ; Some "FR" ; Some "FR" ; Some "US" ; Some "US" ; None ; None ; \
+        Some "US" ; Some "US" ; None ]
+*)
@@ -1,5 +1,6 @@
 (* Simple implementation of a polymorphic set that keeps only the most
- * important entries using the "heavy hitters" selection technique.
+ * important entries using the "heavy hitters" selection technique (namely,
+ * Space-Saving).
  * This technique is an approximation. For an item to be guaranteed to be
  * featured in the top N, its total contribution must be >= 1/N of the total.
  * Other than that, it depends on the actual sequence.
@@ -34,12 +35,15 @@ open RamenHelpersNoLog
 
 let debug = false
 
-(* Weight map: from weight to anything, ordered bigger weights first: *)
-module WMap = Map.Make (struct
-  type t = float ref (* ref so we can downscale *)
-  let compare w1 w2 = Float.compare !w2 !w1
-end)
+module GroupTable = RamenGroupTable
 
+(* This is the Space-Saving algorithm, with the monitored items stored in a
+ * stream-summary: items of equal weight share a bucket, buckets are linked
+ * in decreasing weight order and each holds a doubly linked list of its
+ * items. An updated item therefore moves only past the buckets it overtakes
+ * (usually none or one) and the lightest item to evict is always at hand.
+ * Items and buckets occupy fixed slots of a few flat arrays, so there is no
+ * allocation once the top is full. *)
 type 'a t =
   { max_size : int ;
     mutable cur_size : int ;
@@ -52,32 +56,157 @@ type 'a t =
      * new weights as time passes) *)
     decay : float ; (* decay factor (0 for no decay) *)
     mutable time_origin : float option ;
-    (* value to weight and overestimation: *)
-    mutable w_of_x : ('a, float * float) Map.t ;
-    (* max weight to value to overestimation. Since we need iteration to go
-     * from bigger to smaller weight we need a custom map: *)
-    mutable xs_of_w : (('a, float) Map.t) WMap.t }
+    (* Per slot monitored value and overestimation.
+     * [items] is allocated with the first value: *)
+    mutable items : 'a array ;
+    overs : float array ;
+    (* Per slot bucket and neighbours in that bucket: *)
+    bucket_of : int array ;
+    prev_in_bucket : int array ;
+    next_in_bucket : int array ;
+    (* Per bucket weight, first slot and heavier/lighter neighbours. Unused
+     * buckets are chained through [lighter]: *)
+    bucket_weight : float array ;
+    first_in_bucket : int array ;
+    heavier : int array ;
+    lighter : int array ;
+    mutable heaviest : int ;
+    mutable lightest : int ;
+    mutable unused_buckets : int ;
+    (* Value to slot: *)
+    slots : ('a, int) GroupTable.t }
+
+let nil = -1
 
 let make ~max_size ~decay ~sigmas =
   { max_size ; cur_size = 0 ; sigmas = abs_float sigmas ;
     sum_weight1 = Kahan.init ; sum_weight2 = Kahan.init ; count = 0L ;
     decay ; time_origin = None ;
-    w_of_x = Map.empty ; xs_of_w = WMap.empty }
+    items = [||] ;
+    overs = Array.make max_size 0. ;
+    bucket_of = Array.make max_size nil ;
+    prev_in_bucket = Array.make max_size nil ;
+    next_in_bucket = Array.make max_size nil ;
+    bucket_weight = Array.make max_size 0. ;
+    first_in_bucket = Array.make max_size nil ;
+    heavier = Array.make max_size nil ;
+    lighter = Array.init max_size (fun b -> if b < max_size - 1 then b + 1
+                                            else nil) ;
+    heaviest = nil ; lightest = nil ;
+    unused_buckets = if max_size > 0 then 0 else nil ;
+    slots = GroupTable.create max_size }
+
+let weight s slot =
+  s.bucket_weight.(s.bucket_of.(slot))
+
+(* Slots in decreasing weight order: *)
+let first_ranked s =
+  if s.heaviest = nil then nil else s.first_in_bucket.(s.heaviest)
+
+let next_ranked s slot =
+  let next = s.next_in_bucket.(slot) in
+  if next <> nil then next else
+  let b = s.lighter.(s.bucket_of.(slot)) in
+  if b = nil then nil else s.first_in_bucket.(b)
+
+(* Remove [slot] from its bucket, releasing the bucket if it's left empty.
+ * Returns the buckets just heavier and just lighter than the weight the slot
+ * had, to start searching from for its new bucket: *)
+let detach s slot =
+  let b = s.bucket_of.(slot) in
+  let prev = s.prev_in_bucket.(slot) and next = s.next_in_bucket.(slot) in
+  if prev = nil then s.first_in_bucket.(b) <- next
+  else s.next_in_bucket.(prev) <- next ;
+  if next <> nil then s.prev_in_bucket.(next) <- prev ;
+  let hi = s.heavier.(b) and lo = s.lighter.(b) in
+  if s.first_in_bucket.(b) <> nil then hi, b else (
+    if hi = nil then s.heaviest <- lo else s.lighter.(hi) <- lo ;
+    if lo = nil then s.lightest <- hi else s.heavier.(lo) <- hi ;
+    s.lighter.(b) <- s.unused_buckets ;
+    s.unused_buckets <- b ;
+    hi, lo
+  )
+
+(* Add [slot] to the bucket of weight [w], which is to be found between
+ * buckets [hi] and [lo] or beyond: *)
+let place s slot w hi lo =
+  let rec up hi lo =
+    if hi <> nil && s.bucket_weight.(hi) < w then up s.heavier.(hi) hi
+    else down hi lo
+  and down hi lo =
+    if lo <> nil && s.bucket_weight.(lo) > w then down lo s.lighter.(lo)
+    else hi, lo in
+  let hi, lo = up hi lo in
+  let b =
+    if hi <> nil && s.bucket_weight.(hi) = w then hi else
+    if lo <> nil && s.bucket_weight.(lo) = w then lo else (
+      (* There is always an unused bucket as there are as many buckets as
+       * slots: *)
+      let b = s.unused_buckets in
+      s.unused_buckets <- s.lighter.(b) ;
+      s.bucket_weight.(b) <- w ;
+      s.first_in_bucket.(b) <- nil ;
+      s.heavier.(b) <- hi ;
+      s.lighter.(b) <- lo ;
+      if hi = nil then s.heaviest <- b else s.lighter.(hi) <- b ;
+      if lo = nil then s.lightest <- b else s.heavier.(lo) <- b ;
+      b
+    ) in
+  let next = s.first_in_bucket.(b) in
+  s.bucket_of.(slot) <- b ;
+  s.prev_in_bucket.(slot) <- nil ;
+  s.next_in_bucket.(slot) <- next ;
+  if next <> nil then s.prev_in_bucket.(next) <- slot ;
+  s.first_in_bucket.(b) <- slot
+
+(* Weight of the lightest item, which is the one to evict: *)
+let min_weight s =
+  if s.lightest = nil then 0. else s.bucket_weight.(s.lightest)
 
 (* Downscale all stored weight by [d] and reset time_origin.
- * That's OK to modify the map keys because relative ordering is not going
- * to change: *)
+ * Relative ordering is not going to change: *)
 (* TODO: stats about rescale frequency *)
 let downscale s t d =
   !logger.debug "HeavyHitters: downscaling %d entries by %g"
     s.cur_size d ;
-  s.w_of_x <-
-    Map.map (fun (w, o) -> w *. d, o *. d) s.w_of_x ;
-  WMap.iter (fun w _xs -> w := !w *. d) s.xs_of_w ;
+  let rec scale_buckets b =
+    if b <> nil then (
+      s.bucket_weight.(b) <- s.bucket_weight.(b) *. d ;
+      scale_buckets s.lighter.(b)
+    ) in
+  scale_buckets s.heaviest ;
+  for i = 0 to s.cur_size - 1 do
+    s.overs.(i) <- s.overs.(i) *. d
+  done ;
   s.sum_weight1 <- Kahan.mul s.sum_weight1 d ;
   s.sum_weight2 <- Kahan.mul s.sum_weight2 (d *. d) ;
   s.time_origin <- Some t
 
+(* Start monitoring [x] with that weight and overestimation, evicting the
+ * lightest item if the top is full. [w] must include the overestimation: *)
+let monitor s x w o =
+  if s.cur_size = 0 && Array.length s.items = 0 then
+    s.items <- Array.make s.max_size x ;
+  let slot, hi, lo =
+    if s.cur_size < s.max_size then (
+      let slot = s.cur_size in
+      s.cur_size <- s.cur_size + 1 ;
+      slot, s.lightest, nil
+    ) else (
+      let slot = s.first_in_bucket.(s.lightest) in
+      if debug then
+        Printf.printf "TOP: evict entry %s of weight %f\n"
+          (dump s.items.(slot)) (weight s slot) ;
+      GroupTable.remove s.slots s.items.(slot) ;
+      let hi, lo = detach s slot in
+      slot, hi, lo
+    ) in
+  if debug then Printf.printf "TOP: add entry %s of weight %f\n" (dump x) w ;
+  s.items.(slot) <- x ;
+  s.overs.(slot) <- o ;
+  GroupTable.replace s.slots x slot ;
+  place s slot w hi lo
+
 let add s t w x =
   (* Decaying old weights is the same as inflating new weights.
    * But then after a while new inflated weights will become too big to
@@ -97,151 +226,127 @@ let add s t w x =
           1.
         ) in
   let w = w *. inflation in
-  let add_in_xs_of_w x w o m =
-    if debug then Printf.printf "TOP: add entry %s of weight %f\n" (dump x) w ;
-    WMap.modify_opt (ref w) (function
-      | None -> Some (Map.singleton x o)
-      | Some xs ->
-          assert (not (Map.mem x xs)) ;
-          Some (Map.add x o xs)
-    ) m
-  and rem_from_xs_of_w x w m =
-    WMap.modify_opt (ref w) (function
-      | None -> assert false
-      | Some xs ->
-          (match Map.extract x xs with
-          | exception Not_found ->
-              !logger.error "xs_of_w for w=%f does not have x=%s (only %a)"
-                w (dump x)
-                (Map.print print_dump Float.print) xs ;
-              assert false
-          | _, xs ->
-              if Map.is_empty xs then None else Some xs)
-    ) m
-  in
   (* Shortcut for the frequent case when w=0: *)
-  if w <> 0. then (
-    let victim_x = ref None in
-    s.w_of_x <-
-      Map.modify_opt x (function
-        | None ->
-            let victim_w = ref 0. in
-            if s.cur_size >= s.max_size then (
-              (* pick the victim and remove it from xs_of_w: *)
-              let victim_w', xs = WMap.max_binding s.xs_of_w in
-              let (victim_x', _victim_o), xs' = Map.pop xs in
-              victim_w := !victim_w' ;
-              victim_x := Some victim_x' ;
-              s.xs_of_w <-
-                if Map.is_empty xs' then
-                  WMap.remove victim_w' s.xs_of_w
-                else
-                  WMap.update victim_w' victim_w' xs' s.xs_of_w
-            ) else s.cur_size <- s.cur_size + 1 ;
-            let w = w +. !victim_w in
-            s.xs_of_w <- add_in_xs_of_w x w !victim_w s.xs_of_w ;
-            Some (w, !victim_w)
-        | Some (w', o) ->
-            let w = w +. w' in
-            s.xs_of_w <-
-              rem_from_xs_of_w x w' s.xs_of_w |>
-              add_in_xs_of_w x w o ;
-            Some (w, o)
-      ) s.w_of_x ;
-    Option.may (fun x ->
-      match Map.extract x s.w_of_x with
+  if w <> 0. && s.max_size > 0 then (
+    let w =
+      match GroupTable.find s.slots x with
       | exception Not_found ->
-          !logger.error "w_of_x does not have x=%s, only %a"
-            (dump x)
-            (Enum.print print_dump) (Map.keys s.w_of_x |> Enum.take 99) ;
-          assert false
-      | _, w_of_x ->
-          s.w_of_x <- w_of_x
-    ) !victim_x ;
+          (* Replace the lightest item, inheriting its weight as the
+           * overestimation: *)
+          let victim_w =
+            if s.cur_size < s.max_size then 0. else min_weight s in
+          let w = w +. victim_w in
+          monitor s x w victim_w ;
+          w
+      | slot ->
+          let w = w +. weight s slot in
+          let hi, lo = detach s slot in
+          place s slot w hi lo ;
+          w in
     (* Also compute the mean if sigmas is not null: *)
     if s.sigmas > 0. then (
       s.sum_weight1 <- Kahan.add s.sum_weight1 w ;
-      s.sum_weight2 <- Kahan.add s.sum_weight1 (w *. w) ;
+      s.sum_weight2 <- Kahan.add s.sum_weight2 (w *. w) ;
       s.count <- Int64.add s.count 1L
-    ) ;
-    assert (s.cur_size <= s.max_size) (*;
-    assert (Map.cardinal s.w_of_x = s.cur_size) ;
-    assert (WMap.cardinal s.xs_of_w <= s.cur_size)*)
+    )
   ) (* w <> 0. *)
 
+(* Iter the entries in decreasing weight order: *)
+let fold u f s =
+  let rec loop u slot =
+    if slot = nil then u else
+    loop (f (weight s slot) s.items.(slot) s.overs.(slot) u)
+         (next_ranked s slot) in
+  loop u (first_ranked s)
+
 (* For each monitored item of rank k <= n, we must ask ourselves: could there
  * be an item with rank k > n, or a non-monitored items, with more weight?  For
- * this we must compare guaranteed weight of items with the max weight of item
- * of rank n+1; but we don't know which item that is unless we order them. *)
-(* FIXME: super slow, maintain the entries in increased max weight order. *)
-
-(* Iter the entries in decreasing weight order.
- * Note: BatMap iterates in increasing keys order despite de doc says it's
- * unspecified, but since we reverse the comparison operator we fold from
- * heaviest to lightest. *)
-let fold u f s =
-  WMap.fold (fun w xs u ->
-    if debug then Printf.printf "TOP: folding over all entries of weight %f\n" !w ;
-    Map.foldi (fun x o u ->
-      if debug then Printf.printf "TOP:   ... %s\n" (dump x) ;
-      f !w x o u
-    ) xs u
-  ) s.xs_of_w u
+ * this we compare guaranteed weight of items with the max weight of the item
+ * of rank n+1: *)
 
 (* Iter over the top [n'] entries (<= [n] but close) in order of weight,
  * lightest first (so that it's easy to build the reverse list), ignoring
  * those entries below the specified amount of sigmas: *)
 let fold_top n u f s =
-  let res = ref []
-  and cutoff = ref None in
-  let cutoff_fun () =
+  (* The [n] first slots, lightest first, and the weight of the next one if
+   * any (otherwise we know all the entries): *)
+  let rec collect k l slot =
+    if slot = nil then l, neg_infinity
+    else if k >= n then l, weight s slot
+    else collect (k + 1) (slot :: l) (next_ranked s slot) in
+  let top_slots, cutoff = collect 0 [] (first_ranked s)
+  and cutoff_sigma =
     if s.sigmas > 0. then
       let sum_weight1 = Kahan.finalize s.sum_weight1
       and sum_weight2 = Kahan.finalize s.sum_weight2
       and count = Int64.to_float s.count in
       let mean = sum_weight1 /. count in
       let sigma = sqrt (count *. sum_weight2 -. mean *. mean) /. count in
-      let cutoff_sigma = mean +. s.sigmas *. sigma in
-      match !cutoff with
-      | None ->
-          fun u (w, _min_w, x) ->
-            if w >= cutoff_sigma then f u x else u
-      | Some c ->
-          fun u (w, min_w, x) ->
-            if min_w >= c && w >= cutoff_sigma then f u x else u
+      mean +. s.sigmas *. sigma
     else
-      match !cutoff with
-      | None ->
-          fun u (_w, _min_w, x) -> f u x
-      | Some c ->
-          fun u (_w, min_w, x) ->
-            if min_w >= c then f u x else u
-  in
-  (try
-    let _ =
-      fold 1 (fun w x o rank ->
-        (* We need item at rank n+1 to find top-n *)
-        if rank <= n then (
-          if debug then
-            Printf.printf "TOP rank=%d<=%d is %s, weight %f\n" rank n (dump x) w ;
-          (* May be filtered once we know the cutoff: *)
-          res := (w, (w -. o), x) :: !res ; (* res is lightest to heaviest *)
-          rank + 1
-        ) else (
-          assert (rank = n + 1) ;
-          if debug then
-            Printf.printf "TOP rank=%d>%d is %s, weight %f\n" rank n (dump x) w ;
-          cutoff := Some w ;
-          raise Exit
-        )
-      ) s in
-    (* We reach here when we had less entries than n, in which case we do not
-     * need a cut-off since we know all the entries: *)
+      neg_infinity in
+  List.fold_left (fun u slot ->
+    let w = weight s slot in
+    let min_w = w -. s.overs.(slot) in
     if debug then
-      Printf.printf "TOP: Couldn't reach rank %d, cur_size=%d\n" n s.cur_size ;
-  with Exit -> ()) ;
-  (* Now filter the entries if we have a cutoff, and build the result: *)
-  List.fold_left (cutoff_fun ()) u !res
+      Printf.printf "TOP of %d: %s, weight %f\n"
+        n (dump s.items.(slot)) w ;
+    if min_w >= cutoff && w >= cutoff_sigma then f u s.items.(slot)
+    else u
+  ) u top_slots
+
+(* Merge two tops (with the same decay), for instance computed in parallel
+ * over distinct parts of the same stream. As in the Space-Saving merge, an
+ * item that is not monitored by a full top is assumed to weight as much as
+ * its lightest item, which is also added to its overestimation. The result
+ * is as large as the larger of the two: *)
+let merge s1 s2 =
+  if s1.decay <> s2.decay then invalid_arg "HeavyHitters.merge" ;
+  (* Express both weights relative to the latest time origin: *)
+  let time_origin =
+    match s1.time_origin, s2.time_origin with
+    | None, t | t, None -> t
+    | Some t1, Some t2 -> Some (max t1 t2) in
+  let scale s =
+    match s.time_origin, time_origin with
+    | Some t0, Some t -> exp ((t0 -. t) *. s.decay)
+    | _ -> 1. in
+  let d1 = scale s1 and d2 = scale s2 in
+  let lightest s d =
+    if s.cur_size < s.max_size then 0. else min_weight s *. d in
+  let min1 = lightest s1 d1 and min2 = lightest s2 d2 in
+  let entries =
+    fold [] (fun w x o l ->
+      let w, o =
+        match GroupTable.find s2.slots x with
+        | exception Not_found ->
+            w *. d1 +. min2, o *. d1 +. min2
+        | slot2 ->
+            w *. d1 +. weight s2 slot2 *. d2,
+            o *. d1 +. s2.overs.(slot2) *. d2 in
+      (w, x, o) :: l
+    ) s1 in
+  let entries =
+    fold entries (fun w x o l ->
+      if GroupTable.mem s1.slots x then l
+      else (w *. d2 +. min1, x, o *. d2 +. min1) :: l
+    ) s2 |>
+    List.fast_sort (fun (w1, _, _) (w2, _, _) -> Float.compare w2 w1) in
+  let s =
+    make ~max_size:(max s1.max_size s2.max_size) ~decay:s1.decay
+         ~sigmas:s1.sigmas in
+  s.time_origin <- time_origin ;
+  s.sum_weight1 <-
+    Kahan.add (Kahan.mul s1.sum_weight1 d1)
+              (Kahan.finalize s2.sum_weight1 *. d2) ;
+  s.sum_weight2 <-
+    Kahan.add (Kahan.mul s1.sum_weight2 (d1 *. d1))
+              (Kahan.finalize s2.sum_weight2 *. d2 *. d2) ;
+  s.count <- Int64.add s1.count s2.count ;
+  List.iteri (fun i (w, x, o) ->
+    if i < s.max_size then monitor s x w o
+  ) entries ;
+  s
 
 (* Returns the top as a list ordered by weight (heavier first) *)
 let top n s =
@@ -322,3 +427,38 @@ let is_in_top n x s =
   let success_rate = float_of_int !num_find_all /. float_of_int retry in
   assert_bool "must be accurate most of the times" (success_rate > 0.6)
 *)
+
+(*$= merge & ~printer:(BatIO.to_string (BatList.print BatInt.print))
+  [ 1 ; 2 ; 3 ] \
+    (let s1 = make ~max_size:10 ~decay:0. ~sigmas:0. \
+     and s2 = make ~max_size:10 ~decay:0. ~sigmas:0. in \
+     add s1 0. 4. 1 ; add s1 0. 1. 2 ; add s2 0. 2. 2 ; add s2 0. 1. 3 ; \
+     top 3 (merge s1 s2))
+  [ 3 ; 1 ] \
+    (let s1 = make ~max_size:2 ~decay:0. ~sigmas:0. \
+     and s2 = make ~max_size:2 ~decay:0. ~sigmas:0. in \
+     add s1 0. 5. 1 ; add s1 0. 3. 2 ; add s2 0. 4. 3 ; add s2 0. 1. 4 ; \
+     top 2 (merge s1 s2))
+*)
+
+(* Ranks stay ordered whatever the order of updates: *)
+(*$T add
+  let s = make ~max_size:50 ~decay:0. ~sigmas:0. in \
+  for i = 0 to 999 do add s 0. (float_of_int (i mod 7)) (i mod 40) done ; \
+  let ws = fold [] (fun w _ _ l -> w :: l) s in \
+  List.length ws = 40 && List.sort compare ws = ws
+*)
+
+(* Items overtake those of equal weight, and buckets are reused: *)
+(*$= top & ~printer:(BatIO.to_string (BatList.print BatInt.print))
+  [ 3 ; 1 ] \
+    (let s = make ~max_size:3 ~decay:0. ~sigmas:0. in \
+     add s 0. 1. 1 ; add s 0. 1. 2 ; add s 0. 1. 3 ; \
+     add s 0. 1. 3 ; add s 0. 0.5 1 ; \
+     top 2 s)
+  [ 4 ; 3 ] \
+    (let s = make ~max_size:3 ~decay:0. ~sigmas:0. in \
+     add s 0. 1. 1 ; add s 0. 2. 2 ; add s 0. 3. 3 ; \
+     add s 0. 1. 4 ; add s 0. 2. 4 ; \
+     top 2 s)
+*)
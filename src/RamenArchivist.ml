@@ -123,12 +123,13 @@ let compute_archives conf prog_name func =
     N.path_print bname
     N.path_print arc_dir ;
   let lst =
-    RingBufLib.arc_files_of arc_dir //@
-    (fun (_seq_mi, _seq_ma, t1, t2, _typ, fname) ->
+    RingBufLib.arc_files_with_size_of arc_dir |>
+    Array.enum //@
+    (fun ((_seq_mi, _seq_ma, t1, t2, _typ, _fname), sz) ->
       if Float.(is_nan t1 || is_nan t2) then
         None
       else (
-        Some (t1, t2, false, 1, Files.size fname)
+        Some (t1, t2, false, 1, sz)
       )) |>
     List.of_enum in
   (* We might also have a current archive (if the worker is actually running): *)
@@ -576,7 +577,18 @@ let reconf_workers
                 OWD.Orc {
                   with_index = false ;
                   batch_size = Uint32.of_int Default.orc_rows_per_batch ;
-                  num_batches = Uint32.of_int Default.orc_batches_per_file } in
+                  num_batches = Uint32.of_int Default.orc_batches_per_file ;
+                  compression =
+                    (match RamenExperiments.archive_orc_compression.variant with
+                    | 1 -> OWD.Zstd
+                    | 2 -> OWD.Lz4
+                    | 3 -> OWD.Snappy
+                    | 4 -> OWD.NoCompression
+                    | _ -> OWD.Zlib) ;
+                  compression_block_size =
+                    Uint32.of_int Default.orc_compression_block_size ;
+                  stripe_size = Uint64.of_int Default.orc_stripe_size ;
+                  dictionary_threshold = Default.orc_dictionary_threshold } in
             !logger.info "Make %a to archive"
               N.fq_print fq ;
             Processes.start_archive
@@ -1,27 +1,53 @@
 (* Simple bitmask *)
 open Batteries
 
-type t = { num_bits : int ; bits : Bytes.t }
+type bytes =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(* Bits are stored from byte [offs] of [bits], so that they start on a cache
+ * line boundary. Bigarrays are not moved by the GC but they are when
+ * unmarshalled, so [offs] is updated whenever [bits] is found misaligned
+ * (see [realign]): *)
+type t = { num_bits : int ; bits : bytes ; mutable offs : int }
+
+let cache_line = 64
+
+external align_offset : bytes -> int =
+  "wrap_bitmask_align_offset" [@@noalloc]
+
+let num_bytes num_bits = (num_bits + 7) / 8
 
 let make num_bits =
-  { num_bits ;
-    bits = Bytes.make ((num_bits + 7) / 8) '\000' }
+  let bits =
+    Bigarray.(Array1.create char c_layout
+                (num_bytes num_bits + cache_line - 1)) in
+  Bigarray.Array1.fill bits '\000' ;
+  { num_bits ; bits ; offs = align_offset bits }
+
+let realign t =
+  let offs = align_offset t.bits in
+  if offs <> t.offs then (
+    let len = num_bytes t.num_bits in
+    (* Overlapping blits are fine: *)
+    Bigarray.Array1.(blit (sub t.bits t.offs len) (sub t.bits offs len)) ;
+    t.offs <- offs)
 
 let bit_loc_of_bit b =
   b lsr 3, b land 7
 
 let get t b =
   let idx, b_off = bit_loc_of_bit b in
-  let n = Bytes.get t.bits idx |> Char.code in
+  let n = Bigarray.Array1.get t.bits (t.offs + idx) |> Char.code in
   (n lsr b_off) land 1 = 1
 
 (* returns if the bit was already set *)
 let getset t b =
   let idx, b_off = bit_loc_of_bit b in
-  let n = Bytes.get t.bits idx |> Char.code in
+  let n = Bigarray.Array1.get t.bits (t.offs + idx) |> Char.code in
   let mask = 1 lsl b_off in
   if n land mask = 0 then (
-    Bytes.set t.bits idx (Char.chr (n lor (1 lsl b_off))) ;
+    Bigarray.Array1.set t.bits (t.offs + idx)
+                        (Char.chr (n lor (1 lsl b_off))) ;
     false
   ) else true
 
@@ -29,3 +55,53 @@ let set t b =
   ignore (getset t b)
 
 let to_bools t = Array.init t.num_bits (get t)
+
+(* Blocked bitmasks, as used by bloom filters, are made of blocks of
+ * [block_bits] bits (a cache line), in which the bits of a key are
+ * [(a + i*b) mod block_bits] for i from 0 to [k]-1: *)
+
+let block_bits = 512
+
+let make_blocks num_blocks =
+  make (num_blocks * block_bits)
+
+let num_blocks t =
+  t.num_bits / block_bits
+
+(* The int is the offset of the block in bytes: *)
+external test_block_bits_ : bytes -> int -> int -> int -> int -> bool =
+  "wrap_bitmask_test_block_bits" [@@noalloc]
+external set_block_bits_ : bytes -> int -> int -> int -> int -> int =
+  "wrap_bitmask_set_block_bits" [@@noalloc]
+
+let block_offset t block =
+  if block < 0 || block >= num_blocks t then invalid_arg "block" ;
+  realign t ;
+  t.offs + block * (block_bits / 8)
+
+(* Tells if all those bits of that block are set: *)
+let test_block_bits t block a b k =
+  test_block_bits_ t.bits (block_offset t block) a b k
+
+(* Set all those bits of that block and returns how many were not set
+ * already: *)
+let set_block_bits t block a b k =
+  set_block_bits_ t.bits (block_offset t block) a b k
+
+(*$T set_block_bits
+  let t = make_blocks 2 in \
+  set_block_bits t 1 3 5 4 = 4 && \
+  List.for_all (get t) [ 515 ; 520 ; 525 ; 530 ] && \
+  not (get t 3) && \
+  test_block_bits t 1 3 5 4 && \
+  not (test_block_bits t 0 3 5 4) && \
+  not (test_block_bits t 1 3 5 5) && \
+  set_block_bits t 1 3 5 5 = 1
+  let t = make_blocks 1 in \
+  set_block_bits t 0 500 20 3 = 3 && List.for_all (get t) [ 500 ; 8 ; 28 ]
+  let t = make_blocks 3 in \
+  ignore (set_block_bits t 2 7 9 4) ; \
+  let t' : t = Marshal.(from_string (to_string t [])) 0 in \
+  test_block_bits t' 2 7 9 4 && not (test_block_bits t' 1 7 9 4) && \
+  align_offset t'.bits = t'.offs && get t' (1024 + 16)
+*)
@@ -3,40 +3,33 @@ open Batteries
 open RamenLog
 open RamenHelpersNoLog
 open RamenConsts
+module Metric = RamenConstsMetric
 
-(* TODO: use RamenBitmask *)
+(* This is a blocked bloom filter: all the bits of a value are set within
+ * a single block of RamenBitmask.block_bits (a cache line), chosen by the
+ * hash of that value. Within the block, the bit positions are obtained by
+ * double hashing (Kirsch-Mitzenmacher): bit i is a + i*b, where the block,
+ * a and b are all taken from the same single hash. *)
 type t =
   { (* Storage for [num_bits] bits: *)
-    bytes : Bytes.t ;
-    (* How many bits are physically stored *)
+    bits : RamenBitmask.t ;
+    (* How many bits are physically stored (a multiple of the block size): *)
     num_bits : int ;
-    (* How many rounds of hashing to perform to add/check a key.
-     * Note: when remembering a value [num_keys] bits are set, and when
-     * checking if that value have been encountered all those bits must be set.
-     *)
+    num_blocks : int ;
+    (* How many bits to set to add a key, all of which must be set for a key
+     * to be deemed remembered: *)
     num_keys : int ;
-    (* The [num_keys] integer random values used for each of the hashing round:
-     *)
-    salt : int list ;
+    (* Random value mixed in the hash of every value: *)
+    seed : int ;
     (* Count how many bits in bytes have been set to 1: *)
     mutable num_bits_set : int }
 
-let make num_bits num_keys =
-  let len = (num_bits + 7) / 8 in
-  { bytes = Bytes.make len (Char.chr 0) ;
-    num_bits ; num_keys ; num_bits_set = 0 ;
-    salt = List.init num_keys (fun _ -> Random.int max_int_for_random) }
-
-(* Return the byte index within [bytes] and the bit index within that byte
- * of the [b]th bit: *)
-let bit_loc_of_bit b =
-  b lsr 3, b land 7
-
-(* Tells whether a given bit from [bytes] is set or not: *)
-let get_bit t b =
-  let idx, b_off = bit_loc_of_bit b in
-  let n = Bytes.get t.bytes idx |> Char.code in
-  (n lsr b_off) land 1 = 1
+let make ?(seed=Random.int max_int_for_random) num_bits num_keys =
+  let block_bits = RamenBitmask.block_bits in
+  let num_blocks = max 1 ((num_bits + block_bits - 1) / block_bits) in
+  { bits = RamenBitmask.make_blocks num_blocks ;
+    num_bits = num_blocks * block_bits ; num_blocks ; num_keys ; seed ;
+    num_bits_set = 0 }
 
 (* Returns the ratio of 1s over 0s in [bytes]: *)
 let fill_ratio t =
@@ -46,41 +39,29 @@ let false_positive_likelihood t =
   let k = float_of_int t.num_keys in
   (1. -. exp ~-.(k *. fill_ratio t)) ** k
 
-(* Set bit [b] in [bytes], updating [num_bits_set] *)
-let set_bit t b =
-  let idx, b_off = bit_loc_of_bit b in
-  let n = Bytes.get t.bytes idx |> Char.code in
-  let mask = 1 lsl b_off in
-  if n land mask = 0 then (
-    t.num_bits_set <- t.num_bits_set + 1 ;
-    Bytes.set t.bytes idx (Char.chr (n lor (1 lsl b_off)))
-  )
-
-(*$= get_bit & ~printer:(BatIO.to_string BatBool.print)
-  false (let t = make 1 1 in get_bit t 0)
-  true (let t = make 1 1 in set_bit t 0 ; get_bit t 0)
-  true (let t = make 10 1 in set_bit t 9 ; get_bit t 9)
-  false (let t = make 10 1 in set_bit t 9 ; get_bit t 5)
- *)
-
-type key = int list
+type key = int
 
+(* Scramble the hash of [x] so that all its bits depend on all the bits of
+ * the hash (this is the finalizer of murmur3, truncated to OCaml ints): *)
 let key t x =
-  let h0 = Hashtbl.hash x in
-  List.fold_left (fun prev_key salt ->
-    (* TODO: check how worse the FPR would be if instead of recomputing the
-     * hash of the whole list of previous hashes at every round we instead
-     * used only this round's salt and the head of that list. *)
-    let h = Hashtbl.hash (salt :: prev_key) in
-    h :: prev_key
-  ) [ h0 ] t.salt
+  let h = Hashtbl.hash x lxor t.seed in
+  let h = (h lxor (h lsr 33)) * 0x3f51afd7ed558ccd in
+  let h = (h lxor (h lsr 33)) * 0x04ceb9fe1a85ec53 in
+  h lxor (h lsr 33)
+
+(* The block, and the two hashes of the double hashing: *)
+let block_of_key t k =
+  (k lsr 18) mod t.num_blocks
+
+let a_of_key k = k land 511
+
+(* Must be odd to be coprime with the block size: *)
+let b_of_key k = ((k lsr 9) land 511) lor 1
 
 (* Tells if all bits (for the given keys) are set: *)
 let get_by_key t k =
-  List.for_all (fun h ->
-    let b = h mod t.num_bits in
-    get_bit t b
-  ) k
+  RamenBitmask.test_block_bits t.bits (block_of_key t k) (a_of_key k)
+                               (b_of_key k) t.num_keys
 
 (* Tells if a given value [x] (of any type) is remembered by the filter: *)
 let get t x =
@@ -89,10 +70,10 @@ let get t x =
 
 (* Set all bits of the given key: *)
 let set_by_key t k =
-  List.iter (fun h ->
-    let b = h mod t.num_bits in
-    set_bit t b
-  ) k
+  let newly_set =
+    RamenBitmask.set_block_bits t.bits (block_of_key t k) (a_of_key k)
+                                (b_of_key k) t.num_keys in
+  t.num_bits_set <- t.num_bits_set + newly_set
 
 (* Remember value [x] in the bloom filter: *)
 let set t x =
@@ -112,6 +93,24 @@ let set t x =
   false (get t "baz")
  *)
 
+(* With 10 bits per item, expect about 1% of false positives: *)
+(*$T set
+  let t = make 10_000 7 in \
+  for i = 0 to 999 do set t i done ; \
+  List.for_all (get t) (List.init 1000 identity) && \
+  t.num_bits_set <= 7000 && t.num_bits mod 512 = 0
+  let t = make 10_000 7 in \
+  for i = 0 to 999 do set t i done ; \
+  let fps = List.init 10_000 (fun i -> i + 1000) |> List.filter (get t) in \
+  List.length fps < 500
+*)
+
+(* Estimated false positive ratio of the filters at the time they are
+ * rotated out: *)
+let stats_false_positives =
+  Binocle.FloatGauge.make Metric.Names.bloom_false_positives
+    Metric.Docs.bloom_false_positives
+
 (*
  * Now for the slicing
  *
@@ -129,14 +128,16 @@ type sliced_filter =
     slice_width : float ;
     (* As in the slice: number of hashing rounds. Computed from the FPR. *)
     num_keys : int ;
+    (* All slices share the same seed, so that a value is hashed only once: *)
+    seed : int ;
     (* Ratio between the size of the filter and the number of inserted items.
      * Computed from the desired FPR. *)
     num_bits_per_item : float ;
     (* Current slice (in [slices]: *)
     mutable current : int }
 
-let make_slice num_bits num_keys start_time =
-  { filter = make num_bits num_keys ; start_time }
+let make_slice num_bits num_keys seed start_time =
+  { filter = make ~seed num_bits num_keys ; start_time }
 
 let make_sliced start_time num_slices slice_width false_positive_ratio =
   (* We aim for the given probability of false positive. *)
@@ -148,10 +149,11 @@ let make_sliced start_time num_slices slice_width false_positive_ratio =
                  with %d keys, %f bits per items, %d bits \
                  (%d slices of duration %f)\n"
     start_time num_keys num_bits_per_item num_bits num_slices slice_width ;
+  let seed = Random.int max_int_for_random in
   { slices = Array.init num_slices (fun i ->
       let start_time = start_time +. float_of_int i *. slice_width in
-      make_slice num_bits num_keys start_time) ;
-    slice_width ; num_keys ; num_bits_per_item ; current = 0 }
+      make_slice num_bits num_keys seed start_time) ;
+    slice_width ; num_keys ; seed ; num_bits_per_item ; current = 0 }
 
 (* Tells if [x] has been seen earlier (and remembers it). If [time] is
  * before the range of remembered data then returns false (as if not seen).
@@ -220,19 +222,22 @@ let remember sf refresh time x =
         sf.slices.(sf.current).filter.num_bits
         (int_of_float num_inserted)
         (100. *. fpl) num_bits ;
+      Binocle.FloatGauge.set stats_false_positives fpl ;
       (* TODO: a slice_reset that does not allocate (if we keep a close size) *)
-      sf.slices.(sf.current) <- make_slice num_bits sf.num_keys end_time ;
+      sf.slices.(sf.current) <-
+        make_slice num_bits sf.num_keys sf.seed end_time ;
       loop ()
     ) in
   loop () ;
+  let k = key sf.slices.(sf.current).filter x in
   match
     Array.findi (fun slice ->
-      get slice.filter x
+      get_by_key slice.filter k
     ) sf.slices with
   | exception Not_found ->
-    set sf.slices.(sf.current).filter x ;
+    set_by_key sf.slices.(sf.current).filter k ;
     false
   | i ->
     if refresh && i <> sf.current then
-      set sf.slices.(sf.current).filter x ;
+      set_by_key sf.slices.(sf.current).filter k ;
     true
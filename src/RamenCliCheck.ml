@@ -54,13 +54,15 @@ let check_opt_level = function
       failwith "Invalid optimization level: must be between 0 and 3 \
                 (inclusive)"
 
-let execompserver conf max_simult_compils quarantine opt_level =
+let execompserver conf max_simult_compils quarantine jobs opt_level =
   if conf.C.sync_url = "" then
     failwith "Cannot start the compilation service without --confserver." ;
   if max_simult_compils <= 0 then
     failwith "--max-simult-compilations must be positive." ;
   if quarantine < 0. then
     failwith "--quarantine must be positive." ;
+  if jobs <= 0 then
+    failwith "--jobs must be positive." ;
   check_opt_level opt_level
 
 let compile source_files src_path_opt opt_level =
@@ -549,23 +549,27 @@ let precompserver conf daemonize to_stdout to_syslog prefix_log_with_name
 
 let execompserver conf daemonize to_stdout to_syslog prefix_log_with_name
                   external_compiler max_simult_compilations
-                  dessser_codegen opt_level quarantine () =
-  RamenCliCheck.execompserver conf max_simult_compilations quarantine opt_level ;
+                  dessser_codegen native_codegen opt_level quarantine jobs
+                  compilation_cache () =
+  RamenCliCheck.execompserver conf max_simult_compilations quarantine jobs
+                              opt_level ;
   RamenCompiler.init external_compiler max_simult_compilations
-                     dessser_codegen opt_level ;
+                     dessser_codegen native_codegen opt_level ;
+  RamenCompilCache.shared_dir := compilation_cache ;
   start_daemon conf daemonize to_stdout to_syslog prefix_log_with_name
                ServiceNames.execompserver ;
   start_prometheus_thread ServiceNames.execompserver ;
-  RamenExecompserver.start conf ~quarantine ~while_
+  RamenExecompserver.start conf ~quarantine ~jobs ~while_
 
 let compile conf lib_path external_compiler max_simult_compils smt_solver
-            dessser_codegen opt_level source_files output_file_opt src_path_opt
-            replace () =
+            dessser_codegen native_codegen opt_level compilation_cache
+            source_files output_file_opt src_path_opt replace () =
   RamenCliCheck.compile source_files src_path_opt opt_level ;
   init_logger conf.C.log_level ;
   RamenSmt.solver := smt_solver ;
   RamenCompiler.init external_compiler max_simult_compils dessser_codegen
-                     opt_level ;
+                     native_codegen opt_level ;
+  RamenCompilCache.shared_dir := compilation_cache ;
   List.iter (fun source_file ->
     if conf.C.sync_url = "" then
       compile_local conf lib_path source_file output_file_opt src_path_opt
@@ -835,7 +839,7 @@ let ps_ profile conf pretty with_header sort_col top sites pattern all () =
        "#out" ; "#errs" ; "#groups" ; "max #groups" ; "last out" ;
        "min event time" ; "max event time" ; "CPU" ; "wait in" ; "wait out" ;
        "heap" ; "max heap" ; "volume in" ; "volume out" ; "avg out sz" ;
-       "startup time" ; "#parents" ; "#children" ; "archive size" ;
+       "slowest stage" ; "startup time" ; "#parents" ; "#children" ; "archive size" ;
        "oldest archived" ; "archive duration" ; "worker signature" ;
        "precomp signature" |] in
   let open TermTable in
@@ -948,6 +952,15 @@ let ps_ profile conf pretty with_header sort_col top sites pattern all () =
                                Uint64.to_float s.tot_full_bytes_samples))
                else
                  None) ;
+             (* The stage with the worst 99th percentile: *)
+             Option.bind s (fun s ->
+               Array.fold_left (fun slowest l ->
+                 match slowest with
+                 | Some l' when l'.p99 >= l.p99 -> slowest
+                 | _ -> Some l
+               ) None s.stage_latencies |>
+               Option.map (fun l ->
+                 ValStr (Printf.sprintf "%s (p99 %gs)" l.stage l.p99))) ;
              Option.map (fun s -> ValDate s.last_startup) s ;
              Some (ValInt (Array.length (worker.parents |? [||]))) ;
              Some (ValInt (Array.length worker.children)) ;
@@ -1445,7 +1458,7 @@ let archivist conf loop daemonize stats allocs reconf
 let start conf daemonize to_stdout to_syslog ports ports_sec
           smt_solver fail_for_good kill_at_exit
           test_notifs_every lmdb_max_readers external_compiler max_simult_compils
-          dessser_codegen opt_level
+          dessser_codegen native_codegen opt_level
           srv_pub_key_file srv_priv_key_file ignore_file_perms
           no_source_examples archive_total_size
           archive_recall_cost oldest_restored_site
@@ -1453,7 +1466,7 @@ let start conf daemonize to_stdout to_syslog ports ports_sec
           del_ratio compress_older
           max_fpr kafka_producers_timeout debounce_delay max_last_incidents_kept
           max_incident_age incidents_history_length purge_incidents_every
-          execomp_quarantine allow_upgrade () =
+          execomp_quarantine execomp_jobs compilation_cache allow_upgrade () =
   let ports =
     if ports <> [] then ports
     else [ Default.confserver_port_str ] in
@@ -1464,7 +1477,7 @@ let start conf daemonize to_stdout to_syslog ports ports_sec
                            incidents_history_length purge_incidents_every ;
   RamenCliCheck.choreographer conf ;
   RamenCliCheck.execompserver conf max_simult_compils execomp_quarantine
-                              opt_level ;
+                              execomp_jobs opt_level ;
   RamenCliCheck.precompserver conf ;
   RamenCliCheck.gc false gc_loop ;
   (* Unless told otherwise, do both allocs and reconf of workers: *)
@@ -1504,6 +1517,9 @@ let start conf daemonize to_stdout to_syslog ports ports_sec
   and confserver = conf.C.sync_url
   and max_simultaneous_compilations = string_of_int max_simult_compils
   and quarantine = string_of_float execomp_quarantine
+  and jobs = string_of_int execomp_jobs
+  and compilation_cache =
+    Option.map (fun (d : N.path) -> (d :> string)) compilation_cache
   and test_notifs = nice_string_of_float test_notifs_every
   and lmdb_max_readers = Option.map string_of_int lmdb_max_readers
   and del_ratio = nice_string_of_float del_ratio
@@ -1517,6 +1533,8 @@ let start conf daemonize to_stdout to_syslog ports ports_sec
   and max_incident_age = nice_string_of_float max_incident_age
   and dessser_code_generator =
     RamenCompiler.string_of_dessser_codegen dessser_codegen
+  and native_code_generator =
+    RamenCompiler.string_of_native_codegen native_codegen
   and optimization_level = string_of_int opt_level
   in
   RamenSubcommands.run_confserver
@@ -1535,8 +1553,9 @@ let start conf daemonize to_stdout to_syslog ports ports_sec
     add_pid ServiceNames.choreographer ;
   RamenSubcommands.run_execompserver
     ~daemonize ~to_stdout ~to_syslog ~prefix_log_with_name ~external_compiler
-    ~max_simultaneous_compilations ~dessser_code_generator ~optimization_level
-    ~quarantine ~debug ~quiet ~keep_temp_files ~reuse_prev_files ~variant
+    ~max_simultaneous_compilations ~dessser_code_generator
+    ~native_code_generator ~optimization_level ~quarantine ~jobs
+    ?compilation_cache ~debug ~quiet ~keep_temp_files ~reuse_prev_files ~variant
     ~initial_export_duration ~bundle_dir ~confserver ~colors () |>
     add_pid ServiceNames.execompserver ;
   RamenSubcommands.run_precompserver
@@ -1681,3 +1700,17 @@ let stats conf metric_name () =
       | n -> Printf.printf ", do you mean %S?\n" n
     with Exit ->
         ())
+
+(*
+ * Geolocation database
+ *)
+
+let update_country_db conf csv_v4 csv_v6 () =
+  init_logger conf.C.log_level ;
+  let index_file = RamenPaths.country_index conf.C.persist_dir in
+  Files.mkdir_all ~is_file:true index_file ;
+  CountryOfIp.build_index (csv_v4 : N.path :> string)
+                          (csv_v6 : N.path :> string)
+                          (index_file :> string) ;
+  (* Workers will notice the new file by themselves: *)
+  !logger.info "Country index saved in %a" N.path_print index_file
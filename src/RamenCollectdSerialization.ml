@@ -19,7 +19,8 @@ type collectd_metric =
 
 external decode : Bytes.t -> int -> int -> collectd_metric array * int = "wrap_collectd_decode"
 
-let collector ~inet_addr ~port ~ip_proto ?while_ k =
+let collector ~inet_addr ~port ~ip_proto ?while_ ?receivers ?recv_batch
+              ?on_drops ?(with_batch=fun f -> f ()) k =
   (* Listen to incoming UDP datagrams on given port: *)
   let serve ?sender buffer start stop =
     !logger.debug "Received %d bytes from collectd @ %s"
@@ -27,12 +28,13 @@ let collector ~inet_addr ~port ~ip_proto ?while_ k =
       (match sender with None -> "??" |
        Some ip -> Unix.string_of_inet_addr ip) ;
     let metrics, consumed = decode buffer start stop in
-    Array.iter k metrics ;
+    with_batch (fun () -> Array.iter k metrics) ;
     consumed
   in
   (* collectd current network.c buffer is 1452 bytes: *)
   ip_server ~ip_proto
-    ~what:"collectd sink" ~buffer_size:1500 ~inet_addr ~port ?while_ serve
+    ~what:"collectd sink" ~buffer_size:1500 ~inet_addr ~port ?while_
+    ?receivers ?recv_batch ?on_drops serve
 
 let test ?(port=25826) () =
   init_logger Normal ;
@@ -0,0 +1,138 @@
+(* Content-addressed cache of compiled objects.
+ *
+ * Compiling the code generated for a program takes a long time, and the very
+ * same code is compiled again on every site (or again on the same site
+ * whenever an executable is deleted). So the resulting object files are
+ * saved in a cache, under a key that is a hash of the source code, of the
+ * compiler flags and versions, and of anything else that may change the
+ * outcome of the compilation (such as the compiled interfaces of the local
+ * modules the source depends on, which the caller must pass along).
+ *
+ * The cache lives in the persist_dir and can also be shared with other sites
+ * via a common directory (typically some network filesystem).
+ * Entries are written atomically so that several compilers can use the same
+ * cache concurrently. *)
+open Batteries
+open RamenHelpers
+open RamenLog
+module Default = RamenConstsDefault
+module Files = RamenFiles
+module Metric = RamenConstsMetric
+module N = RamenName
+
+open Binocle
+
+let stats_lookups =
+  Files.ensure_inited (fun save_dir ->
+    IntCounter.make ~save_dir:(save_dir :> string)
+      Metric.Names.compiler_cache_lookups
+      "Number of objects that were found (or not) in the compilation cache.")
+
+let stats_build_time =
+  Files.ensure_inited (fun save_dir ->
+    Histogram.make ~save_dir:(save_dir :> string)
+      Metric.Names.compiler_build_time
+      "Time spent compiling objects that were not in the cache, per language."
+      Histogram.powers_of_two)
+
+(* Optional cache directory shared with other sites: *)
+let shared_dir : N.path option ref = ref None
+
+let local_dir persist_dir =
+  N.path_cat [ persist_dir ; N.path "compilation_cache" ;
+               N.path RamenVersions.codegen ]
+
+(* Compiled objects also depend on the bundled libraries, that come with this
+ * very executable: *)
+let self_digest =
+  lazy (
+    try Digest.file Sys.executable_name
+    with e ->
+      !logger.warning "Cannot digest %s: %s"
+        Sys.executable_name (Printexc.to_string e) ;
+      RamenVersions.release_tag)
+
+let key ~flags ?(deps=[]) (src_file : N.path) =
+  RamenVersions.codegen :: Sys.ocaml_version :: Lazy.force self_digest ::
+  flags :: Digest.file (src_file :> string) :: deps |>
+  String.join "\n" |>
+  Digest.string |>
+  Digest.to_hex
+
+let entry dir key ext =
+  N.path_cat [ dir ; N.path (String.sub key 0 2) ; N.path (key ^"."^ ext) ]
+
+(* Copy [src] into [dst] atomically: *)
+let copy ~src ~dst =
+  let tmp = N.cat dst (N.path (".tmp."^ string_of_int (Unix.getpid ()))) in
+  Files.write_whole_file tmp (Files.read_whole_file src) ;
+  Files.rename tmp dst
+
+let save dir key exts obj_file =
+  try
+    List.iter (fun ext ->
+      copy ~src:(Files.change_ext ext obj_file) ~dst:(entry dir key ext)
+    ) exts
+  with e ->
+    !logger.warning "Cannot save %a into compilation cache %a: %s"
+      N.path_print obj_file
+      N.path_print dir
+      (Printexc.to_string e)
+
+(* Delete the entries that have not been used for [max_age] seconds: *)
+let expire ?(max_age=Default.compilation_cache_max_age) persist_dir =
+  let root = Files.dirname (local_dir persist_dir) in
+  if Files.is_directory root then (
+    let oldest = Unix.time () -. max_age in
+    Files.dir_subtree_iter ~on_file:(fun fname _rel_fname ->
+      if Files.mtime_def 0. fname < oldest then (
+        !logger.debug "Expiring %a from the compilation cache"
+          N.path_print fname ;
+        Files.safe_unlink fname)
+    ) root)
+
+(* Produce [obj_file] and its siblings of extensions [exts] (which must
+ * include [obj_file]'s own) by either retrieving them from the cache under
+ * [key] or by calling [build]: *)
+let with_cache persist_dir ~lang ~exts key obj_file build =
+  let count status =
+    IntCounter.inc ~labels:[ "lang", lang ; "status", status ]
+      (stats_lookups persist_dir) in
+  let local = local_dir persist_dir in
+  let found_in dir =
+    List.for_all (fun ext -> Files.exists (entry dir key ext)) exts in
+  let retrieved =
+    match List.find found_in (local :: Option.to_list !shared_dir) with
+    | exception Not_found ->
+        false
+    | dir ->
+        (try
+          let now = Unix.time () in
+          List.iter (fun ext ->
+            let src = entry dir key ext in
+            copy ~src ~dst:(Files.change_ext ext obj_file) ;
+            (* For [expire]. Shared caches might be read-only: *)
+            log_and_ignore_exceptions ~what:"Touching cache entry"
+              (Files.touch src) now
+          ) exts ;
+          if dir = local then count "hit" else (
+            count "shared_hit" ;
+            save local key exts obj_file) ;
+          !logger.debug "Retrieved %a from compilation cache %a"
+            N.path_print obj_file
+            N.path_print dir ;
+          true
+        with e ->
+          !logger.warning "Cannot retrieve %a from compilation cache %a: %s"
+            N.path_print obj_file
+            N.path_print dir
+            (Printexc.to_string e) ;
+          false) in
+  if not retrieved then (
+    count "miss" ;
+    let t0 = Unix.gettimeofday () in
+    build () ;
+    Histogram.add (stats_build_time persist_dir) ~labels:[ "lang", lang ]
+      (Unix.gettimeofday () -. t0) ;
+    save local key exts obj_file ;
+    Option.may (fun dir -> save dir key exts obj_file) !shared_dir)
@@ -52,19 +52,53 @@ let string_of_dessser_codegen = function
   | TryDessser -> "try"
   | ForceDessser -> "force"
 
+(* Whether to compile the parts of the legacy workers that CodeGen_CPP can
+ * handle into native code: *)
+type native_codegen = NoNative | TryNative | ForceNative
+let native_codegen = ref NoNative
+let string_of_native_codegen = function
+  | NoNative -> "never"
+  | TryNative -> "try"
+  | ForceNative -> "force"
+
 let compiler_inited = ref false
 
-let init use_external_compiler max_simult_compils dessser_codegen_ opt_level =
+let init use_external_compiler max_simult_compils dessser_codegen_
+         native_codegen_ opt_level =
   assert (not !compiler_inited) ;
   compiler_inited := true ;
   RamenOCamlCompiler.use_external_compiler := use_external_compiler ;
   Atomic.Counter.set RamenOCamlCompiler.max_simult_compilations
                      max_simult_compils ;
   dessser_codegen := dessser_codegen_ ;
+  native_codegen := native_codegen_ ;
   DessserEval.inline_level := opt_level
 
 (* Helper for C++ compilation, takes a code generator and returns the object
  * file: *)
+(* The digest of the headers bundled in [bundle_dir]/include, which C++
+ * objects also depend on, memoized per bundle_dir: *)
+let bundled_headers_digest =
+  let cache = Hashtbl.create 3 in
+  fun (bundle_dir : N.path) ->
+    try Hashtbl.find cache bundle_dir
+    with Not_found ->
+      let dir = N.path_cat [ bundle_dir ; N.path "include" ] in
+      let digests = ref [] in
+      if Files.is_directory dir then
+        Files.dir_subtree_iter ~on_file:(fun fname (rel_fname : N.path) ->
+          digests :=
+            ((rel_fname :> string) ^":"^
+             Digest.to_hex (Digest.file (fname :> string))) :: !digests
+        ) dir ;
+      let d =
+        List.fast_sort String.compare !digests |>
+        String.join "\n" |>
+        Digest.string |>
+        Digest.to_hex in
+      Hashtbl.add cache bundle_dir d ;
+      d
+
 let cpp_compile print_code conf prefix_name suffix_name =
   let debug = !logger.log_level = Debug in
   let src_file =
@@ -104,8 +138,13 @@ let cpp_compile print_code conf prefix_name suffix_name =
       (shell_quote (dst :> string))
       (shell_quote (src :> string)) in
   let obj_file = Files.change_ext "o" src_file in
-  let cmd = cpp_command src_file obj_file in
-  run_cmd cmd ;
+  let build () = run_cmd (cpp_command src_file obj_file) in
+  let flags =
+    Printf.sprintf "c++ %s debug:%b" RamenCompilConfig.cpp_compiler debug in
+  let deps = [ bundled_headers_digest conf.C.bundle_dir ] in
+  let key = RamenCompilCache.key ~flags ~deps src_file in
+  RamenCompilCache.with_cache conf.C.persist_dir ~lang:"c++" ~exts:[ "o" ]
+                              key obj_file build ;
   obj_file
 
 let ocaml_compile print_code conf prefix_name suffix_name =
@@ -135,10 +174,32 @@ let orc_codec conf orc_write_func orc_read_func prefix_name rtyp =
     Orc.emit_intro oc ;
     Orc.emit_write_value orc_write_func rtyp oc ;
     Orc.emit_read_values orc_read_func rtyp oc ;
+    Orc.emit_read_values_batch (orc_read_func ^"_batch") rtyp oc ;
     Orc.emit_outro oc in
   cpp_compile print_code conf prefix_name ObjectSuffixes.orc_codec,
   schema
 
+(* Natively compiled prefilter, if the function has one and CodeGen_CPP can
+ * compile it. Returns the object file and the name of the C function: *)
+let native_prefilter conf func op in_type func_src_name =
+  let expr = CodeGen_OCaml.prefilter_expr op in_type in
+  if !native_codegen = NoNative || E.is_true expr then None else
+    try
+      let sym = "prefilter_"^ func.VSI.signature in
+      (* Generate the code first so that unsupported expressions fail before
+       * anything is written: *)
+      let code = IO.to_string (CodeGen_CPP.emit_prefilter sym in_type) expr in
+      let obj_file =
+        cpp_compile (fun oc -> String.print oc code) conf func_src_name
+                    ObjectSuffixes.native_helper in
+      Some (obj_file, sym)
+    with (Failure _ | Not_implemented _) as e ->
+      if !native_codegen = ForceNative then raise e ;
+      !logger.debug "Cannot compile prefilter natively: %s, \
+                     keeping the OCaml version"
+        (Printexc.to_string e) ;
+      None
+
 (* Build the helper for deserialization, returns the obj name: *)
 let reader_deserializer conf func func_src_name =
   match func.VSI.operation with
@@ -881,11 +942,19 @@ let compile conf info ~exec_file base_file src_path =
               let dessser_mod_name =
                 Option.map RamenOCamlCompiler.module_name_of_file_name
                            dessser_obj_file in
+              (* Then possibly a native prefilter: *)
+              let obj_files, native_prefilter =
+                match native_prefilter conf func op in_type func_src_name with
+                | Some (obj_file, sym) ->
+                    add_temp_file obj_file ; (* Will also get rid of the "cc" file *)
+                    obj_files @ [ obj_file ], Some sym
+                | None ->
+                    obj_files, None in
               CodeGen_OCaml.generate_code
                 conf func.VSI.name op in_type
                 env_env param_env globals_env
                 global_state_env group_state_env
-                obj_name params_mod_name dessser_mod_name
+                obj_name params_mod_name dessser_mod_name native_prefilter
                 orc_write_func orc_read_func info.default_params
                 globals_mod_name ;
               obj_files
@@ -38,6 +38,7 @@ let commands =
     variants ;
     gc ;
     stats ;
+    update_country_db ;
     archivist ;
     summary ;
     dequeue ;
@@ -72,6 +72,10 @@ let max_external_msg_size = 200_000
 (* Size of the allocated circular buffer to read external data sources: *)
 let read_buffer_size = 500_000
 
+(* Regular files are read with a buffer as large as the file, up to that
+ * size: *)
+let max_read_file_buffer_size = 16_000_000
+
 (* Timeout used when calling rd_kafka_consume_queue.
  * Must not be too high or those workers will take a long time to kill: *)
 let kafka_consume_timeout = 0.3
@@ -91,6 +95,9 @@ let worker_quarantine_delay = 30.
 (* Maximum duration to skip output to some ringbuf *)
 let max_ringbuf_quarantine = 30.
 
+(* Workers dequeue their input by batches of at most that many records: *)
+let max_records_per_read_batch = 64
+
 (* Timeout any http command after that number of seconds: *)
 let httpd_cmd_timeout = 300.
 
@@ -115,6 +122,10 @@ let default_team_name = N.team "default"
  * present on disc (secs): *)
 let check_binaries_on_disk_every = 10.
 
+(* How often execompserver should delete compiled objects that have not been
+ * used for a long time from its compilation cache (secs): *)
+let expire_compilation_cache_every = 3600.
+
 (* Username used in the confserver by the confserver. Must start with a "_"
  * like other daemons: *)
 let confserver_uid = "_confserver"
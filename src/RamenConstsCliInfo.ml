@@ -225,6 +225,15 @@ let dessser_codegen =
     docv = "never|try|force" ;
     typ = Scalar}
 
+let native_codegen =
+  { names = [ "native-code-generator" ] ;
+    env = "RAMEN_NATIVE_CODE_GENERATOR" ;
+    doc = "Controls whether the parts of the workers that are simple enough \
+           (such as the input filter of aggregations) are compiled into \
+           native code via C++." ;
+    docv = "never|try|force" ;
+    typ = Scalar }
+
 let optimization_level =
   { names = [ "optimization-level" ; "O" ] ;
     env = "RAMEN_OPTIMIZATION_LEVEL" ;
@@ -241,6 +250,21 @@ let execomp_quarantine =
     docv = "DURATION" ;
     typ = Scalar }
 
+let execomp_jobs =
+  { names = [ "jobs" ; "j" ] ;
+    env = "RAMEN_COMPILATION_JOBS" ;
+    doc = "How many programs execompserver can build simultaneously." ;
+    docv = "" ;
+    typ = Scalar }
+
+let compilation_cache =
+  { names = [ "compilation-cache" ] ;
+    env = "RAMEN_COMPILATION_CACHE" ;
+    doc = "Directory where compiled objects are cached in addition to the \
+           local cache, typically to share them between sites." ;
+    docv = "DIR" ;
+    typ = Scalar }
+
 let smt_solver =
   { names = [ "smt-solver" ; "solver" ] ;
     env = "RAMEN_SMT_SOLVER" ;
@@ -302,7 +326,8 @@ let del_ratio =
 let compress_older =
   { names = [ "compress-older" ] ;
     env = "" ;
-    doc = "Convert to ORC archive files older than this." ;
+    doc = "Compress archive files older than this (into ORC files if \
+           the archive_in_orc experiment is on, with zstd otherwise)." ;
     docv = "" ;
     typ = Scalar }
 
@@ -1015,6 +1040,20 @@ let metric_name =
     docv = "STRING" ;
     typ = Scalar }
 
+let country_csv_v4 =
+  { names = [] ;
+    env = "" ;
+    doc = "IpToCountry CSV file for IPv4, possibly gzipped." ;
+    docv = "FILE" ;
+    typ = Scalar }
+
+let country_csv_v6 =
+  { names = [] ;
+    env = "" ;
+    doc = "IpToCountry CSV file for IPv6, possibly gzipped." ;
+    docv = "FILE" ;
+    typ = Scalar }
+
 (* Commands *)
 
 type command =
@@ -1045,7 +1084,7 @@ let test =
     doc = "Test a configuration against one or several tests." ;
     opts = [ server_url ; api ; graphite ; external_compiler ;
              max_simult_compilations ; smt_solver ; dessser_codegen ;
-             optimization_level ; test_file ] @ copts }
+             native_codegen ; optimization_level ; test_file ] @ copts }
 
 let archivist =
   { name = "archivist" ;
@@ -1060,7 +1099,8 @@ let start =
     opts = [ daemonize ; to_stdout ; to_syslog ; confserver_port ;
              confserver_port_sec ; smt_solver ; fail_for_good ; kill_at_exit ;
              test_notifs_every ; lmdb_max_readers ; external_compiler ;
-             max_simult_compilations ; dessser_codegen ; optimization_level ;
+             max_simult_compilations ; dessser_codegen ; native_codegen ;
+             optimization_level ; execomp_jobs ; compilation_cache ;
              server_pub_key ; server_priv_key ; ignore_file_perms ;
              no_source_examples ; default_archive_total_size ;
              default_archive_recall_cost ; oldest_restored_site ;
@@ -1081,6 +1121,11 @@ let stats =
     doc = "Display internal statistics." ;
     opts = metric_name :: copts }
 
+let update_country_db =
+  { name = "update-country-db" ;
+    doc = "Replace the IP-to-country database used by running workers." ;
+    opts = country_csv_v4 :: country_csv_v6 :: copts }
+
 let autocomplete =
   { name = "_completion" ;
     doc = "Autocomplete the given command." ;
@@ -1185,7 +1230,8 @@ let compile =
   { name = "compile" ;
     doc = "Compile each given source file into an executable." ;
     opts = [ lib_path ; external_compiler ; max_simult_compilations ;
-             smt_solver ; dessser_codegen ; optimization_level ; src_files ;
+             smt_solver ; dessser_codegen ; native_codegen ;
+             optimization_level ; compilation_cache ; src_files ;
              output_file ; as_ ; replace ] @ copts }
 
 let precompserver =
@@ -1200,7 +1246,8 @@ let execompserver =
            files." ;
     opts = [ daemonize ; to_stdout ; to_syslog ; prefix_log_with_name ;
              external_compiler ; max_simult_compilations ;
-             dessser_codegen ; optimization_level ; execomp_quarantine ] @
+             dessser_codegen ; native_codegen ; optimization_level ;
+             execomp_quarantine ; execomp_jobs ; compilation_cache ] @
            copts }
 
 let run =
@@ -30,7 +30,8 @@ let gc_loop = 180.
 (* Do not delete all excess files at once but only that ratio: *)
 let del_ratio = 0.3
 
-(* Archive in ringbuf format older than that will be converted into ORC *)
+(* Archive in ringbuf format older than that will be compressed (or converted
+ * into ORC) *)
 let compress_older = 6. *. 3600.
 
 (* How frequently should the archivist reallocate disk space and
@@ -59,17 +60,44 @@ let ringbuffer_word_length = 1_000_000
  * ramen test uses longer timeout. *)
 let ringbuffer_timeout = 5.
 
+(* How many children can share a broadcast input ringbuffer: *)
+let ringbuffer_max_consumers = 16
+
 (* When writing an ORC file, how many lines are buffered before we flush
  * to the file: *)
 let orc_rows_per_batch = 1000
 let orc_batches_per_file = 1000
 
+(* Whether full ORC batches are compressed and written by a dedicated thread
+ * while the worker keeps filling the next one: *)
+let orc_async_writes = true
+
+(* How ORC files are compressed. Those are liborc's own defaults (zero would
+ * also select them): *)
+let orc_compression_block_size = 65536
+let orc_stripe_size = 67108864
+(* Dictionary encoding is used for a string column as long as the ratio of
+ * distinct values stays below that threshold. liborc defaults to 0, that
+ * disable dictionaries altogether: *)
+let orc_dictionary_threshold = 0.
+
+(* How frequently workers check whether the country index has been updated: *)
+let country_index_check_period = 10.
+
 (* Alerter: delay between first scheduling of a new alert: *)
 let init_schedule_delay = 30.
 
 (* Default port for the tuple forward service: *)
 let tunneld_port = 29329
 
+(* Tuples forwarded to tunneld are sent in frames of at most that many bytes
+ * (before compression), or as soon as the input ringbuf has been drained: *)
+let tunneld_max_frame_size = 65536
+
+(* How many bytes a tunneld client can send before it has to wait for the
+ * server to acknowledge them: *)
+let tunneld_window = 1_048_576
+
 (* Default binding option for the secure config sync service: *)
 let confserver_port_sec = 29341
 let confserver_port_sec_str = string_of_int confserver_port_sec
@@ -88,6 +116,30 @@ let sync_long_sessions_timeout = 1200.
  * tuples: *)
 let replay_timeout = 300.
 
+(* Parallel replays (see the ParallelReplay experiment) decode up to that
+ * many archive files at once, in as many processes: *)
+let replay_decoders = 4
+
+(* ...and keep that many tuples of each decoder aside to output them in
+ * event time order: *)
+let replay_merge_window = 10_000
+
+(* With the ParallelCsvParsing experiment, plain CSV files are split into
+ * chunks of whole records of about that many bytes, that are parsed by that
+ * many processes: *)
+let csv_chunk_size = 1_000_000
+let csv_parsers = 4
+
+(* With the MultiUdpReceivers experiment, listeners receive datagrams on that
+ * many sockets bound to the same port, each in its own thread: *)
+let udp_receivers = 4
+
+(* ...receiving up to that many datagrams per system call: *)
+let udp_recv_batch = 32
+
+(* Workers time the processing stages of one tuple every so many: *)
+let stage_timing_sample = 64
+
 (* When some worker lacks stats it still needs to be allocated storage: *)
 let compute_cost = 0.5 (* 0.5s of CPU for 1s of data *)
 let recall_size = 100. (* 100 bytes of data every second *)
@@ -155,5 +207,21 @@ let purge_incidents_every = 10
  * a compilation error: *)
 let execomp_quarantine = 300.
 
+(* How many programs can execompserver build simultaneously: *)
+let execomp_jobs = 4
+
+(* How long are unused compiled objects kept in the compilation cache: *)
+let compilation_cache_max_age = 7. *. 86400.
+
+(* Resolutions of the pre-aggregated time series (seconds): *)
+let timeseries_rollups = [ 60. ; 600. ; 3600. ]
+
+(* How long must a time range be over before its rollup is saved, to give the
+ * archivist some time to archive that data: *)
+let timeseries_rollups_delay = 3600.
+
+(* How long are unused rollups kept: *)
+let timeseries_rollups_max_age = 30. *. 86400.
+
 (* How many seconds of extra history should be replayed if unspecified: *)
 let best_after = 0.
@@ -21,6 +21,17 @@ struct
   let group_sizes = "group_sizes"
   let avg_full_out_bytes = "avg_full_out_bytes"
   let relocated_groups = "relocated_groups"
+  let orc_write_queue = "orc_write_queue"
+  let orc_flushes = "orc_flushes"
+  let orc_flush_time = "orc_flush_time"
+  let orc_max_flush_time = "orc_max_flush_time"
+  let gc_minor_collections = "gc_minor_collections"
+  let gc_major_collections = "gc_major_collections"
+  let gc_compactions = "gc_compactions"
+  let gc_top_heap = "gc_top_heap"
+  let bloom_false_positives = "bloom_false_positives"
+  let udp_rx_drops = "udp_rx_drops"
+  let stage_latency = "stage_latency"
   let num_subscribers = "subscribers"
   let num_sync_msgs_in = "sync_msgs_in"
   let num_sync_msgs_out = "sync_msgs_out"
@@ -29,6 +40,7 @@ struct
   let num_rate_limited_unpublished = "rate_limited_unpublished"
   let perf_per_tuple = "perf_per_tuple"
   let perf_where_fast = "perf_where_fast"
+  let perf_key_of_input = "perf_key_of_input"
   let perf_find_group = "perf_find_group"
   let perf_where_slow = "perf_where_slow"
   let perf_update_group = "perf_update_group"
@@ -38,6 +50,7 @@ struct
   let perf_commit_others = "perf_commit_others"
   let perf_flush_others = "perf_flush_others"
   let compilations_count = "compilations_count"
+  let compilation_time = "compilation_time"
   let precompilations_count = "precompilations_count"
 
   (* Metrics reported by the supervisor: *)
@@ -66,6 +79,8 @@ struct
   (* Metrics reported by the compiler: *)
   let compiler_typing_time = "compiler_typing_time"
   let compiler_typing_count = "compiler_typing_count"
+  let compiler_cache_lookups = "compiler_cache_lookups"
+  let compiler_build_time = "compiler_build_time"
 
   (* Metrics reported by the copy service: *)
   let copy_server_accepts = "copy_server_accepts"
@@ -80,6 +95,7 @@ struct
   let sync_subscription_count = "sync_subscriptions_count"
   let sync_sent_msgs = "sync_sent_msgs"
   let sync_sent_bytes = "sync_sent_bytes"
+  let sync_skipped_msgs = "sync_skipped_msgs"
   let sync_recvd_msgs = "sync_recvd_msgs"
   let sync_recvd_bytes = "sync_recvd_bytes"
   let sync_bad_recvd_msgs = "sync_bad_recvd_msgs"
@@ -144,6 +160,29 @@ struct
   let avg_full_out_bytes = "Average size of a fully-fledged out tuple."
   let relocated_groups =
     "How many times a group was moved in the commit precondition heap."
+  let orc_write_queue =
+    "Number of ORC batches queued or being written by the writer thread."
+  let orc_flushes = "Number of ORC batches written by the writer thread."
+  let orc_flush_time =
+    "Total time spent compressing and writing ORC batches."
+  let orc_max_flush_time =
+    "Longest time spent compressing and writing a single ORC batch."
+  let gc_minor_collections =
+    "Number of minor collections since that worker has started."
+  let gc_major_collections =
+    "Number of major collections completed since that worker has started."
+  let gc_compactions =
+    "Number of heap compactions since that worker has started."
+  let gc_top_heap =
+    "Maximum number of bytes ever allocated in the heap for that worker."
+  let bloom_false_positives =
+    "Estimated false positive ratio of the bloom filters of the NOVELTY \
+     operator, when last rotated."
+  let udp_rx_drops =
+    "Number of datagrams dropped by the kernel before they could be \
+     received, summed over all receiving sockets."
+  let stage_latency =
+    "Time spent in each processing stage, for a sample of the input tuples."
   let num_subscribers = "Number of tail-subscribers"
   let num_sync_msgs_in = "Number of received synchronisation messages"
   let num_sync_msgs_out = "Number of emitted synchronisation messages"
@@ -154,6 +193,8 @@ struct
   let perf_where_fast =
     "Average time spent executing the (fast) WHERE clause for each \
      incoming tuple."
+  let perf_key_of_input =
+    "Average time spent computing the group key of each incoming tuple."
   let perf_find_group =
     "Average time spent looking for the group for each incoming tuple."
   let perf_where_slow =
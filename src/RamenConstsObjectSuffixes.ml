@@ -3,3 +3,4 @@ module N = RamenName
 (* Suffixes used to form the worker helper object file: *)
 let orc_codec = N.path "orc_codec"
 let dessser_helper = N.path "dessser_helper"
+let native_helper = N.path "native_helper"
@@ -15,3 +15,77 @@ type set_target_msg =
  * (once target has been set): *)
  (* TODO: versioned variant type *)
 type append_msg = Bytes.t
+
+(*
+ * Framed protocol.
+ *
+ * Rather than one marshaled message per tuple, clients start by sending
+ * [magic] followed by the set_target_msg (marshaled, prefixed with its
+ * length). Then they send frames of records, each record being the raw
+ * ringbuf message prefixed with its size.
+ * A frame starts with a header made of the length of the payload on the
+ * wire, its length once decompressed and the codec used for that frame.
+ * All integers are 32 bits little endian.
+ *
+ * For flow control, the server first sends the number of bytes the client
+ * can send (its window), and then gives back the size of each frame once
+ * its records have been enqueued.
+ *)
+
+(* Does not look like the beginning of a marshaled value, so that the
+ * server can tell older clients apart: *)
+let magic = "RC"^ RamenVersions.copy_protocol
+
+let frame_header_size = 12
+
+type codec = NoCompression | LZ4 | ZSTD
+
+(* Must match compress.c: *)
+let int_of_codec = function
+  | NoCompression -> 0
+  | LZ4 -> 1
+  | ZSTD -> 2
+
+let codec_of_int = function
+  | 0 -> NoCompression
+  | 1 -> LZ4
+  | 2 -> ZSTD
+  | c -> Printf.sprintf "Unknown frame codec %d" c |> failwith
+
+(* From the variant name of the TunnelCompression experiment: *)
+let codec_of_string = function
+  | "lz4" -> LZ4
+  | "zstd" -> ZSTD
+  | _ -> NoCompression
+
+external compress_bound_ : int -> int -> int = "wrap_copy_compress_bound"
+external compress_ :
+  int -> Bytes.t -> int -> int -> Bytes.t -> int -> int =
+  "wrap_copy_compress_bytecode" "wrap_copy_compress"
+external decompress_ :
+  int -> Bytes.t -> int -> int -> Bytes.t -> int -> unit =
+  "wrap_copy_decompress_bytecode" "wrap_copy_decompress"
+
+let compress_bound codec len =
+  compress_bound_ (int_of_codec codec) len
+
+(* [compress codec src offs len dst dst_offs] returns the compressed
+ * length: *)
+let compress codec =
+  compress_ (int_of_codec codec)
+
+(* [decompress codec src offs len dst dst_len] fails unless exactly
+ * [dst_len] bytes are decompressed: *)
+let decompress codec =
+  decompress_ (int_of_codec codec)
+
+let get_u32 b offs =
+  let c i = Char.code (Bytes.get b (offs + i)) in
+  c 0 lor (c 1 lsl 8) lor (c 2 lsl 16) lor (c 3 lsl 24)
+
+let set_u32 b offs v =
+  let c i = Char.unsafe_chr ((v lsr (8 * i)) land 0xff) in
+  Bytes.set b offs (c 0) ;
+  Bytes.set b (offs + 1) (c 1) ;
+  Bytes.set b (offs + 2) (c 2) ;
+  Bytes.set b (offs + 3) (c 3)
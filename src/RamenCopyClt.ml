@@ -2,6 +2,7 @@
 open Batteries
 open RamenLog
 open RamenHelpersNoLog
+module Default = RamenConstsDefault
 module Metric = RamenConstsMetric
 module N = RamenName
 module Files = RamenFiles
@@ -20,7 +21,26 @@ let stats_tuples =
 
 (* Client: *)
 
-let copy_client clt_site srv_host port child parent_num =
+type t =
+  { fd : Unix.file_descr ;
+    codec : RamenCopy.codec ;
+    (* Records not sent yet, after some room for the frame header: *)
+    mutable frame : Bytes.t ;
+    mutable frame_len : int ;
+    (* Where to compress the frame into: *)
+    mutable zframe : Bytes.t ;
+    max_frame_size : int ;
+    (* How many more bytes can be sent before the server acknowledges some: *)
+    mutable credit : int ;
+    window : int ;
+    credit_buf : Bytes.t }
+
+let read_credit t =
+  Files.really_read_fd_into t.credit_buf 0 t.fd 4 ;
+  t.credit <- t.credit + RamenCopy.get_u32 t.credit_buf 0
+
+let copy_client ?(codec=RamenCopy.NoCompression)
+                clt_site srv_host port child parent_num =
   if port < 0 || port > 65535 then
     Printf.sprintf "tunneld port number (%d) not within valid range" port |>
     failwith ;
@@ -46,14 +66,78 @@ let copy_client clt_site srv_host port child parent_num =
   let target =
     RamenCopy.{ client_site = clt_site ;
                 child ; parent_num } in
-  Files.marshal_into_fd ~at_start:false fd target ;
+  let target = Marshal.to_bytes target [] in
+  let hello = Bytes.create (String.length RamenCopy.magic + 4) in
+  Bytes.blit_string RamenCopy.magic 0 hello 0 (String.length RamenCopy.magic) ;
+  RamenCopy.set_u32 hello (String.length RamenCopy.magic) (Bytes.length target) ;
+  let hello = Bytes.cat hello target in
+  restart_on_EINTR (write fd hello 0) (Bytes.length hello) |> ignore ;
   !logger.info "Send target identification" ;
-  fun bytes ->
-    IntCounter.inc stats_tuples ;
-    let msg : RamenCopy.append_msg = bytes in
+  let credit_buf = Bytes.create 4 in
+  Files.really_read_fd_into credit_buf 0 fd 4 ;
+  let window = RamenCopy.get_u32 credit_buf 0 in
+  !logger.info "Server granted a window of %d bytes" window ;
+  (* Keep frames small enough for the window to never be exhausted by a
+   * single one: *)
+  let max_frame_size = min Default.tunneld_max_frame_size (window / 4) in
+  { fd ; codec ;
+    frame = Bytes.create (RamenCopy.frame_header_size + max_frame_size) ;
+    frame_len = RamenCopy.frame_header_size ;
+    zframe = Bytes.empty ;
+    max_frame_size ; credit = window ; window ; credit_buf }
+
+(* Send whatever records are pending as a single frame: *)
+let flush t =
+  let open RamenCopy in
+  let payload_len = t.frame_len - frame_header_size in
+  if payload_len > 0 then (
+    let codec, buf, wire_len =
+      match t.codec with
+      | NoCompression ->
+          NoCompression, t.frame, payload_len
+      | codec ->
+          let bound = frame_header_size + compress_bound codec payload_len in
+          if Bytes.length t.zframe < bound then t.zframe <- Bytes.create bound ;
+          let zlen =
+            compress codec t.frame frame_header_size payload_len
+                     t.zframe frame_header_size in
+          (* Send uncompressible frames as is: *)
+          if zlen < payload_len then codec, t.zframe, zlen
+          else NoCompression, t.frame, payload_len in
+    set_u32 buf 0 wire_len ;
+    set_u32 buf 4 payload_len ;
+    set_u32 buf 8 (int_of_codec codec) ;
+    let frame_size = frame_header_size + wire_len in
+    (* Wait for the server to make room for this frame, unless the whole
+     * window is available already: *)
+    while t.credit < frame_size && t.credit < t.window do
+      read_credit t
+    done ;
     (* If the connection became unusable for any reason, this will raise,
      * and kill the worker. Supersivor will then have another look at it, esp.
      * will resolve tunneld service again, and restart the worker.
      * We do not want a worker to stubbornly retry to connect to some place
      * when the service IP have changed. *)
-    Files.marshal_into_fd ~at_start:false fd msg
+    Unix.(restart_on_EINTR (write t.fd buf 0) frame_size) |> ignore ;
+    t.credit <- t.credit - frame_size ;
+    t.frame_len <- frame_header_size)
+
+(* Add a message to the current frame, that is sent once large enough or
+ * when [flush] is called: *)
+let append t (bytes : RamenCopy.append_msg) =
+  IntCounter.inc stats_tuples ;
+  let len = Bytes.length bytes in
+  if t.frame_len > RamenCopy.frame_header_size &&
+     t.frame_len + 4 + len > RamenCopy.frame_header_size + t.max_frame_size
+  then
+    flush t ;
+  let min_size = t.frame_len + 4 + len in
+  if Bytes.length t.frame < min_size then (
+    let frame = Bytes.create min_size in
+    Bytes.blit t.frame 0 frame 0 t.frame_len ;
+    t.frame <- frame) ;
+  RamenCopy.set_u32 t.frame t.frame_len len ;
+  Bytes.blit bytes 0 t.frame (t.frame_len + 4) len ;
+  t.frame_len <- t.frame_len + 4 + len ;
+  if t.frame_len >= RamenCopy.frame_header_size + t.max_frame_size then
+    flush t
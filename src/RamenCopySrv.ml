@@ -38,6 +38,8 @@ let stats_tuples =
 
 (* Server: *)
 
+(* Clients from before the framed protocol send one marshaled message per
+ * tuple: *)
 let copy_all ~while_ _conf (client_site : N.site) (bname : N.path) fd rb =
   !logger.debug "Copying all from %a into %a"
     N.site_print client_site
@@ -62,6 +64,109 @@ let copy_all ~while_ _conf (client_site : N.site) (bname : N.path) fd rb =
       (RingBuf.enqueue rb bytes (Bytes.length bytes) 0.) 0.
   done
 
+let send_credit fd credit =
+  let buf = Bytes.create 4 in
+  RamenCopy.set_u32 buf 0 credit ;
+  Unix.(restart_on_EINTR (write fd buf 0) 4) |> ignore
+
+(* Enqueue the records of each frame straight from the receive buffer,
+ * blocking on the ringbuf when it's full, and give the frame size back to
+ * the client once done: *)
+let copy_frames ~while_ _conf (client_site : N.site) (bname : N.path) fd rb =
+  !logger.debug "Copying frames from %a into %a"
+    N.site_print client_site
+    N.path_print bname ;
+  let labels = [ "client", (client_site :> string) ] in
+  let window = Default.tunneld_window in
+  send_credit fd window ;
+  let header = Bytes.create RamenCopy.frame_header_size
+  and wire_buf = ref (Bytes.create Default.tunneld_max_frame_size)
+  and raw_buf = ref (Bytes.create Default.tunneld_max_frame_size) in
+  let ensure_size buf sz =
+    if Bytes.length !buf < sz then buf := Bytes.create sz in
+  (* Frames are larger than tunneld_max_frame_size only when they have a
+   * single record, that must then fit in the ringbuf: *)
+  let max_frame_size =
+    let rb_bytes =
+      (RingBuf.stats rb).RingBuf.capacity * DessserRamenRingBuffer.word_size in
+    max Default.tunneld_max_frame_size (4 + rb_bytes) in
+  let input_pending () =
+    let readables, _, _ = Unix.select [ fd ] [] [] 0. in
+    readables <> [] in
+  (* Credit to be given back to the client: *)
+  let to_ack = ref 0 in
+  let rec enqueue buf offs len =
+    if len > 0 then (
+      (* Room for the first record and its length: *)
+      let first_size = RamenCopy.get_u32 buf offs + 4 in
+      let consumed =
+        RingBufLib.retry_for_ringbuf
+          ~while_ ~sleep:(RingBuf.wait_for_room rb first_size)
+          (RingBuf.enqueue_records rb buf offs) len in
+      enqueue buf (offs + consumed) (len - consumed)) in
+  let rec count_records buf offs stop n =
+    if offs >= stop then n else
+    count_records buf (offs + 4 + RamenCopy.get_u32 buf offs) stop (n + 1) in
+  try
+    while while_ () do
+      Files.really_read_fd_into header 0 fd RamenCopy.frame_header_size ;
+      let wire_len = RamenCopy.get_u32 header 0
+      and raw_len = RamenCopy.get_u32 header 4
+      and codec = RamenCopy.(codec_of_int (get_u32 header 8)) in
+      (* Check the sizes before allocating anything for them: *)
+      if raw_len > max_frame_size || wire_len > raw_len then
+        Printf.sprintf "Invalid frame from %s: %d bytes (%d on the wire) \
+                        while frames are at most %d bytes"
+          (client_site :> string) raw_len wire_len max_frame_size |>
+        failwith ;
+      ensure_size wire_buf wire_len ;
+      Files.really_read_fd_into !wire_buf 0 fd wire_len ;
+      let buf =
+        match codec with
+        | RamenCopy.NoCompression ->
+            !wire_buf
+        | codec ->
+            ensure_size raw_buf raw_len ;
+            RamenCopy.decompress codec !wire_buf 0 wire_len !raw_buf raw_len ;
+            !raw_buf in
+      IntCounter.add ~labels stats_tuples (count_records buf 0 raw_len 0) ;
+      enqueue buf 0 raw_len ;
+      (* Coalesce acknowledgments, but never let the client wait for
+       * them: *)
+      to_ack := !to_ack + RamenCopy.frame_header_size + wire_len ;
+      if !to_ack >= window / 4 || not (input_pending ()) then (
+        send_credit fd !to_ack ;
+        to_ack := 0)
+    done
+  with End_of_file ->
+    !logger.info "Client %a disconnected"
+      N.site_print client_site
+
+(* Read the target identification, and tell which protocol the client
+ * speaks: *)
+let read_target fd =
+  let magic_len = String.length RamenCopy.magic in
+  let prefix = Bytes.create magic_len in
+  Files.really_read_fd_into prefix 0 fd magic_len ;
+  if Bytes.to_string prefix = RamenCopy.magic then (
+    let len_buf = Bytes.create 4 in
+    Files.really_read_fd_into len_buf 0 fd 4 ;
+    let len = RamenCopy.get_u32 len_buf 0 in
+    let buf = Bytes.create len in
+    Files.really_read_fd_into buf 0 fd len ;
+    (Marshal.from_bytes buf 0 : RamenCopy.set_target_msg), true
+  ) else (
+    (* Then that was the beginning of the marshaled target: *)
+    let header_size = Marshal.header_size in
+    let buf = Bytes.create header_size in
+    Bytes.blit prefix 0 buf 0 magic_len ;
+    Files.really_read_fd_into buf magic_len fd (header_size - magic_len) ;
+    let data_size = Marshal.data_size buf 0 in
+    let buf = Bytes.extend buf 0 data_size in
+    Files.really_read_fd_into buf header_size fd data_size ;
+    (Marshal.from_bytes buf 0 : RamenCopy.set_target_msg), false
+  )
+
 let serve conf ~while_ fd =
   !logger.debug "New connection to copy service on fd %d!"
     (Files.int_of_fd fd) ;
@@ -69,12 +174,12 @@ let serve conf ~while_ fd =
   IntCounter.inc (stats_accepts conf.C.persist_dir) ;
   (* First message is supposed to identify the client and what the
    * target is: *)
-  let id : RamenCopy.set_target_msg =
-    Files.(marshal_from_fd socket_path) fd in
-  !logger.info "Received target identification: %a, %a, #%d"
+  let id, framed = read_target fd in
+  !logger.info "Received target identification: %a, %a, #%d%s"
     N.site_print id.client_site
     N.fq_print id.child
-    id.parent_num ;
+    id.parent_num
+    (if framed then "" else " (unframed)") ;
   let topics =
     let pref =
       N.path_cat [
@@ -103,7 +208,8 @@ let serve conf ~while_ fd =
                   (* If supervisor, for any reason, haven't created this
                    * ringbuf yet, then [load] is going to fail. Just wait. *)
                   retry ~on:always ~while_ RingBuf.load bname in
-                copy_all ~while_ conf id.client_site bname fd rb
+                (if framed then copy_frames else copy_all)
+                  ~while_ conf id.client_site bname fd rb
             | None ->
                 Printf.sprintf2 "Cannot find input ringbufs at %a"
                   Key.print ringbuf_key |>
@@ -27,8 +27,22 @@ let stats_compilations_count =
       Metric.Names.compilations_count
         "Number of compilations that have been attempted.")
 
+let stats_compilation_time =
+  Files.ensure_inited (fun save_dir ->
+    Histogram.make ~save_dir:(save_dir :> string)
+      Metric.Names.compilation_time
+      "Time spent building programs executables." Histogram.powers_of_two)
+
 let execomp_quarantine = ref Default.execomp_quarantine
 
+(* Max number of programs that can be built simultaneously. When greater than
+ * one, each program is built in a child process: *)
+let execomp_jobs = ref Default.execomp_jobs
+
+(* How many external compilers each of those child processes may run at once,
+ * so that --max-simult-compilations still holds for them all: *)
+let compilations_per_job = ref 1
+
 let compile_one conf session prog_name info_value info_file bin_file info_mtime =
   let clt = option_get "compile_one" __LOC__ session.ZMQClient.clt in
   let get_parent =
@@ -38,47 +52,143 @@ let compile_one conf session prog_name info_value info_file bin_file info_mtime
 
 let quarantined = Hashtbl.create 10
 
+let publish_binary conf session info_sign bin_file =
+  let exe_key =
+    Key.PerSite (conf.C.site, PerProgram (info_sign, Executable)) in
+  let exe_path = Value.(of_string (bin_file :> string)) in
+  ZMQClient.send_cmd session (SetKey (exe_key, exe_path)) ;
+  IntCounter.inc ~labels:["status", "ok"]
+    (stats_compilations_count conf.C.persist_dir) ;
+  !logger.debug "New binary %a" Key.print exe_key
+
+let build_failed conf src_path reason =
+  IntCounter.inc ~labels:["status", "failure"]
+    (stats_compilations_count conf.C.persist_dir) ;
+  let retry_date = Unix.time () +. !execomp_quarantine in
+  !logger.error "While compiling %a: %s, quarantining until %a"
+    N.src_path_print src_path
+    reason
+    print_as_date retry_date ;
+  Hashtbl.replace quarantined src_path retry_date
+
+let record_compilation_time conf status started =
+  Histogram.add (stats_compilation_time conf.C.persist_dir)
+    ~labels:["status", status] (Unix.gettimeofday () -. started)
+
+(* Builds running in child processes, by pid, and builds waiting for a job
+ * slot to be available: *)
+type build =
+  { src_path : N.src_path ;
+    info_sign : string ;
+    bin_file : N.path ;
+    compile : unit -> unit ;
+    mutable started : float }
+
+let running = Hashtbl.create 10
+let pending = Queue.create ()
+
+let is_building info_sign =
+  Hashtbl.exists (fun _ b -> b.info_sign = info_sign) running ||
+  Queue.fold (fun found b -> found || b.info_sign = info_sign) false pending
+
+let spawn_build b =
+  b.started <- Unix.gettimeofday () ;
+  flush_all () ;
+  match Unix.fork () with
+  | 0 ->
+      (* The fork inherited the whole limit: *)
+      Atomic.Counter.set RamenOCamlCompiler.max_simult_compilations
+                         !compilations_per_job ;
+      let status =
+        try
+          b.compile () ;
+          ExitCodes.terminated
+        with e ->
+          !logger.error "While compiling %a: %s"
+            N.src_path_print b.src_path
+            (Printexc.to_string e) ;
+          ExitCodes.other_error in
+      flush_all () ;
+      (* Skip the at_exit handlers of the execompserver: *)
+      sys_exit status
+  | pid ->
+      !logger.info "Compiling binary for %a in process %d"
+        N.src_path_print b.src_path pid ;
+      Hashtbl.add running pid b
+
+let start_build b =
+  if is_building b.info_sign then
+    !logger.debug "Binary for %a is already being built"
+      N.src_path_print b.src_path
+  else if Hashtbl.length running < !execomp_jobs then
+    spawn_build b
+  else (
+    !logger.debug "Delaying compilation of %a until a job is available"
+      N.src_path_print b.src_path ;
+    Queue.add b pending)
+
+(* Collect the builds that are over and start pending ones in their stead: *)
+let reap_builds conf session =
+  Hashtbl.keys running |> List.of_enum |>
+  List.iter (fun pid ->
+    match Unix.waitpid [ Unix.WNOHANG ] pid with
+    | exception Unix.(Unix_error (EINTR, _, _)) ->
+        ()
+    | 0, _ ->
+        ()
+    | _, status ->
+        let b = Hashtbl.find running pid in
+        Hashtbl.remove running pid ;
+        if status = Unix.WEXITED ExitCodes.terminated &&
+           Files.is_executable b.bin_file
+        then (
+          record_compilation_time conf "ok" b.started ;
+          publish_binary conf session b.info_sign b.bin_file
+        ) else (
+          record_compilation_time conf "failure" b.started ;
+          build_failed conf b.src_path
+            ("compiler "^ string_of_process_status status))) ;
+  while Hashtbl.length running < !execomp_jobs && not (Queue.is_empty pending)
+  do
+    spawn_build (Queue.take pending)
+  done
+
 let compile_info conf ~while_ session src_path info comp mtime =
   let do_compile () =
-    !logger.info "Compiling binary for %a"
-      N.src_path_print src_path ;
     let info_sign = Value.SourceInfo.signature_of_compiled comp in
     let info_file =
       Paths.execompserver_cache_file
         conf.C.persist_dir (N.path info_sign) "info" in
     let bin_file =
       Paths.execompserver_cache_bin conf.C.persist_dir info_sign in
+    let compile () =
+      compile_one conf session src_path info info_file bin_file mtime in
     try
       if not (while_ ()) then raise Exit ;
       (* Do not compile if the binary file is already there and looks legit,
        * since the info signature encodes for everything that matters
        * (starting with the codegen version) and supervisor will delete it
        * if the worker starts crashlooping. *)
-      if Files.is_executable bin_file then
+      if Files.is_executable bin_file then (
         !logger.info "Executable in %a looks fresh, keeping it."
-          N.path_print bin_file
+          N.path_print bin_file ;
         (* Might still need to be rewritten in the config though *)
-      else
-        compile_one conf session src_path info info_file bin_file mtime ;
-      let exe_key =
-        Key.PerSite (conf.C.site, PerProgram (info_sign, Executable)) in
-      let exe_path = Value.(of_string (bin_file :> string)) in
-      ZMQClient.send_cmd session (SetKey (exe_key, exe_path)) ;
-      IntCounter.inc ~labels:["status", "ok"]
-        (stats_compilations_count conf.C.persist_dir) ;
-      !logger.debug "New binary %a" Key.print exe_key
+        publish_binary conf session info_sign bin_file
+      ) else if !execomp_jobs > 1 && not conf.C.test then (
+        start_build { src_path ; info_sign ; bin_file ; compile ; started = 0. }
+      ) else (
+        !logger.info "Compiling binary for %a"
+          N.src_path_print src_path ;
+        let started = Unix.gettimeofday () in
+        compile () ;
+        record_compilation_time conf "ok" started ;
+        publish_binary conf session info_sign bin_file
+      )
     with
       | Exit ->
           ()
       | e when not conf.C.test ->
-          IntCounter.inc ~labels:["status", "failure"]
-            (stats_compilations_count conf.C.persist_dir) ;
-          let retry_date = Unix.time () +. !execomp_quarantine in
-          !logger.error "While compiling %a: %s, quarantining until %a"
-            N.src_path_print src_path
-            (Printexc.to_string e)
-            print_as_date retry_date ;
-          Hashtbl.replace quarantined src_path retry_date
+          build_failed conf src_path (Printexc.to_string e)
   in
   match Hashtbl.find quarantined src_path with
   | exception Not_found ->
@@ -104,15 +214,23 @@ let check_binaries conf ~while_ session =
         let info_sign = Value.SourceInfo.signature_of_compiled comp in
         let bin_file =
           Paths.execompserver_cache_bin conf.C.persist_dir info_sign in
-        if not (Files.exists bin_file) then (
+        if not (Files.exists bin_file) && not (is_building info_sign) then (
           !logger.warning "Executable %a vanished, rebuilding it"
             N.path_print bin_file ;
           compile_info conf ~while_ session src_path hv.value comp hv.mtime)
     | _ ->
         ())
 
-let start ?(quarantine=Default.execomp_quarantine) conf ~while_ =
+let start ?(quarantine=Default.execomp_quarantine)
+          ?(jobs=Default.execomp_jobs) conf ~while_ =
   execomp_quarantine := quarantine ;
+  let max_compils =
+    Atomic.Counter.get RamenOCamlCompiler.max_simult_compilations in
+  if jobs > max_compils then
+    !logger.warning "Limiting --jobs to %d (--max-simult-compilations)"
+      max_compils ;
+  execomp_jobs := min jobs max_compils ;
+  compilations_per_job := max 1 (max_compils / !execomp_jobs) ;
   (* We must wait the end of sync to start compiling for [get_parent] above
    * to work: *)
   let synced = ref false in
@@ -142,7 +260,8 @@ let start ?(quarantine=Default.execomp_quarantine) conf ~while_ =
   let on_new session k v uid mtime _can_write _can_del _owner _expiry =
     on_set session k v uid mtime in
   let sync_loop session =
-    let next_files_check = ref 0. in
+    let next_files_check = ref 0.
+    and next_cache_expiry = ref 0. in
     while while_ () do
       let now = Unix.time () in
       if now >= !next_files_check then (
@@ -150,6 +269,11 @@ let start ?(quarantine=Default.execomp_quarantine) conf ~while_ =
         (* [check_binaries] can run for a long time so do not use [now]: *)
         next_files_check := Unix.time () +. jitter check_binaries_on_disk_every ;
       ) ;
+      if now >= !next_cache_expiry then (
+        RamenCompilCache.expire conf.C.persist_dir ;
+        next_cache_expiry := Unix.time () +. jitter expire_compilation_cache_every
+      ) ;
+      reap_builds conf session ;
       ZMQClient.process_in ~while_ session
     done in
   let topics = [ "sources/*" ] in
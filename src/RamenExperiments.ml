@@ -77,15 +77,85 @@ let archive_in_orc =
       "All archives are written in ORC format. Non ORC non-wrapping \
        ringbufs are still possible but will not be archived.\n" |]
 
+let archive_orc_compression =
+  make [|
+    Variant.make "zlib" "ORC archives are compressed with zlib.\n" ;
+    Variant.make ~share:0. "zstd" "ORC archives are compressed with zstd.\n" ;
+    Variant.make ~share:0. "lz4" "ORC archives are compressed with lz4.\n" ;
+    Variant.make ~share:0. "snappy"
+      "ORC archives are compressed with snappy.\n" ;
+    Variant.make ~share:0. "none" "ORC archives are not compressed.\n" |]
+
 let parse_error_correction =
   make [|
     Variant.make "off" "No attempt at error correction\n" ;
     Variant.make ~share:0. "on" "Look for likely typo on parse errors\n" |]
 
+let shared_input_ringbufs =
+  make [|
+    Variant.make "off"
+      "Every worker reads from its own input ringbuffer, that parents \
+       write into for each child.\n" ;
+    Variant.make ~share:0. "on"
+      "Children of a single local parent share a broadcast input ringbuffer \
+       when they read the same fields with the same filters, so that the \
+       parent writes each tuple only once for all of them.\n" |]
+
+let tunnel_compression =
+  make [|
+    Variant.make "none" "Tuples are sent to remote sites uncompressed.\n" ;
+    Variant.make ~share:0. "lz4"
+      "Frames of tuples sent to remote sites are compressed with lz4.\n" ;
+    Variant.make ~share:0. "zstd"
+      "Frames of tuples sent to remote sites are compressed with zstd.\n" |]
+
+let parallel_replay =
+  make [|
+    Variant.make "off"
+      "Replayers read archive files one after the other.\n" ;
+    Variant.make ~share:0. "on"
+      "Replayers decode several archive files at once in a pool of \
+       processes, and merge the tuples in event time order.\n" |]
+
+let parallel_csv_parsing =
+  make [|
+    Variant.make "off"
+      "CSV files are parsed one record after the other.\n" ;
+    Variant.make ~share:0. "on"
+      "Plain CSV files are split into chunks of whole records that are \
+       parsed in a pool of processes, the tuples being output in the file \
+       order.\n" |]
+
+let multi_udp_receivers =
+  make [|
+    Variant.make "off"
+      "Listeners receive datagrams one at a time from a single socket.\n" ;
+    Variant.make ~share:0. "on"
+      "Listeners receive batches of datagrams from several sockets sharing \
+       the same port, in as many threads.\n" |]
+
+let ringbuf_mmap_options =
+  make [|
+    Variant.make "off"
+      "Ringbuffer files are mapped as is, pages being allocated on first \
+       touch.\n" ;
+    Variant.make ~share:0. "on"
+      "Input ringbuffers are preallocated and prefaulted, and use \
+       transparent hugepages where possible. Archive buffers are \
+       preallocated, advised for sequential access and the next one is \
+       prepared in the background after each rotation.\n" |]
+
 let all_internal_experiments =
   [ "TheBigOne", the_big_one ;
     "ArchiveInORC", archive_in_orc ;
-    "ParseErrorCorrection", parse_error_correction ]
+    "ArchiveORCCompression", archive_orc_compression ;
+    "ParseErrorCorrection", parse_error_correction ;
+    "SharedInputRingbufs", shared_input_ringbufs ;
+    "TunnelCompression", tunnel_compression ;
+    "ParallelReplay", parallel_replay ;
+    "ParallelCsvParsing", parallel_csv_parsing ;
+    "MultiUdpReceivers", multi_udp_receivers ;
+    "RingbufMmapOptions", ringbuf_mmap_options ]
 
 (*
  * Initialization
@@ -63,6 +63,19 @@ let checked_field_names pub_typ field_names =
     field_names)
 
 (* Will raise when the compiled function is missing *)
+(* Returns the program name, the function and the header of the tuples [replay]
+ * would call back with, without replaying anything: *)
+let replay_header session worker field_names ~with_event_time =
+  let _site_name, prog_name, func_name = N.worker_parse worker in
+  let fq = N.fq_of_program prog_name func_name in
+  let clt = option_get "replay_header" __LOC__ session.ZMQClient.clt in
+  let _prog, prog_name, func = function_of_fq clt fq in
+  let pub_typ = O.out_type_of_operation ~with_priv:false func.VSI.operation in
+  let field_names = checked_field_names pub_typ field_names in
+  let _head_idx, head_typ =
+    header_of_type ~with_event_time field_names pub_typ in
+  prog_name, func, head_typ
+
 let replay conf ~while_ session worker field_names where since until
            ~with_event_time f =
   (* Start with the most hazardous and interesting part: find a way to
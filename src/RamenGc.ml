@@ -99,6 +99,7 @@ let cleanup_old_versions conf dry_run =
       N.path "workers/states", v1v2_regexp,
         N.path Versions.(worker_state ^"_"^ codegen) ;
       N.path "workers/factors", v_regexp, N.path Versions.factors ;
+      N.path "workers/rollups", v_regexp, N.path Versions.rollups ;
       N.path "confserver/snapshots", v_regexp, N.path Versions.sync_conf ]
   in
   List.iter (cleanup_dir_old conf dry_run) to_clean
@@ -109,17 +110,13 @@ let clean_seq_archives del_ratio dry_run dir alloced =
    * what we should delete. *)
   (* Delete all files matching %d_%d_%a_%a.r but the last ones.
    * Also, for each of these, try to delete all attached factor files. *)
-  let files = Files.files_of dir |> Array.of_enum in
-  let arc_files =
-    Array.enum files |> RingBufLib.filter_arc_files dir |>
-    Array.of_enum in
-  Array.fast_sort RingBufLib.arc_file_compare arc_files ;
+  let arc_files = RingBufLib.arc_files_with_size_of dir in
   (* Older files come first in [arc_files].
    * Now find the allocated size for this worker: *)
   let rec loop i sum_sz num_to_del to_del =
     if i < 0 then num_to_del, to_del else
-    let _, _, _, _, _, fpath as f = arc_files.(i) in
-    let sum_sz = sum_sz + Files.size fpath in
+    let f, sz = arc_files.(i) in
+    let sum_sz = sum_sz + sz in
     let num_to_del, to_del =
       if sum_sz <= alloced then num_to_del, to_del
       else num_to_del + 1, f::to_del in
@@ -130,6 +127,8 @@ let clean_seq_archives del_ratio dry_run dir alloced =
   (* We have at the head of to_del the oldest files. Delete some of them,
    * but not all of them at once: *)
   let num_to_del = round_to_int (float_of_int num_to_del *. del_ratio) in
+  (* Only list the directory if there is something to delete: *)
+  let files = lazy (Files.files_of dir |> Array.of_enum) in
   let rec del deleted_count n = function
     | [] ->
         0
@@ -152,7 +151,7 @@ let clean_seq_archives del_ratio dry_run dir alloced =
                   IntCounter.add stats_del_bytes (Files.size path) ;
                   Files.unlink path
                 ) ()
-            ) files
+            ) (Lazy.force files)
           ) ;
           del (deleted_count + 1) (n - 1) to_del
         ) in
@@ -164,6 +163,22 @@ let clean_seq_archives del_ratio dry_run dir alloced =
       N.path_print dir
       (if dry_run then " (NOPE)" else "")
 
+(* Delete the pre-aggregated time series that have not been used for a
+ * while: *)
+let clean_old_rollups conf dry_run =
+  let dir =
+    N.path_cat [ conf.C.persist_dir ;
+                 N.path "workers/rollups" ; N.path Versions.rollups ] in
+  if Files.is_directory dir then (
+    let oldest = Unix.time () -. Default.timeseries_rollups_max_age in
+    Files.dir_subtree_iter ~on_file:(fun fname _rel_fname ->
+      if Files.mtime_def 0. fname < oldest then (
+        !logger.debug "Deleting unused rollup %a%s"
+          N.path_print fname
+          (if dry_run then " (NOPE)" else "") ;
+        if not dry_run then Files.safe_unlink fname)
+    ) dir)
+
 let get_alloced_special _fname _rel_fname =
   150_000_000 (* TODO *)
 
@@ -192,29 +207,54 @@ let compress_archive (bin : N.path) (func_name : N.func) rb_name =
     ) ;
     if output <> "" then !logger.debug "Output: %s" output)
 
+(* Unless archiving into ORC, ringbuf archives are merely compressed with
+ * zstd, which RingBuf.load knows how to read back without any temp file: *)
+let zstd_compress_archive rb_name =
+  let zst_name = N.cat rb_name (N.path ".zst") in
+  match Files.size rb_name with
+  | exception e ->
+      (* Might have been deleted in between: *)
+      !logger.debug "Cannot stat %a: %s"
+        N.path_print rb_name (Printexc.to_string e)
+  | size_before ->
+      (match RingBuf.compress_archive rb_name with
+      | exception e ->
+          !logger.error "Cannot compress archive %a: %s"
+            N.path_print rb_name (Printexc.to_string e) ;
+          IntCounter.inc stats_errors
+      | () ->
+          !logger.debug "Compressed %a into %a"
+            N.path_print rb_name N.path_print zst_name ;
+          IntCounter.inc stats_compressed_files ;
+          IntCounter.add stats_compressed_bytes_before size_before ;
+          IntCounter.add stats_compressed_bytes_after (Files.size zst_name))
+
 let compress_old_archives conf worker_bins dry_run compress_older =
   (* Compress archives of every functions we can find in the RC file (running
-   * or not) from ringbuf to ORC: *)
+   * or not), either from ringbuf to ORC or with zstd: *)
   !logger.debug "Compressing archives..." ;
+  let to_orc = RamenExperiments.archive_in_orc.variant > 0 in
   List.iter (fun (bin, prog_name, func) ->
     Paths.archive_buf_name ~file_type:OWD.RingBuf conf prog_name func |>
     RingBufLib.arc_dir_of_bname |>
     RingBufLib.arc_files_of |>
     Enum.iter (fun (_from, _to, _t1, _t2, arc_typ, fname) ->
       if arc_typ = RingBufLib.RingBuf &&
+         not (Files.has_ext "zst" fname) &&
          Files.is_older_than ~on_err:false compress_older fname
       then (
         !logger.debug "Compressing %a%s"
           N.path_print fname (if dry_run then " (NOPE)" else "") ;
-        if not dry_run then compress_archive bin func.VSI.name fname))
+        if not dry_run then
+          if to_orc then compress_archive bin func.VSI.name fname
+          else zstd_compress_archive fname))
   ) worker_bins
 
 let cleanup_once
       conf dry_run del_ratio compress_older get_alloced_worker worker_bins =
   !logger.debug "Cleaning old unused files..." ;
   cleanup_old_versions conf dry_run ;
-  if RamenExperiments.archive_in_orc.variant > 0 then
-    compress_old_archives conf.C.persist_dir worker_bins dry_run compress_older ;
+  compress_old_archives conf.C.persist_dir worker_bins dry_run compress_older ;
   (* Delete old archive files *)
   !logger.debug "Deleting old archives..." ;
   let on_dir get_alloced fname rel_fname =
@@ -239,7 +279,8 @@ let cleanup_once
   let factordir =
     N.path_cat [ conf.C.persist_dir ;
                  N.path "workers/factors" ; N.path Versions.factors ] in
-  Files.dir_subtree_iter ~on_dir:(on_dir get_alloced_special) factordir
+  Files.dir_subtree_iter ~on_dir:(on_dir get_alloced_special) factordir ;
+  clean_old_rollups conf dry_run
 
 let cleanup_once conf session dry_run del_ratio compress_older =
   let open RamenSync in
@@ -122,7 +122,8 @@ let parse ?sender ~recept_time line =
     (parse ~recept_time:1.23 "foo.bar 42")
 *)
 
-let collector ~inet_addr ~port ~ip_proto ?while_ k =
+let collector ~inet_addr ~port ~ip_proto ?while_ ?receivers ?recv_batch
+              ?on_drops ?(with_batch=fun f -> f ()) k =
   let lines_of_string s =
     (string_split_on_char '\n' s |> List.enum) // ((<>) "")
   in
@@ -153,8 +154,9 @@ let collector ~inet_addr ~port ~ip_proto ?while_ k =
             (* Ignore that batch and proceed: *)
             stop - start
         | tuples ->
-            Enum.iter k tuples ;
+            with_batch (fun () -> Enum.iter k tuples) ;
             stop - start
   in
   ip_server ~ip_proto
-    ~what:"graphite sink" ~buffer_size:60000 ~inet_addr ~port ?while_ serve
+    ~what:"graphite sink" ~buffer_size:60000 ~inet_addr ~port ?while_
+    ?receivers ?recv_batch ?on_drops serve
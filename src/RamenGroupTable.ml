@@ -0,0 +1,171 @@
+(* Hash table for the groups of aggregate workers.
+ *
+ * Unlike Hashtbl, which allocates a bucket cell per binding, this is an open
+ * addressing table which bindings are stored in flat arrays, along with the
+ * hash of their key so that probing and resizing never have to rehash
+ * anything, and keys are compared only when hashes match.
+ * Collisions are resolved by linear probing, and removals shift the next
+ * bindings back so that no tombstones are needed. *)
+open Batteries
+
+type ('k, 'v) t =
+  { (* Hash of the key in each slot, or [none] for free slots: *)
+    mutable hashes : int array ;
+    mutable keys : 'k array ;
+    mutable values : 'v array ;
+    mutable length : int ;
+    init_capa : int }
+
+let none = -1
+
+(* Keep the load factor below 3/4, with a power of two capacity: *)
+let capacity_for n =
+  let rec loop c = if c * 3 >= n * 4 then c else loop (c * 2) in
+  loop 8
+
+(* Slots are allocated only once the first binding is added: *)
+let create n =
+  { hashes = [||] ; keys = [||] ; values = [||] ;
+    length = 0 ; init_capa = capacity_for n }
+
+let length t = t.length
+
+let capacity t = Array.length t.hashes
+
+(* Returns the slot holding [k], or the free slot where it should go: *)
+let find_slot t h k =
+  let mask = Array.length t.hashes - 1 in
+  let rec loop i =
+    let h' = t.hashes.(i) in
+    if h' = none || h' = h && compare t.keys.(i) k = 0 then i
+    else loop ((i + 1) land mask) in
+  loop (h land mask)
+
+(* Reinsert all bindings into larger arrays. Free slots of [keys] and
+ * [values] must hold something, so they initially hold [k] and [v], the
+ * binding that's about to be added: *)
+let resize t capa k v =
+  let hashes = t.hashes and keys = t.keys and values = t.values in
+  t.hashes <- Array.make capa none ;
+  t.keys <- Array.make capa k ;
+  t.values <- Array.make capa v ;
+  let mask = capa - 1 in
+  Array.iteri (fun i h ->
+    if h <> none then (
+      let rec probe j =
+        if t.hashes.(j) = none then j else probe ((j + 1) land mask) in
+      let j = probe (h land mask) in
+      t.hashes.(j) <- h ;
+      t.keys.(j) <- keys.(i) ;
+      t.values.(j) <- values.(i))
+  ) hashes
+
+(* Raises Not_found if [k] is unbound: *)
+let find t k =
+  if t.length = 0 then raise Not_found ;
+  let i = find_slot t (Hashtbl.hash k) k in
+  if t.hashes.(i) = none then raise Not_found ;
+  t.values.(i)
+
+let mem t k =
+  t.length > 0 &&
+  t.hashes.(find_slot t (Hashtbl.hash k) k) <> none
+
+(* Add or replace the binding for [k]: *)
+let replace t k v =
+  if t.length * 4 >= Array.length t.hashes * 3 then
+    resize t (max t.init_capa (2 * Array.length t.hashes)) k v ;
+  let h = Hashtbl.hash k in
+  let i = find_slot t h k in
+  if t.hashes.(i) = none then (
+    t.hashes.(i) <- h ;
+    t.keys.(i) <- k ;
+    t.length <- t.length + 1) ;
+  t.values.(i) <- v
+
+(* Move the binding from slot [src] to the free slot [dst]: *)
+let move t src dst =
+  t.hashes.(dst) <- t.hashes.(src) ;
+  t.keys.(dst) <- t.keys.(src) ;
+  t.values.(dst) <- t.values.(src)
+
+(* Free slot [i], which must then not keep its binding reachable. It is
+ * given the binding of some other slot still in use, the next one in
+ * probing order since live slots come in runs. Once the table is empty
+ * the arrays are released altogether: *)
+let free t i =
+  t.hashes.(i) <- none ;
+  if t.length = 0 then (
+    t.hashes <- [||] ; t.keys <- [||] ; t.values <- [||]
+  ) else (
+    let mask = Array.length t.hashes - 1 in
+    let rec live j =
+      if t.hashes.(j) <> none then j else live ((j + 1) land mask) in
+    let j = live ((i + 1) land mask) in
+    t.keys.(i) <- t.keys.(j) ;
+    t.values.(i) <- t.values.(j))
+
+let remove t k =
+  if t.length > 0 then
+    let i = find_slot t (Hashtbl.hash k) k in
+    if t.hashes.(i) <> none then (
+      t.length <- t.length - 1 ;
+      let mask = Array.length t.hashes - 1 in
+      (* Move back into the hole the following bindings that could not be
+       * found any longer past it, ie. those which home slot is not between
+       * the hole and their current slot: *)
+      let rec shift hole j =
+        let h = t.hashes.(j) in
+        if h = none then free t hole else
+        let home = h land mask in
+        if (j - home) land mask >= (j - hole) land mask then (
+          move t j hole ;
+          shift j ((j + 1) land mask)
+        ) else
+          shift hole ((j + 1) land mask) in
+      shift i ((i + 1) land mask))
+
+(* Iterate over all bindings, in no particular order.
+ * [f] must not modify the table: *)
+let fold f t init =
+  let acc = ref init in
+  Array.iteri (fun i h ->
+    if h <> none then acc := f t.keys.(i) t.values.(i) !acc
+  ) t.hashes ;
+  !acc
+
+let iter f t =
+  fold (fun k v () -> f k v) t ()
+
+let to_list t =
+  fold (fun k v l -> (k, v) :: l) t []
+
+(*$inject
+  let of_list l =
+    let t = create 0 in
+    List.iter (fun (k, v) -> replace t k v) l ;
+    t
+*)
+
+(*$= to_list & ~printer:(BatIO.to_string (BatList.print (BatTuple.Tuple2.print BatInt.print BatString.print)))
+  [] (to_list (create 10))
+  [ 1, "a" ; 2, "b" ] (to_list (of_list [ 1, "a" ; 2, "b" ]) |> List.sort compare)
+  [ 1, "c" ; 2, "b" ] \
+    (to_list (of_list [ 1, "a" ; 2, "b" ; 1, "c" ]) |> List.sort compare)
+  [ 1, "a" ] (let t = of_list [ 1, "a" ; 2, "b" ] in remove t 2 ; to_list t)
+  [] (let t = of_list [ 1, "a" ] in remove t 1 ; to_list t)
+*)
+
+(*$T
+  let t = of_list (List.init 1000 (fun i -> i, i)) in \
+  length t = 1000 && capacity t = 2048 && \
+  List.for_all (fun i -> find t i = i) (List.init 1000 identity)
+  let t = of_list (List.init 1000 (fun i -> i, i)) in \
+  for i = 0 to 999 do if i mod 3 = 0 then remove t i done ; \
+  length t = 666 && \
+  List.for_all (fun i -> mem t i = (i mod 3 <> 0)) (List.init 1000 identity) && \
+  List.sort compare (List.map fst (to_list t)) = \
+    List.filter (fun i -> i mod 3 <> 0) (List.init 1000 identity)
+  let t = create 0 in not (mem t 42) && (try ignore (find t 42) ; false \
+                                         with Not_found -> true)
+*)
@@ -0,0 +1,122 @@
+(* Histograms of non negative integer values (typically durations in
+ * nanoseconds) with a fixed log-linear layout, in the spirit of HDR
+ * histograms: values below 2^sub_bits have their own bucket, and then each
+ * power of two is split into 2^sub_bits buckets of equal width, so that the
+ * relative error never exceeds 1/2^sub_bits.
+ *
+ * The bucket layout is the same for all histograms, so that adding a value is
+ * only a few shifts and an array increment, and histograms can be merged by
+ * adding their counts. *)
+open Batteries
+
+(* 16 buckets per power of two, ie. about 6% precision: *)
+let sub_bits = 4
+let sub_count = 1 lsl sub_bits
+
+(* Values above 2^max_bits (about 18 minutes when counting nanoseconds) are
+ * all counted in the last bucket: *)
+let max_bits = 40
+let max_value = 1 lsl max_bits - 1
+
+let num_buckets = (max_bits - sub_bits + 1) * sub_count
+
+type t =
+  { counts : int array ;
+    mutable count : int ;
+    mutable sum : int ;
+    mutable max : int }
+
+let make () =
+  { counts = Array.make num_buckets 0 ; count = 0 ; sum = 0 ; max = 0 }
+
+(* Index of the most significant bit set in [v] (which must be > 0): *)
+let msb v =
+  let rec loop m v =
+    if v <= 1 then m else loop (m + 1) (v lsr 1) in
+  loop 0 v
+
+let bucket_of_value v =
+  if v < sub_count then v else
+    let m = msb v in
+    (m - sub_bits + 1) * sub_count + (v lsr (m - sub_bits)) - sub_count
+
+(*$= bucket_of_value & ~printer:string_of_int
+  0 (bucket_of_value 0)
+  15 (bucket_of_value 15)
+  16 (bucket_of_value 16)
+  31 (bucket_of_value 31)
+  32 (bucket_of_value 32)
+  32 (bucket_of_value 33)
+  33 (bucket_of_value 34)
+  (num_buckets - 1) (bucket_of_value max_value)
+*)
+
+(* Lowest and highest values counted in bucket [b]: *)
+let bucket_range b =
+  let k = b / sub_count in
+  if k = 0 then b, b else
+    let lo = (b mod sub_count + sub_count) lsl (k - 1) in
+    lo, lo + 1 lsl (k - 1) - 1
+
+(*$= bucket_range & ~printer:(IO.to_string (Tuple2.print Int.print Int.print))
+  (7, 7) (bucket_range 7)
+  (31, 31) (bucket_range 31)
+  (32, 33) (bucket_range 32)
+  (0, max_value) (fst (bucket_range 0), snd (bucket_range (num_buckets - 1)))
+*)
+
+(*$Q bucket_range
+  Q.small_int (fun v -> let lo, hi = bucket_range (bucket_of_value v) in \
+                        lo <= v && v <= hi)
+  Q.pos_int (fun v -> let v = min v max_value in \
+                      let lo, hi = bucket_range (bucket_of_value v) in \
+                      lo <= v && v <= hi && hi - lo <= lo / sub_count)
+*)
+
+let add t v =
+  let v = if v < 0 then 0 else if v > max_value then max_value else v in
+  let b = bucket_of_value v in
+  t.counts.(b) <- t.counts.(b) + 1 ;
+  t.count <- t.count + 1 ;
+  t.sum <- t.sum + v ;
+  if v > t.max then t.max <- v
+
+let merge_into dst src =
+  Array.iteri (fun b c -> dst.counts.(b) <- dst.counts.(b) + c) src.counts ;
+  dst.count <- dst.count + src.count ;
+  dst.sum <- dst.sum + src.sum ;
+  if src.max > dst.max then dst.max <- src.max
+
+(* Returns the upper bound of the bucket holding the value of rank [p]
+ * percent (never more than the greatest value added), or 0 if the histogram is
+ * empty: *)
+let percentile t p =
+  if t.count = 0 then 0 else
+    let rank = max 1 (int_of_float (ceil (p *. float_of_int t.count /. 100.))) in
+    let rec loop b seen =
+      if b >= num_buckets - 1 then t.max else
+        let seen = seen + t.counts.(b) in
+        if seen >= rank then min t.max (snd (bucket_range b))
+        else loop (b + 1) seen in
+    loop 0 0
+
+(*$inject
+  let of_list l =
+    let t = make () in
+    List.iter (add t) l ;
+    t
+*)
+
+(*$= percentile & ~printer:string_of_int
+  0 (percentile (make ()) 50.)
+  5 (percentile (of_list [ 1 ; 2 ; 3 ; 4 ; 5 ; 6 ; 7 ; 8 ; 9 ; 10 ]) 50.)
+  10 (percentile (of_list [ 1 ; 2 ; 3 ; 4 ; 5 ; 6 ; 7 ; 8 ; 9 ; 10 ]) 100.)
+  1 (percentile (of_list [ 1 ; 2 ; 3 ; 4 ; 5 ; 6 ; 7 ; 8 ; 9 ; 10 ]) 0.)
+  1001 (percentile (of_list [ 1 ; 1 ; 1 ; 1001 ]) 99.)
+*)
+
+(*$T merge_into
+  let t = of_list [ 1 ; 2 ; 1000 ] in \
+  merge_into t (of_list [ 3 ; 5000 ]) ; \
+  t.count = 5 && t.sum = 6006 && t.max = 5000 && percentile t 40. = 2
+*)
@@ -29,7 +29,7 @@ exception Timeout
 let retry
     ~on ?(first_delay=1.0) ?(min_delay=0.0001) ?(max_delay=10.0)
     ?(delay_adjust_ok=0.2) ?(delay_adjust_nok=1.5) ?delay_rec
-    ?max_retry ?max_retry_time ?(while_=always) f =
+    ?max_retry ?max_retry_time ?(while_=always) ?(sleep=Unix.sleepf) f =
   let next_delay = ref first_delay in
   let started = Unix.gettimeofday () in
   let can_wait_longer () =
@@ -53,7 +53,7 @@ let retry
           let delay = max delay min_delay in
           next_delay := !next_delay *. delay_adjust_nok ;
           Option.may (fun f -> f delay) delay_rec ;
-          Unix.sleepf delay ;
+          sleep delay ;
           (loop [@tailcall]) (num_try + 1) x
         ) else (
           !logger.debug "Non-retryable error: %s after %d attempt%s"
@@ -378,7 +378,22 @@ let run_coprocess ~max_count ?(to_stdin="") ?(env=ReducedEnv) cmd_name cmd =
           Thread.create read_out pstderr ] ;
     !status)
 
-let udp_server ?(buffer_size=2000) ~what ~inet_addr ~port ?(while_=always) k =
+external udp_setup_socket : Unix.file_descr -> unit =
+  "wrap_udp_setup_socket"
+
+external udp_recv_batch :
+  Unix.file_descr -> Bytes.t -> int -> int array ->
+    (int * Unix.inet_addr option) array =
+  "wrap_udp_recv_batch"
+
+(* If [receivers] is greater than 0 then that many sockets are bound to the
+ * same port and served each by its own thread, receiving up to
+ * [recv_batch] datagrams per system call. [k] is then never called
+ * concurrently, and [on_drops] is given from time to time the total number
+ * of datagrams dropped by the kernel on all those sockets.
+ * Otherwise datagrams are received one by one from a single socket. *)
+let udp_server ?(buffer_size=2000) ~what ~inet_addr ~port ?(while_=always)
+               ?(receivers=0) ?(recv_batch=1) ?(on_drops=ignore) k =
   if port < 0 || port > 65535 then
     Printf.sprintf "%s: port number (%d) not within valid range" what port |>
     failwith ;
@@ -388,30 +403,79 @@ let udp_server ?(buffer_size=2000) ~what ~inet_addr ~port ?(while_=always) k =
   let sock_of_domain domain =
     let sock = socket ~cloexec:true domain SOCK_DGRAM 0 in
     setsockopt sock SO_REUSEADDR true ;
+    if receivers > 0 then (
+      udp_setup_socket sock ;
+      (* So that receivers can notice when to quit: *)
+      setsockopt_float sock SO_RCVTIMEO 1.) ;
     bind sock (ADDR_INET (inet_addr, port)) ;
     sock in
-  let sock =
+  let make_sock () =
     try sock_of_domain PF_INET6
     with _ -> sock_of_domain PF_INET in
-  !logger.info "Listening for datagrams on %s:%d"
-    (Unix.string_of_inet_addr inet_addr) port ;
-  let buffer = Bytes.create buffer_size in
-  let rec until_exit () =
-    if while_ () then
-      let recv_len, sockaddr =
-        restart_on_eintr ~while_ (fun () ->
-          recvfrom sock buffer 0 (Bytes.length buffer) []) () in
-      !logger.debug "Received %d bytes on UDP port %d" recv_len port ;
-      let sender =
-        match sockaddr with
-        | ADDR_INET (addr, _port) -> Some addr
-        | _ -> None in
-      let _ = k ?sender buffer 0 recv_len in
-      (until_exit [@tailcall]) ()
-  in
-  try until_exit ()
-  with Exit -> (* from the above restart_on_eintr *)
-    ()
+  if receivers <= 0 then (
+    let sock = make_sock () in
+    !logger.info "Listening for datagrams on %s:%d"
+      (Unix.string_of_inet_addr inet_addr) port ;
+    let buffer = Bytes.create buffer_size in
+    let rec until_exit () =
+      if while_ () then
+        let recv_len, sockaddr =
+          restart_on_eintr ~while_ (fun () ->
+            recvfrom sock buffer 0 (Bytes.length buffer) []) () in
+        !logger.debug "Received %d bytes on UDP port %d" recv_len port ;
+        let sender =
+          match sockaddr with
+          | ADDR_INET (addr, _port) -> Some addr
+          | _ -> None in
+        let _ = k ?sender buffer 0 recv_len in
+        (until_exit [@tailcall]) ()
+    in
+    try until_exit ()
+    with Exit -> (* from the above restart_on_eintr *)
+      ()
+  ) else (
+    let socks = Array.init receivers (fun _ -> make_sock ()) in
+    !logger.info "Listening for datagrams on %s:%d with %d sockets"
+      (Unix.string_of_inet_addr inet_addr) port receivers ;
+    (* Drop counters, per socket: *)
+    let drops = Array.init receivers (fun _ -> [| 0 |]) in
+    let lock = Mutex.create () in
+    let with_lock f =
+      Mutex.lock lock ;
+      finally (fun () -> Mutex.unlock lock) f () in
+    (* First failure of any receiver, that stops all others: *)
+    let failure = ref None in
+    let while_ () =
+      !failure = None && while_ () in
+    let receive i =
+      let sock = socks.(i) in
+      let buffer = Bytes.create (recv_batch * buffer_size) in
+      try
+        while with_lock while_ do
+          let msgs = udp_recv_batch sock buffer buffer_size drops.(i) in
+          if Array.length msgs > 0 then (
+            !logger.debug "Received %d datagrams on UDP port %d"
+              (Array.length msgs) port ;
+            with_lock (fun () ->
+              Array.iteri (fun j (recv_len, sender) ->
+                let start = j * buffer_size in
+                let _ = k ?sender buffer start (start + recv_len) in ()
+              ) msgs ;
+              Array.fold_left (fun s d -> s + d.(0)) 0 drops |> on_drops))
+        done
+      with e ->
+        with_lock (fun () ->
+          if !failure = None then failure := Some e) in
+    finally
+      (fun () -> Array.iter close socks)
+      (fun () ->
+        let threads =
+          List.init (receivers - 1) (fun i -> Thread.create receive (i + 1)) in
+        receive 0 ;
+        List.iter Thread.join threads) () ;
+    match !failure with
+    | None | Some Exit -> ()
+    | Some e -> raise e)
 
 type tcp_client =
   { sender : Unix.inet_addr ;
@@ -504,10 +568,11 @@ let tcp_server ?buffer_size ~what ~inet_addr ~port ?(while_=always) k =
     ()
 
 let ip_server ?buffer_size ~what ~inet_addr ~port ~ip_proto
-              ?while_ k =
+              ?while_ ?receivers ?recv_batch ?on_drops k =
   match ip_proto with
   | Raql_ip_protocol.DessserGen.UDP ->
-      udp_server ?buffer_size ~what ~inet_addr ~port ?while_ k
+      udp_server ?buffer_size ~what ~inet_addr ~port ?while_
+                 ?receivers ?recv_batch ?on_drops k
   | TCP ->
       tcp_server ?buffer_size ~what ~inet_addr ~port ?while_ k
 
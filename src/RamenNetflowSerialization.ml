@@ -38,24 +38,27 @@ type netflow_metric =
   Uint8.t (* tcp_flags *)
 
 external decode :
-  Bytes.t -> int -> RamenIp.t option -> netflow_metric array =
+  Bytes.t -> int -> int -> RamenIp.t option -> netflow_metric array =
   "wrap_netflow_v5_decode"
 
-let collector ~inet_addr ~port ~ip_proto ?while_ k =
+let collector ~inet_addr ~port ~ip_proto ?while_ ?receivers ?recv_batch
+              ?on_drops ?(with_batch=fun f -> f ()) k =
   (* Listen to incoming UDP datagrams on given port: *)
   let serve ?sender buffer start stop =
-    if start <> 0 then todo "Netflow over TCP" ;
+    if ip_proto <> Raql_ip_protocol.DessserGen.UDP then
+      todo "Netflow over TCP" ;
     let recv_len = stop - start in
     let sender = Option.map RamenIp.of_unix_addr sender in
     !logger.debug "Received %d bytes from netflow source @ %a"
       recv_len
       (Option.print RamenIp.print) sender ;
-    decode buffer recv_len sender |>
-    Array.iter k ;
+    let flows = decode buffer start stop sender in
+    with_batch (fun () -> Array.iter k flows) ;
     recv_len
   in
   ip_server ~ip_proto
-    ~what:"netflow sink" ~inet_addr ~port ?while_ serve
+    ~what:"netflow sink" ~inet_addr ~port ?while_
+    ?receivers ?recv_batch ?on_drops serve
 
 let test ?(port=2055) () =
   init_logger Normal ;
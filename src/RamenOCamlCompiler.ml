@@ -150,10 +150,41 @@ let compile_external _conf ~keep_temp_files what (src_file : N.path) obj_file =
        * report to the GUI: *)
       cannot_compile what (string_of_process_status status)
 
+(* Digests of the compiled modules found next to [obj_file] that [src_file]
+ * refers to, since they also determine the compilation outcome. A module is
+ * assumed to be referred to if its name appears anywhere in the source,
+ * which can only err on the side of caution: *)
+let local_deps src_file obj_file =
+  let src = Files.read_whole_file src_file
+  and self = Files.(basename obj_file |> remove_ext) in
+  Files.files_of (Files.dirname obj_file) //
+  (fun f ->
+    (Files.has_ext "cmi" f || Files.has_ext "cmx" f) &&
+    let m = Files.remove_ext f in
+    m <> self &&
+    String.exists src (String.capitalize_ascii (m :> string))) |>
+  List.of_enum |>
+  List.sort N.compare |>
+  List.map (fun f ->
+    let fname = N.path_cat [ Files.dirname obj_file ; f ] in
+    (f :> string) ^":"^ Digest.file (fname :> string))
+
 let compile conf ?(keep_temp_files=false) what src_file obj_file =
   Files.mkdir_all ~is_file:true obj_file ;
-  (if !use_external_compiler then compile_external else compile_internal)
-    conf ~keep_temp_files what src_file obj_file
+  let build () =
+    (if !use_external_compiler then compile_external else compile_internal)
+      conf ~keep_temp_files what src_file obj_file in
+  if keep_temp_files then build () else
+    let debug = !logger.log_level = Debug in
+    (* The module name is part of the compiled object: *)
+    let flags =
+      Printf.sprintf "ocaml %s debug:%b external:%b warnings:%s"
+        (Files.basename obj_file :> string)
+        debug !use_external_compiler warnings in
+    let deps = local_deps src_file obj_file in
+    let key = RamenCompilCache.key ~flags ~deps src_file in
+    RamenCompilCache.with_cache conf.C.persist_dir ~lang:"ocaml"
+      ~exts:[ "cmx" ; "cmi" ; "o" ] key obj_file build
 
 (* Function to take some object files, a source file, and produce an
  * executable: *)
@@ -477,13 +477,22 @@ let emit_write_value func_name rtyp oc =
   p "{" ;
   p "  CAMLparam4(hder_, v_, start_, stop_);" ;
   p "  OrcHandler *handler = Handler_val(hder_);" ;
-  p "  if (! handler->writer) handler->start_write();" ;
+  p "  if (! handler->batch) handler->start_write();" ;
   emit_get_vb 1 "root" rtyp "handler->batch.get()" oc ;
   emit_add_value_to_batch
     1 0 (Some "v_") "root" "root->numElements" rtyp "" oc ;
+  (* flush_batch leaves an empty batch or none, and [root] must not be
+   * used afterward since in async mode it's now owned by the writer
+   * thread: *)
   p "  if (root->numElements >= root->capacity) {" ;
-  p "    handler->flush_batch(true);" ; (* might destroy the writer... *)
-  p "    root->numElements = 0;" ;  (* ... but not the batch! *)
+  (* In async mode this is where the errors of the writer thread surface: *)
+  p "    string err;" ;
+  p "    try {" ;
+  p "      handler->flush_batch(true);" ;
+  p "    } catch (exception const &e) {" ;
+  p "      err = string(\"Cannot write ORC file: \") + e.what();" ;
+  p "    }" ;
+  p "    if (! err.empty()) caml_failwith(err.c_str());" ;
   p "  }" ;
   p "  // Since we survived, update this file timestamps:" ;
   p "  double start = Double_val(start_);" ;
@@ -756,10 +765,160 @@ let emit_read_values func_name rtyp oc =
   p "  CAMLreturn(res);" ;
   p "}"
 
+(* Same as above, but calls back OCaml once per batch of rows, and
+ * optionally reads only some of the top-level columns.
+ * Rather than building an OCaml value for every row of the batch, the
+ * callback receives a view of the batch (and its number of rows) from which
+ * it reads the rows one by one with the function named [func_name ^"_row"],
+ * so that each row is a short lived value that is consumed right away.
+ * [include_] is an OCaml bool array telling for each public top-level field
+ * whether it must be read, or the empty array to read all of them. Columns
+ * that are not nullable are always read. Columns that are not read are
+ * returned as NULL, by substituting a batch full of nulls for each of them
+ * so that the reader code above can be reused as is: *)
+let emit_read_values_batch func_name rtyp oc =
+  let p fmt = emit oc 0 fmt in
+  let max_depth = DT.(depth ~opaque_user_type:false rtyp.typ) + 1 in
+  let nullable_cols =
+    match DT.develop rtyp.DT.typ with
+    | TRec kts ->
+        Array.filter (fun (k, _) -> not N.(is_private (field k))) kts |>
+        Array.map (fun (_, mn) -> mn.DT.nullable)
+    | TTup mns ->
+        Array.map (fun mn -> mn.DT.nullable) mns
+    | _ ->
+        [||] in
+  let emit_locals () =
+    let rec localN n =
+      if n < max_depth then
+        let c = min 5 (max_depth - n) in
+        p "  CAMLlocal%d(%a);" c
+          (Enum.print ~sep:", " (fun oc n -> Printf.fprintf oc "tmp%d" n))
+            (Enum.range n ~until:(n + c - 1)) ;
+        localN (n + c) in
+    localN 0 in
+  (* The view is a custom block pointing to the batch, or NULL once the
+   * batch is gone: *)
+  p "static struct custom_operations %s_view_ops = {" func_name ;
+  p "  \"org.ramen.orc_batch_view\"," ;
+  p "  custom_finalize_default," ;
+  p "  custom_compare_default," ;
+  p "  custom_hash_default," ;
+  p "  custom_serialize_default," ;
+  p "  custom_deserialize_default," ;
+  p "  custom_compare_ext_default" ;
+  p "};" ;
+  p "" ;
+  p "#define %s_view_val(v) (*(ColumnVectorBatch **)Data_custom_val(v))"
+    func_name ;
+  p "" ;
+  p "extern \"C\" value %s_row(value view_, value row_)" func_name ;
+  p "{" ;
+  p "  CAMLparam2(view_, row_);" ;
+  p "  CAMLlocal1(res);" ;
+  emit_locals () ;
+  p "  ColumnVectorBatch *rows_batch = %s_view_val(view_);" func_name ;
+  p "  uint64_t const row = Long_val(row_);" ;
+  p "  if (! rows_batch || row >= rows_batch->numElements)" ;
+  p "    caml_invalid_argument(\"%s_row\");" func_name ;
+  emit_read_value_from_batch 1 0 "rows_batch" "row" "res" rtyp oc ;
+  p "  CAMLreturn(res);" ;
+  p "}" ;
+  p "" ;
+  p "extern \"C\" value %s(value path_, value batch_sz_, value include_, value cb_)"
+    func_name ;
+  p "{" ;
+  p "  CAMLparam4(path_, batch_sz_, include_, cb_);" ;
+  p "  CAMLlocal2(res, view_);" ;
+  (* With a last unused item to never emit an empty array: *)
+  p "  static bool const nullable_cols[] = { %a };"
+    (Array.print ~first:"" ~last:"" ~sep:", " (fun oc b ->
+      String.print oc (if b then "true" else "false")))
+      (Array.append nullable_cols [| false |]) ;
+  p "  size_t const num_cols = %d;" (Array.length nullable_cols) ;
+  p "  char const *path = String_val(path_);" ;
+  p "  unsigned batch_sz = Long_val(batch_sz_);" ;
+  p "  size_t const num_incl = Wosize_val(include_);" ;
+  p "  if (num_incl != 0 && num_incl != num_cols)" ;
+  p "    caml_invalid_argument(\"%s: include must be empty or have one entry per column\");"
+    func_name ;
+  p "  vector<bool> incl(num_cols, true);" ;
+  p "  for (size_t c = 0; c < num_incl; c++)" ;
+  p "    incl[c] = Bool_val(Field(include_, c)) || ! nullable_cols[c];" ;
+  p "  unique_ptr<InputStream> in_file = readLocalFile(path);" ;
+  p "  ReaderOptions options;" ;
+  p "  unique_ptr<Reader> reader = createReader(move(in_file), options);" ;
+  p "  RowReaderOptions row_options;" ;
+  p "  if (num_incl > 0) {" ;
+  p "    list<uint64_t> cols;" ;
+  p "    for (size_t c = 0; c < num_cols; c++)" ;
+  p "      if (incl[c]) cols.push_back(c);" ;
+  p "    row_options.include(cols);" ;
+  p "  }" ;
+  p "  unique_ptr<RowReader> row_reader =" ;
+  p "    reader->createRowReader(row_options);" ;
+  p "  unique_ptr<ColumnVectorBatch> batch =" ;
+  p "    row_reader->createRowBatch(batch_sz);" ;
+  p "  /* The batch has only the selected fields, so build a view with all" ;
+  p "   * the fields, skipped ones being always null: */" ;
+  p "  vector<unique_ptr<ColumnVectorBatch>> nulls;" ;
+  p "  StructVectorBatch full(0, *getDefaultPool());" ;
+  p "  ColumnVectorBatch *rows_batch = batch.get();" ;
+  p "  if (num_incl > 0) {" ;
+  p "    StructVectorBatch *selected = dynamic_cast<StructVectorBatch *>(batch.get());" ;
+  p "    assert(selected);" ;
+  p "    size_t s = 0;" ;
+  p "    for (size_t c = 0; c < num_cols; c++) {" ;
+  p "      if (incl[c]) {" ;
+  p "        full.fields.push_back(selected->fields[s++]);" ;
+  p "      } else {" ;
+  p "        nulls.push_back(" ;
+  p "          reader->getType().getSubtype(c)->createRowBatch(batch_sz, *getDefaultPool()));" ;
+  p "        ColumnVectorBatch *n = nulls.back().get();" ;
+  p "        n->hasNulls = true;" ;
+  p "        memset(n->notNull.data(), 0, n->notNull.size());" ;
+  p "        full.fields.push_back(n);" ;
+  p "      }" ;
+  p "    }" ;
+  p "    rows_batch = &full;" ;
+  p "  }" ;
+  p "  view_ = caml_alloc_custom(&%s_view_ops, sizeof(ColumnVectorBatch *), 0, 1);"
+    func_name ;
+  p "  %s_view_val(view_) = rows_batch;" func_name ;
+  p "  unsigned num_lines = 0;" ;
+  p "  unsigned num_errors = 0;" ;
+  p "  while (row_reader->next(*batch)) {" ;
+  p "    if (batch->numElements == 0) continue;" ;
+  p "    // The view has the same number of rows as the batch:" ;
+  p "    rows_batch->numElements = batch->numElements;" ;
+  p "    num_lines += batch->numElements;" ;
+  p "    res = caml_callback2_exn(cb_, view_, Val_long(batch->numElements));" ;
+  p "    if (Is_exception_result(res)) {" ;
+  p "      res = Extract_exception(res);" ;
+  p "      if (num_errors++ < 10) {" ;
+  p "        cerr << \"Exception while reading ORC file \" << path" ;
+  p "             << \": to_be_printed\\n\";" ;
+  p "      }" ;
+  p "    }" ;
+  p "  }" ;
+  p "  // The view must not outlive the batch:" ;
+  p "  %s_view_val(view_) = NULL;" func_name ;
+  p "  // Fields of the view are owned by the batch or by nulls:" ;
+  p "  full.fields.clear();" ;
+  p "  // Return the number of lines and errors:" ;
+  p "  res = caml_alloc(2, 0);" ;
+  p "  Store_field(res, 0, Val_long(num_lines));" ;
+  p "  Store_field(res, 1, Val_long(num_errors));" ;
+  p "  CAMLreturn(res);" ;
+  p "}"
+
 let emit_intro oc =
   let p fmt = emit oc 0 fmt in
   p "/* This code is automatically generated. Edition is futile. */" ;
   p "#include <cassert>" ;
+  p "#include <cstring>" ;
+  p "#include <list>" ;
+  p "#include <vector>" ;
   p "#include <orc/OrcFile.hh>" ;
   p "extern \"C\" {" ;
   p "#  include <limits.h> /* CHAR_BIT */" ;
@@ -768,6 +927,7 @@ let emit_intro oc =
   p "#  include <caml/alloc.h>" ;
   p "#  include <caml/custom.h>" ;
   p "#  include <caml/callback.h>" ;
+  p "#  include <caml/fail.h>" ;
   p "extern struct custom_operations uint128_ops;" ;
   p "extern struct custom_operations uint64_ops;" ;
   p "extern struct custom_operations uint32_ops;" ;
@@ -780,18 +940,32 @@ let emit_intro oc =
   p "using namespace std;" ;
   p "using namespace orc;" ;
   p "" ;
+  p "class StringArena;" ;
+  p "class AsyncWriter;" ;
+  p "" ;
+  p "struct OrcOptions {" ;
+  p "  CompressionKind compression;" ;
+  p "  uint64_t compression_block_size;" ;
+  p "  uint64_t stripe_size;" ;
+  p "  double dictionary_threshold;" ;
+  p "};" ;
+  p "" ;
   p "class OrcHandler {" ;
   p "    unique_ptr<Type> type;" ;
   p "    string fname;" ;
   p "    bool const with_index;" ;
+  p "    OrcOptions const options;" ;
   p "    unsigned const batch_size;" ;
   p "    unsigned const max_batches;" ;
   p "    unsigned num_batches;" ;
   p "    bool archive;" ;
-  p "    std::vector<char> strs;" ;
+  p "    unique_ptr<StringArena> strs;" ;
+  p "    bool const async;" ;
+  p "    unique_ptr<AsyncWriter> async_writer;" ;
   p "  public:" ;
-  p "    OrcHandler(string schema, string fn, bool with_index, unsigned bsz, unsigned mb, bool arc);" ;
+  p "    OrcHandler(string schema, string fn, bool with_index, OrcOptions const &, unsigned bsz, unsigned mb, bool arc, bool async);" ;
   p "    ~OrcHandler();" ;
+  p "    void close();" ;
   p "    void start_write();" ;
   p "    void flush_batch(bool);" ;
   p "    char *keep_string(char const *, size_t);" ;
@@ -799,6 +973,7 @@ let emit_intro oc =
   p "    unique_ptr<Writer> writer;" ;
   p "    unique_ptr<ColumnVectorBatch> batch;" ;
   p "    double start, stop;" ;
+  p "    void get_stats(unsigned &, uint64_t &, double &, double &);" ;
   p "};" ;
   p "" ;
   p "#define Handler_val(v) (*((class OrcHandler **)Data_custom_val(v)))" ;
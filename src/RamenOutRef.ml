@@ -283,3 +283,18 @@ let check_spec_change rcpt old new_ =
       RamenFieldMask.print old.fieldmask
       RamenFieldMask.print new_.fieldmask |>
     failwith
+
+(* With the SharedInputRingbufs experiment, a whole worker which only parent
+ * runs on the same site reads from a broadcast ringbuf shared with all the
+ * siblings receiving the same tuples (see
+ * [RamenPaths.shared_in_ringbuf_name]) instead of from its own input
+ * ringbuf.
+ * Workers with remote parents never share, as tunneld writes directly into
+ * their input ringbuf. Returns the reference to that only parent. *)
+let shared_input_parent site worker =
+  if RamenExperiments.shared_input_ringbufs.variant <= 0 then None else
+  match worker.Value.Worker.role, worker.parents with
+  | Whole, Some [| pref |] when pref.Func_ref.DessserGen.site = site ->
+      Some pref
+  | _ ->
+      None
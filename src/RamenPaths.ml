@@ -27,6 +27,26 @@ let in_ringbuf_name persist_dir pname func =
 
 let type_signature_hash = N.md5 % DT.mn_to_string
 
+(* Children reading the very same tuples from a parent (same parent output
+ * type, same fieldmask and same filters) can share a single broadcast
+ * ring-buffer fed only once by that parent. That file belongs to the
+ * parent rather than to any child: *)
+let shared_in_ringbuf_name persist_dir pname pfunc fieldmask filters =
+  let sign =
+    O.out_record_of_operation ~with_priv:false pfunc.VSI.operation |>
+    type_signature_hash
+  and recipient =
+    RamenFieldMask.to_string fieldmask ^"_"^
+    IO.to_string RamenSync.Value.OutputSpecs.print_filters filters |>
+    N.md5 in
+  N.path_cat
+    [ persist_dir ; N.path "workers/ringbufs" ;
+      N.path RamenVersions.ringbuf ; VSI.fq_path pname pfunc ;
+      N.path sign ; N.path ("shared_"^ recipient ^".r") ]
+
+let is_shared_in_ringbuf (fname : N.path) =
+  String.starts_with (Files.basename fname :> string) "shared_"
+
 (* Operations can also be asked to output their full result (all the public
  * fields) in a non-wrapping file for later retrieval by the tail or
  * timeseries commands.
@@ -68,6 +88,16 @@ let factors_of_function persist_dir pname func =
       (* extension for the GC. *)
       N.path (sign ^".factors") ]
 
+(* Where to store the pre-aggregated time series of a function (see
+ * RamenTimeseries). [query_id] identifies the fields, factors and filter of
+ * the time series. *)
+let rollups_of_function persist_dir pname func query_id =
+  N.path_cat
+    [ persist_dir ; N.path "workers/rollups" ;
+      N.path RamenVersions.rollups ; N.path Config.version ;
+      VSI.fq_path pname func ; N.path func.VSI.signature ;
+      N.path query_id ]
+
 let precompserver_cache_file persist_dir src_path ext =
   N.path_cat [ persist_dir ; N.path "precompserver/cache" ;
                N.path Versions.codegen ;
@@ -107,6 +137,10 @@ let default_srv_priv_key_file persist_dir =
 let globals_dir persist_dir =
   N.path_cat [ persist_dir ; N.path "supervisor/globals.lmdb" ]
 
+(* Location of the IP-to-country index that replaces the compiled in one: *)
+let country_index persist_dir =
+  N.path_cat [ persist_dir ; N.path "geoip/country_index" ]
+
 let bin_of_program_name lib_path program_name =
   (* Use an extension so we can still use the plain program_name for a
    * directory holding subprograms. Not using "exe" as it remind me of
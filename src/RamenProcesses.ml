@@ -157,8 +157,11 @@ let start_archive ~while_ ?(file_type=OWD.RingBuf)
   !logger.debug "start archiving into %a for %a..."
     N.path_print bname
     print_as_duration duration ;
-  if file_type = OWD.RingBuf then
-    RingBuf.create ~wrap:false bname ;
+  if file_type = OWD.RingBuf then (
+    let mmap_flags =
+      if RamenExperiments.ringbuf_mmap_options.variant <= 0 then []
+      else RingBuf.[ Prefault ; Sequential ; Precreate ] in
+    RingBuf.create ~wrap:false ~mmap_flags bname) ;
   (* Negative durations, yielding a timestamp of 0, means no timeout ;
    * while duration = 0 means to actually not export anything (and we have
    * a cli-test that relies on the spec not being present in the out_ref
@@ -238,6 +241,14 @@ let of_bin =
     VSI.{ p with
       default_params = RamenTuple.overwrite_params p.default_params params }
 
+(* Add the experiment variants to the given environment: *)
+let env_of_exps env =
+  RamenExperiments.all_experiments () |>
+  List.fold_left (fun env (name, exp) ->
+    (exp_envvar_prefix ^ name ^"="^
+      exp.RamenExperiments.variants.(exp.variant).name) :: env
+  ) env
+
 (* The [site] is not taken from [conf] because choreographer might want
  * to pretend running a worker in another site: *)
 let env_of_params_and_exps site params envvars =
@@ -251,12 +262,7 @@ let env_of_params_and_exps site params envvars =
         RamenTypes.print v) |>
     List.of_enum in
   (* Then the experiment variants: *)
-  let env =
-    RamenExperiments.all_experiments () |>
-    List.fold_left (fun env (name, exp) ->
-      (exp_envvar_prefix ^ name ^"="^
-        exp.RamenExperiments.variants.(exp.variant).name) :: env
-    ) env in
+  let env = env_of_exps env in
   (* Then the used envvars: *)
   let env =
     List.fold_left (fun env -> function
@@ -444,19 +444,26 @@ let setup_links conf ~while_ session func_of_fq t =
   let num_sources = Int16.of_int (Array.length t.VR.sources) in
   let now = Unix.gettimeofday () in
   (* Connect the target first, then the graph: *)
-  let connect_to prog_name func out_ref_k fieldmask =
+  let connect_to ?filters prog_name func out_ref_k fieldmask =
     let fq = VSI.fq_name prog_name func in
     OutRef.add ~now ~while_ session conf.C.site fq out_ref_k
                ~timeout_date:t.timeout_date ~num_sources
-               ~channel:t.channel fieldmask
+               ~channel:t.channel ?filters fieldmask
   in
-  let connect_to_rb prog_name func fname fieldmask =
+  let connect_to_rb ?filters prog_name func fname fieldmask =
     let out_ref_k = OWD.DirectFile fname in
-    connect_to prog_name func out_ref_k fieldmask
+    connect_to ?filters prog_name func out_ref_k fieldmask
   and connect_to_sync_key prog_name func sync_key fieldmask =
     let out_ref_k = OWD.SyncKey sync_key in
     connect_to prog_name func out_ref_k fieldmask
   in
+  let shares_input site fq =
+    let clt = option_get "setup_links" __LOC__ session.ZMQClient.clt in
+    let k = Key.PerSite (site, PerWorker (fq, Worker)) in
+    match (Client.find clt k).value with
+    | exception Not_found -> false
+    | Value.Worker worker -> OutRef.shared_input_parent site worker <> None
+    | _ -> false in
   let target_fq = N.fq_of_program t.target.program t.target.function_ in
   let target_fieldmask = RamenFieldMask.of_string t.target_fieldmask in
   let what = Printf.sprintf2 "Setting up links for channel %a"
@@ -487,11 +494,25 @@ let setup_links conf ~while_ session func_of_fq t =
       log_and_ignore_exceptions ~what (fun () ->
         let cprog_name, cfunc = func_of_fq cfq in
         let pprog_name, pfunc = func_of_fq pfq in
-        let fname = Paths.in_ringbuf_name conf.C.persist_dir cprog_name cfunc
-        and fieldmask =
+        let fieldmask =
           RamenFieldMaskLib.make_fieldmask pfunc.VSI.operation
                                            cfunc.VSI.operation in
-        connect_to_rb pprog_name pfunc fname fieldmask) ()
+        if shares_input to_.site cfq then
+          (* Then the siblings sharing that ringbuf will also receive the
+           * replayed tuples, and process them for nothing since none of
+           * their outputs accept that channel. The filters must be kept
+           * though: *)
+          let filters =
+            O.scalar_filters_of_operation pfunc.VSI.operation
+                                          cfunc.VSI.operation in
+          let fname =
+            Paths.shared_in_ringbuf_name conf.C.persist_dir pprog_name pfunc
+                                         fieldmask filters in
+          connect_to_rb ~filters pprog_name pfunc fname fieldmask
+        else
+          let fname =
+            Paths.in_ringbuf_name conf.C.persist_dir cprog_name cfunc in
+          connect_to_rb pprog_name pfunc fname fieldmask) ()
   ) t.links
 
 (*$>*)
@@ -341,19 +341,27 @@ let rec fold_seq_range ?while_ ?wait_for_more ?(mi=0) ?ma bname init f =
          * have been archived already. *)
         fold_seq_range ?while_ ?wait_for_more ~mi:next_seq ?ma bname usr f)))
 
-let fold_buffer ?wait_for_more ?while_ bname init f =
+(* With [time_range], only the parts of the file that may have tuples in
+ * that time range are read (and [wait_for_more] is ignored): *)
+let fold_buffer ?wait_for_more ?while_ ?time_range bname init f =
   match load bname with
   | exception Failure msg ->
       !logger.debug "Cannot fold_buffer: %s" msg ;
       (* Therefore there is nothing to fold: *)
       init
   | rb ->
+      let read_buf =
+        match time_range with
+        | None ->
+            read_buf ?wait_for_more ?while_ rb
+        | Some (since, until) ->
+            read_buf_ranges ?while_ rb (index_ranges rb since until) in
       finally
         (fun () -> unload rb)
-        (read_buf ?wait_for_more ?while_ rb init) f
+        (read_buf init) f
 
 (* Like fold_buffer but call f with the message rather than the tx: *)
-let fold_buffer_tuple ?while_ ?(early_stop=true) bname mn init f =
+let fold_buffer_tuple ?while_ ?(early_stop=true) ?time_range bname mn init f =
   !logger.debug "Going to fold over %a" N.path_print bname ;
   let unserialize = read_array_of_values mn in
   let f usr tx =
@@ -366,7 +374,7 @@ let fold_buffer_tuple ?while_ ?(early_stop=true) bname mn init f =
         if early_stop then res
         else (usr, true)
   in
-  fold_buffer ~wait_for_more:false ?while_ bname init f
+  fold_buffer ~wait_for_more:false ?while_ ?time_range bname init f
 
 let event_time_of_tuple out_type params
       ((start_field, start_field_src, start_scale), duration_info) =
@@ -414,7 +422,7 @@ let event_time_of_tuple out_type params
  * wait for data and must return as soon as we've reached the end of what's
  * available. *)
 let fold_buffer_with_time ?(channel_id=RamenChannel.live)
-                          ?while_ ?early_stop
+                          ?while_ ?early_stop ?time_range
                           bname mn params event_time init f =
   !logger.debug "Folding over %a" N.path_print bname ;
   let event_time_of_tuple =
@@ -431,7 +439,7 @@ let fold_buffer_with_time ?(channel_id=RamenChannel.live)
     | _ ->
         usr, true
   in
-  fold_buffer_tuple ?early_stop ?while_ bname mn init f
+  fold_buffer_tuple ?early_stop ?while_ ?time_range bname mn init f
 
 let time_range ?while_ bname typ params event_time =
   let dir = arc_dir_of_bname bname in
@@ -449,6 +457,7 @@ let time_range ?while_ bname typ params event_time =
     max_range mi_ma t1 t2, true)
 
 let fold_time_range ?(while_=always) bname typ params event_time since until init f =
+  let time_range = since, until in
   let dir = arc_dir_of_bname bname in
   let entries =
     RingBufLib.arc_files_of dir //
@@ -460,14 +469,15 @@ let fold_time_range ?(while_=always) bname typ params event_time since until ini
       match Enum.get_exn entries with
       | exception Enum.No_more_elements -> usr
       | _s1, _s2, _t1, _t2, arc_typ, fname ->
-          if arc_typ = RingBufLib.RingBuf then
-            fold_buffer_with_time ~while_ ~early_stop:false
-                                  fname typ params event_time usr f ;
-          loop ()
+          let usr =
+            if arc_typ = RingBufLib.RingBuf then
+              fold_buffer_with_time ~while_ ~early_stop:false ~time_range
+                                    fname typ params event_time usr f
+            else usr in
+          loop usr
     else usr
   in
   let usr = loop init in
-  (* finish with the current rb: *)
-  (* FIXME: shouldn't we check the min/max event time of this file against
-   * since/until as we did for others? *)
-  fold_buffer_with_time ~while_ bname typ params event_time usr f
+  (* finish with the current rb, which index also tells if there is anything
+   * in the time range: *)
+  fold_buffer_with_time ~while_ ~time_range bname typ params event_time usr f
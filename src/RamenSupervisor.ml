@@ -98,6 +98,11 @@ let stats_chans_per_replayer =
  * memory range allocated. Supervisor must thus ensure all ringbuffers are
  * valid before assigning any pre-existing one to any worker (in or out). *)
 
+(* See the RingbufMmapOptions experiment: *)
+let in_ringbuf_mmap_flags () =
+  if RamenExperiments.ringbuf_mmap_options.variant <= 0 then []
+  else RingBuf.[ Prefault ; Hugepages ]
+
 let checked_ringbuffers = ref N.SetOfPaths.empty
 
 let check_ringbuffer ?rb conf fname =
@@ -212,6 +217,24 @@ let fq_should_run conf session fq =
   | exception Not_found -> false
   | worker -> worker_should_run conf worker
 
+(* Tells if some other process than [pid] still consumes from that input
+ * ringbuf, which can only happen for shared ones: *)
+let has_other_consumers input_ringbuf pid =
+  Paths.is_shared_in_ringbuf input_ringbuf &&
+  match RingBuf.load input_ringbuf with
+  | exception e ->
+      !logger.debug "Cannot load %a: %s"
+        N.path_print input_ringbuf (Printexc.to_string e) ;
+      false
+  | rb ->
+      finally
+        (fun () -> RingBuf.unload rb)
+        (fun () ->
+          ignore (RingBuf.reap_consumers rb) ;
+          Array.exists (fun c ->
+            c.RingBuf.consumer_pid <> pid
+          ) (RingBuf.stats rb).consumers) ()
+
 (* When a worker seems to crashloop, assume it's because of a bad file and
  * delete them! *)
 let rescue_worker conf session site fq state_file input_ringbuf_opt =
@@ -221,8 +244,13 @@ let rescue_worker conf session site fq state_file input_ringbuf_opt =
                 input ringbuffers, binary and out_ref config entry."
     N.fq_print fq ;
   Files.move_aside state_file ;
-  (* At this stage there should be no writers since this worker is stopped. *)
-  Option.may Files.move_aside input_ringbuf_opt ;
+  (* At this stage there should be no writers since this worker is stopped.
+   * Shared input ringbufs are left alone as long as siblings read them
+   * though: *)
+  Option.may (fun input_ringbuf ->
+    if not (has_other_consumers input_ringbuf 0) then
+      Files.move_aside input_ringbuf
+  ) input_ringbuf_opt ;
   (* Delete the binary (which may also impact sibling workers): *)
   (match find_worker session conf.C.site fq with
   | exception Not_found ->
@@ -243,6 +271,10 @@ let rescue_worker conf session site fq state_file input_ringbuf_opt =
  * that the actual worker could monitor to stop emission on deletion. *)
 let cut_from_parents_outrefs ~while_ session input_ringbuf pid site =
   let clt = option_get "cut_from_parents_outrefs" __LOC__ session.ZMQClient.clt in
+  if has_other_consumers input_ringbuf pid then
+    !logger.debug "Keeping shared %a in parents outrefs for the siblings"
+      N.path_print input_ringbuf
+  else
   let now = Unix.gettimeofday () in
   let prefix = "sites/"^ (site : N.site :> string) ^"/workers/" in
   Client.iter ~prefix clt (fun k _hv ->
@@ -283,9 +315,14 @@ let start_worker
   let fq = VSI.fq_name prog_name func in
   let fq_str = (fq :> string) in
   let globals_dir = Paths.globals_dir conf.C.persist_dir in
+  let shared = Option.map_default Paths.is_shared_in_ringbuf false
+                                 input_ringbuf in
   Option.may (fun input_ringbuf ->
     !logger.debug "Creating in buffers..." ;
-    RingBuf.create input_ringbuf ;
+    let consumers =
+      if shared then Default.ringbuffer_max_consumers else 0 in
+    let mmap_flags = in_ringbuf_mmap_flags () in
+    RingBuf.create ~consumers ~mmap_flags input_ringbuf ;
     let rb = RingBuf.load input_ringbuf in
     finally
       (fun () -> RingBuf.unload rb)
@@ -299,19 +336,29 @@ let start_worker
        * not running yet). When a lazy function starts it will add itself to
        * its parent outref (see the end of this very function). *)
       let cfq = N.fq_of_program pname cfunc.VSI.name in
-      if fq_should_run conf session cfq then (
-        let fname = Paths.in_ringbuf_name conf.C.persist_dir pname cfunc
-        and fieldmask = RamenFieldMaskLib.make_fieldmask func.VSI.operation
-                                                         cfunc.VSI.operation
-        and filters = O.scalar_filters_of_operation func.VSI.operation
-                                                    cfunc.VSI.operation
-        and now = Unix.gettimeofday () in
-        (* The destination ringbuffer must exist before it's referenced in an
-         * out-ref, or the worker might err and throw away the tuples: *)
-        RingBuf.create fname ;
-        check_ringbuffer conf fname ;
-        OutRef.(add ~now ~while_ session conf.C.site fq (DirectFile fname)
-                    ~filters fieldmask))
+      match find_worker session conf.C.site cfq with
+      | exception Not_found -> ()
+      | cworker when worker_should_run conf cworker ->
+          let fieldmask = RamenFieldMaskLib.make_fieldmask func.VSI.operation
+                                                           cfunc.VSI.operation
+          and filters = O.scalar_filters_of_operation func.VSI.operation
+                                                      cfunc.VSI.operation
+          and now = Unix.gettimeofday () in
+          let fname, consumers =
+            if OutRef.shared_input_parent conf.C.site cworker <> None then
+              Paths.shared_in_ringbuf_name conf.C.persist_dir prog_name func
+                                           fieldmask filters,
+              Default.ringbuffer_max_consumers
+            else
+              Paths.in_ringbuf_name conf.C.persist_dir pname cfunc, 0 in
+          (* The destination ringbuffer must exist before it's referenced in an
+           * out-ref, or the worker might err and throw away the tuples: *)
+          let mmap_flags = in_ringbuf_mmap_flags () in
+          RingBuf.create ~consumers ~mmap_flags fname ;
+          check_ringbuffer conf fname ;
+          OutRef.(add ~now ~while_ session conf.C.site fq (DirectFile fname)
+                      ~filters fieldmask)
+      | _ -> ()
     ) children ;
     (* Start exporting until told otherwise (helps with both automatic and
      * manual tests): *)
@@ -338,6 +385,7 @@ let start_worker
     "rand_seed="^ (match !rand_seed with None -> ""
                   | Some s -> string_of_int s) ;
     "site="^ (conf.C.site :> string) ;
+    "country_index="^ (Paths.country_index conf.C.persist_dir :> string) ;
     (match !logger.output with
       | Directory _ ->
         let dir = N.path_cat [ conf.C.persist_dir ; N.path "log/workers" ;
@@ -392,6 +440,13 @@ let start_worker
                        else Worker_argv0.top_half ;
        fq_str |] in
   let cwd = if N.is_empty cwd then None else Some cwd in
+  (* TODO: Every function runs in its own process, with its own runtime, GC
+   * heap, confserver session and mappings of every ringbuf. Hosting several
+   * functions of a program in one process requires the worker library to
+   * keep its state (configuration, stats, publisher, quit flag) in a
+   * per-function context first, and the input loops to process one batch
+   * per call so that a scheduler can go round-robin over the functions'
+   * input ringbufs. *)
   let pid =
     Processes.run_worker ?cwd ~and_stop:conf.C.test bin args env |>
     Uint32.of_int in
@@ -402,6 +457,8 @@ let start_worker
   Option.may (fun input_ringbuf ->
     (* input_ringbuf has been checked already right abovve *)
     let now = Unix.gettimeofday () in
+    (* A shared input ringbuf is not owned by any of the siblings: *)
+    let pid = if shared then Uint32.zero else pid in
     Array.iter (fun (pfq, fieldmask, filters) ->
       OutRef.(add ~while_ ~now session conf.C.site pfq (DirectFile input_ringbuf)
                   ~pid ~filters fieldmask)
@@ -459,7 +516,9 @@ let start_replayer conf fq func bin since until channels replayer_id =
                     | Some s -> string_of_int s) ] in
   let env =
     let name = "replayer"^ Uint32.to_string replayer_id in
-    add_sync_env conf name fq env |>
+    (* Experiments such as ParallelReplay are also relevant to replayers: *)
+    RamenProcesses.env_of_exps env |>
+    add_sync_env conf name fq |>
     Array.of_list in
   let pid = RamenProcesses.run_worker bin args env in
   !logger.debug "Replay for %a is running under pid %d"
@@ -699,6 +758,19 @@ let is_quarantined clt site fq worker_sign =
   | v ->
       invalid_sync_type k v "a float"
 
+let input_ringbuf_still_valid session site fq worker_sign worker =
+  let clt = option_get "input_ringbuf_still_valid" __LOC__ session.ZMQClient.clt in
+  let k = per_instance_key site fq worker_sign InputRingFile in
+  match (Client.find clt k).value with
+  | exception Not_found ->
+      (* Either not set yet or that worker has no parents *)
+      true
+  | Value.RamenValue (VString s) ->
+      Paths.is_shared_in_ringbuf (N.path s) =
+        (OutRef.shared_input_parent site worker <> None)
+  | _ ->
+      true
+
 (* This worker is running. Should it?
  * Note: running conditions are not supposed to change once a program has
  * started, as testing them all at every iterations would be expensive. *)
@@ -717,6 +789,14 @@ let should_run conf session site fq worker_sign =
         !logger.debug "Instance %s is obsolete and should not run"
           worker.worker_signature ;
         false
+      (* Has it started reading from a shared ringbuf it should no longer
+       * read from, or the other way around (as parents are not part of the
+       * signature)? *)
+      ) else if not (input_ringbuf_still_valid session site fq worker_sign
+                                               worker) then (
+        !logger.debug "Instance %s must change its input ringbuf"
+          worker_sign ;
+        false
       ) else
         true
 
@@ -833,18 +913,25 @@ let try_start_instance conf session ~while_ site fq worker =
    * Therefore it's much simpler to store those paths in the config tree. *)
   (* FIXME: that it has no parent yet does not mean it selects from nobody!
    * yet Skeletons assumes that! *)
-  let input_ringbuf =
-    if worker.parents = None then None
-    else Some (Paths.in_ringbuf_name conf.C.persist_dir prog_name func)
-  and state_file =
-    Paths.state_file_path conf.C.persist_dir src_path worker.worker_signature
-  and parent_links =
+  let parent_links =
     Array.map (fun pref ->
       let _pname, pfunc = func_of_ref pref in
       Value.Worker.fq_of_ref pref,
       RamenFieldMaskLib.make_fieldmask pfunc.VSI.operation func.VSI.operation,
       O.scalar_filters_of_operation pfunc.VSI.operation func.VSI.operation
     ) (worker.parents |? [||]) in
+  let input_ringbuf =
+    if worker.parents = None then None else
+    match OutRef.shared_input_parent site worker with
+    | Some pref ->
+        let pname, pfunc = func_of_ref pref
+        and _pfq, fieldmask, filters = parent_links.(0) in
+        Some (Paths.shared_in_ringbuf_name conf.C.persist_dir pname pfunc
+                                           fieldmask filters)
+    | None ->
+        Some (Paths.in_ringbuf_name conf.C.persist_dir prog_name func)
+  and state_file =
+    Paths.state_file_path conf.C.persist_dir src_path worker.worker_signature in
   let pid =
     start_worker
       conf ~while_ session prog_name func worker.params envvars worker.role
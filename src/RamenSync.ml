@@ -436,6 +436,7 @@ end
 (* For now we just use globs on the key names: *)
 module Selector =
 struct
+  (*$< Selector *)
   module Key = Key
   type t = Globs.t
   let print = Globs.print
@@ -447,6 +448,29 @@ struct
   type prepared_key = string
   let prepare_key = Key.to_string
   let matches = Globs.matches ~case_sensitive:true
+
+  (* Clients can ask for a throttled view of (high churn) keys by appending
+   * to the selector id "@" followed by the minimum duration in seconds
+   * between two messages, for instance "tails/*/*/*/lasts/*@2".
+   * Returns the id without the throttling, and the duration (0 if none): *)
+  let split_throttle id =
+    match String.rsplit id ~by:"@" with
+    | exception Not_found -> id, 0.
+    | glob, d ->
+        (match float_of_string d with
+        | exception Failure _ -> id, 0.
+        | d -> glob, d)
+
+  let with_throttle id d =
+    if d > 0. then id ^"@"^ nice_string_of_float d else id
+
+  (*$= split_throttle & ~printer:Batteries.dump
+    ("tails/*/lasts/*", 2.) (split_throttle "tails/*/lasts/*@2")
+    ("tails/*/lasts/*", 0.) (split_throttle "tails/*/lasts/*")
+    ("foo@bar", 0.) (split_throttle "foo@bar")
+    ("foo", 0.5) (split_throttle (with_throttle "foo" 0.5))
+  *)
+  (*$>*)
 end
 
 (* Unfortunately there is no association between the key and the type for
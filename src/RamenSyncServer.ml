@@ -241,13 +241,15 @@ struct
         prev.set_by <- u ;
         prev.mtime <- Unix.gettimeofday () ;
         let uid = IO.to_string User.print_id (User.id u) in
-        let msg _ =
+        (* The very same message is sent to all subscribers, so that it can
+         * be serialized only once: *)
+        let msg =
           SrvMsg.SetKey { setKey_k = k ; setKey_v = v ;
                           setKey_uid = uid ; setKey_mtime = prev.mtime } in
         let is_permitted user =
           User.has_any_role prev.can_read user &&
           (echo || not (User.equal user u)) in
-        notify t k prev.prepared_key is_permitted msg
+        notify t k prev.prepared_key is_permitted (fun _ -> msg)
 
   let set t u k v ~echo = (* TODO: H.find and pass prev item to update *)
     if H.mem t.h k then
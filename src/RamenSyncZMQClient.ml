@@ -474,9 +474,16 @@ let process_until ~while_ session =
 
 let init_sync ?(while_=always) session topics =
   let clt = option_get "init_sync" __LOC__ session.clt in
-  let globs = List.map Globs.compile topics in
+  (* Topics may ask for a throttled view (see [Selector.split_throttle]): *)
+  let globs =
+    List.map (fun topic ->
+      let topic, throttle = Selector.split_throttle topic in
+      Globs.compile topic, throttle
+    ) topics in
   let add_glob_for_key ?(is_dir=false) key globs =
-    if List.exists (fun glob -> Globs.matches glob key) globs then (
+    (* Throttled views must not be relied upon for those: *)
+    if List.exists (fun (glob, throttle) ->
+         throttle = 0. && Globs.matches glob key) globs then (
       !logger.debug "subscribed topics already cover key %a, \
                      not subscribing separately"
         String.print_quoted key ;
@@ -486,7 +493,7 @@ let init_sync ?(while_=always) session topics =
       let g =
         if is_dir then Globs.concat g (Globs.compile "/*")
                   else g in
-      g :: globs in
+      (g, 0.) :: globs in
   (* Also subscribe to the error messages, unless it's covered already: *)
   (* Because we are authenticated: *)
   assert (clt.Client.my_socket <> None) ;
@@ -500,16 +507,16 @@ let init_sync ?(while_=always) session topics =
       match globs with
       | [] ->
           () (* Nothing to sync to -> nothing to wait for *)
-      | [ glob ] ->
+      | [ glob, throttle ] ->
           (* Last command: wait until it's acked *)
           let set_synced () =
             with_lock session.wait_synced_lock (fun () ->
               session.is_synced <- true ;
               Condition.broadcast session.is_synced_cond) in
-          let sel = Globs.decompile glob in
+          let sel = Selector.with_throttle (Globs.decompile glob) throttle in
           send_cmd session ~on_ok:set_synced (CltCmd.StartSync sel)
-      | glob :: rest ->
-          let sel = Globs.decompile glob in
+      | (glob, throttle) :: rest ->
+          let sel = Selector.with_throttle (Globs.decompile glob) throttle in
           send_cmd session (CltCmd.StartSync sel) ;
           loop rest in
   match loop globs with
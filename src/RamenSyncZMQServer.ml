@@ -405,6 +405,11 @@ let stats_key_count =
   IntGauge.make Metric.Names.sync_key_count
     "Current number of keys stored in the configuration tree."
 
+let stats_skipped_msgs =
+  IntCounter.make Metric.Names.sync_skipped_msgs
+    "Total number of messages that were superseded or throttled before \
+     being sent by the confserver."
+
 (* Stores, per worker, the last max_last_tuples sequence numbers, used to
  * delete the oldest one when new one is received.
  * Notice the instance identifier of that worker does not matter: if the
@@ -503,12 +508,50 @@ let is_ramen = function
   | User.Internal | User.Ramen _ -> true
   | User.Anonymous | User.Auth _ -> false
 
+(* Messages to a peer are not sent right away but queued until the end of the
+ * current iteration of the service loop, which gives the opportunity to
+ * coalesce successive updates of the same key (such as the runtime stats of
+ * the workers) and to throttle the views that clients asked to be throttled
+ * (such as tails). *)
+type pending =
+  { msg : SrvMsg.t ;
+    (* Serialized only once for all peers: *)
+    str : string Lazy.t ;
+    (* Not to be sent before that time: *)
+    not_before : float ;
+    (* For throttled messages, the name under which to remember when it has
+     * been sent last (or ""): *)
+    throttle_name : string ;
+    mutable cancelled : bool }
+
+type outbox =
+  { pendings : pending Queue.t ;
+    (* Last pending SetKey per key, to be superseded by the next one: *)
+    last_sets : (Key.t, pending) Hashtbl.t ;
+    (* Throttled selections and the minimum duration between two messages
+     * for any given key: *)
+    mutable throttles : (Globs.t * float) list ;
+    (* The last time a throttled message was sent, per key for updates and
+     * per parent for new keys: *)
+    last_sents : (string, float) Hashtbl.t ;
+    (* New keys that have been skipped (and so must be any other message
+     * about those keys): *)
+    skipped : (Key.t, unit) Hashtbl.t }
+
+let make_outbox () =
+  { pendings = Queue.create () ;
+    last_sets = Hashtbl.create 10 ;
+    throttles = [] ;
+    last_sents = Hashtbl.create 10 ;
+    skipped = Hashtbl.create 10 }
+
 type session =
   { socket : User.socket ;
     authn : Authn.session ;
     mutable timeout : float ;
     mutable user : User.t ;
-    mutable last_used : float }
+    mutable last_used : float ;
+    outbox : outbox }
 
 let srv_pub_key = ref ""
 let srv_priv_key = ref ""
@@ -518,18 +561,196 @@ let send peer bytes =
   IntCounter.add stats_sent_bytes (Bytes.length bytes) ;
   TcpSocket.send peer bytes
 
+let key_of_srv_msg = function
+  | SrvMsg.AuthOk _ | AuthErr _ -> None
+  | SetKey { setKey_k = k ; _ }
+  | NewKey { newKey_k = k ; _ }
+  | DelKey { delKey_k = k ; _ }
+  | LockKey { k ; _ }
+  | UnlockKey k -> Some k
+
+(* Returns the throttling duration for that key (0 if not throttled) and,
+ * if throttled, its name: *)
+let throttle_of_key outbox k =
+  if outbox.throttles = [] then 0., "" else
+  let k_str = Key.to_string k in
+  let d =
+    List.fold_left (fun d (glob, d') ->
+      if Globs.matches ~case_sensitive:true glob k_str then max d d' else d
+    ) 0. outbox.throttles in
+  d, if d > 0. then k_str else ""
+
+(* Queue [msg] for a peer logged in as [user]: *)
+let queue_in_outbox now outbox user msg str =
+  let add ?(not_before=0.) ?(throttle_name="") () =
+    let p = { msg ; str ; not_before ; throttle_name ; cancelled = false } in
+    Queue.add p outbox.pendings ;
+    p in
+  (* Cancel the previous pending SetKey for that key, returning the time it
+   * was supposed to be sent: *)
+  let supersede k =
+    match Hashtbl.find outbox.last_sets k with
+    | exception Not_found ->
+        0.
+    | p ->
+        IntCounter.inc stats_skipped_msgs ;
+        p.cancelled <- true ;
+        Hashtbl.remove outbox.last_sets k ;
+        p.not_before in
+  match key_of_srv_msg msg with
+  | None ->
+      ignore (add ())
+  | Some (Key.Error _) ->
+      (* Error keys carry the acknowledgment of every single command, which
+       * a peer might be waiting for. Successive ones are set by the same
+       * internal user and must each be delivered: *)
+      ignore (add ())
+  | Some k when Hashtbl.mem outbox.skipped k ->
+      IntCounter.inc stats_skipped_msgs ;
+      (match msg with
+      | DelKey _ -> Hashtbl.remove outbox.skipped k
+      | _ -> ())
+  | Some k ->
+      let throttle, throttle_name = throttle_of_key outbox k in
+      (match msg with
+      | SetKey { setKey_uid ; _ } ->
+          let not_before = supersede k in
+          let not_before =
+            if throttle > 0. then
+              max not_before
+                  (Hashtbl.find_default outbox.last_sents throttle_name 0. +.
+                   throttle)
+            else not_before in
+          let p = add ~not_before ~throttle_name () in
+          (* Never supersede the echo of the peer's own writes, that it might
+           * be waiting for: *)
+          if setKey_uid <> IO.to_string User.print_id (User.id user)
+          then Hashtbl.replace outbox.last_sets k p
+      | NewKey _ when throttle > 0. ->
+          (* Throttle the creation of keys per parent, since high churn keys
+           * such as tuples from tails are new keys every time: *)
+          let parent =
+            try fst (String.rsplit ~by:"/" throttle_name)
+            with Not_found -> throttle_name in
+          let last = Hashtbl.find_default outbox.last_sents parent 0. in
+          if now < last +. throttle then (
+            IntCounter.inc stats_skipped_msgs ;
+            Hashtbl.replace outbox.skipped k ()
+          ) else (
+            Hashtbl.replace outbox.last_sents parent now ;
+            ignore (add ()))
+      | DelKey _ ->
+          ignore (supersede k) ;
+          ignore (add ())
+      | _ ->
+          ignore (add ()))
+
+let queue_msg now peer msg str =
+  let session = peer.TcpSocket.session in
+  queue_in_outbox now session.outbox session.user msg str
+
+(* Pipelined commands get all their acknowledgments, even from a peer which
+ * throttles everything: *)
+(*$inject
+  let ack_msg socket seq =
+    let k = RamenSync.Key.Error (Some socket)
+    and v = RamenSync.Value.err_msg (Stdint.Uint32.of_int seq) "" in
+    SrvMsg.SetKey {
+      setKey_k = k ; setKey_v = v ; setKey_mtime = 0. ;
+      setKey_uid = BatIO.to_string User.print_id (User.id User.internal) }
+
+  let acks_of_outbox outbox =
+    Queue.fold (fun acks p ->
+      match p.msg with
+      | SrvMsg.SetKey { setKey_v = RamenSync.Value.Error (_, seq, _) ; _ }
+        when not p.cancelled ->
+          Stdint.Uint32.to_int seq :: acks
+      | _ ->
+          acks
+    ) [] outbox.pendings |>
+    List.rev
+*)
+(*$= queue_in_outbox & ~printer:(BatIO.to_string (BatList.print BatInt.print))
+  [ 1 ; 2 ] \
+    (let outbox = make_outbox () \
+     and socket = User.socket_of_string "127.0.0.1:29341" in \
+     let user = User.Anonymous in \
+     outbox.throttles <- [ Globs.compile "*", 10. ] ; \
+     List.iter (fun seq -> \
+       let msg = ack_msg socket seq in \
+       queue_in_outbox 0. outbox user msg (lazy (SrvMsg.to_string msg)) \
+     ) [ 1 ; 2 ] ; \
+     acks_of_outbox outbox)
+*)
+
 (* Called with an enum of destination peer * message *)
 let send_msg msg_sockets =
   (* FIXME: record peers with the keys directly *)
+  let now = Unix.gettimeofday () in
+  (* Messages sent to several peers are usually the very same value: *)
+  let last_msg = ref None in
   Enum.iter (fun (peer, msg) ->
-    !logger.debug "> %a: %a"
-      User.print peer.TcpSocket.session.user
-      SrvMsg.print msg ;
-    let msg = SrvMsg.to_string msg in
-    let msg = Authn.wrap peer.session.authn msg in
-    send peer (Bytes.unsafe_of_string msg) (* FIXME *)
+    let str =
+      match !last_msg with
+      | Some (m, str) when m == msg ->
+          str
+      | _ ->
+          let str = lazy (SrvMsg.to_string msg) in
+          last_msg := Some (msg, str) ;
+          str in
+    queue_msg now peer msg str
   ) msg_sockets
 
+(* Send all pending messages that are due: *)
+let flush_outbox now peer =
+  let session = peer.TcpSocket.session in
+  let outbox = session.outbox in
+  let deferred = Queue.create () in
+  while not (Queue.is_empty outbox.pendings) do
+    let p = Queue.take outbox.pendings in
+    if not p.cancelled then (
+      if p.not_before > now then Queue.add p deferred else (
+        (match p.msg with
+        | SetKey { setKey_k = k ; _ } ->
+            (match Hashtbl.find outbox.last_sets k with
+            | exception Not_found -> ()
+            | p' -> if p' == p then Hashtbl.remove outbox.last_sets k)
+        | _ -> ()) ;
+        if p.throttle_name <> "" then
+          Hashtbl.replace outbox.last_sents p.throttle_name now ;
+        !logger.debug "> %a: %a"
+          User.print session.user
+          SrvMsg.print p.msg ;
+        let msg = Authn.wrap session.authn (Lazy.force p.str) in
+        send peer (Bytes.unsafe_of_string msg) (* FIXME *)))
+  done ;
+  Queue.transfer deferred outbox.pendings
+
+(* Forget about throttled messages sent long ago: *)
+let purge_outbox now peer =
+  let outbox = peer.TcpSocket.session.outbox in
+  let max_throttle =
+    List.fold_left (fun m (_, d) -> max m d) 0. outbox.throttles in
+  Hashtbl.filter_inplace (fun t -> t >= now -. max_throttle) outbox.last_sents
+
+(* Register the throttling of a subscription and returns the command for the
+ * server, devoid of it: *)
+let register_throttle session = function
+  | CltCmd.StartSync id as cmd ->
+      (match Selector.split_throttle id with
+      | _, 0. ->
+          cmd
+      | id, d ->
+          !logger.debug "Throttling subscription %S for user %a to %a"
+            id
+            User.print session.user
+            print_as_duration d ;
+          let outbox = session.outbox in
+          outbox.throttles <- (Globs.compile id, d) :: outbox.throttles ;
+          CltCmd.StartSync id)
+  | cmd ->
+      cmd
+
 exception Ignore
 
 let validate_cmd =
@@ -678,13 +899,16 @@ let service_loop ~while_ conf srv services =
       let now = Unix.time () in
       if clean_rate () then (
         timeout_sessions srv now services ;
-        update_stats srv services) ;
+        update_stats srv services ;
+        fold_peers (fun () -> purge_outbox now) () services) ;
       if save_rate () then Snapshot.save conf srv ;
       (* Update current time: *)
       if now <> !last_time then (
         last_time := now ;
         let echo = false in
         Server.set srv User.internal Key.Time (Value.of_float now) ~echo) ;
+      let now = Unix.gettimeofday () in
+      fold_peers (fun () -> flush_outbox now) () services ;
       loop ()
     ) in
   loop () ;
@@ -816,7 +1040,8 @@ let start
       (* Will be set when the Auth is spotted: *)
       timeout = Default.sync_sessions_timeout ;
       user = User.Anonymous ;
-      last_used = Unix.time () } in
+      last_used = Unix.time () ;
+      outbox = make_outbox () } in
   let on_msg peer bytes =
     if Bytes.length bytes = 0 then (
       C.info_or_test conf "User %a disconnected"
@@ -856,6 +1081,8 @@ let start
               Server.set_user_err srv peer.session.user peer.session.socket
                                   msg.seq err
           | () ->
+              let msg =
+                CltMsg.{ msg with cmd = register_throttle peer.session msg.cmd } in
               peer.session.user <-
                 Server.process_msg srv peer peer.session.user
                                    peer.session.socket clt_pub_key msg ;
@@ -626,7 +626,7 @@ let run_test conf session ~while_ dirname test =
   !all_good
 
 let run conf server_url api graphite use_external_compiler max_simult_compils
-        smt_solver dessser_codegen opt_level test_file () =
+        smt_solver dessser_codegen native_codegen opt_level test_file () =
   (* Tweak the configuration specifically for running tests: *)
   RamenCliCheck.non_empty "test file name" (test_file : N.path :> string) ;
   let persist_dir =
@@ -644,7 +644,7 @@ let run conf server_url api graphite use_external_compiler max_simult_compils
   init_logger conf.C.log_level ;
   RamenSmt.solver := smt_solver ;
   RamenCompiler.init use_external_compiler max_simult_compils dessser_codegen
-                     opt_level ;
+                     native_codegen opt_level ;
   !logger.info "Using temp dir %a" N.path_print conf.persist_dir ;
   Files.mkdir_all conf.persist_dir ;
   RamenProcesses.prepare_signal_handlers conf ;
@@ -11,6 +11,7 @@ module VSI = RamenSync.Value.SourceInfo
 module O = RamenOperation
 module T = RamenTypes
 module N = RamenName
+module Default = RamenConstsDefault
 module Files = RamenFiles
 module Paths = RamenPaths
 
@@ -46,6 +47,63 @@ let bucket_of_time since dt t =
   int_of_float i,
   (t -. (i *. dt)) /. dt
 
+(* Pour the [num_data_fields] values of [tuple] that follow the [data_ofs]
+ * first ones into the buckets, for the time interval [t1..t2]: *)
+let pour_tuple buckets bucket_of_time data_ofs num_data_fields t1 t2 tuple =
+  let bi1, r1 = bucket_of_time t1 and bi2, r2 = bucket_of_time t2 in
+  !logger.debug "bi1=%d (r1=%f), bi2=%d (r2=%f)" bi1 r1 bi2 r2 ;
+  (* If bi2 ends up right on the boundary, speed things up by shortening
+   * the range: *)
+  let bi2, r2 =
+    if r2 = 0. && bi2 > bi1 then bi2 - 1, 1. else bi2, r2 in
+  (* Iter over all data_fields, that are the last components of tuple: *)
+  for i = 0 to num_data_fields - 1 do
+    (* We assume that the value is "intensive" rather than "extensive",
+     * and so contribute the same amount to each buckets of the interval,
+     * instead of distributing the value (TODO: extensive values) *)
+    let v = T.float_of_scalar tuple.(data_ofs + i) in
+    Option.may (fun v ->
+      let v, bi1, bi2, r =
+        if bi1 = bi2 then (
+          (* Special case: just soften v *)
+          let r = r2 -. r1 in
+          abs_float r *. v, bi1, bi2, r
+        ) else (
+          (* Values on the edge should contribute in proportion to overlap: *)
+          let v1 = v *. (1. -. r1) and v2 = v *. r2 in
+          if bi1 >= 0 && bi1 < Array.length buckets then
+            pour_into_bucket buckets bi1 i v1 (1. -. r1) ;
+          if bi2 >= 0 && bi2 < Array.length buckets then
+            pour_into_bucket buckets bi2 i v2 r2 ;
+          v, bi1 + 1, bi2 - 1, 1.
+        ) in
+      for bi = max bi1 0 to min bi2 (Array.length buckets - 1) do
+        pour_into_bucket buckets bi i v r
+      done
+    ) v
+  done
+
+(* Pour a bucket [b] covering [t1..t1+res] into the column [ci] of the
+ * buckets starting at [since] and [dt] apart, in proportion of their
+ * overlap (as if the data was evenly spread within [b]): *)
+let pour_bucket buckets since dt ci t1 res b =
+  if b.count > 0. then (
+    let t2 = t1 +. res in
+    let bi1, _ = bucket_of_time since dt t1
+    and bi2, _ = bucket_of_time since dt t2 in
+    for bi = max bi1 0 to min bi2 (Array.length buckets - 1) do
+      let start = since +. dt *. float_of_int bi in
+      let overlap = min t2 (start +. dt) -. max t1 start in
+      if overlap > 0. then (
+        (* Counts and sums are relative to the bucket duration: *)
+        let r = overlap /. dt in
+        let b' = buckets.(bi).(ci) in
+        b'.count <- b'.count +. b.count *. r ;
+        b'.sum <- b'.sum +. b.sum *. r ;
+        b'.min <- min b'.min b.min ;
+        b'.max <- max b'.max b.max)
+    done)
+
 let bucket_sum b =
   if b.count = 0. then None else Some b.sum
 let bucket_avg b =
@@ -57,6 +115,143 @@ let bucket_max b =
 let bucket_count b =
   Some b.count
 
+(*
+ * Rollups.
+ *
+ * Answering queries over long time ranges from the raw tuples is slow, and
+ * dashboards keep asking for the same time ranges again and again. So once
+ * a time range is well over (and hopefully archived), the time series
+ * computed for it at a few fixed resolutions (Default.timeseries_rollups)
+ * are saved on disk, per block of [rollup_block_len] buckets aligned on a
+ * multiple of the block duration.
+ * Queries with buckets large enough compared to one of those resolutions
+ * then read only the blocks that were not saved yet (that are then saved)
+ * and the raw tuples of the most recent end of their time range.
+ *)
+
+let rollup_block_len = 256
+
+(* Rollups may only be used for buckets that are that many times larger than
+ * their resolution, so that the approximation of [pour_bucket] on the edges
+ * of the buckets stay small: *)
+let rollup_min_ratio = 10.
+
+(* Returns the best resolution for buckets of duration [dt], or 0 if no
+ * rollup should be used: *)
+let rollup_resolution dt =
+  List.fold_left (fun best res ->
+    if dt >= res *. rollup_min_ratio && res > best then res else best
+  ) 0. Default.timeseries_rollups
+
+(* Rollups are saved per function, and per selected fields and filter: *)
+let rollups_dir conf prog_name func tuple_fields where =
+  let query_id =
+    Printf.sprintf2 "%a_%a"
+      (List.print N.field_print) tuple_fields
+      (List.print (fun oc (field, op, value) ->
+        Printf.fprintf oc "%a %s %a"
+          N.field_print field
+          op
+          T.print value)) where |>
+    N.md5 in
+  Paths.rollups_of_function conf.C.persist_dir prog_name func query_id
+
+let rollup_file dir res block_start =
+  N.path_cat [ dir ; N.path (nice_string_of_float res) ;
+               N.path (nice_string_of_float block_start) ]
+
+(* A block is, for each factor key, an array of [rollup_block_len] buckets per
+ * data field: *)
+type rollup_block = (T.value array * bucket array array) array
+
+let load_rollup fname : rollup_block option =
+  if not (Files.exists fname) then None else
+  match Files.marshal_from_file fname with
+  | exception e ->
+      !logger.warning "Cannot read rollup %a: %s, ignoring"
+        N.path_print fname
+        (Printexc.to_string e) ;
+      None
+  | block ->
+      (* For the GC: *)
+      (try Files.touch fname (Unix.time ()) with _ -> ()) ;
+      Some block
+
+let save_rollup fname (block : rollup_block) =
+  let tmp = N.cat fname (N.path (".tmp."^ string_of_int (Unix.getpid ()))) in
+  Files.marshal_into_file tmp block ;
+  Files.rename tmp fname
+
+(* Compute the blocks of resolution [res] from [b1] (incl.) to [b2] (excl.)
+ * out of the raw tuples and save them: *)
+let compute_rollups conf ~while_ session worker tuple_fields where
+                    num_factors num_data_fields dir res b1 b2 =
+  let block_dt = res *. float_of_int rollup_block_len in
+  let num_blocks = round_to_int ((b2 -. b1) /. block_dt) in
+  !logger.debug "Computing %d rollup blocks of resolution %a for %a"
+    num_blocks
+    print_as_duration res
+    N.worker_print worker ;
+  let per_factor_buckets = Hashtbl.create 11 in
+  let bucket_of_time = bucket_of_time b1 res in
+  let on_tuple t1 t2 tuple =
+    let k = Array.sub tuple 0 num_factors in
+    let buckets =
+      try Hashtbl.find per_factor_buckets k
+      with Not_found ->
+        let buckets =
+          make_buckets (num_blocks * rollup_block_len) num_data_fields in
+        Hashtbl.add per_factor_buckets k buckets ;
+        buckets in
+    pour_tuple buckets bucket_of_time num_factors num_data_fields t1 t2 tuple in
+  RamenExport.replay conf ~while_ session worker tuple_fields where b1 b2
+                     ~with_event_time:false (fun _ -> on_tuple, ignore) ;
+  (* Do not save incomplete results: *)
+  if while_ () then
+    Array.init num_blocks (fun bi ->
+      let block =
+        Hashtbl.enum per_factor_buckets /@
+        (fun (k, buckets) ->
+          k, Array.sub buckets (bi * rollup_block_len) rollup_block_len) |>
+        Array.of_enum in
+      let block_start = b1 +. block_dt *. float_of_int bi in
+      save_rollup (rollup_file dir res block_start) block ;
+      block_start, block) |>
+    Array.to_list
+  else []
+
+(* Call [f] with every block of resolution [res] covering [since] to [until]
+ * (computing and saving those that are missing) and returns the time until
+ * which blocks were available: *)
+let iter_rollups conf ~while_ session worker tuple_fields where
+                 num_factors num_data_fields dir res since until f =
+  let block_dt = res *. float_of_int rollup_block_len in
+  (* Only blocks that are over since long enough may be saved: *)
+  let sealed =
+    align_float block_dt (Unix.gettimeofday () -. Default.timeseries_rollups_delay) in
+  let compute b1 b2 =
+    if b1 < b2 then
+      compute_rollups conf ~while_ session worker tuple_fields where
+                      num_factors num_data_fields dir res b1 b2 |>
+      List.iter (fun (block_start, block) -> f block_start block) in
+  (* Read the saved blocks, and compute the missing ones by runs: *)
+  let rec loop missing_since b =
+    if b >= until || b >= sealed then (
+      compute missing_since b ;
+      min b until
+    ) else (
+      match load_rollup (rollup_file dir res b) with
+      | None ->
+          loop missing_since (b +. block_dt)
+      | Some block ->
+          compute missing_since b ;
+          f b block ;
+          let b' = b +. block_dt in
+          loop b' b'
+    ) in
+  let first = align_float block_dt since in
+  if first >= sealed then since else loop first first
+
 (* Enumerates all the time*values.
  * Returns the array of factor-column and the Enum.t of data.
  *
@@ -94,6 +289,14 @@ let get conf session num_points since until where factors
   (* Prepare the buckets in which to aggregate the data fields: *)
   let dt = (until -. since) /. float_of_int num_points in
   let per_factor_buckets = Hashtbl.create 11 in
+  let buckets_of_key k =
+    try Hashtbl.find per_factor_buckets k
+    with Not_found ->
+      !logger.debug "New time series for column key %a"
+        (Array.print T.print) k ;
+      let buckets = make_buckets num_points num_data_fields in
+      Hashtbl.add per_factor_buckets k buckets ;
+      buckets in
   let bucket_of_time = bucket_of_time since dt
   and time_of_bucket =
     match bucket_time with
@@ -114,97 +317,86 @@ let get conf session num_points since until where factors
   let tuple_fields = factors @ data_fields in
   !logger.debug "tuple_fields = %a"
     (List.print N.field_print) tuple_fields ;
-  let callback (head : RamenTuple.field_typ list) =
+  let def_aggr = ref [||] in
+  let init (head : RamenTuple.field_typ list) =
     (* TODO: RamenTuple.typ should be an array *)
     let head = Array.of_list head in
-    (* Extract fields of interest (data fields, keys...) from a tuple: *)
-    (* So tuple will be composed of rev factors then data_fields: *)
-    let key_of_factors tuple =
-      Array.sub tuple 0 num_factors in
-    let open RamenSerialization in
-    let def_aggr =
+    def_aggr :=
       Array.init num_data_fields (fun i ->
         match head.(num_factors + i).aggr with
         | Some str -> consolidate str
         | None ->
             (match consolidation with
             | None -> bucket_avg
-            | Some str -> consolidate str))
-    in
+            | Some str -> consolidate str)) ;
     (* If we asked for some factors and have no data, then there will be no
      * columns in the result, which is OK (cartesian product of data fields and
      * factors). But if we asked for no factors then we expect one column per
      * data field, whether there is data or not. So in that case let's create
      * the buckets in advance, in case on_tuple is not called at all: *)
-    if num_factors = 0 then (
-      let buckets = make_buckets num_points num_data_fields in
-      Hashtbl.add per_factor_buckets [||] buckets) ;
-    (fun t1 t2 tuple ->
-      let k = key_of_factors tuple in
-      let buckets =
-        try Hashtbl.find per_factor_buckets k
-        with Not_found ->
-          !logger.debug "New time series for column key %a"
-            (Array.print T.print) k ;
-          let buckets = make_buckets num_points num_data_fields in
-          Hashtbl.add per_factor_buckets k buckets ;
-          buckets in
-      let bi1, r1 = bucket_of_time t1 and bi2, r2 = bucket_of_time t2 in
-      !logger.debug "bi1=%d (r1=%f), bi2=%d (r2=%f)" bi1 r1 bi2 r2 ;
-      (* If bi2 ends up right on the boundary, speed things up by shortening
-       * the range: *)
-      let bi2, r2 =
-        if r2 = 0. && bi2 > bi1 then bi2 - 1, 1. else bi2, r2 in
-      (* Iter over all data_fields, that are the last components of tuple: *)
-      for i = 0 to num_data_fields - 1 do
-        (* We assume that the value is "intensive" rather than "extensive",
-         * and so contribute the same amount to each buckets of the interval,
-         * instead of distributing the value (TODO: extensive values) *)
-        let v = T.float_of_scalar tuple.(num_factors + i) in
-        Option.may (fun v ->
-          let v, bi1, bi2, r =
-            if bi1 = bi2 then (
-              (* Special case: just soften v *)
-              let r = r2 -. r1 in
-              abs_float r *. v, bi1, bi2, r
-            ) else (
-              (* Values on the edge should contribute in proportion to overlap: *)
-              let v1 = v *. (1. -. r1) and v2 = v *. r2 in
-              if bi1 > 0 && bi1 < Array.length buckets then
-                pour_into_bucket buckets bi1 i v1 (1. -. r1) ;
-              if bi2 > 0 && bi2 < Array.length buckets then
-                pour_into_bucket buckets bi2 i v2 r2 ;
-              v, bi1 + 1, bi2 - 1, 1.
-            ) in
-          for bi = max bi1 0 to min bi2 (Array.length buckets - 1) do
-            pour_into_bucket buckets bi i v r
-          done
-        ) v
-      done),
-    (fun () ->
-      (* Extract the results as an Enum, one value per key *)
-      let indices = Enum.range 0 ~until:(num_points - 1) in
-      (* Assume keys and values will enumerate keys in the same orders: *)
-      let columns =
-        Hashtbl.keys per_factor_buckets |>
-        Array.of_enum in
-      let ts =
-        Hashtbl.values per_factor_buckets |>
-        Array.of_enum in
-      columns,
-      indices /@
-      (fun i ->
-        let t = time_of_bucket i
-        and v =
-          Array.map (fun buckets ->
-            Array.mapi (fun data_field_idx bucket ->
-              def_aggr.(data_field_idx) bucket
-            ) buckets.(i)
-          ) ts in
-        t, v)) in
-  (* Must not add event time in front of factors: *)
-  RamenExport.replay conf ~while_ session worker tuple_fields where since until
-                     ~with_event_time:false callback
+    if num_factors = 0 then ignore (buckets_of_key [||]) in
+  (* Tuples may be clipped to start no sooner than [from]: *)
+  let on_tuple ?(from=neg_infinity) t1 t2 tuple =
+    let t1 = max t1 from in
+    if t2 >= t1 then
+      (* So tuple will be composed of rev factors then data_fields: *)
+      let buckets = buckets_of_key (Array.sub tuple 0 num_factors) in
+      pour_tuple buckets bucket_of_time num_factors num_data_fields
+                 t1 t2 tuple in
+  let result () =
+    (* Extract the results as an Enum, one value per key *)
+    let indices = Enum.range 0 ~until:(num_points - 1) in
+    (* Assume keys and values will enumerate keys in the same orders: *)
+    let columns =
+      Hashtbl.keys per_factor_buckets |>
+      Array.of_enum in
+    let ts =
+      Hashtbl.values per_factor_buckets |>
+      Array.of_enum in
+    columns,
+    indices /@
+    (fun i ->
+      let t = time_of_bucket i
+      and v =
+        Array.map (fun buckets ->
+          Array.mapi (fun data_field_idx bucket ->
+            !def_aggr.(data_field_idx) bucket
+          ) buckets.(i)
+        ) ts in
+      t, v) in
+  match rollup_resolution dt with
+  | 0. ->
+      (* Must not add event time in front of factors: *)
+      RamenExport.replay conf ~while_ session worker tuple_fields where
+                         since until ~with_event_time:false (fun head ->
+        init head ;
+        (fun t1 t2 tuple -> on_tuple t1 t2 tuple), result)
+  | res ->
+      !logger.debug "Using rollups of resolution %a" print_as_duration res ;
+      let prog_name, func, head =
+        RamenExport.replay_header session worker tuple_fields
+                                  ~with_event_time:false in
+      init head ;
+      let dir = rollups_dir conf prog_name func tuple_fields where in
+      let rolled_until =
+        iter_rollups conf ~while_ session worker tuple_fields where
+                     num_factors num_data_fields dir res since until
+                     (fun block_start block ->
+          Array.iter (fun (k, rbuckets) ->
+            let buckets = buckets_of_key k in
+            Array.iteri (fun i rb ->
+              let t1 = block_start +. res *. float_of_int i in
+              Array.iteri (fun ci b ->
+                pour_bucket buckets since dt ci t1 res b
+              ) rb
+            ) rbuckets
+          ) block) in
+      (* Then complete with the raw tuples: *)
+      if rolled_until < until then
+        RamenExport.replay conf ~while_ session worker tuple_fields where
+                           rolled_until until ~with_event_time:false (fun _ ->
+          on_tuple ~from:rolled_until, ignore) ;
+      result ()
 
 (* [get] uses the number of points but users can specify either num-points or
  * the time-step (in which case [since] and [until] are aligned to a multiple
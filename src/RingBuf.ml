@@ -47,6 +47,11 @@
  * although in practice there is always a unique reader (the worker whose input
  * ringbuffer it is).
  *
+ * The exception being "broadcast" ringbuffers, created with some consumer
+ * slots, which are shared by several children reading the same output of the
+ * same parent: each registered consumer then reads every message, and the
+ * space is given back to writers once the slowest consumer is done with it.
+ *
  * Every data in the ringbuffer is 32bits padded.
  *
  * Each input, or message, is appended in the ringbuffer until the buffer can
@@ -144,15 +149,49 @@ let prepend_rb_name f (fname : N.path) =
   try f fname
   with Failure msg -> failwith ((fname :> string) ^": "^ msg)
 
-external create_ : string -> bool -> int -> float -> N.path -> unit =
-  "wrap_ringbuf_create"
+external create_ :
+  string -> bool -> int -> float -> bool -> int -> int -> N.path -> unit =
+  "wrap_ringbuf_create_bytecode" "wrap_ringbuf_create"
+
+(* Must match enum ringbuf_mmap_flags in ringbuf.h: *)
+type mmap_flag =
+  | Prefault (* allocate every page upfront, and populate the mappings *)
+  | Hugepages (* ask for transparent hugepages *)
+  | Sequential (* advise sequential accesses *)
+  | Precreate (* prepare the next archive file in the background *)
+
+let int_of_mmap_flags =
+  List.fold_left (fun i flag ->
+    i lor (match flag with
+           | Prefault -> 1
+           | Hugepages -> 2
+           | Sequential -> 4
+           | Precreate -> 8)) 0
 
+(* With [legacy], the file is created with the former header layout (and
+ * version) so that workers that have not been upgraded yet can still use it.
+ * Such a ringbuffer cannot be loaded by this program.
+ * With [consumers], the file is created as a broadcast ringbuffer with that
+ * many consumer slots (see [register_consumer]).
+ * [mmap_flags] are stored in the file and apply to every mapping of it and
+ * of the files it is rotated into. *)
 let create ?(wrap=true)
            ?(words=Default.ringbuffer_word_length)
            ?(timeout=Default.ringbuffer_timeout)
+           ?(legacy=false)
+           ?(consumers=0)
+           ?(mmap_flags=[])
            fname =
   Files.mkdir_all ~is_file:true fname ;
-  prepend_rb_name (create_ RamenVersions.ringbuf wrap words timeout) fname
+  let version =
+    if legacy then RamenVersions.ringbuf_legacy else RamenVersions.ringbuf in
+  let mmap_flags = int_of_mmap_flags mmap_flags in
+  prepend_rb_name
+    (create_ version wrap words timeout legacy consumers mmap_flags) fname
+
+type consumer_stats = {
+  consumer_pid : int ;
+  consumer_lag : int (* words yet to be read *) }
 
 type stats = {
   capacity : int ; (* in words *)
@@ -167,13 +206,41 @@ type stats = {
   cons_head : int ;
   cons_tail : int ;
   first_seq : int (* taken from arc/max file *) ;
-  timeout : float }
+  timeout : float ;
+  max_consumers : int ; (* 0 unless a broadcast ringbuffer *)
+  consumers : consumer_stats array (* only the registered ones *) }
 
 external load_ : string -> N.path -> t = "wrap_ringbuf_load"
 let load = prepend_rb_name (load_ RamenVersions.ringbuf)
 external unload : t -> unit = "wrap_ringbuf_unload"
+
+(* Compress that archive file [f] into [f.zst] (that [load] can load as well)
+ * and delete [f]: *)
+external compress_archive : N.path -> unit = "wrap_ringbuf_compress_archive"
 external stats : t -> stats = "wrap_ringbuf_stats"
 external repair : t -> bool = "wrap_ringbuf_repair"
+
+(* Non wrapping ringbuffers (archives) come with a sparse index of their
+ * content, made of buckets of records that are contiguous in the file.
+ * [index] returns those buckets that are not empty, in file order (an empty
+ * array for files predating the index): *)
+type bucket = {
+  b_tmin : float ; (* Time range of the timed records *)
+  b_tmax : float ;
+  b_first_record : int ; (* in words, to be passed to [read_at] *)
+  b_num_records : int ;
+  b_num_untimed : int ; (* records with no time information *)
+  b_first_seq : int }
+
+external index : t -> bucket array = "wrap_ringbuf_index"
+(* Broadcast ringbuffers can only be dequeued from once registered as one of
+ * its consumers. Fails if there are no free slot left. Unloading the
+ * ringbuffer unregisters, and slots of dead processes are eventually
+ * reclaimed, as [reap_consumers] does (which returns the number of consumers
+ * still registered): *)
+external register_consumer : t -> unit = "wrap_ringbuf_register_consumer"
+external unregister_consumer : t -> unit = "wrap_ringbuf_unregister_consumer"
+external reap_consumers : t -> int = "wrap_ringbuf_reap_consumers"
 (* Same as unload, but if the ringbuf is non wrapping tries to archive it: *)
 external may_archive_and_unload : t -> unit = "wrap_ringbuf_may_archive"
 
@@ -193,7 +260,32 @@ external dequeue : t -> bytes = "wrap_ringbuf_dequeue"
 external read_raw : t -> int -> int -> bytes = "wrap_ringbuf_read_raw"
 external read_raw_tx : tx -> bytes = "wrap_ringbuf_read_raw_tx"
 external write_raw_tx : tx -> int -> bytes -> unit = "wrap_ringbuf_write_raw_tx"
+(* Batches of consecutive records allocated (or dequeued) with a single
+ * update of the ringbuffer indices. The returned TX points to the first
+ * record of the batch; move from record to record with [batch_next], which
+ * returns false once on the last record. Then commit the whole batch with the
+ * usual [enqueue_commit] or [dequeue_commit]. *)
+external enqueue_alloc_batch : t -> int array -> tx =
+  "wrap_ringbuf_enqueue_alloc_batch"
+external dequeue_alloc_batch : t -> int -> tx =
+  "wrap_ringbuf_dequeue_alloc_batch"
+
+(* [enqueue_records rb bytes offs len] enqueues in a single batch as many
+ * of the records found in [bytes] from [offs] to [offs + len] as possible,
+ * each record being prefixed with its size in bytes (as a 32 bits little
+ * endian integer). Returns how many bytes were consumed, or raises
+ * [NoMoreRoom] if not even the first record could be enqueued. *)
+external enqueue_records : t -> Bytes.t -> int -> int -> int =
+  "wrap_ringbuf_enqueue_records"
+external tx_num_records : tx -> int = "wrap_ringbuf_tx_num_records" [@@noalloc]
+external batch_next : tx -> bool = "wrap_ringbuf_batch_next" [@@noalloc]
+(* Block until the ringbuffer is non empty, or has room for a message of the
+ * given size (in bytes), or the given timeout (in seconds) has expired.
+ * Used in place of sleeping in between retries: *)
+external wait_for_data : t -> float -> unit = "wrap_ringbuf_wait_for_data"
+external wait_for_room : t -> int -> float -> unit = "wrap_ringbuf_wait_for_room"
 external read_first : t -> tx = "wrap_ringbuf_read_first"
+external read_at : t -> int -> tx = "wrap_ringbuf_read_at"
 external read_next : tx -> tx = "wrap_ringbuf_read_next"
 (* A TX that serialize things in an internal buffer of the given size (in
  * bytes) and which is effectively independent of any ringbuffer.
@@ -284,6 +376,38 @@ let read_i8 tx offs = Int8.of_int (read_i8_ tx offs)
 let read_i16 tx offs = Int16.of_int (read_i16_ tx offs)
 let read_i24 tx offs = Int24.of_int (read_i24_ tx offs)
 
+(* Zero-copy accessors, that read straight from the mapped record without
+ * bound checks. [check_range tx offs size] must have been called beforehand
+ * with a range covering all the peeked values: *)
+external check_range : tx -> int -> int -> unit = "wrap_ringbuf_tx_check_range"
+external peek_float : tx -> int -> float = "peek_float"
+external peek_char : tx -> int -> char = "peek_word" [@@noalloc]
+external peek_u8 : tx -> int -> Uint8.t = "peek_uint8" [@@noalloc]
+external peek_u16 : tx -> int -> Uint16.t = "peek_uint16" [@@noalloc]
+external peek_u24 : tx -> int -> Uint24.t = "peek_uint24" [@@noalloc]
+external peek_u32 : tx -> int -> Uint32.t = "peek_uint32"
+external peek_u40 : tx -> int -> Uint40.t = "peek_uint40"
+external peek_u48 : tx -> int -> Uint48.t = "peek_uint48"
+external peek_u56 : tx -> int -> Uint56.t = "peek_uint56"
+external peek_u64 : tx -> int -> Uint64.t = "peek_uint64"
+external peek_u128 : tx -> int -> Uint128.t = "peek_uint128"
+external peek_i32 : tx -> int -> Int32.t = "peek_int32"
+external peek_i40 : tx -> int -> Int40.t = "peek_int40"
+external peek_i48 : tx -> int -> Int48.t = "peek_int48"
+external peek_i56 : tx -> int -> Int56.t = "peek_int56"
+external peek_i64 : tx -> int -> Int64.t = "peek_int64"
+external peek_i128 : tx -> int -> Int128.t = "peek_int128"
+external peek_eth : tx -> int -> Uint48.t = "peek_uint48"
+external peek_ip4 : tx -> int -> Uint32.t = "peek_uint32"
+external peek_ip6 : tx -> int -> Uint128.t = "peek_uint128"
+external peek_bool : tx -> int -> bool = "peek_word" [@@noalloc]
+external peek_i8_ : tx -> int -> int = "peek_int8" [@@noalloc]
+external peek_i16_ : tx -> int -> int = "peek_int16" [@@noalloc]
+external peek_i24_ : tx -> int -> int = "peek_int24" [@@noalloc]
+let peek_i8 tx offs = Int8.of_int (peek_i8_ tx offs)
+let peek_i16 tx offs = Int16.of_int (peek_i16_ tx offs)
+let peek_i24 tx offs = Int24.of_int (peek_i24_ tx offs)
+
 let round_up_to_rb_word bytes =
   let low = bytes land (DessserRamenRingBuffer.word_size - 1) in
   if low = 0 then bytes else bytes - low + DessserRamenRingBuffer.word_size
@@ -90,6 +90,12 @@ let summary conf max_bytes files () =
       s.alloced_words s.capacity
       (float_of_int s.alloced_words *. 100. /. (float_of_int s.capacity))
       s.mem_size s.prod_tail s.prod_head s.cons_tail s.cons_head ;
+    if s.max_consumers > 0 then (
+      Printf.printf "broadcast consumers: %d/%d\n"
+        (Array.length s.consumers) s.max_consumers ;
+      Array.iter (fun c ->
+        Printf.printf "  pid %d: %d words behind\n" c.consumer_pid c.consumer_lag
+      ) s.consumers) ;
     (* Also dump the content. *)
     let dumped_words =
       if s.cons_tail <> s.cons_head then (
@@ -262,14 +262,18 @@ and read_array t tx offs =
  *)
 
 (* Unless wait_for_more, this will raise Empty when out of data *)
-let retry_for_ringbuf ?(wait_for_more=true) ?while_ ?delay_rec ?max_retry_time f =
+(* [sleep] can be given to block on the ringbuf rather than merely sleeping
+ * in between attempts (see [RingBuf.wait_for_data] and
+ * [RingBuf.wait_for_room]). *)
+let retry_for_ringbuf ?(wait_for_more=true) ?while_ ?delay_rec ?max_retry
+                      ?max_retry_time ?sleep f =
   let on = function
     | NoMoreRoom -> true
     | Empty -> wait_for_more
     | _ -> false
   in
   retry ?while_ ~on ~first_delay:0.001 ~max_delay:1. ?delay_rec
-        ?max_retry_time f
+        ?max_retry ?max_retry_time ?sleep f
 
 (* To allow a func to select only some fields from its parent and write only
  * a skip list in the out_ref (to makes serialization easier not out_ref
@@ -279,7 +283,7 @@ let ser_tuple_field_cmp (t1, _) (t2, _) =
 
 let dequeue_ringbuf_once ?while_ ?delay_rec ?max_retry_time rb =
   retry_for_ringbuf ?while_ ?delay_rec ?max_retry_time
-                    dequeue_alloc rb
+                    ~sleep:(wait_for_data rb) dequeue_alloc rb
 
 let read_ringbuf ?while_ ?delay_rec rb f =
   let rec loop () =
@@ -293,6 +297,27 @@ let read_ringbuf ?while_ ?delay_rec rb f =
         loop () in
   loop ()
 
+(* Same as above, but dequeue up to [max_records] records at once. Here [f]
+ * is called on every record of the batch and must not call dequeue_commit;
+ * once [f] has been called on every record of the batch [after_batch] is
+ * called and the batch committed. *)
+let read_ringbuf_batch ?while_ ?delay_rec ?(after_batch=ignore)
+                       ~max_records rb f =
+  let rec loop () =
+    match retry_for_ringbuf ?while_ ?delay_rec ~sleep:(wait_for_data rb)
+                            (dequeue_alloc_batch rb) max_records with
+    | exception (Exit | Timeout) ->
+        ()
+    | tx ->
+        let rec each () =
+          f tx ;
+          if batch_next tx then each () in
+        each () ;
+        dequeue_commit tx ;
+        after_batch () ;
+        loop () in
+  loop ()
+
 let read_buf ?wait_for_more ?while_ ?delay_rec rb init f =
   (* Read tuples by hoping from one to the next using tx_next.
    * Note that we may reach the end of the written content, and will
@@ -316,15 +341,123 @@ let read_buf ?wait_for_more ?while_ ?delay_rec rb init f =
   in
   read read_first rb init loop
 
+(* Using its index, returns the ranges of words of a non wrapping ringbuf,
+ * as (start, stop) pairs, that can hold records which time range
+ * intersects [since..until] (or that have no time information).
+ * [stop] is exclusive and the last range might go up to [max_int]: *)
+let index_ranges rb since until =
+  let idx = index rb in
+  if Array.length idx = 0 then
+    (* Empty or not indexed: *)
+    [ 0, max_int ]
+  else
+    let may_match b =
+      b.b_num_untimed > 0 || (b.b_tmax >= since && b.b_tmin <= until) in
+    let stop_of i =
+      if i < Array.length idx - 1 then idx.(i + 1).b_first_record
+      else max_int in
+    Array.fold_righti (fun i b ranges ->
+      if not (may_match b) then ranges else
+      let stop = stop_of i in
+      match ranges with
+      | (start', stop') :: ranges when start' = stop ->
+          (* Merge with the following one: *)
+          (b.b_first_record, stop') :: ranges
+      | ranges ->
+          (b.b_first_record, stop) :: ranges
+    ) idx []
+
+(* Like [read_buf] but only for the given ranges of words (see
+ * [index_ranges]), and never waiting for more: *)
+let read_buf_ranges ?while_ rb ranges init f =
+  let read how arg usr k =
+    match retry_for_ringbuf ?while_ ~wait_for_more:false how arg with
+    | exception (Exit | Timeout | End_of_file | Empty) -> usr
+    | tx -> k usr tx
+  in
+  let rec loop_ranges usr = function
+    | [] ->
+        usr
+    | (start, stop) :: ranges ->
+        let rec loop usr tx =
+          (* tx_start is past the size word of the record: *)
+          if tx_start tx > stop then
+            loop_ranges usr ranges
+          else
+            let usr, more_to_come = f usr tx in
+            if more_to_come then
+              read read_next tx usr loop
+            else usr in
+        read (read_at rb) start usr loop
+  in
+  loop_ranges init ranges
+
+(*$inject
+  let with_indexed_rb f =
+    let fname = N.path "/tmp/ringbuf_lib_index_test.r" in
+    (try Files.unlink fname with _ -> ()) ;
+    RingBuf.create ~wrap:false ~words:1280 fname ;
+    let rb = RingBuf.load fname in
+    BatPervasives.finally
+      (fun () -> RingBuf.unload rb ; Files.unlink fname) f rb
+  (* 100 records of 7 words (+1 for the size) with times 1..100 but for
+   * the 51st that has no time, then read those which times are within
+   * [since..until]: *)
+  let fill rb =
+    for i = 0 to 99 do
+      let tx = RingBuf.enqueue_alloc rb 28 in
+      RingBuf.write_u32 tx 0 (Stdint.Uint32.of_int i) ;
+      let t = if i = 50 then 0. else float_of_int (i + 1) in
+      RingBuf.enqueue_commit tx t t
+    done
+  let read_range rb since until =
+    read_buf_ranges rb (index_ranges rb since until) [] (fun l tx ->
+      (RingBuf.read_u32 tx 0 |> Stdint.Uint32.to_int) :: l, true) |>
+    List.rev
+*)
+(*$T
+  with_indexed_rb (fun rb -> fill rb ; \
+    let l = read_range rb 20. 30. in \
+    List.mem 19 l && List.mem 29 l && List.mem 50 l && \
+    not (List.mem 0 l) && not (List.mem 99 l))
+  with_indexed_rb (fun rb -> fill rb ; \
+    read_range rb 0. 101. = List.init 100 (fun i -> i))
+  with_indexed_rb (fun rb -> read_range rb 0. 101. = [])
+*)
+
 let with_enqueue_tx rb sz f =
   let tx =
-    retry_for_ringbuf (enqueue_alloc rb) sz in
+    retry_for_ringbuf ~sleep:(wait_for_room rb sz) (enqueue_alloc rb) sz in
   let tmin, tmax = f tx in
   (* There is no such thing as enqueue_rollback. We cannot make the rb
    * pointer go backward (or... can we?) but we could have a 1 bit header
    * indicating if an entry is valid or not. *)
   enqueue_commit tx tmin tmax
 
+(* Same as above, for a batch of records of the given sizes. [f] is called
+ * in turn with the TX positioned on each record and its index, and must
+ * return the time range of that record. With [max_retry] it can fail with
+ * NoMoreRoom. *)
+let with_enqueue_batch_tx ?max_retry rb szs f =
+  let tx =
+    let tot_sz =
+      (* Each record but the first also comes with its size word: *)
+      Array.fold_left (+) 0 szs +
+      (Array.length szs - 1) * DessserRamenRingBuffer.word_size in
+    retry_for_ringbuf ?max_retry ~sleep:(wait_for_room rb tot_sz)
+                      (enqueue_alloc_batch rb) szs in
+  let rec loop i tmin tmax =
+    let tmin', tmax' = f tx i in
+    (* start = stop = 0. => times are unset *)
+    let tmin, tmax =
+      if tmin' = 0. && tmax' = 0. then tmin, tmax else
+      if tmin = 0. && tmax = 0. then tmin', tmax' else
+      min tmin tmin', max tmax tmax' in
+    if batch_next tx then loop (i + 1) tmin tmax
+    else tmin, tmax in
+  let tmin, tmax = loop 0 0. 0. in
+  enqueue_commit tx tmin tmax
+
 let arc_dir_of_bname fname =
   N.cat (Files.dirname fname) (N.path "/arc")
 
@@ -340,6 +473,9 @@ let parse_archive_file_name (fname : N.path) =
   let ma, rest = String.split ~by:"_" rest in
   let tmi, rest = String.split ~by:"_" rest in
   let tma, rest = String.rsplit ~by:"." rest in
+  (* Ring buffers archives might have been compressed (see RamenGc): *)
+  let tma, rest =
+    if rest = "zst" then String.rsplit ~by:"." tma else tma, rest in
   let type_ =
     match rest with
     | "b" -> RingBuf
@@ -361,6 +497,9 @@ let parse_archive_file_name (fname : N.path) =
   (10, 16, 0x1.6bbcc4b69ae36p+30, 0x1.6bbcf3df4c0dbp+30, Orc) \
     (parse_archive_file_name \
       (N.path "00A_010_0x1.6bbcc4b69ae36p+30_0x1.6bbcf3df4c0dbp+30.orc"))
+  (10, 16, 0x1.6bbcc4b69ae36p+30, 0x1.6bbcf3df4c0dbp+30, RingBuf) \
+    (parse_archive_file_name \
+      (N.path "00A_010_0x1.6bbcc4b69ae36p+30_0x1.6bbcf3df4c0dbp+30.b.zst"))
 *)
 
 let filter_arc_files dir =
@@ -380,6 +519,55 @@ let arc_files_of dir =
 let arc_file_compare (s1, _, _, _, _, _) (s2, _, _, _, _, _) =
   Int.compare s1 s2
 
+(* Archive directories can hold a huge number of files, that the GC and the
+ * archivist must know the size of. Rather than statting all of them on every
+ * run, an index of the archive files and their sizes is kept next to the
+ * directory (not inside, which would modify it) and refreshed whenever the
+ * directory is modified, in which case only the new files are statted
+ * (archive files are never modified once renamed into that directory). *)
+let arc_index_of_dir dir = N.cat dir (N.path ".index")
+
+(* Returns the archive files of [dir] and their sizes, oldest first: *)
+let arc_files_with_size_of dir =
+  match Files.mtime dir with
+  | exception Unix.(Unix_error (ENOENT, _, _)) ->
+      [||]
+  | dir_mtime ->
+      let index_file = arc_index_of_dir dir in
+      let prev_mtime, prev =
+        if Files.exists index_file then
+          Files.marshal_from_file ~default:(nan, [||]) index_file
+        else
+          nan, [||] in
+      if dir_mtime = prev_mtime then prev else (
+        let prev_sizes = Hashtbl.create (Array.length prev) in
+        Array.iter (fun ((_, _, _, _, _, fname), sz) ->
+          Hashtbl.add prev_sizes fname sz
+        ) prev ;
+        let files =
+          arc_files_of dir //@
+          (fun (_, _, _, _, _, fname as f) ->
+            match Hashtbl.find prev_sizes fname with
+            | exception Not_found ->
+                (* Might have been deleted in the meantime: *)
+                (try Some (f, Files.size fname)
+                with Unix.(Unix_error (ENOENT, _, _)) -> None)
+            | sz ->
+                Some (f, sz)) |>
+          Array.of_enum in
+        Array.fast_sort (fun (f1, _) (f2, _) -> arc_file_compare f1 f2) files ;
+        (* Do not trust a modification time that's too recent, as the
+         * directory could still be modified within the same clock tick: *)
+        let dir_mtime =
+          if Unix.gettimeofday () -. dir_mtime < 1. then nan else dir_mtime in
+        log_and_ignore_exceptions ~what:"Saving archive index" (fun () ->
+          let tmp =
+            N.cat index_file
+                  (N.path (".tmp."^ string_of_int (Unix.getpid ()))) in
+          Files.marshal_into_file tmp (dir_mtime, files) ;
+          Files.rename tmp index_file) () ;
+        files)
+
 let seq_range bname =
   (* Returns the first and last available seqnums.
    * Takes first from the per.seq subdir names and last from same subdir +
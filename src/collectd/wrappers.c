@@ -16,20 +16,72 @@
 
 #include "collectd.h"
 
+/* Host, plugin and type names are few and repeated in every message, so
+ * rather than copying them for every metric the OCaml values are kept
+ * from one call to the next, in a small direct mapped cache. */
+#define INTERN_SIZE 1024  // Must be a power of 2
+
+struct interned {
+  uint64_t hash;
+  value opt;  // Some string, or 0 if unused yet
+};
+
+static struct interned interned[INTERN_SIZE];
+
+static uint64_t hash_string(char const *s, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Returns an OCaml option holding that string:
+static value intern(char const *str)
+{
+  CAMLparam0();
+  CAMLlocal2(tmp, opt);
+  size_t const len = strlen(str);
+  uint64_t const h = hash_string(str, len);
+  struct interned *e = interned + (h & (INTERN_SIZE - 1));
+  if (e->opt && e->hash == h) {
+    value const s = Field(e->opt, 0);
+    if (caml_string_length(s) == len && 0 == memcmp(String_val(s), str, len))
+      CAMLreturn(e->opt);
+  }
+  tmp = caml_copy_string(str);
+  opt = caml_alloc_small(1, 0);
+  Field(opt, 0) = tmp;
+  e->hash = h;
+  if (e->opt) {
+    caml_modify_generational_global_root(&e->opt, opt);
+  } else {
+    e->opt = opt;
+    caml_register_generational_global_root(&e->opt);
+  }
+  CAMLreturn(opt);
+}
+
 static void set_nullable_string(value block, unsigned idx, char const *str)
 {
   CAMLparam1(block);
-  CAMLlocal1(tmp);
   if (!str || str[0] == '\0')
     Store_field(block, idx, Val_int(0));
-  else {
-    tmp = caml_alloc(1, 0);
-    Store_field(tmp, 0, caml_copy_string(str));
-    Store_field(block, idx, tmp);
-  }
+  else
+    Store_field(block, idx, intern(str));
   CAMLreturn0;
 }
 
+/* Decoding memory, reused from one call to the next and enlarged whenever
+ * a message does not fit: */
+#define DECODE_MEM_INIT_SIZE 16384
+#define DECODE_MEM_MAX_SIZE (16 * 1024 * 1024)
+
+static char *decode_mem;
+static size_t decode_mem_size;
+
 CAMLprim value wrap_collectd_decode(value buffer_, value start_, value stop_)
 {
   CAMLparam3(buffer_, start_, stop_);
@@ -41,13 +93,27 @@ CAMLprim value wrap_collectd_decode(value buffer_, value start_, value stop_)
   assert(stop <= caml_string_length(buffer_));
 
   unsigned num_metrics;
-  struct collectd_metric *metrics; // Will point into mem
+  struct collectd_metric *metrics; // Will point into decode_mem
   unsigned consumed;
-  char mem[4096];
+  enum collectd_decode_status status;
   // Must not call caml_alloc from there until we are done with buffer
   char *buffer = String_val(buffer_) + start;
-  enum collectd_decode_status status =
-    collectd_decode(stop - start, buffer, sizeof(mem), mem, &num_metrics, &metrics, &consumed);
+  while (true) {
+    if (! decode_mem) {
+      decode_mem = malloc(DECODE_MEM_INIT_SIZE);
+      if (! decode_mem) caml_raise_out_of_memory();
+      decode_mem_size = DECODE_MEM_INIT_SIZE;
+    }
+    status = collectd_decode(stop - start, buffer, decode_mem_size, decode_mem,
+                             &num_metrics, &metrics, &consumed);
+    if (status != COLLECTD_NOT_ENOUGH_RAM ||
+        decode_mem_size >= DECODE_MEM_MAX_SIZE) break;
+    // Start over with more room:
+    free(decode_mem);
+    decode_mem_size *= 2;
+    decode_mem = malloc(decode_mem_size);
+    if (! decode_mem) caml_raise_out_of_memory();
+  }
 
   /* Return an array of collectd_metric and number of consumed bytes */
   arr = caml_alloc(num_metrics, 0);
@@ -57,7 +123,7 @@ CAMLprim value wrap_collectd_decode(value buffer_, value start_, value stop_)
     struct collectd_metric *m = metrics + i;
     assert(m->num_values > 0);
     m_tup = caml_alloc(6 + COLLECTD_NB_VALUES, 0);
-    Store_field(m_tup, 0, caml_copy_string(m->host));
+    Store_field(m_tup, 0, Field(intern(m->host), 0));
     set_nullable_string(m_tup, 1, m->plugin_instance);
     set_nullable_string(m_tup, 2, m->plugin_name);
     Store_field(m_tup, 3, caml_copy_double(m->time));
@@ -65,7 +131,7 @@ CAMLprim value wrap_collectd_decode(value buffer_, value start_, value stop_)
     set_nullable_string(m_tup, 5, m->type_name);
     Store_field(m_tup, 6+0, caml_copy_double(m->values[0]));
     unsigned v;
-    for (v = 1; v < m->num_values; v++) {
+    for (v = 1; v < m->num_values && v < COLLECTD_NB_VALUES; v++) {
       tmp = caml_alloc(1, 0);
       Store_field(tmp, 0, caml_copy_double(m->values[v]));
       Store_field(m_tup, 6+v, tmp);
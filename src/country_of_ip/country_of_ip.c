@@ -1,37 +1,713 @@
 // vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+#include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 #include "country_of_ip.h"
 #include "db_v4.h"
 #include "db_v6.h"
 
-#define SEARCH(db) do { \
-  assert(SIZEOF_ARRAY(db) > 0); \
-  size_t first = 0, last = SIZEOF_ARRAY(db) - 1; \
- \
-  if (ip < db[first].from || ip > db[last].to) return NULL; \
- \
-  while (last > first) { \
-    size_t mid = first + (last - first + 1)/2; \
-    if (ip < db[mid].from) { \
-      last = mid - 1; \
-    } else { \
-      first = mid; \
+/* Rather than binary searching the tables of ranges, which cost a cache miss
+ * per probe, only the start of the ranges are indexed in a layout that keeps
+ * the next probes close together, apart from the ends of the ranges and
+ * country codes that are only read once the range is found:
+ *
+ * - For v4, a static B-tree which nodes hold 16 keys, ie. exactly one cache
+ *   line, that are compared all at once;
+ * - For v6, an Eytzinger layout (the implicit binary tree of a heap) which
+ *   next levels can be prefetched.
+ *
+ * Alongside each key is stored its rank in the sorted table, so the payload
+ * can be kept in sorted order.
+ *
+ * The ranges of the databases are not sorted and some are nested within
+ * others (for instance, large reserved blocks containing allocated ones).
+ * They are thus first split into disjoint ranges, the innermost ranges
+ * taking precedence.
+ *
+ * The whole index is a single block of memory which can be saved in a file
+ * and then mmapped as is. */
+
+#define BTREE_B 16  // Keys per v4 node
+#define CC_SIZE 4   // Country codes are padded
+
+#define INDEX_MAGIC "RMNGEOIP"
+#define INDEX_VERSION 1U
+
+struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_v4, num_v4_nodes, num_v6;
+};
+
+struct geo_index {
+  uint32_t num_v4, num_v4_nodes;
+  uint32_t const *keys_v4;  // num_v4_nodes * BTREE_B
+  uint32_t const *ranks_v4; // same
+  uint32_t const *to_v4;    // num_v4
+  char const (*cc_v4)[CC_SIZE];
+  uint32_t num_v6;
+  uint128_t const *keys_v6; // num_v6 + 1, first one unused
+  uint32_t const *ranks_v6; // same
+  uint128_t const *to_v6;   // num_v6
+  char const (*cc_v6)[CC_SIZE];
+  // The memory block holding the whole index, including its header:
+  void *mem;
+  size_t mem_size;
+  bool mmapped;
+};
+
+struct layout {
+  size_t keys_v4, ranks_v4, to_v4, cc_v4;
+  size_t keys_v6, ranks_v6, to_v6, cc_v6;
+  size_t size;
+};
+
+static size_t align_line(size_t o)
+{
+  return (o + 63) & ~(size_t)63;
+}
+
+static void compute_layout(
+  struct layout *l, uint32_t num_v4, uint32_t num_v4_nodes, uint32_t num_v6)
+{
+  size_t o = align_line(sizeof(struct index_header));
+  l->keys_v4 = o;
+  o = align_line(o + (size_t)num_v4_nodes * BTREE_B * sizeof(uint32_t));
+  l->ranks_v4 = o;
+  o = align_line(o + (size_t)num_v4_nodes * BTREE_B * sizeof(uint32_t));
+  l->to_v4 = o;
+  o = align_line(o + (size_t)num_v4 * sizeof(uint32_t));
+  l->cc_v4 = o;
+  o = align_line(o + (size_t)num_v4 * CC_SIZE);
+  l->keys_v6 = o;
+  o = align_line(o + ((size_t)num_v6 + 1) * sizeof(uint128_t));
+  l->ranks_v6 = o;
+  o = align_line(o + ((size_t)num_v6 + 1) * sizeof(uint32_t));
+  l->to_v6 = o;
+  o = align_line(o + (size_t)num_v6 * sizeof(uint128_t));
+  l->cc_v6 = o;
+  o = align_line(o + (size_t)num_v6 * CC_SIZE);
+  l->size = o;
+}
+
+static void set_pointers(struct geo_index *idx, struct layout const *l)
+{
+  char const *mem = idx->mem;
+  idx->keys_v4 = (uint32_t const *)(mem + l->keys_v4);
+  idx->ranks_v4 = (uint32_t const *)(mem + l->ranks_v4);
+  idx->to_v4 = (uint32_t const *)(mem + l->to_v4);
+  idx->cc_v4 = (char const (*)[CC_SIZE])(mem + l->cc_v4);
+  idx->keys_v6 = (uint128_t const *)(mem + l->keys_v6);
+  idx->ranks_v6 = (uint32_t const *)(mem + l->ranks_v6);
+  idx->to_v6 = (uint128_t const *)(mem + l->to_v6);
+  idx->cc_v6 = (char const (*)[CC_SIZE])(mem + l->cc_v6);
+}
+
+/*
+ * Building the index
+ */
+
+// Both v4 and v6 ranges, before indexing:
+struct range {
+  uint128_t from, to;
+  char cc[CC_SIZE];
+};
+
+struct ranges {
+  struct range *arr;
+  size_t num, alloced;
+};
+
+static struct range *new_range(struct ranges *rs)
+{
+  if (rs->num >= rs->alloced) {
+    size_t const alloced = rs->alloced ? 2 * rs->alloced : 65536;
+    struct range *arr = realloc(rs->arr, alloced * sizeof(*arr));
+    if (! arr) return NULL;
+    rs->arr = arr;
+    rs->alloced = alloced;
+  }
+  return rs->arr + rs->num++;
+}
+
+static int add_range(
+  struct ranges *rs, uint128_t from, uint128_t to, char const *cc)
+{
+  if (from > to) return 0;
+  // Merge with the previous range when possible:
+  if (rs->num > 0) {
+    struct range *last = rs->arr + rs->num - 1;
+    if (last->to + 1 == from && 0 == strcmp(last->cc, cc)) {
+      last->to = to;
+      return 0;
+    }
+  }
+  struct range *r = new_range(rs);
+  if (! r) return -1;
+  r->from = from;
+  r->to = to;
+  strncpy(r->cc, cc, CC_SIZE - 1);
+  r->cc[CC_SIZE - 1] = '\0';
+  return 0;
+}
+
+/* Larger ranges first so that they contain the next ones. For identical
+ * ranges, the last one wins so put the unknown country (ZZ) first: */
+static int cmp_range(void const *a_, void const *b_)
+{
+  struct range const *a = a_, *b = b_;
+  if (a->from != b->from) return a->from < b->from ? -1 : 1;
+  if (a->to != b->to) return a->to > b->to ? -1 : 1;
+  bool const a_zz = 0 == strcmp(a->cc, "ZZ"), b_zz = 0 == strcmp(b->cc, "ZZ");
+  if (a_zz != b_zz) return a_zz ? -1 : 1;
+  return strcmp(a->cc, b->cc);
+}
+
+#define MAX_NESTING 64
+
+/* Sort the ranges and split them into disjoint ranges in out, innermost
+ * ranges taking precedence. Ranges partially overlapping a previous one
+ * are clipped. */
+static int flatten_ranges(struct ranges *in, struct ranges *out)
+{
+  qsort(in->arr, in->num, sizeof(*in->arr), cmp_range);
+
+  struct range const *stack[MAX_NESTING];
+  unsigned depth = 0;
+  uint128_t pos = 0;  // Start of what's not been output yet
+  bool all_done = false;  // Set once pos wraps around
+
+# define POP_UNTIL(cond) \
+  while (depth > 0 && (cond)) { \
+    struct range const *top = stack[--depth]; \
+    if (! all_done && pos <= top->to) { \
+      if (0 != add_range(out, pos, top->to, top->cc)) return -1; \
+      pos = top->to + 1; \
+      if (pos == 0) all_done = true; \
     } \
-  } \
- \
-  if (ip < db[first].from || ip > db[first].to) return NULL; \
- \
-  return db[first].cc; \
-} while (false)
+  }
+
+  for (size_t i = 0; i < in->num; i++) {
+    struct range *r = in->arr + i;
+    POP_UNTIL(stack[depth - 1]->to < r->from);
+    // Then the rest of the space is covered already:
+    if (all_done) break;
+    if (depth > 0) {
+      struct range const *top = stack[depth - 1];
+      if (pos < r->from &&
+          0 != add_range(out, pos, r->from - 1, top->cc)) return -1;
+      if (r->to > top->to) r->to = top->to;
+    }
+    if (pos < r->from) pos = r->from;
+    if (depth >= MAX_NESTING) {
+      fprintf(stderr, "Country ranges nested too deeply\n");
+      return -1;
+    }
+    stack[depth++] = r;
+  }
+  POP_UNTIL(true);
+# undef POP_UNTIL
+
+  return 0;
+}
+
+/* Fill the B-tree in order, padding with keys that are greater than any IP
+ * and which rank is past the end of the table: */
+static void fill_btree_v4(
+  uint32_t *keys, uint32_t *ranks, uint32_t num_nodes,
+  struct range const *rs, uint32_t num, uint32_t *t, uint32_t k)
+{
+  if (k >= num_nodes) return;
+  for (unsigned i = 0; i < BTREE_B; i++) {
+    fill_btree_v4(keys, ranks, num_nodes, rs, num, t, k * (BTREE_B + 1) + i + 1);
+    keys[k * BTREE_B + i] = *t < num ? (uint32_t)rs[*t].from : UINT32_MAX;
+    ranks[k * BTREE_B + i] = *t < num ? *t : num;
+    (*t)++;
+  }
+  fill_btree_v4(keys, ranks, num_nodes, rs, num, t, k * (BTREE_B + 1) + BTREE_B + 1);
+}
+
+static void fill_eytzinger_v6(
+  uint128_t *keys, uint32_t *ranks,
+  struct range const *rs, uint32_t num, uint32_t *t, uint32_t k)
+{
+  if (k > num) return;
+  fill_eytzinger_v6(keys, ranks, rs, num, t, 2 * k);
+  keys[k] = rs[*t].from;
+  ranks[k] = *t;
+  (*t)++;
+  fill_eytzinger_v6(keys, ranks, rs, num, t, 2 * k + 1);
+}
+
+// Ranges must be disjoint and sorted:
+static struct geo_index *make_index(
+  struct ranges const *v4, struct ranges const *v6)
+{
+  if (v4->num > UINT32_MAX / 2 || v6->num > UINT32_MAX / 2) {
+    fprintf(stderr, "Too many country ranges\n");
+    return NULL;
+  }
+  uint32_t const num_v4 = v4->num, num_v6 = v6->num;
+
+  struct geo_index *idx = malloc(sizeof(*idx));
+  if (! idx) goto oom;
+
+  uint32_t num_v4_nodes = (num_v4 + BTREE_B - 1) / BTREE_B;
+  struct layout l;
+  compute_layout(&l, num_v4, num_v4_nodes, num_v6);
+
+  char *mem = aligned_alloc(64, l.size);
+  if (! mem) {
+    free(idx);
+    goto oom;
+  }
+  memset(mem, 0, l.size);
+
+  struct index_header *hdr = (struct index_header *)mem;
+  memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+  hdr->version = INDEX_VERSION;
+  hdr->num_v4 = num_v4;
+  hdr->num_v4_nodes = num_v4_nodes;
+  hdr->num_v6 = num_v6;
+
+  uint32_t t = 0;
+  fill_btree_v4((uint32_t *)(mem + l.keys_v4), (uint32_t *)(mem + l.ranks_v4),
+                num_v4_nodes, v4->arr, num_v4, &t, 0);
+  uint32_t *to_v4 = (uint32_t *)(mem + l.to_v4);
+  char (*cc_v4)[CC_SIZE] = (char (*)[CC_SIZE])(mem + l.cc_v4);
+  for (uint32_t i = 0; i < num_v4; i++) {
+    to_v4[i] = v4->arr[i].to;
+    memcpy(cc_v4[i], v4->arr[i].cc, CC_SIZE);
+  }
+
+  t = 0;
+  fill_eytzinger_v6((uint128_t *)(mem + l.keys_v6),
+                    (uint32_t *)(mem + l.ranks_v6), v6->arr, num_v6, &t, 1);
+  uint128_t *to_v6 = (uint128_t *)(mem + l.to_v6);
+  char (*cc_v6)[CC_SIZE] = (char (*)[CC_SIZE])(mem + l.cc_v6);
+  for (uint32_t i = 0; i < num_v6; i++) {
+    to_v6[i] = v6->arr[i].to;
+    memcpy(cc_v6[i], v6->arr[i].cc, CC_SIZE);
+  }
+
+  idx->num_v4 = num_v4;
+  idx->num_v4_nodes = num_v4_nodes;
+  idx->num_v6 = num_v6;
+  idx->mem = mem;
+  idx->mem_size = l.size;
+  idx->mmapped = false;
+  set_pointers(idx, &l);
+
+  return idx;
+oom:
+  fprintf(stderr, "Cannot allocate country index\n");
+  return NULL;
+}
+
+// Flatten unsorted v4 and v6 ranges into an index:
+static struct geo_index *index_of_ranges(
+  struct ranges *v4, struct ranges *v6)
+{
+  struct geo_index *idx = NULL;
+  struct ranges flat4 = {}, flat6 = {};
+
+  if (0 != flatten_ranges(v4, &flat4) ||
+      0 != flatten_ranges(v6, &flat6)) {
+    fprintf(stderr, "Cannot allocate country ranges\n");
+    goto err;
+  }
+
+  idx = make_index(&flat4, &flat6);
+
+err:
+  free(flat4.arr);
+  free(flat6.arr);
+  return idx;
+}
+
+static void free_index(struct geo_index *idx)
+{
+  if (! idx) return;
+  if (idx->mmapped) {
+    if (0 != munmap(idx->mem, idx->mem_size))
+      fprintf(stderr, "Cannot munmap country index: %s\n", strerror(errno));
+  } else {
+    free(idx->mem);
+  }
+  free(idx);
+}
+
+/*
+ * The current index
+ *
+ * OCaml callers hold the runtime lock so there is no concurrent access to
+ * it.
+ */
+
+static struct geo_index *cur_index;
+
+static struct geo_index *index_of_db(void)
+{
+  struct geo_index *idx = NULL;
+  struct ranges v4 = {}, v6 = {};
+
+  for (size_t i = 0; i < SIZEOF_ARRAY(db_v4); i++) {
+    struct range *r = new_range(&v4);
+    if (! r) goto err;
+    r->from = db_v4[i].from;
+    r->to = db_v4[i].to;
+    memcpy(r->cc, db_v4[i].cc, sizeof(db_v4[i].cc));
+  }
+  for (size_t i = 0; i < SIZEOF_ARRAY(db_v6); i++) {
+    struct range *r = new_range(&v6);
+    if (! r) goto err;
+    r->from = db_v6[i].from;
+    r->to = db_v6[i].to;
+    memcpy(r->cc, db_v6[i].cc, sizeof(db_v6[i].cc));
+  }
+
+  idx = index_of_ranges(&v4, &v6);
+
+err:
+  free(v4.arr);
+  free(v6.arr);
+  return idx;
+}
+
+static struct geo_index const *get_index(void)
+{
+  if (! cur_index) {
+    // Fallback to the compiled in database:
+    cur_index = index_of_db();
+    assert(cur_index);
+  }
+  return cur_index;
+}
+
+static void set_index(struct geo_index *idx)
+{
+  free_index(cur_index);
+  cur_index = idx;
+}
+
+/*
+ * Lookups
+ */
+
+// Number of keys of that node that are <= ip:
+static unsigned count_le_v4(uint32_t const *node, uint32_t ip)
+{
+# ifdef __SSE2__
+  // SSE2 only compares signed integers:
+  __m128i const bias = _mm_set1_epi32(INT32_MIN);
+  __m128i const x = _mm_xor_si128(_mm_set1_epi32(ip), bias);
+  unsigned gt = 0;
+  for (unsigned j = 0; j < BTREE_B; j += 4) {
+    __m128i k = _mm_load_si128((__m128i const *)(node + j));
+    k = _mm_xor_si128(k, bias);
+    __m128i const c = _mm_cmpgt_epi32(k, x);
+    gt |= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(c)) << j;
+  }
+  return BTREE_B - __builtin_popcount(gt);
+# else
+  unsigned n = 0;
+  for (unsigned j = 0; j < BTREE_B; j++) n += node[j] <= ip;
+  return n;
+# endif
+}
+
+// Returns the rank of the first range starting after ip:
+static uint32_t upper_bound_v4(struct geo_index const *idx, uint32_t ip)
+{
+  uint32_t res = idx->num_v4;
+  uint32_t k = 0;
+  while (k < idx->num_v4_nodes) {
+    unsigned const i = count_le_v4(idx->keys_v4 + k * BTREE_B, ip);
+    if (i < BTREE_B) res = idx->ranks_v4[k * BTREE_B + i];
+    k = k * (BTREE_B + 1) + i + 1;
+  }
+  return res;
+}
+
+static uint32_t upper_bound_v6(struct geo_index const *idx, uint128_t ip)
+{
+  uint32_t k = 1;
+  while (k <= idx->num_v6) {
+    // A cache line holds the 4 grandchildren:
+    __builtin_prefetch(idx->keys_v6 + 4 * k);
+    k = 2 * k + (idx->keys_v6[k] <= ip);
+  }
+  // Go back up to the last node which key was > ip:
+  k >>= __builtin_ffs(~k);
+  return k ? idx->ranks_v6[k] : idx->num_v6;
+}
 
 char const *country_of_ipv4(uint32_t ip)
 {
-  SEARCH(db_v4);
+  struct geo_index const *idx = get_index();
+  uint32_t r = upper_bound_v4(idx, ip);
+  if (r == 0 || ip > idx->to_v4[--r]) return NULL;
+  return idx->cc_v4[r];
 }
 
 char const *country_of_ipv6(uint128_t ip)
 {
-  SEARCH(db_v6);
+  struct geo_index const *idx = get_index();
+  uint32_t r = upper_bound_v6(idx, ip);
+  if (r == 0 || ip > idx->to_v6[--r]) return NULL;
+  return idx->cc_v6[r];
+}
+
+/*
+ * Loading the CSV files
+ */
+
+// Split a CSV line, in place, into at most max_fields unquoted fields:
+static unsigned split_csv(char *line, char **fields, unsigned max_fields)
+{
+  unsigned n = 0;
+  char *c = line;
+  while (n < max_fields) {
+    while (*c == ' ') c++;
+    if (*c == '"') {
+      fields[n++] = ++c;
+      while (*c != '\0' && *c != '"') c++;
+      if (*c == '"') *c++ = '\0';
+      while (*c != '\0' && *c != ',') c++;
+    } else {
+      fields[n++] = c;
+      while (*c != '\0' && *c != ',' && *c != '\n' && *c != '\r') c++;
+    }
+    if (*c != ',') {
+      *c = '\0';
+      break;
+    }
+    *c++ = '\0';
+  }
+  return n;
+}
+
+static uint128_t uint128_of_in6(struct in6_addr const *a)
+{
+  uint128_t r = 0;
+  for (unsigned i = 0; i < 16; i++) r = (r << 8) | a->s6_addr[i];
+  return r;
+}
+
+/* Same formats as what's compiled in (see make.inc), that zlib also reads
+ * uncompressed: */
+static int read_csv(char const *fname, bool v6, struct ranges *rs)
+{
+  gzFile f = gzopen(fname, "rb");
+  if (! f) {
+    fprintf(stderr, "Cannot open %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+
+  int ret = -1;
+  char line[1024];
+  while (gzgets(f, line, sizeof(line))) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    char *fields[7];
+    unsigned const num_fields = split_csv(line, fields, 7);
+    if (v6) {
+      // ::-ff:ffff:ffff:ffff:ffff:ffff:ffff:ffff,ZZ,iana,838857600
+      if (num_fields < 2 || strlen(fields[1]) != 2) continue;
+      char *dash = strchr(fields[0], '-');
+      if (! dash) continue;
+      *dash = '\0';
+      struct in6_addr from, to;
+      if (1 != inet_pton(AF_INET6, fields[0], &from) ||
+          1 != inet_pton(AF_INET6, dash + 1, &to)) {
+        fprintf(stderr, "%s: Cannot parse IP range %s-%s\n",
+                fname, fields[0], dash + 1);
+        goto err;
+      }
+      struct range *r = new_range(rs);
+      if (! r) goto oom;
+      // Only the network part is significant (see tools/ipcsv.ml):
+      uint128_t const host_mask = ((uint128_t)1 << 64) - 1;
+      r->from = uint128_of_in6(&from) & ~host_mask;
+      r->to = uint128_of_in6(&to) | host_mask;
+      memcpy(r->cc, fields[1], 3);
+    } else {
+      // "16777216","16777471","apnic","1313020800","AU","AUS","Australia"
+      if (num_fields < 5 || strlen(fields[4]) != 2) continue;
+      char *end1, *end2;
+      unsigned long const from = strtoul(fields[0], &end1, 10);
+      unsigned long const to = strtoul(fields[1], &end2, 10);
+      if (*end1 != '\0' || *end2 != '\0' || from > UINT32_MAX || to > UINT32_MAX) {
+        fprintf(stderr, "%s: Cannot parse IP range %s-%s\n",
+                fname, fields[0], fields[1]);
+        goto err;
+      }
+      struct range *r = new_range(rs);
+      if (! r) goto oom;
+      r->from = from;
+      r->to = to;
+      memcpy(r->cc, fields[4], 3);
+    }
+  }
+
+  if (! gzeof(f)) {
+    int errnum;
+    fprintf(stderr, "Cannot read %s: %s\n", fname, gzerror(f, &errnum));
+    goto err;
+  }
+
+  ret = 0;
+  goto err;
+oom:
+  fprintf(stderr, "Cannot allocate country entries\n");
+err:
+  gzclose(f);
+  return ret;
+}
+
+static int write_index(struct geo_index const *idx, char const *fname)
+{
+  int ret = -1;
+  char tmp_fname[PATH_MAX];
+  if ((size_t)snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", fname) >=
+      sizeof(tmp_fname)) {
+    fprintf(stderr, "Index file name too long: %s\n", fname);
+    return -1;
+  }
+
+  int fd = open(tmp_fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create %s: %s\n", tmp_fname, strerror(errno));
+    return -1;
+  }
+
+  char const *c = idx->mem;
+  size_t rem = idx->mem_size;
+  while (rem > 0) {
+    ssize_t w = write(fd, c, rem);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Cannot write %s: %s\n", tmp_fname, strerror(errno));
+      goto err;
+    }
+    c += w;
+    rem -= w;
+  }
+
+  if (0 != fsync(fd)) {
+    fprintf(stderr, "Cannot fsync %s: %s\n", tmp_fname, strerror(errno));
+    goto err;
+  }
+
+  /* Workers still having the previous index mmapped keep their copy until
+   * they reload: */
+  if (0 != rename(tmp_fname, fname)) {
+    fprintf(stderr, "Cannot rename %s into %s: %s\n",
+            tmp_fname, fname, strerror(errno));
+    goto err;
+  }
+
+  ret = 0;
+err:
+  if (0 != close(fd)) {
+    fprintf(stderr, "Cannot close %s: %s\n", tmp_fname, strerror(errno));
+    ret = -1;
+  }
+  if (ret != 0) (void)unlink(tmp_fname);
+  return ret;
+}
+
+int country_of_ip_build_index(
+  char const *v4_csv, char const *v6_csv, char const *index_file)
+{
+  int ret = -1;
+  struct ranges v4 = {}, v6 = {};
+
+  if (0 != read_csv(v4_csv, false, &v4)) goto err;
+  if (0 != read_csv(v6_csv, true, &v6)) goto err;
+
+  struct geo_index *idx = index_of_ranges(&v4, &v6);
+  if (! idx) goto err;
+
+  ret = write_index(idx, index_file);
+  free_index(idx);
+
+err:
+  free(v4.arr);
+  free(v6.arr);
+  return ret;
+}
+
+int country_of_ip_load_index(char const *index_file)
+{
+  int ret = -1;
+  int fd = open(index_file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s: %s\n", index_file, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (0 != fstat(fd, &st)) {
+    fprintf(stderr, "Cannot stat %s: %s\n", index_file, strerror(errno));
+    goto err;
+  }
+
+  struct index_header hdr;
+  if ((size_t)st.st_size < sizeof(hdr) ||
+      sizeof(hdr) != read(fd, &hdr, sizeof(hdr)) ||
+      0 != memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) ||
+      hdr.version != INDEX_VERSION ||
+      hdr.num_v4_nodes != (hdr.num_v4 + BTREE_B - 1) / BTREE_B) {
+    fprintf(stderr, "%s is not a country index\n", index_file);
+    goto err;
+  }
+
+  struct layout l;
+  compute_layout(&l, hdr.num_v4, hdr.num_v4_nodes, hdr.num_v6);
+  if ((size_t)st.st_size != l.size) {
+    fprintf(stderr, "%s: Invalid size (%zu instead of %zu)\n",
+            index_file, (size_t)st.st_size, l.size);
+    goto err;
+  }
+
+  void *mem = mmap(NULL, l.size, PROT_READ, MAP_SHARED|MAP_POPULATE, fd, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Cannot mmap %s: %s\n", index_file, strerror(errno));
+    goto err;
+  }
+
+  struct geo_index *idx = malloc(sizeof(*idx));
+  if (! idx) {
+    fprintf(stderr, "Cannot allocate country index\n");
+    (void)munmap(mem, l.size);
+    goto err;
+  }
+  idx->num_v4 = hdr.num_v4;
+  idx->num_v4_nodes = hdr.num_v4_nodes;
+  idx->num_v6 = hdr.num_v6;
+  idx->mem = mem;
+  idx->mem_size = l.size;
+  idx->mmapped = true;
+  set_pointers(idx, &l);
+
+  set_index(idx);
+  ret = 0;
+err:
+  if (0 != close(fd)) {
+    fprintf(stderr, "Cannot close %s: %s\n", index_file, strerror(errno));
+  }
+  return ret;
 }
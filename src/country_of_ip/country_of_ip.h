@@ -8,4 +8,14 @@ typedef __uint128_t uint128_t;
 char const *country_of_ipv4(uint32_t ip);
 char const *country_of_ipv6(uint128_t ip);
 
+/* Build an index file from the IpToCountry CSV files (possibly gzipped).
+ * Returns 0 on success or -1 on error. */
+int country_of_ip_build_index(
+  char const *v4_csv, char const *v6_csv, char const *index_file);
+
+/* Replace the compiled in database with that index file.
+ * Returns 0 on success or -1 on error, in which case the previous index is
+ * kept. */
+int country_of_ip_load_index(char const *index_file);
+
 #endif
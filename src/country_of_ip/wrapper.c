@@ -37,3 +37,21 @@ CAMLprim value wrap_country_of_ipv6(value ip_)
   ret_ = caml_copy_string(cc);
   CAMLreturn(ret_);
 }
+
+CAMLprim value wrap_country_of_ip_build_index(
+  value v4_csv_, value v6_csv_, value index_file_)
+{
+  CAMLparam3(v4_csv_, v6_csv_, index_file_);
+  if (0 != country_of_ip_build_index(String_val(v4_csv_), String_val(v6_csv_),
+                                     String_val(index_file_)))
+    caml_failwith("Cannot build the country index");
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value wrap_country_of_ip_load_index(value index_file_)
+{
+  CAMLparam1(index_file_);
+  if (0 != country_of_ip_load_index(String_val(index_file_)))
+    caml_failwith("Cannot load the country index");
+  CAMLreturn(Val_unit);
+}
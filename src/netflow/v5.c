@@ -49,19 +49,25 @@ struct nf_flow {
   uint16_t padding2;
 } __attribute__((__packed__));
 
+/* Returns an array of tuples with fields in serialization order (see
+ * RamenNetflowSerialization.netflow_metric).
+ * Values that are the same for all flows of a message are allocated only
+ * once. */
 CAMLprim value wrap_netflow_v5_decode(
-    value buffer_, value num_bytes_, value source_)
+    value buffer_, value start_, value stop_, value source_)
 {
-  CAMLparam3(buffer_, num_bytes_, source_);
-  CAMLlocal2(res, tup);
-  unsigned num_bytes = Long_val(num_bytes_);
-  assert(caml_string_length(buffer_) >= num_bytes);
+  CAMLparam4(buffer_, start_, stop_, source_);
+  CAMLlocal3(res, tup, seqnum_);
+  size_t const start = Long_val(start_);
+  size_t const stop = Long_val(stop_);
+  assert(start <= stop);
+  assert(caml_string_length(buffer_) >= stop);
+  unsigned const num_bytes = stop - start;
   if (num_bytes < sizeof(struct nf_msg)) {
     caml_invalid_argument("message smaller than netflow header");
   }
 
-  // Assuming buffer will be suitably aligned:
-  struct nf_msg const *msg = (struct nf_msg *)String_val(buffer_);
+  struct nf_msg const *msg = (struct nf_msg *)(String_val(buffer_) + start);
 
   unsigned const version = ntohs(msg->version);
   if (version != 5) {
@@ -78,46 +84,51 @@ CAMLprim value wrap_netflow_v5_decode(
     caml_invalid_argument("truncated message or not netflow");
   }
 
-  struct nf_flow const *f = (struct nf_flow *)(msg+1);
+  // Header (read before msg is invalidated by allocations)
+  unsigned const sampling = ntohs(msg->sampling);
+  value const engine_id = Val_uint8(msg->engine_id);
+  value const engine_type = Val_uint8(msg->engine_type);
+  value const sampling_rate = Val_uint16(sampling & 0x3FFF);
+  value const sampling_type = Val_uint8(sampling >> 14U);
+  seqnum_ = copy_uint32(ntohl(msg->seqnum));
+
   // The array of tuples:
   res = caml_alloc(num_flows, 0);
 
 # define NB_FLOW_FIELDS 24
-  for (unsigned i = 0; i < num_flows; i++, f++) {
+  for (unsigned i = 0; i < num_flows; i++) {
+    /* Copy the flow since the buffer could be moved by the GC as we
+     * allocate: */
+    struct nf_flow f;
+    memcpy(&f, String_val(buffer_) + start + sizeof(*msg) + i * sizeof(f),
+           sizeof(f));
     // Alloc a new tuple:
     tup = caml_alloc(NB_FLOW_FIELDS, 0);
     unsigned j = 0;
-    // Source
+    Store_field(tup, j++, copy_uint32(ntohl(f.bytes)));
+    Store_field(tup, j++, copy_uint32(ntohl(f.addr[1]))); // dst
+    Store_field(tup, j++, Val_uint16(ntohs(f.as[1]))); // dst_as
+    Store_field(tup, j++, Val_uint8(f.mask[1])); // dst_mask
+    Store_field(tup, j++, Val_uint16(ntohs(f.port[1]))); // dst_port
+    Store_field(tup, j++, engine_id);
+    Store_field(tup, j++, engine_type);
+    Store_field(tup, j++, Val_uint16(ntohs(f.in_iface)));
+    Store_field(tup, j++, Val_uint8(f.ip_proto));
+    Store_field(tup, j++, Val_uint8(f.ip_tos));
+    Store_field(tup, j++, copy_uint32(ntohl(f.next_hop)));
+    Store_field(tup, j++, Val_uint16(ntohs(f.out_iface)));
+    Store_field(tup, j++, copy_uint32(ntohl(f.packets)));
+    Store_field(tup, j++, sampling_rate);
+    Store_field(tup, j++, sampling_type);
+    Store_field(tup, j++, seqnum_);
     Store_field(tup, j++, source_);
-    // Time
-    double const first = boot_time + ntohl(f->first) / 1e3;
-    Store_field(tup, j++, caml_copy_double(first));
-    double const last = boot_time + ntohl(f->last) / 1e3;
-    Store_field(tup, j++, caml_copy_double(last));
-    // Header
-    Store_field(tup, j++, copy_uint32(ntohl(msg->seqnum)));
-    Store_field(tup, j++, Val_uint8(msg->engine_type));
-    Store_field(tup, j++, Val_uint8(msg->engine_id));
-    unsigned const sampling = ntohs(msg->sampling);
-    Store_field(tup, j++, Val_uint8(sampling >> 14U));
-    Store_field(tup, j++, Val_uint16(sampling & 0x2FFF));
-    // Flow
-    Store_field(tup, j++, copy_uint32(ntohl(f->addr[0])));
-    Store_field(tup, j++, copy_uint32(ntohl(f->addr[1])));
-    Store_field(tup, j++, copy_uint32(ntohl(f->next_hop)));
-    Store_field(tup, j++, Val_uint16(ntohs(f->port[0])));
-    Store_field(tup, j++, Val_uint16(ntohs(f->port[1])));
-    Store_field(tup, j++, Val_uint16(ntohs(f->in_iface)));
-    Store_field(tup, j++, Val_uint16(ntohs(f->out_iface)));
-    Store_field(tup, j++, copy_uint32(ntohl(f->packets)));
-    Store_field(tup, j++, copy_uint32(ntohl(f->bytes)));
-    Store_field(tup, j++, Val_uint8(f->tcp_flags));
-    Store_field(tup, j++, Val_uint8(f->ip_proto));
-    Store_field(tup, j++, Val_uint8(f->ip_tos));
-    Store_field(tup, j++, Val_uint16(ntohs(f->as[0])));
-    Store_field(tup, j++, Val_uint16(ntohs(f->as[1])));
-    Store_field(tup, j++, Val_uint8(f->mask[0]));
-    Store_field(tup, j++, Val_uint8(f->mask[1]));
+    Store_field(tup, j++, copy_uint32(ntohl(f.addr[0]))); // src
+    Store_field(tup, j++, Val_uint16(ntohs(f.as[0]))); // src_as
+    Store_field(tup, j++, Val_uint8(f.mask[0])); // src_mask
+    Store_field(tup, j++, Val_uint16(ntohs(f.port[0]))); // src_port
+    Store_field(tup, j++, caml_copy_double(boot_time + ntohl(f.first) / 1e3)); // start
+    Store_field(tup, j++, caml_copy_double(boot_time + ntohl(f.last) / 1e3)); // stop
+    Store_field(tup, j++, Val_uint8(f.tcp_flags));
 
     assert(j == NB_FLOW_FIELDS);
     Store_field(res, i, tup);
@@ -82,16 +82,30 @@ let main =
       (* Destructor do not seems to be called when the OCaml program exits: *)
       p "external orc_close : handler -> unit = \"orc_handler_close\"" ;
       p "" ;
-      p "(* Parameters: schema * path * index * row per batch * batches per file * archive *)" ;
-      p "external orc_make_handler : string -> string -> bool -> int -> int -> bool -> handler =" ;
-      p "  \"orc_handler_create_bytecode_lol\" \"orc_handler_create\"" ;
+      p "(* Parameters: schema * path * index * options * row per batch * batches per file * archive * async *)" ;
+      p "external orc_make_handler : string -> string -> bool -> (int * int * int * float) -> int -> int -> bool -> bool -> handler =" ;
+      p "  \"orc_handler_create_bytecode\" \"orc_handler_create\"" ;
       p "" ;
       p "let main =" ;
       p "  let syntax () =" ;
-      p "    !logger.error \"%%s [read|write] file.orc\" Sys.argv.(0) ;" ;
+      p "    !logger.error \"%%s [read|write] file.orc [codec [dict_threshold]]\" Sys.argv.(0) ;" ;
       p "    exit 1 in" ;
       p "  let batch_size = 1000 and num_batches = 100 in" ;
-      p "  if Array.length Sys.argv <> 3 then syntax () ;" ;
+      p "  let num_args = Array.length Sys.argv in" ;
+      p "  if num_args < 3 || num_args > 5 then syntax () ;" ;
+      p "  (* Same order as orc_codecs in wrappers.cc: *)" ;
+      p "  let codecs = [| \"none\"; \"zlib\"; \"snappy\"; \"lz4\"; \"zstd\" |] in" ;
+      p "  let codec =" ;
+      p "    if num_args < 4 then 1 else" ;
+      p "    match Array.findi ((=) (String.lowercase_ascii Sys.argv.(3))) codecs with" ;
+      p "    | exception Not_found -> syntax ()" ;
+      p "    | i -> i in" ;
+      p "  let dict_threshold =" ;
+      p "    if num_args < 5 then %f else float_of_string Sys.argv.(4) in"
+        Default.orc_dictionary_threshold ;
+      p "  let options =" ;
+      p "    codec, %d, %d, dict_threshold in"
+        Default.orc_compression_block_size Default.orc_stripe_size ;
       p "  let orc_fname = Sys.argv.(2) in" ;
       p "  match String.lowercase_ascii Sys.argv.(1) with" ;
       p "  | \"read\" | \"r\" ->" ;
@@ -102,7 +116,7 @@ let main =
       p "        \"Read %%d lines (%%d errors)\" lines errs" ;
       p "  | \"write\" | \"w\" ->" ;
       p "      let handler =" ;
-      p "        orc_make_handler %S orc_fname false batch_size num_batches false in"
+      p "        orc_make_handler %S orc_fname false options batch_size num_batches false false in"
         schema ;
       p "      (try forever (fun () ->" ;
       p "            let tuple = read_line () |> value_of_string in" ;
@@ -1,11 +1,21 @@
 // vim: ft=cpp bs=2 ts=2 sts=2 sw=2 expandtab
 #include <cassert>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <orc/OrcFile.hh>
 extern "C" {
 #  include <caml/mlvalues.h>
 #  include <caml/memory.h>
 #  include <caml/alloc.h>
 #  include <caml/custom.h>
+#  include <caml/fail.h>
+#  include <caml/signals.h>
 #  include "../ringbuf/archive.h"
 }
 
@@ -19,18 +29,271 @@ using namespace orc;
  * Writing ORC files
  */
 
+/* Storage for the strings of the current batch, that must stay valid until
+ * the batch is written. Made of segments that are never reallocated, so
+ * that previously returned pointers stay valid; and recycled for the next
+ * batch once flushed. */
+class StringArena {
+    struct Segment {
+      unique_ptr<char[]> data;
+      size_t size;
+      size_t used;
+      Segment(size_t sz) : data(new char[sz]), size(sz), used(0) {}
+    };
+    vector<Segment> segments;
+    size_t cur; // Index of the segment currently filled
+  public:
+    StringArena() : cur(0) {}
+    char *keep(char const *, size_t len);
+    void clear();
+};
+
+#define STRS_SEGMENT_SIZE 1000000
+
+char *StringArena::keep(char const *s, size_t len)
+{
+  size_t const sz = len + 1; // Also keep a final nul byte
+  while (cur < segments.size() &&
+         segments[cur].used + sz > segments[cur].size) cur++;
+  if (cur >= segments.size())
+    segments.emplace_back(max((size_t)STRS_SEGMENT_SIZE, sz));
+  Segment &seg = segments[cur];
+  char *dst = seg.data.get() + seg.used;
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  seg.used += sz;
+  return dst;
+}
+
+void StringArena::clear()
+{
+  for (Segment &seg : segments) seg.used = 0;
+  cur = 0;
+}
+
+/* How ORC files are compressed and encoded. Zero sizes stand for liborc's
+ * defaults. */
+struct OrcOptions {
+  CompressionKind compression;
+  uint64_t compression_block_size;
+  uint64_t stripe_size;
+  double dictionary_threshold;
+};
+
+/* In async mode, full batches are handed over to a dedicated thread that
+ * compresses, writes and archives them, while the worker fills another
+ * batch. */
+struct OrcJob {
+  unique_ptr<ColumnVectorBatch> batch;
+  unique_ptr<StringArena> strs;
+  bool close; // Close (and maybe archive) the file after that batch
+  double start, stop;
+};
+
+// How many batches can be queued or being written before the worker blocks:
+#define ORC_MAX_PENDING_BATCHES 2
+
+class AsyncWriter {
+    Type const &type;
+    string const fname;
+    bool const with_index;
+    OrcOptions const &options;
+    bool const archive;
+    mutex lock;
+    condition_variable has_job, has_room;
+    deque<OrcJob> jobs;
+    unsigned num_pending; // Queued or being written
+    vector<OrcJob> free_jobs; // Recycled batches and arenas
+    bool quit;
+    // First error met by the writer thread, after which nothing more is
+    // written (protected by lock):
+    exception_ptr error;
+    // Only the writer thread touches those:
+    unique_ptr<OutputStream> outStream;
+    unique_ptr<Writer> writer;
+    thread thd;
+    void run();
+    void write(OrcJob &);
+  public:
+    AsyncWriter(Type const &, string, bool with_index, OrcOptions const &,
+                bool archive);
+    ~AsyncWriter();
+    void finish();
+    void push(OrcJob &&);
+    void get_free(OrcJob &);
+    void get_stats(unsigned &depth, uint64_t &num_flushes,
+                   double &tot_flush_time, double &max_flush_time);
+  private:
+    // Stats, protected by lock:
+    uint64_t num_flushes;
+    double tot_flush_time, max_flush_time;
+};
+
+static unique_ptr<Writer> open_writer(
+  Type const &type, string const &fname, bool with_index,
+  OrcOptions const &opts, unique_ptr<OutputStream> &outStream)
+{
+  outStream = writeLocalFile(fname);
+  WriterOptions options;
+  options.setRowIndexStride(with_index ? 10000 : 0); // To disable indexing
+  options.setCompression(opts.compression);
+  if (opts.compression_block_size > 0)
+    options.setCompressionBlockSize(opts.compression_block_size);
+  if (opts.stripe_size > 0)
+    options.setStripeSize(opts.stripe_size);
+  options.setDictionaryKeySizeThreshold(opts.dictionary_threshold);
+  return createWriter(type, outStream.get(), options);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+AsyncWriter::AsyncWriter(Type const &t, string fn, bool wi,
+                         OrcOptions const &opts, bool arc) :
+  type(t), fname(fn), with_index(wi), options(opts), archive(arc),
+  num_pending(0),
+  quit(false), num_flushes(0), tot_flush_time(0), max_flush_time(0)
+{
+  thd = thread(&AsyncWriter::run, this);
+}
+
+// Wait for all pending batches to be written:
+AsyncWriter::~AsyncWriter()
+{
+  if (! thd.joinable()) return;
+  {
+    unique_lock<mutex> guard(lock);
+    quit = true;
+  }
+  has_job.notify_one();
+  thd.join();
+}
+
+/* Same as above, but rethrows the error that prevented some batches to be
+ * written, if any: */
+void AsyncWriter::finish()
+{
+  {
+    unique_lock<mutex> guard(lock);
+    quit = true;
+  }
+  has_job.notify_one();
+  thd.join();
+  if (error) rethrow_exception(error);
+}
+
+/* Once a write failed, the file is not reopened (which would truncate it)
+ * and the remaining batches are dropped. The error is given to the worker
+ * on the next push or when closing: */
+void AsyncWriter::write(OrcJob &job)
+{
+  {
+    unique_lock<mutex> guard(lock);
+    if (error) return;
+  }
+  try {
+    if (! writer)
+      writer = open_writer(type, fname, with_index, options, outStream);
+    writer->add(*job.batch);
+    if (job.close) {
+      writer->close();
+      writer.reset();
+      outStream.reset();
+      if (archive) ramen_archive(fname.c_str(), job.start, job.stop);
+    }
+  } catch (exception const &e) {
+    cerr << "Cannot write ORC file " << fname << ": " << e.what() << endl;
+    writer.reset();
+    outStream.reset();
+    unique_lock<mutex> guard(lock);
+    error = current_exception();
+  }
+}
+
+void AsyncWriter::run()
+{
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    has_job.wait(guard, [this]{ return quit || !jobs.empty(); });
+    if (jobs.empty()) break; // quit once everything is written
+    OrcJob job = move(jobs.front());
+    jobs.pop_front();
+    guard.unlock();
+    double const t0 = now();
+    write(job);
+    double const dt = now() - t0;
+    job.batch->clear();
+    job.strs->clear();
+    guard.lock();
+    free_jobs.push_back(move(job));
+    num_pending--;
+    num_flushes++;
+    tot_flush_time += dt;
+    if (dt > max_flush_time) max_flush_time = dt;
+    has_room.notify_one();
+  }
+}
+
+/* Blocks while too many batches are pending. The OCaml runtime is released
+ * meanwhile since only C++ data are involved. */
+void AsyncWriter::push(OrcJob &&job)
+{
+  exception_ptr err;
+  caml_enter_blocking_section();
+  {
+    unique_lock<mutex> guard(lock);
+    has_room.wait(guard, [this]{
+      return error || num_pending < ORC_MAX_PENDING_BATCHES; });
+    if (error) {
+      err = error;
+    } else {
+      jobs.push_back(move(job));
+      num_pending++;
+    }
+  }
+  caml_leave_blocking_section();
+  if (err) rethrow_exception(err);
+  has_job.notify_one();
+}
+
+void AsyncWriter::get_free(OrcJob &job)
+{
+  unique_lock<mutex> guard(lock);
+  if (! free_jobs.empty()) {
+    job = move(free_jobs.back());
+    free_jobs.pop_back();
+  }
+}
+
+void AsyncWriter::get_stats(unsigned &depth, uint64_t &nf, double &tot, double &max)
+{
+  unique_lock<mutex> guard(lock);
+  depth = num_pending;
+  nf = num_flushes;
+  tot = tot_flush_time;
+  max = max_flush_time;
+}
+
 class OrcHandler {
     unique_ptr<Type> type;
     string fname;
     bool const with_index;
+    OrcOptions const options;
     unsigned const batch_size;
     unsigned const max_batches;
     unsigned num_batches;
     bool archive;
-    std::vector<char> strs;
+    unique_ptr<StringArena> strs;
+    bool const async;
+    unique_ptr<AsyncWriter> async_writer;
   public:
-    OrcHandler(string schema, string fn, bool with_index, unsigned bsz, unsigned mb, bool arc);
+    OrcHandler(string schema, string fn, bool with_index, OrcOptions const &, unsigned bsz, unsigned mb, bool arc, bool async);
     ~OrcHandler();
+    void close();
     void start_write();
     void flush_batch(bool);
     char *keep_string(char const *, size_t len);
@@ -38,60 +301,109 @@ class OrcHandler {
     unique_ptr<Writer> writer;
     unique_ptr<ColumnVectorBatch> batch;
     double start, stop;
+    void get_stats(unsigned &, uint64_t &, double &, double &);
 };
 
-#define MAX_STRS_SIZE 999999
-
-OrcHandler::OrcHandler(string sch, string fn, bool wi, unsigned bsz, unsigned mb, bool arc) :
+OrcHandler::OrcHandler(string sch, string fn, bool wi, OrcOptions const &opts, unsigned bsz, unsigned mb, bool arc, bool as) :
   type(Type::buildTypeFromString(sch)), fname(fn), with_index(wi),
-  batch_size(bsz), max_batches(mb), num_batches(0), archive(arc)
+  options(opts),
+  batch_size(bsz), max_batches(mb), num_batches(0), archive(arc),
+  strs(new StringArena()), async(as)
 {
-  strs.reserve(MAX_STRS_SIZE);  // FIXME: something better than a vector
 }
 
 OrcHandler::~OrcHandler()
 {
-  flush_batch(false);
+  try {
+    flush_batch(false);
+  } catch (exception const &e) {
+    cerr << "Cannot write ORC file " << fname << ": " << e.what() << endl;
+  }
+  // Wait for the writer thread to finish with the pending batches:
+  caml_enter_blocking_section();
+  async_writer.reset();
+  caml_leave_blocking_section();
 };
 
+/* Like the destructor, but throws if some batches could not be written: */
+void OrcHandler::close()
+{
+  flush_batch(false);
+  if (async_writer) {
+    exception_ptr err;
+    caml_enter_blocking_section();
+    try {
+      async_writer->finish();
+    } catch (...) {
+      err = current_exception();
+    }
+    async_writer.reset();
+    caml_leave_blocking_section();
+    if (err) rethrow_exception(err);
+  }
+}
+
 void OrcHandler::start_write()
 {
-  outStream = writeLocalFile(fname);
-  WriterOptions options;
-  options.setRowIndexStride(with_index ? 10000 : 0); // To disable indexing
-  writer = createWriter(*type, outStream.get(), options);
-  batch = writer->createRowBatch(batch_size);
+  if (async) {
+    if (! async_writer)
+      async_writer.reset(
+        new AsyncWriter(*type, fname, with_index, options, archive));
+    OrcJob job;
+    async_writer->get_free(job);
+    batch = job.batch ? move(job.batch) :
+                        type->createRowBatch(batch_size, *getDefaultPool());
+    strs = job.strs ? move(job.strs) : unique_ptr<StringArena>(new StringArena());
+  } else {
+    writer = open_writer(*type, fname, with_index, options, outStream);
+    /* We could keep using the batch created by the first writer,
+     * as writer->createRowBatch just call the proper createRowBatch for
+     * that Type. */
+    batch = writer->createRowBatch(batch_size);
+    if (! strs) strs.reset(new StringArena());
+  }
   assert(batch);
 }
 
+/* Leaves either an empty batch or no batch at all (if the file has been
+ * closed), in which case start_write must be called again. */
 void OrcHandler::flush_batch(bool more_to_come)
 {
-  if (writer) {
+  if (! batch) return;
+  bool const close = !more_to_come || ++num_batches >= max_batches;
+  if (close) num_batches = 0;
+  if (async) {
+    OrcJob job { move(batch), move(strs), close, start, stop };
+    async_writer->push(move(job));
+    if (! close) start_write();
+  } else {
     writer->add(*batch);
     batch->clear();
-    strs.clear();
-    if (!more_to_come || ++num_batches >= max_batches) {
-      num_batches = 0;
+    strs->clear();
+    if (close) {
       writer->close();
       writer.reset();
       batch.reset();
       outStream.reset();
       if (archive) ramen_archive(fname.c_str(), start, stop);
-      /* We could keep using the batch created by the first writer,
-       * as writer->createRowBatch just call the proper createRowBatch for
-       * that Type. */
     }
   }
 }
 
-/// strs must not reallocate!
 char *OrcHandler::keep_string(char const *s, size_t len)
 {
-  assert(strs.size() + len <= strs.capacity());
-  size_t const pos = strs.size();
-  while (*s != '\0') strs.push_back(*s++);
-  strs.push_back('\0');
-  return &strs[pos];
+  return strs->keep(s, len);
+}
+
+void OrcHandler::get_stats(unsigned &depth, uint64_t &num_flushes, double &tot, double &max)
+{
+  if (async_writer) {
+    async_writer->get_stats(depth, num_flushes, tot, max);
+  } else {
+    depth = 0;
+    num_flushes = 0;
+    tot = max = 0.;
+  }
 }
 
 #define Handler_val(v) (*((class OrcHandler **)Data_custom_val(v)))
@@ -106,19 +418,38 @@ static struct custom_operations handler_ops = {
   custom_compare_ext_default
 };
 
-extern "C" value orc_handler_create(value schema_, value path_, value with_index_, value batch_sz_, value max_batches_, value archive_)
+// Must match the order of CodeGenLib_Publish.orc_codec_of_compression:
+static CompressionKind const orc_codecs[] = {
+  CompressionKind_NONE, CompressionKind_ZLIB, CompressionKind_SNAPPY,
+  CompressionKind_LZ4, CompressionKind_ZSTD
+};
+
+/* options_ is a tuple of codec, compression block size, stripe size and
+ * dictionary threshold: */
+extern "C" value orc_handler_create(value schema_, value path_, value with_index_, value options_, value batch_sz_, value max_batches_, value archive_, value async_)
 {
-  CAMLparam5(schema_, path_, with_index_, batch_sz_, max_batches_);
-  CAMLxparam1(archive_);
+  CAMLparam5(schema_, path_, with_index_, options_, batch_sz_);
+  CAMLxparam3(max_batches_, archive_, async_);
   CAMLlocal1(res);
   char const *schema = String_val(schema_);
   char const *path = String_val(path_);
   bool with_index = Bool_val(with_index_);
+  unsigned codec = Long_val(Field(options_, 0));
+  if (codec >= sizeof orc_codecs / sizeof orc_codecs[0])
+    caml_invalid_argument("orc_handler_create: codec");
+  OrcOptions options {
+    orc_codecs[codec],
+    (uint64_t)Long_val(Field(options_, 1)),
+    (uint64_t)Long_val(Field(options_, 2)),
+    Double_val(Field(options_, 3))
+  };
   unsigned batch_sz = Long_val(batch_sz_);
   unsigned max_batches = Long_val(max_batches_);
   bool archive = Bool_val(archive_);
+  bool async = Bool_val(async_);
   OrcHandler *hder =
-    new OrcHandler(schema, path, with_index, batch_sz, max_batches, archive);
+    new OrcHandler(schema, path, with_index, options, batch_sz, max_batches,
+                   archive, async);
   res = caml_alloc_custom(&handler_ops, sizeof *hder, 0, 1);
   Handler_val(res) = hder;
   CAMLreturn(res);
@@ -130,7 +461,40 @@ extern "C" value orc_handler_close(value hder_)
   OrcHandler *handler = Handler_val(hder_);
   if (handler) {
     Handler_val(hder_) = nullptr;
+    string err;
+    try {
+      handler->close();
+    } catch (exception const &e) {
+      err = string("Cannot write ORC file: ") + e.what();
+    }
     delete handler;
+    if (! err.empty()) caml_failwith(err.c_str());
   }
   CAMLreturn(Val_unit);
 }
+
+extern "C" value orc_handler_create_bytecode(value *argv, int argn)
+{
+  assert(argn == 8);
+  return orc_handler_create(argv[0], argv[1], argv[2], argv[3], argv[4],
+                            argv[5], argv[6], argv[7]);
+}
+
+/* Returns the number of batches queued or being written, the number of
+ * batches written so far, and the total and max time spent writing one: */
+extern "C" value orc_handler_stats(value hder_)
+{
+  CAMLparam1(hder_);
+  CAMLlocal1(res);
+  OrcHandler *handler = Handler_val(hder_);
+  unsigned depth = 0;
+  uint64_t num_flushes = 0;
+  double tot_time = 0., max_time = 0.;
+  if (handler) handler->get_stats(depth, num_flushes, tot_time, max_time);
+  res = caml_alloc_tuple(4);
+  Store_field(res, 0, Val_long(depth));
+  Store_field(res, 1, Val_long(num_flushes));
+  Store_field(res, 2, caml_copy_double(tot_time));
+  Store_field(res, 3, caml_copy_double(max_time));
+  CAMLreturn(res);
+}
@@ -209,6 +209,12 @@ let dessser_codegen =
                              "force", ForceDessser ] in
   Arg.(value (opt (enum uses) NoDessser i))
 
+let native_codegen =
+  let i = info_of_opt CliInfo.native_codegen in
+  let uses = RamenCompiler.[ "never", NoNative ; "try", TryNative ;
+                             "force", ForceNative ] in
+  Arg.(value (opt (enum uses) NoNative i))
+
 let optimization_level =
   let i = info_of_opt CliInfo.optimization_level in
   Arg.(value (opt int !DessserEval.inline_level i))
@@ -727,6 +733,10 @@ let as_ =
 let replace =
   flag_of_opt CliInfo.replace
 
+let compilation_cache =
+  let i = info_of_opt CliInfo.compilation_cache in
+  Arg.(value (opt (some path) None i))
+
 let compile =
   Term.(
     (const RamenCliCmd.compile
@@ -736,7 +746,9 @@ let compile =
       $ max_simult_compilations
       $ smt_solver
       $ dessser_codegen
+      $ native_codegen
       $ optimization_level
+      $ compilation_cache
       $ src_files
       $ output_file
       $ as_
@@ -758,6 +770,10 @@ let execomp_quarantine =
   let i = info_of_opt CliInfo.execomp_quarantine in
   Arg.(value (opt float Default.execomp_quarantine i))
 
+let execomp_jobs =
+  let i = info_of_opt CliInfo.execomp_jobs in
+  Arg.(value (opt int Default.execomp_jobs i))
+
 let execompserver =
   Term.(
     (const RamenCliCmd.execompserver
@@ -769,8 +785,11 @@ let execompserver =
       $ external_compiler
       $ max_simult_compilations
       $ dessser_codegen
+      $ native_codegen
       $ optimization_level
-      $ execomp_quarantine),
+      $ execomp_quarantine
+      $ execomp_jobs
+      $ compilation_cache),
     info_of_cmd CliInfo.execompserver)
 
 let report_period =
@@ -1189,6 +1208,7 @@ let test =
       $ max_simult_compilations
       $ smt_solver
       $ dessser_codegen
+      $ native_codegen
       $ optimization_level
       $ test_file),
     info_of_cmd CliInfo.test)
@@ -1250,6 +1270,7 @@ let start =
       $ external_compiler
       $ max_simult_compilations
       $ dessser_codegen
+      $ native_codegen
       $ optimization_level
       $ server_pub_key_file
       $ server_priv_key_file
@@ -1272,6 +1293,8 @@ let start =
       $ incidents_history_length
       $ purge_incidents_every
       $ execomp_quarantine
+      $ execomp_jobs
+      $ compilation_cache
       $ allow_upgrade),
     info_of_cmd CliInfo.start)
 
@@ -1300,6 +1323,26 @@ let stats =
       $ metric_name),
     info_of_cmd CliInfo.stats)
 
+(*
+ * Geolocation database
+ *)
+
+let country_csv_v4 =
+  let i = info_of_opt CliInfo.country_csv_v4 in
+  Arg.(value (pos 0 path (N.path "IpToCountry.csv.gz") i))
+
+let country_csv_v6 =
+  let i = info_of_opt CliInfo.country_csv_v6 in
+  Arg.(value (pos 1 path (N.path "IpToCountry.6R.csv.gz") i))
+
+let update_country_db =
+  Term.(
+    (const RamenCliCmd.update_country_db
+      $ copts ()
+      $ country_csv_v4
+      $ country_csv_v6),
+    info_of_cmd CliInfo.update_country_db)
+
 (*
  * Autocompletion
  *)
@@ -1360,6 +1403,8 @@ let () =
         test ; test_alert ;
         (* introspection: *)
         variants ; stats ;
+        (* geolocation: *)
+        update_country_db ;
         (* debug: *)
         autocomplete ; expand
       ]) with
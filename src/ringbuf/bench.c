@@ -0,0 +1,493 @@
+// vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+/* Throughput and latency benchmark for ring buffers.
+ *
+ * Each case forks some producers and consumers around a fresh ring buffer
+ * and reports how many messages (and bytes) went through per second, and
+ * the enqueue-to-dequeue latency percentiles, measured from a timestamp that
+ * producers write at the beginning of every message.
+ *
+ * Non-wrapping cases have no consumers: they measure how fast producers can
+ * fill archive files, rotation included (archives are read back by replays,
+ * not dequeued).
+ *
+ * Results are printed as one line per case, so that the output of one run
+ * can be used as the reference (-r) for later runs, that then fail if
+ * throughput dropped or p99 latency rose by more than the tolerance (-T).
+ *
+ * Build once per locking strategy (none, LOCK_WITH_SPINLOCK or
+ * LOCK_WITH_LOCKF) to compare them (see the ringbuf-bench make target).
+ */
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+#include "ringbuf.h"
+
+#define RB_VERSION 42
+#define RB_WORDS (1U << 20)
+// Latency samples kept per consumer (reservoir sampling past that):
+#define MAX_SAMPLES (1U << 18)
+#define MAX_CONSUMERS 8
+// How many bytes each case enqueues in total, at most, before scaling:
+#define CASE_BYTES (256UL << 20)
+#define CASE_MAX_MSGS 2000000UL
+
+#if defined(LOCK_WITH_LOCKF)
+# define LOCK_NAME "lockf"
+#elif defined(LOCK_WITH_SPINLOCK)
+# define LOCK_NAME "spinlock"
+#else
+# define LOCK_NAME "lockfree"
+#endif
+
+struct bench_case {
+  char const *name;
+  unsigned num_producers;
+  unsigned num_consumers;
+  bool broadcast;  // Every consumer reads every message
+  bool wrap;
+  uint32_t num_words;  // Per message
+};
+
+#define SIZES(name, p, c, bcast, wrap) \
+  { name, p, c, bcast, wrap, 1 }, \
+  { name, p, c, bcast, wrap, 16 }, \
+  { name, p, c, bcast, wrap, 256 }, \
+  { name, p, c, bcast, wrap, MAX_RINGBUF_MSG_WORDS - 1 }
+
+static struct bench_case const cases[] = {
+  SIZES("1P1C", 1, 1, false, true),
+  SIZES("4P1C", 4, 1, false, true),
+  SIZES("1P4C", 1, 4, false, true),
+  SIZES("1P4C-bcast", 1, 4, true, true),
+  SIZES("1P-archive", 1, 0, false, false),
+};
+
+/* Shared between the parent and all the children of a case: */
+struct shared {
+  uint32_t _Atomic ready;
+  uint32_t _Atomic go;
+  uint64_t _Atomic consumed;
+  uint32_t num_samples[MAX_CONSUMERS];
+  uint32_t samples[MAX_CONSUMERS][MAX_SAMPLES];
+};
+
+static char rb_dir[PATH_MAX];
+static char fname[PATH_MAX];
+static double scale = 1.;
+static double ns_per_tick = 1.;
+
+/*
+ * Time measurement
+ *
+ * Only the lower 32 bits of the timestamp are stored so that even single
+ * word messages can be timed; latencies are then computed modulo 2^32
+ * ticks, which is more than a second.
+ */
+
+static uint64_t ticks(void)
+{
+# if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+# else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+# endif
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void calibrate(void)
+{
+  struct timespec const pause = { .tv_sec = 0, .tv_nsec = 100000000 };
+  double const t0 = now();
+  uint64_t const k0 = ticks();
+  nanosleep(&pause, NULL);
+  double const t1 = now();
+  uint64_t const k1 = ticks();
+  ns_per_tick = (t1 - t0) * 1e9 / (double)(k1 - k0);
+}
+
+/*
+ * Children
+ */
+
+static void load(struct ringbuf *rb)
+{
+  if (RB_OK != ringbuf_load(rb, RB_VERSION, fname)) {
+    fprintf(stderr, "Cannot load ringbuffer %s\n", fname);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void wait_go(struct shared *sh)
+{
+  atomic_fetch_add(&sh->ready, 1);
+  while (! atomic_load(&sh->go)) sched_yield();
+}
+
+static void producer(struct shared *sh, struct bench_case const *c, unsigned long num_msgs)
+{
+  struct ringbuf rb;
+  load(&rb);
+  uint32_t *data = calloc(c->num_words, sizeof(*data));
+  assert(data);
+  wait_go(sh);
+
+  for (unsigned long m = 0; m < num_msgs; ) {
+    data[0] = (uint32_t)ticks();
+    switch (ringbuf_enqueue(&rb, data, c->num_words, 0., 0.)) {
+      case RB_OK:
+        m++;
+        break;
+      case RB_ERR_NO_MORE_ROOM:
+        sched_yield();
+        break;
+      default:
+        fprintf(stderr, "Cannot enqueue\n");
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  free(data);
+  ringbuf_unload(&rb);
+}
+
+static void consumer(struct shared *sh, struct bench_case const *c, unsigned n, uint64_t total)
+{
+  struct ringbuf rb;
+  load(&rb);
+  if (c->broadcast && RB_OK != ringbuf_register_consumer(&rb)) {
+    fprintf(stderr, "Consumer %u cannot register\n", n);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t *samples = sh->samples[n];
+  uint64_t seen = 0;
+  uint32_t rnd = 2463534242U + n;  // xorshift32 state for the reservoir
+  wait_go(sh);
+
+  while (c->broadcast ? seen < total : atomic_load(&sh->consumed) < total) {
+    struct ringbuf_tx tx;
+    ssize_t const num_records =
+      ringbuf_dequeue_alloc_batch(&rb, &tx, 64, RB_WORDS);
+    if (num_records < 0) {
+      sched_yield();
+      continue;
+    }
+    uint32_t const t = (uint32_t)ticks();
+    struct ringbuf_tx cursor = tx;
+    for (ssize_t r = 0; r < num_records; r++) {
+      if (r > 0) ringbuf_batch_next(&rb, &cursor);
+      uint32_t const lat = t - rb.rbf->data[cursor.record_start];
+      if (seen < MAX_SAMPLES) {
+        samples[seen] = lat;
+      } else {
+        rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5;
+        uint64_t const i = rnd % (seen + 1);
+        if (i < MAX_SAMPLES) samples[i] = lat;
+      }
+      seen++;
+    }
+    ringbuf_dequeue_commit(&rb, &tx);
+    if (! c->broadcast) atomic_fetch_add(&sh->consumed, num_records);
+  }
+
+  sh->num_samples[n] = seen < MAX_SAMPLES ? seen : MAX_SAMPLES;
+  ringbuf_unload(&rb);
+}
+
+/*
+ * Running a case
+ */
+
+struct result {
+  double msgs_per_sec;
+  double bytes_per_sec;
+  double p50, p99, p999;  // in ns, or negative if there were no consumers
+};
+
+static int cmp_u32(void const *a_, void const *b_)
+{
+  uint32_t const a = *(uint32_t const *)a_, b = *(uint32_t const *)b_;
+  return a < b ? -1 : a > b;
+}
+
+static double percentile(uint32_t const *sorted, size_t n, double p)
+{
+  size_t i = p * n;
+  if (i >= n) i = n - 1;
+  return sorted[i] * ns_per_tick;
+}
+
+/* Remove every file of that directory, recursing once for the archives: */
+static void remove_files_of(char const *dir_name, bool recurse)
+{
+  DIR *dir = opendir(dir_name);
+  if (! dir) return;
+  struct dirent *e;
+  while (NULL != (e = readdir(dir))) {
+    if (e->d_name[0] == '.') continue;
+    char path[PATH_MAX + NAME_MAX + 2];
+    snprintf(path, sizeof(path), "%s/%s", dir_name, e->d_name);
+    if (0 != unlink(path) && errno == EISDIR && recurse) {
+      remove_files_of(path, false);
+      (void)rmdir(path);
+    }
+  }
+  closedir(dir);
+}
+
+static void remove_files(void)
+{
+  remove_files_of(rb_dir, true);
+}
+
+static int run_case(struct bench_case const *c, struct shared *sh, struct result *res)
+{
+  assert(c->num_consumers <= MAX_CONSUMERS);
+  remove_files();
+  if (RB_OK != ringbuf_create(RB_VERSION, c->wrap, RB_WORDS, 0., false,
+                              c->broadcast ? c->num_consumers : 0, 0, fname)) {
+    fprintf(stderr, "Cannot create ringbuffer in %s\n", fname);
+    return -1;
+  }
+
+  unsigned long msgs_per_producer =
+    CASE_BYTES / (c->num_words * sizeof(uint32_t));
+  if (msgs_per_producer > CASE_MAX_MSGS) msgs_per_producer = CASE_MAX_MSGS;
+  msgs_per_producer = (msgs_per_producer * scale) / c->num_producers;
+  if (msgs_per_producer == 0) msgs_per_producer = 1;
+  uint64_t const total = (uint64_t)msgs_per_producer * c->num_producers;
+
+  memset(sh, 0, offsetof(struct shared, samples));
+  unsigned const num_children = c->num_producers + c->num_consumers;
+
+  for (unsigned n = 0; n < c->num_consumers; n++) {
+    pid_t p = fork();
+    if (p < 0) {
+      perror("fork");
+      return -1;
+    } else if (! p) {
+      consumer(sh, c, n, total);
+      exit(EXIT_SUCCESS);
+    }
+  }
+  for (unsigned n = 0; n < c->num_producers; n++) {
+    pid_t p = fork();
+    if (p < 0) {
+      perror("fork");
+      return -1;
+    } else if (! p) {
+      producer(sh, c, msgs_per_producer);
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  // Consumers register before being ready, so no message can be missed:
+  while (atomic_load(&sh->ready) < num_children) sched_yield();
+  double const t0 = now();
+  atomic_store(&sh->go, 1);
+
+  int ret = 0;
+  for (unsigned n = 0; n < num_children; n++) {
+    int status;
+    if (wait(&status) < 0 || ! WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) ret = -1;
+  }
+  double const dt = now() - t0;
+  remove_files();
+  if (ret != 0) return ret;
+
+  uint64_t const delivered =
+    c->broadcast ? total * c->num_consumers : total;
+  res->msgs_per_sec = delivered / dt;
+  res->bytes_per_sec = res->msgs_per_sec * c->num_words * sizeof(uint32_t);
+
+  // Merge the samples of all consumers:
+  size_t num_samples = 0;
+  for (unsigned n = 0; n < c->num_consumers; n++) {
+    memmove(sh->samples[0] + num_samples, sh->samples[n],
+            sh->num_samples[n] * sizeof(uint32_t));
+    num_samples += sh->num_samples[n];
+  }
+  if (num_samples == 0) {
+    res->p50 = res->p99 = res->p999 = -1.;
+  } else {
+    qsort(sh->samples[0], num_samples, sizeof(uint32_t), cmp_u32);
+    res->p50 = percentile(sh->samples[0], num_samples, 0.5);
+    res->p99 = percentile(sh->samples[0], num_samples, 0.99);
+    res->p999 = percentile(sh->samples[0], num_samples, 0.999);
+  }
+  return 0;
+}
+
+/*
+ * Reference results
+ */
+
+#define MAX_REFS 256
+
+struct reference {
+  char lock[16];
+  char name[32];
+  unsigned num_words;
+  double msgs_per_sec;
+  double p99;
+};
+
+static struct reference refs[MAX_REFS];
+static unsigned num_refs;
+
+static int read_refs(char const *ref_fname)
+{
+  FILE *f = fopen(ref_fname, "r");
+  if (! f) {
+    fprintf(stderr, "Cannot open %s: %s\n", ref_fname, strerror(errno));
+    return -1;
+  }
+  char line[512];
+  while (num_refs < MAX_REFS && fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') continue;
+    struct reference *r = refs + num_refs;
+    double bytes_per_sec, p50, p999;
+    if (8 == sscanf(line, "%15s %31s %u %lf %lf %lf %lf %lf",
+                    r->lock, r->name, &r->num_words, &r->msgs_per_sec,
+                    &bytes_per_sec, &p50, &r->p99, &p999))
+      num_refs++;
+  }
+  fclose(f);
+  return 0;
+}
+
+static struct reference const *find_ref(struct bench_case const *c)
+{
+  for (unsigned i = 0; i < num_refs; i++) {
+    if (0 == strcmp(refs[i].lock, LOCK_NAME) &&
+        0 == strcmp(refs[i].name, c->name) &&
+        refs[i].num_words == c->num_words) return refs + i;
+  }
+  return NULL;
+}
+
+/* Returns false if that result regressed compared to the reference: */
+static bool check_ref(struct bench_case const *c, struct result const *res, double tolerance)
+{
+  struct reference const *ref = find_ref(c);
+  if (! ref) return true;
+  bool ok = true;
+  if (res->msgs_per_sec < ref->msgs_per_sec * (1. - tolerance)) {
+    fprintf(stderr, "REGRESSION: %s %s %u words: %.0f msgs/s < %.0f\n",
+            LOCK_NAME, c->name, c->num_words,
+            res->msgs_per_sec, ref->msgs_per_sec);
+    ok = false;
+  }
+  if (ref->p99 >= 0. && res->p99 > ref->p99 * (1. + tolerance)) {
+    fprintf(stderr, "REGRESSION: %s %s %u words: p99 %.0fns > %.0fns\n",
+            LOCK_NAME, c->name, c->num_words, res->p99, ref->p99);
+    ok = false;
+  }
+  return ok;
+}
+
+int main(int num_args, char **args)
+{
+  char const *only = NULL;
+  char const *parent_dir = "/tmp";
+  double tolerance = 0.25;
+  int opt;
+  while (-1 != (opt = getopt(num_args, args, "c:d:r:s:T:h"))) {
+    switch (opt) {
+      case 'c':
+        only = optarg;
+        break;
+      case 'd':
+        parent_dir = optarg;
+        break;
+      case 'r':
+        if (0 != read_refs(optarg)) return EXIT_FAILURE;
+        break;
+      case 's':
+        scale = strtod(optarg, NULL);
+        break;
+      case 'T':
+        tolerance = strtod(optarg, NULL) / 100.;
+        break;
+      default:
+        printf("%s [-c case] [-d dir] [-r reference] [-s scale] "
+               "[-T tolerance%%]\n", args[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (scale <= 0.) {
+    fprintf(stderr, "Scale must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  // Each run has its own directory, since archives of a directory share
+  // their sequence numbers:
+  if ((size_t)snprintf(rb_dir, sizeof(rb_dir), "%s/ringbuf_bench.%d",
+                       parent_dir, (int)getpid()) >= sizeof(rb_dir) ||
+      (size_t)snprintf(fname, sizeof(fname), "%s/rb", rb_dir)
+        >= sizeof(fname)) {
+    fprintf(stderr, "Directory name too long\n");
+    return EXIT_FAILURE;
+  }
+  if (0 != mkdir(rb_dir, S_IRWXU)) {
+    fprintf(stderr, "Cannot create %s: %s\n", rb_dir, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct shared *sh =
+    mmap(NULL, sizeof(*sh), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+         -1, 0);
+  if (sh == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+
+  calibrate();
+  printf("# lock case words msgs/s bytes/s p50_ns p99_ns p999_ns\n");
+  fflush(stdout);
+
+  int ret = EXIT_SUCCESS;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+    struct bench_case const *c = cases + i;
+    if (only && 0 != strcmp(only, c->name)) continue;
+    struct result res;
+    if (0 != run_case(c, sh, &res)) {
+      fprintf(stderr, "Case %s with %u words failed\n", c->name, c->num_words);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    printf("%s %s %u %.0f %.0f %.0f %.0f %.0f\n",
+           LOCK_NAME, c->name, c->num_words, res.msgs_per_sec,
+           res.bytes_per_sec, res.p50, res.p99, res.p999);
+    fflush(stdout);
+    if (! check_ref(c, &res, tolerance)) ret = EXIT_FAILURE;
+  }
+
+  (void)rmdir(rb_dir);
+  return ret;
+}
@@ -0,0 +1,73 @@
+// vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+/* Bit-set kernels for the blocked bloom filters (see RamenBitmask.ml and
+ * RamenBloomFilter.ml).
+ * A block is one cache line of 512 bits, in which the [k] bits of a key are
+ * [(a + i*b) mod 512] for i from 0 to k-1. Masks for the whole block are
+ * built first and then tested or applied to the 8 words at once. */
+#include <assert.h>
+#include <stdint.h>
+
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / 64)
+#define CACHE_LINE 64
+
+/* How many bytes to skip from the beginning of that bigarray for the blocks
+ * to start on a cache line: */
+CAMLprim value wrap_bitmask_align_offset(value bytes_)
+{
+  uintptr_t const addr = (uintptr_t)Caml_ba_data_val(bytes_);
+  return Val_long((CACHE_LINE - addr % CACHE_LINE) % CACHE_LINE);
+}
+
+static uint64_t *block_of(value bytes_, value offs_)
+{
+  long const offs = Long_val(offs_);
+  char *const block = (char *)Caml_ba_data_val(bytes_) + offs;
+  assert(offs >= 0);
+  assert((uintptr_t)block % CACHE_LINE == 0);
+  assert((unsigned long)offs + BLOCK_BITS / 8 <=
+         (unsigned long)Caml_ba_array_val(bytes_)->dim[0]);
+  return (uint64_t *)block;
+}
+
+static void make_masks(uint64_t masks[BLOCK_WORDS], long a, long b, long k)
+{
+  for (unsigned w = 0; w < BLOCK_WORDS; w++) masks[w] = 0;
+  for (long i = 0; i < k; i++) {
+    unsigned const bit = (unsigned long)(a + i * b) % BLOCK_BITS;
+    masks[bit / 64] |= UINT64_C(1) << (bit % 64);
+  }
+}
+
+/* Tells if all the bits of the key are set in that block: */
+CAMLprim value wrap_bitmask_test_block_bits(
+  value bytes_, value offs_, value a_, value b_, value k_)
+{
+  uint64_t const *block = block_of(bytes_, offs_);
+  uint64_t masks[BLOCK_WORDS];
+  make_masks(masks, Long_val(a_), Long_val(b_), Long_val(k_));
+  uint64_t missing = 0;
+  for (unsigned w = 0; w < BLOCK_WORDS; w++)
+    missing |= masks[w] & ~block[w];
+  return Val_bool(missing == 0);
+}
+
+/* Sets all the bits of the key in that block, and returns how many of them
+ * were not set already: */
+CAMLprim value wrap_bitmask_set_block_bits(
+  value bytes_, value offs_, value a_, value b_, value k_)
+{
+  uint64_t *block = block_of(bytes_, offs_);
+  uint64_t masks[BLOCK_WORDS];
+  make_masks(masks, Long_val(a_), Long_val(b_), Long_val(k_));
+  long newly_set = 0;
+  for (unsigned w = 0; w < BLOCK_WORDS; w++) {
+    newly_set += __builtin_popcountll(masks[w] & ~block[w]);
+    block[w] |= masks[w];
+  }
+  return Val_long(newly_set);
+}
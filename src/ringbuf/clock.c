@@ -0,0 +1,17 @@
+// vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+/* A monotonic clock with nanosecond resolution, to time the stages of the
+ * workers (see CodeGenLib_Stats.Stage). */
+#include <time.h>
+
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+
+/* In nanoseconds since some unspecified starting point.
+ * Fits in an OCaml int on 64 bits platforms: */
+CAMLprim value wrap_monotonic_ns(value unit)
+{
+  (void)unit;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return Val_long((long)ts.tv_sec * 1000000000L + ts.tv_nsec);
+}
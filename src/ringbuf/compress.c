@@ -0,0 +1,402 @@
+// vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+/* Compression of the frames exchanged by tunneld clients and servers (see
+ * RamenCopy.ml).
+ * Codecs are identified by the same small integers on both ends:
+ * 0 for no compression, 1 for LZ4 and 2 for zstd.
+ *
+ * Also compression of archived ring buffers (see RamenGc.ml), that are
+ * decompressed straight into memory when loaded. */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lz4.h>
+#include <zstd.h>
+
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+
+#include "ringbuf.h"
+
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+
+// Favor speed, as frames are compressed on the fly by top-halves:
+#define ZSTD_LEVEL 1
+
+// Archives are compressed in the background and kept for long:
+#define ZSTD_ARCHIVE_LEVEL 9
+
+static void check_range(value bytes_, long offs, long len, char const *what)
+{
+  if (offs < 0 || len < 0 || offs + len > (long)caml_string_length(bytes_))
+    caml_invalid_argument(what);
+}
+
+CAMLprim value wrap_copy_compress_bound(value codec_, value len_)
+{
+  CAMLparam2(codec_, len_);
+  long const len = Long_val(len_);
+  long bound;
+  switch (Long_val(codec_)) {
+    case CODEC_NONE:
+      bound = len;
+      break;
+    case CODEC_LZ4:
+      bound = LZ4_compressBound(len);
+      break;
+    case CODEC_ZSTD:
+      bound = ZSTD_compressBound(len);
+      break;
+    default:
+      caml_invalid_argument("compress_bound: unknown codec");
+  }
+  CAMLreturn(Val_long(bound));
+}
+
+/* Compress src[src_offs..src_offs+src_len[ into dst from dst_offs and
+ * returns the compressed length: */
+CAMLprim value wrap_copy_compress(
+  value codec_, value src_, value src_offs_, value src_len_,
+  value dst_, value dst_offs_)
+{
+  CAMLparam5(codec_, src_, src_offs_, src_len_, dst_);
+  CAMLxparam1(dst_offs_);
+  long const src_offs = Long_val(src_offs_);
+  long const src_len = Long_val(src_len_);
+  long const dst_offs = Long_val(dst_offs_);
+  check_range(src_, src_offs, src_len, "compress: invalid source range");
+  check_range(dst_, dst_offs, 0, "compress: invalid destination offset");
+  char const *src = (char const *)Bytes_val(src_) + src_offs;
+  char *dst = (char *)Bytes_val(dst_) + dst_offs;
+  long const dst_capa = caml_string_length(dst_) - dst_offs;
+  long res;
+  switch (Long_val(codec_)) {
+    case CODEC_NONE:
+      if (src_len > dst_capa) caml_failwith("compress: destination too small");
+      memcpy(dst, src, src_len);
+      res = src_len;
+      break;
+    case CODEC_LZ4:
+      res = LZ4_compress_default(src, dst, src_len, dst_capa);
+      if (res <= 0) caml_failwith("LZ4_compress_default failed");
+      break;
+    case CODEC_ZSTD:
+      {
+        size_t const sz = ZSTD_compress(dst, dst_capa, src, src_len, ZSTD_LEVEL);
+        if (ZSTD_isError(sz)) caml_failwith(ZSTD_getErrorName(sz));
+        res = sz;
+      }
+      break;
+    default:
+      caml_invalid_argument("compress: unknown codec");
+  }
+  CAMLreturn(Val_long(res));
+}
+
+CAMLprim value wrap_copy_compress_bytecode(value *argv, int argn)
+{
+  assert(argn == 6);
+  return wrap_copy_compress(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+/* Decompress src[src_offs..src_offs+src_len[ into dst[0..dst_len[, failing
+ * unless exactly dst_len bytes come out: */
+CAMLprim value wrap_copy_decompress(
+  value codec_, value src_, value src_offs_, value src_len_,
+  value dst_, value dst_len_)
+{
+  CAMLparam5(codec_, src_, src_offs_, src_len_, dst_);
+  CAMLxparam1(dst_len_);
+  long const src_offs = Long_val(src_offs_);
+  long const src_len = Long_val(src_len_);
+  long const dst_len = Long_val(dst_len_);
+  check_range(src_, src_offs, src_len, "decompress: invalid source range");
+  check_range(dst_, 0, dst_len, "decompress: invalid destination length");
+  char const *src = (char const *)Bytes_val(src_) + src_offs;
+  char *dst = (char *)Bytes_val(dst_);
+  long res;
+  switch (Long_val(codec_)) {
+    case CODEC_NONE:
+      if (src_len > dst_len) caml_failwith("decompress: destination too small");
+      memcpy(dst, src, src_len);
+      res = src_len;
+      break;
+    case CODEC_LZ4:
+      res = LZ4_decompress_safe(src, dst, src_len, dst_len);
+      if (res < 0) caml_failwith("LZ4_decompress_safe failed");
+      break;
+    case CODEC_ZSTD:
+      {
+        size_t const sz = ZSTD_decompress(dst, dst_len, src, src_len);
+        if (ZSTD_isError(sz)) caml_failwith(ZSTD_getErrorName(sz));
+        res = sz;
+      }
+      break;
+    default:
+      caml_invalid_argument("decompress: unknown codec");
+  }
+  if (res != dst_len) caml_failwith("decompress: unexpected decompressed size");
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value wrap_copy_decompress_bytecode(value *argv, int argn)
+{
+  assert(argn == 6);
+  return wrap_copy_decompress(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+/*
+ * Archived ring buffers
+ */
+
+#define ARCHIVE_CHUNK_SIZE (1 << 17)
+
+/* Compress the archive file fname into fname.zst (written atomically) and
+ * delete fname. Returns 0 on success or -1 on error (then fname is left
+ * untouched). */
+static int compress_archive(char const *fname)
+{
+  int ret = -1;
+  char tmp_fname[PATH_MAX], dst_fname[PATH_MAX];
+
+  if ((size_t)snprintf(dst_fname, PATH_MAX, "%s.zst", fname) >= PATH_MAX ||
+      (size_t)snprintf(tmp_fname, PATH_MAX, "%s.tmp.%d", dst_fname,
+                       (int)getpid()) >= PATH_MAX) {
+    fprintf(stderr, "%d: Compressed archive file name too long: %s\n",
+            getpid(), fname);
+    goto err0;
+  }
+
+  FILE *in = fopen(fname, "r");
+  if (! in) {
+    fprintf(stderr, "%d: Cannot open '%s': %s\n",
+            getpid(), fname, strerror(errno));
+    goto err0;
+  }
+
+  struct stat st;
+  if (0 != fstat(fileno(in), &st)) {
+    fprintf(stderr, "%d: Cannot stat '%s': %s\n",
+            getpid(), fname, strerror(errno));
+    goto err1;
+  }
+
+  FILE *out = fopen(tmp_fname, "w");
+  if (! out) {
+    fprintf(stderr, "%d: Cannot create '%s': %s\n",
+            getpid(), tmp_fname, strerror(errno));
+    goto err1;
+  }
+
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  char *in_buf = malloc(ARCHIVE_CHUNK_SIZE);
+  size_t const out_size = ZSTD_CStreamOutSize();
+  char *out_buf = malloc(out_size);
+  if (! cctx || ! in_buf || ! out_buf) {
+    fprintf(stderr, "%d: Cannot allocate compression context\n", getpid());
+    goto err2;
+  }
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_ARCHIVE_LEVEL);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  // So that the decompressed size is known from the frame header:
+  ZSTD_CCtx_setPledgedSrcSize(cctx, st.st_size);
+
+  bool last;
+  do {
+    size_t const rd = fread(in_buf, 1, ARCHIVE_CHUNK_SIZE, in);
+    if (ferror(in)) {
+      fprintf(stderr, "%d: Cannot read '%s'\n", getpid(), fname);
+      goto err2;
+    }
+    last = rd < ARCHIVE_CHUNK_SIZE;
+    ZSTD_inBuffer input = { in_buf, rd, 0 };
+    bool done;
+    do {
+      ZSTD_outBuffer output = { out_buf, out_size, 0 };
+      size_t const rem =
+        ZSTD_compressStream2(cctx, &output, &input,
+                             last ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(rem)) {
+        fprintf(stderr, "%d: Cannot compress '%s': %s\n",
+                getpid(), fname, ZSTD_getErrorName(rem));
+        goto err2;
+      }
+      if (fwrite(out_buf, 1, output.pos, out) != output.pos) {
+        fprintf(stderr, "%d: Cannot write '%s': %s\n",
+                getpid(), tmp_fname, strerror(errno));
+        goto err2;
+      }
+      done = last ? rem == 0 : input.pos == input.size;
+    } while (! done);
+  } while (! last);
+
+  if (0 != fclose(out)) {
+    out = NULL;
+    (void)unlink(tmp_fname);
+    fprintf(stderr, "%d: Cannot close '%s': %s\n",
+            getpid(), tmp_fname, strerror(errno));
+    goto err2;
+  }
+  out = NULL;
+
+  if (0 != rename(tmp_fname, dst_fname)) {
+    fprintf(stderr, "%d: Cannot rename '%s' into '%s': %s\n",
+            getpid(), tmp_fname, dst_fname, strerror(errno));
+    goto err2;
+  }
+
+  // Readers may have that file mmapped already, which is fine:
+  if (0 != unlink(fname)) {
+    fprintf(stderr, "%d: Cannot unlink '%s': %s\n",
+            getpid(), fname, strerror(errno));
+    // Keep the compressed version, the uncompressed one will be deleted
+    // along with it eventually.
+  }
+
+  ret = 0;
+
+err2:
+  if (out) {
+    (void)fclose(out);
+    (void)unlink(tmp_fname);
+  }
+  free(out_buf);
+  free(in_buf);
+  ZSTD_freeCCtx(cctx);
+err1:
+  (void)fclose(in);
+err0:
+  fflush(stderr);
+  return ret;
+}
+
+CAMLprim value wrap_ringbuf_compress_archive(value fname_)
+{
+  CAMLparam1(fname_);
+  char *fname = strdup(String_val(fname_));
+  if (! fname) caml_failwith("compress_archive: cannot allocate");
+  caml_release_runtime_system();
+  int const ret = compress_archive(fname);
+  caml_acquire_runtime_system();
+  free(fname);
+  if (ret != 0) caml_failwith("Cannot compress archive");
+  CAMLreturn(Val_unit);
+}
+
+extern enum ringbuf_error ringbuf_load_compressed(
+    struct ringbuf *rb, uint64_t version, char const *fname)
+{
+  enum ringbuf_error err = RB_ERR_FAILURE;
+
+  size_t fname_len = strlen(fname);
+  if (fname_len + 1 > sizeof(rb->fname)) {
+    fprintf(stderr, "%d: Cannot load ring-buffer: Filename too long: %s\n",
+            getpid(), fname);
+    goto err0;
+  }
+  memcpy(rb->fname, fname, fname_len + 1);
+  rb->rbf = NULL;
+  rb->mmapped_size = 0;
+# ifdef LOCK_WITH_LOCKF
+  rb->lock_fd = -1;
+# endif
+  rb->consumer = -1;
+
+  FILE *in = fopen(fname, "r");
+  if (! in) {
+    fprintf(stderr, "%d: Cannot load ring-buffer from file '%s': %s\n",
+            getpid(), fname, strerror(errno));
+    goto err0;
+  }
+
+  /* The decompressed size is in the frame header, so that the whole ring
+   * buffer can be decompressed straight into an anonymous mapping: */
+  char *in_buf = malloc(ARCHIVE_CHUNK_SIZE);
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  if (! in_buf || ! dctx) {
+    fprintf(stderr, "%d: Cannot allocate decompression context\n", getpid());
+    goto err1;
+  }
+
+  size_t rd = fread(in_buf, 1, ARCHIVE_CHUNK_SIZE, in);
+  unsigned long long const size = ZSTD_getFrameContentSize(in_buf, rd);
+  if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+      size <= sizeof(struct ringbuf_file)) {
+    fprintf(stderr, "%d: Invalid compressed ring buffer file '%s'\n",
+            getpid(), fname);
+    goto err1;
+  }
+
+  struct ringbuf_file *rbf =
+    mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (rbf == MAP_FAILED) {
+    fprintf(stderr, "%d: Cannot mmap %llu bytes for '%s': %s\n",
+            getpid(), size, fname, strerror(errno));
+    goto err1;
+  }
+
+  ZSTD_outBuffer output = { rbf, size, 0 };
+  size_t rem = 1;  // until the end of the frame
+  while (rd > 0 && rem != 0) {
+    ZSTD_inBuffer input = { in_buf, rd, 0 };
+    while (input.pos < input.size && rem != 0) {
+      size_t const prev_in = input.pos, prev_out = output.pos;
+      rem = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(rem)) {
+        fprintf(stderr, "%d: Cannot decompress '%s': %s\n",
+                getpid(), fname, ZSTD_getErrorName(rem));
+        goto err2;
+      }
+      if (input.pos == prev_in && output.pos == prev_out) {
+        fprintf(stderr, "%d: Compressed ring buffer file '%s' is larger "
+                        "than advertised\n", getpid(), fname);
+        goto err2;
+      }
+    }
+    if (rem != 0) rd = fread(in_buf, 1, ARCHIVE_CHUNK_SIZE, in);
+  }
+  if (ferror(in) || rem != 0 || output.pos != size) {
+    fprintf(stderr, "%d: Truncated compressed ring buffer file '%s'\n",
+            getpid(), fname);
+    goto err2;
+  }
+
+  if (rbf->version != version) {
+    err = RB_ERR_BAD_VERSION;
+    goto err2;
+  }
+
+  if (ringbuf_file_size(rbf->num_words, rbf->max_consumers,
+                        rbf->num_buckets) != size ||
+      rbf->prod_tail > rbf->num_words) {
+    fprintf(stderr, "%d: Invalid compressed ring buffer file '%s'\n",
+            getpid(), fname);
+    goto err2;
+  }
+
+  rb->rbf = rbf;
+  rb->mmapped_size = size;
+  err = RB_OK;
+  goto err1;
+
+err2:
+  munmap(rbf, size);
+err1:
+  ZSTD_freeDCtx(dctx);
+  free(in_buf);
+  (void)fclose(in);
+err0:
+  fflush(stderr);
+  return err;
+}
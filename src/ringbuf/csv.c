@@ -0,0 +1,126 @@
+// vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+/* Record boundaries of CSV files that are mapped in memory, for
+ * CodeGenLib_IO.read_file. */
+#include <stddef.h>
+#include <string.h>
+
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/bigarray.h>
+#include <caml/fail.h>
+
+/* Returns one past the last newline of [p..end[ that is not within quotes,
+ * or NULL if there is none. [quote] is the quote character, or -1 if values
+ * cannot be quoted.
+ * Since a quote that appears within a quoted value must be doubled, being
+ * within quotes or not depends only on the parity of the number of quotes
+ * seen so far, and the scan can jump from quote to quote. */
+static char const *last_record_end(char const *p, char const *end, int quote)
+{
+  char const *last = NULL;
+
+  if (quote < 0) {
+    while (end > p) {
+      end --;
+      if (*end == '\n') return end + 1;
+    }
+    return NULL;
+  }
+
+  while (p < end) {
+    char const *nl = memchr(p, '\n', end - p);
+    char const *q = memchr(p, quote, (nl ? nl : end) - p);
+    if (q) {
+      // Skip the quoted value:
+      q = memchr(q + 1, quote, end - (q + 1));
+      if (! q) break;
+      p = q + 1;
+    } else if (nl) {
+      last = nl + 1;
+      p = nl + 1;
+    } else {
+      break;
+    }
+  }
+
+  return last;
+}
+
+/* Returns one past the first newline of [p..end[ that is not within quotes
+ * and is at or after [from], or [end] if there is none. [p] must be the start
+ * of a record, since quotes are tracked from there. */
+static char const *next_record_end(
+  char const *p, char const *from, char const *end, int quote)
+{
+  if (quote < 0) {
+    char const *nl = memchr(from, '\n', end - from);
+    return nl ? nl + 1 : end;
+  }
+
+  while (p < end) {
+    char const *nl = memchr(p, '\n', end - p);
+    char const *q = memchr(p, quote, (nl ? nl : end) - p);
+    if (q) {
+      q = memchr(q + 1, quote, end - (q + 1));
+      if (! q) break;
+      p = q + 1;
+    } else if (nl) {
+      if (nl >= from) return nl + 1;
+      p = nl + 1;
+    } else {
+      break;
+    }
+  }
+
+  return end;
+}
+
+/* Copy into [dst_] as many whole records of the mapped file [src_] as
+ * possible, starting at offset [start_] and up to offset [stop_], and return
+ * the number of bytes copied. What remains before [stop_] is considered a
+ * whole record once it fits entirely. Returns 0 if the next record is larger
+ * than [dst_]. */
+CAMLprim value wrap_csv_copy_records(
+  value src_, value start_, value stop_, value dst_, value quote_)
+{
+  CAMLparam5(src_, start_, stop_, dst_, quote_);
+  char const *src = Caml_ba_data_val(src_);
+  size_t const src_len = Caml_ba_array_val(src_)->dim[0];
+  size_t const start = Long_val(start_);
+  size_t const stop = Long_val(stop_);
+  size_t const room = caml_string_length(dst_);
+  int const quote = Int_val(quote_);
+  if (stop > src_len || start > stop)
+    caml_invalid_argument("csv_copy_records: bad start/stop");
+
+  size_t len = stop - start;
+  if (len > room) {
+    len = room;
+    char const *last = last_record_end(src + start, src + start + len, quote);
+    len = last ? (size_t)(last - (src + start)) : 0;
+  }
+
+  memcpy(Bytes_val(dst_), src + start, len);
+  CAMLreturn(Val_long(len));
+}
+
+/* Returns the offset of the first record of the mapped file [src_] that
+ * starts at or after offset [from_], [start_] being the offset of a record,
+ * or the length of the file if there is none. */
+CAMLprim value wrap_csv_next_record(
+  value src_, value start_, value from_, value quote_)
+{
+  CAMLparam4(src_, start_, from_, quote_);
+  char const *src = Caml_ba_data_val(src_);
+  size_t const src_len = Caml_ba_array_val(src_)->dim[0];
+  size_t const start = Long_val(start_);
+  size_t const from = Long_val(from_);
+  int const quote = Int_val(quote_);
+  if (from > src_len || start > from)
+    caml_invalid_argument("csv_next_record: bad start/from");
+
+  char const *next =
+    next_record_end(src + start, src + from, src + src_len, quote);
+  CAMLreturn(Val_long(next - src));
+}
@@ -11,6 +11,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <signal.h>
+#include <stddef.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
 
 #include "ringbuf.h"
 #include "archive.h"
@@ -22,12 +29,19 @@ extern inline void ringbuf_head_unlock(struct ringbuf *);
 extern inline void ringbuf_head_lock(struct ringbuf *);
 extern inline uint32_t ringbuf_file_num_entries(struct ringbuf_file const *rb, uint32_t, uint32_t);
 extern inline uint32_t ringbuf_file_num_free(struct ringbuf_file const *rb, uint32_t, uint32_t);
+extern inline size_t ringbuf_file_consumers_offset(uint32_t);
+extern inline struct ringbuf_consumer *ringbuf_file_consumers(struct ringbuf_file const *);
+extern inline struct ringbuf_bucket *ringbuf_file_buckets(struct ringbuf_file const *);
+extern inline uint32_t ringbuf_file_bucket_words(struct ringbuf_file const *);
+extern inline size_t ringbuf_file_size(uint32_t, uint32_t, uint32_t);
 
 extern inline enum ringbuf_error ringbuf_enqueue(struct ringbuf *rb, uint32_t const *data, uint32_t num_words, double t_start, double t_stop);
 
 extern inline ssize_t ringbuf_dequeue(struct ringbuf *rb, uint32_t *data, size_t max_size);
 extern inline ssize_t ringbuf_read_first(struct ringbuf *rb, struct ringbuf_tx *tx);
 extern inline ssize_t ringbuf_read_next(struct ringbuf *rb, struct ringbuf_tx *tx);
+extern inline uint32_t ringbuf_batch_record_words(struct ringbuf const *rb, struct ringbuf_tx const *tx);
+extern inline void ringbuf_batch_next(struct ringbuf const *rb, struct ringbuf_tx *tx);
 
 static ssize_t really_read(int fd, void *d, size_t sz, char const *fname /* printed */)
 {
@@ -173,12 +187,60 @@ err0:
   return ret;
 }
 
+/* Header layout of the former ringbuf files, with producers and consumers
+ * indices sharing the same cache line. Only ever used to create such files
+ * for the benefit of older workers during a migration: */
+struct ringbuf_file_legacy {
+  uint64_t version;
+  uint64_t first_seq;
+  uint32_t num_words;
+  uint32_t wrap:1;
+  atomic_flag lock;
+  uint32_t _Atomic prod_head;
+  uint32_t _Atomic prod_tail;
+  uint32_t _Atomic cons_head;
+  uint32_t _Atomic cons_tail;
+  uint32_t _Atomic num_allocs;
+  double _Atomic tmin;
+  double _Atomic tmax;
+  double timeout;
+  uint32_t _Atomic data[];
+};
+
+static int write_legacy_header(
+    int fd, struct ringbuf_file const *rbf, char const *fname)
+{
+  struct ringbuf_file_legacy lrbf;
+  memset(&lrbf, 0, sizeof(lrbf));
+  lrbf.version = rbf->version;
+  lrbf.first_seq = rbf->first_seq;
+  lrbf.num_words = rbf->num_words;
+  lrbf.wrap = rbf->wrap;
+  atomic_flag_clear(&lrbf.lock);
+  atomic_init(&lrbf.prod_head, 0);
+  atomic_init(&lrbf.prod_tail, 0);
+  atomic_init(&lrbf.cons_head, 0);
+  atomic_init(&lrbf.cons_tail, 0);
+  atomic_init(&lrbf.num_allocs, 0);
+  atomic_init(&lrbf.tmin, 0.);
+  atomic_init(&lrbf.tmax, 0.);
+  lrbf.timeout = rbf->timeout;
+
+  return really_write(fd, &lrbf, sizeof(lrbf), fname);
+}
+
 // Keep existing files as much as possible:
 extern int ringbuf_create_locked(
-    uint64_t version, bool wrap, uint32_t num_words, double timeout, char const *fname)
+    uint64_t version, bool wrap, uint32_t num_words, double timeout,
+    bool legacy_layout, uint32_t max_consumers, unsigned mmap_flags,
+    char const *fname)
 {
   int ret = -1;
   struct ringbuf_file rbf;
+  memset(&rbf, 0, sizeof(rbf));  // Also zero the padding
+  uint32_t const num_buckets =
+    wrap || legacy_layout ? 0 :
+      num_words < RINGBUF_NUM_BUCKETS ? num_words : RINGBUF_NUM_BUCKETS;
 
   // First try to create the file:
   int fd = open(fname, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
@@ -186,7 +248,11 @@ extern int ringbuf_create_locked(
     // We are the creator. Other creators are waiting for the lock.
     //printf("Creating ringbuffer '%s'\n", fname);
 
-    size_t file_length = sizeof(rbf) + num_words*sizeof(uint32_t);
+    size_t const file_length =
+      legacy_layout ?
+        sizeof(struct ringbuf_file_legacy) + num_words*sizeof(uint32_t) :
+        ringbuf_file_size(num_words, max_consumers, num_buckets);
+    // Consumer slots are left zeroed, ie. free, and index buckets empty.
     if (ftruncate(fd, file_length) < 0) {
       fprintf(stderr, "%d: Cannot ftruncate file '%s': %s\n",
               getpid(), fname, strerror(errno));
@@ -206,11 +272,31 @@ extern int ringbuf_create_locked(
     atomic_init(&rbf.num_allocs, 0);
     atomic_init(&rbf.tmin, 0.);
     atomic_init(&rbf.tmax, 0.);
+    atomic_init(&rbf.data_seq, 0);
+    atomic_init(&rbf.num_readers_waiting, 0);
+    atomic_init(&rbf.room_seq, 0);
+    atomic_init(&rbf.num_writers_waiting, 0);
+    atomic_flag_clear(&rbf.consumers_lock);
     rbf.wrap = wrap;
     rbf.timeout = timeout;
+    rbf.max_consumers = max_consumers;
+    rbf.num_buckets = num_buckets;
+    rbf.mmap_flags = legacy_layout ? 0 : mmap_flags;
 
-    if (0 != really_write(fd, &rbf, sizeof(rbf), fname)) {
-      goto err3;
+    if (legacy_layout) {
+      if (0 != write_legacy_header(fd, &rbf, fname)) goto err3;
+    } else {
+      if (0 != really_write(fd, &rbf, sizeof(rbf), fname)) goto err3;
+    }
+    if (rbf.mmap_flags & RB_MMAP_PREFAULT) {
+      /* Have the file system allocate (and zero) every page now rather than
+       * on first touch by some writer: */
+      int const e = posix_fallocate(fd, 0, file_length);
+      if (e != 0) {
+        fprintf(stderr, "%d: Cannot preallocate ringbuf file '%s': %s\n",
+                getpid(), fname, strerror(e));
+        // best effort
+      }
     }
     if (! wrap && 0 != fsync(fd)) {
       fprintf(stderr, "%d: Cannot fsync ringbuf file '%s': %s\n",
@@ -246,16 +332,28 @@ err0:
 }
 
 extern enum ringbuf_error ringbuf_create(
-    uint64_t version, bool wrap, uint32_t num_words, double timeout, char const *fname)
+    uint64_t version, bool wrap, uint32_t num_words, double timeout,
+    bool legacy_layout, uint32_t max_consumers, unsigned mmap_flags,
+    char const *fname)
 {
   enum ringbuf_error err = RB_ERR_FAILURE;
 
+  if (max_consumers > 0 && (! wrap || legacy_layout)) {
+    fprintf(stderr, "%d: Cannot create ring-buffer '%s': broadcast ring "
+                    "buffers must wrap and use the current layout\n",
+            getpid(), fname);
+    fflush(stderr);
+    goto err0;
+  }
+
   // We must not try to create a RB while another process is rotating or
   // creating it:
   int lock_fd = lock(fname, LOCK_EX, false);
   if (lock_fd < 0) goto err0;
 
-  if (0 != ringbuf_create_locked(version, wrap, num_words, timeout, fname)) {
+  if (0 != ringbuf_create_locked(version, wrap, num_words, timeout,
+                                 legacy_layout, max_consumers, mmap_flags,
+                                 fname)) {
     goto err1;
   }
 
@@ -287,6 +385,31 @@ static bool check_header_max(char const *fname, char const *what, unsigned max,
   return false;
 }
 
+static void try_madvise(char const *fname, void *addr, size_t len, int advice, char const *what)
+{
+  if (0 != madvise(addr, len, advice)) {
+    fprintf(stderr, "%d: Cannot madvise %s for '%s': %s\n",
+            getpid(), what, fname, strerror(errno));
+    // best effort
+  }
+}
+
+/* Hugepages must be asked for before the pages are populated, thus the use
+ * of MADV_POPULATE_WRITE rather than MAP_POPULATE when available: */
+static void advise_mmap(char const *fname, void *addr, size_t len, unsigned mmap_flags)
+{
+# ifdef MADV_HUGEPAGE
+  if (mmap_flags & RB_MMAP_HUGEPAGES)
+    try_madvise(fname, addr, len, MADV_HUGEPAGE, "hugepages");
+# endif
+  if (mmap_flags & RB_MMAP_SEQUENTIAL)
+    try_madvise(fname, addr, len, MADV_SEQUENTIAL, "sequential access");
+# ifdef MADV_POPULATE_WRITE
+  if (mmap_flags & RB_MMAP_PREFAULT)
+    try_madvise(fname, addr, len, MADV_POPULATE_WRITE, "prefaulting");
+# endif
+}
+
 static enum ringbuf_error mmap_rb(uint64_t version, struct ringbuf *rb)
 {
   enum ringbuf_error err = RB_ERR_FAILURE;
@@ -310,17 +433,34 @@ static enum ringbuf_error mmap_rb(uint64_t version, struct ringbuf *rb)
     goto err1;
   }
 
+  // Mapping options must be known before mapping:
+  struct ringbuf_file hdr;
+  unsigned mmap_flags = 0;
+  if (pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+      hdr.version == version) mmap_flags = hdr.mmap_flags;
+
+  int flags = MAP_SHARED;
+# if defined(MAP_POPULATE) && !defined(MADV_POPULATE_WRITE)
+  if (mmap_flags & RB_MMAP_PREFAULT) flags |= MAP_POPULATE;
+# endif
   struct ringbuf_file *rbf =
-      mmap(NULL, file_length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, (off_t)0);
+      mmap(NULL, file_length, PROT_READ|PROT_WRITE, flags, fd, (off_t)0);
   if (rbf == MAP_FAILED) {
     fprintf(stderr, "%d: Cannot mmap file '%s': %s\n",
             getpid(), rb->fname, strerror(errno));
     goto err1;
   }
 
+  // Check version first, since the rest of the header depends on it:
+  if (rbf->version != version) {
+    munmap(rbf, file_length);
+    err = RB_ERR_BAD_VERSION;
+    goto err1;
+  }
+
   // Sanity checks
   if (!(
-        check_header_eq(rb->fname, "file size", rbf->num_words*sizeof(uint32_t) + sizeof(*rbf), file_length) &&
+        check_header_eq(rb->fname, "file size", ringbuf_file_size(rbf->num_words, rbf->max_consumers, rbf->num_buckets), file_length) &&
         check_header_max(rb->fname, "prod head", rbf->num_words, rbf->prod_head) &&
         check_header_max(rb->fname, "prod tail", rbf->num_words, rbf->prod_tail) &&
         check_header_max(rb->fname, "cons head", rbf->num_words, rbf->cons_head) &&
@@ -330,12 +470,7 @@ static enum ringbuf_error mmap_rb(uint64_t version, struct ringbuf *rb)
     goto err1;
   }
 
-  // Check version
-  if (rbf->version != version) {
-    munmap(rbf, file_length);
-    err = RB_ERR_BAD_VERSION;
-    goto err1;
-  }
+  advise_mmap(rb->fname, rbf, file_length, mmap_flags);
 
   rb->rbf = rbf;
   rb->mmapped_size = file_length;
@@ -384,6 +519,7 @@ extern enum ringbuf_error ringbuf_load(struct ringbuf *rb, uint64_t version, cha
 # ifdef LOCK_WITH_LOCKF
   rb->lock_fd = -1;
 # endif
+  rb->consumer = -1;
 
   // Although we probably just ringbuf_created that file, some other processes
   // might be rotating it already. Note that archived files do not have a lock
@@ -407,6 +543,7 @@ err0:
 enum ringbuf_error ringbuf_unload(struct ringbuf *rb)
 {
   if (rb->rbf) {
+    ringbuf_unregister_consumer(rb);
     if (0 != munmap(rb->rbf, rb->mmapped_size)) {
       fprintf(stderr, "%d: Cannot munmap: %s\n", getpid(), strerror(errno));
       fflush(stderr);
@@ -428,6 +565,137 @@ enum ringbuf_error ringbuf_unload(struct ringbuf *rb)
   return RB_OK;
 }
 
+/*
+ * Preparation of the next file of non-wrapping ring buffers (see
+ * RB_MMAP_PRECREATE): a thread creates and preallocates it under a temporary
+ * name, then renames it into "$fname.next" once it is complete.
+ * When rotating, that file is claimed by renaming it first into a name
+ * private to the rotating process, so that no other preparation can replace
+ * it while its first_seq is updated, and then into the ring buffer name.
+ */
+
+static int next_fname(char *next, char const *fname)
+{
+  if ((size_t)snprintf(next, PATH_MAX, "%s.next", fname) >= PATH_MAX) {
+    fprintf(stderr, "%d: Next ringbuf file name truncated: '%s'\n",
+            getpid(), next);
+    return -1;
+  }
+  return 0;
+}
+
+struct precreation {
+  uint64_t version;
+  uint32_t num_words;
+  double timeout;
+  uint32_t max_consumers;
+  unsigned mmap_flags;
+  char fname[PATH_MAX];
+};
+
+static void *precreate(void *p_)
+{
+  struct precreation *p = p_;
+  static unsigned _Atomic seq;
+  char next[PATH_MAX], tmp[PATH_MAX];
+  if (0 != next_fname(next, p->fname)) goto err0;
+  // Maybe another writer has prepared it already:
+  if (0 == access(next, F_OK)) goto err0;
+  if ((size_t)snprintf(tmp, PATH_MAX, "%s.%d.%u", next, (int)getpid(),
+                       atomic_fetch_add(&seq, 1)) >= PATH_MAX) {
+    fprintf(stderr, "%d: Temporary ringbuf file name truncated: '%s'\n",
+            getpid(), tmp);
+    goto err0;
+  }
+  if (0 != ringbuf_create_locked(p->version, false, p->num_words, p->timeout,
+                                 false, p->max_consumers, p->mmap_flags, tmp))
+    goto err0;
+  if (0 != rename(tmp, next)) {
+    fprintf(stderr, "%d: Cannot rename '%s' into '%s': %s\n",
+            getpid(), tmp, next, strerror(errno));
+    (void)unlink(tmp);
+  }
+err0:
+  fflush(stderr);
+  free(p);
+  return NULL;
+}
+
+static void start_precreation(struct ringbuf const *rb)
+{
+  struct ringbuf_file const *rbf = rb->rbf;
+  struct precreation *p = malloc(sizeof(*p));
+  if (! p) {
+    fprintf(stderr, "%d: Cannot malloc for precreation\n", getpid());
+    goto err0;
+  }
+  p->version = rbf->version;
+  p->num_words = rbf->num_words;
+  p->timeout = rbf->timeout;
+  p->max_consumers = rbf->max_consumers;
+  p->mmap_flags = rbf->mmap_flags;
+  memcpy(p->fname, rb->fname, sizeof(p->fname));
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  int e = pthread_attr_init(&attr);
+  if (e == 0) e = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (e == 0) e = pthread_create(&thread, &attr, precreate, p);
+  (void)pthread_attr_destroy(&attr);
+  if (e != 0) {
+    fprintf(stderr, "%d: Cannot start the precreation of '%s': %s\n",
+            getpid(), rb->fname, strerror(e));
+    free(p);
+  }
+err0:
+  fflush(stderr);
+}
+
+/* Returns 0 if a prepared next file has been installed as the new ring
+ * buffer file, with the given first_seq: */
+static int claim_next_file(struct ringbuf const *rb, uint64_t first_seq)
+{
+  char next[PATH_MAX], claimed[PATH_MAX];
+  if (0 != next_fname(next, rb->fname)) return -1;
+  if ((size_t)snprintf(claimed, PATH_MAX, "%s.%d", next, (int)getpid())
+      >= PATH_MAX) return -1;
+  // Usual case of there being no prepared file (yet):
+  if (0 != rename(next, claimed)) return -1;
+
+  int ret = -1;
+  int fd = open(claimed, O_RDWR);
+  if (fd < 0) goto err1;
+  // Check it has been prepared for the same ring buffer:
+  struct ringbuf_file hdr;
+  if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+      hdr.version != rb->rbf->version ||
+      hdr.num_words != rb->rbf->num_words ||
+      hdr.max_consumers != rb->rbf->max_consumers) {
+    fprintf(stderr, "%d: Discarding prepared ringbuf file '%s'\n",
+            getpid(), next);
+    goto err2;
+  }
+  if (pwrite(fd, &first_seq, sizeof(first_seq),
+             offsetof(struct ringbuf_file, first_seq)) !=
+      (ssize_t)sizeof(first_seq)) {
+    fprintf(stderr, "%d: Cannot set first_seq of '%s': %s\n",
+            getpid(), claimed, strerror(errno));
+    goto err2;
+  }
+  if (0 != rename(claimed, rb->fname)) {
+    fprintf(stderr, "%d: Cannot rename '%s' into '%s': %s\n",
+            getpid(), claimed, rb->fname, strerror(errno));
+    goto err2;
+  }
+  ret = 0;
+err2:
+  (void)close(fd);
+err1:
+  if (ret != 0) (void)unlink(claimed);
+  fflush(stderr);
+  return ret;
+}
+
 // Called with the lock
 static int rotate_file_locked(struct ringbuf *rb)
 {
@@ -466,12 +734,20 @@ static int rotate_file_locked(struct ringbuf *rb)
   // Regardless of how this rotation went, we must not release the lock without
   // having created a new archive file:
   //printf("Create a new buffer file under the same old name '%s'\n", rb->fname);
-  if (0 != ringbuf_create_locked(rb->rbf->version, rb->rbf->wrap,
+  bool const precreated =
+    (rb->rbf->mmap_flags & RB_MMAP_PRECREATE) &&
+    0 == claim_next_file(rb, last_seq);
+  if (! precreated &&
+      0 != ringbuf_create_locked(rb->rbf->version, rb->rbf->wrap,
                                  rb->rbf->num_words, rb->rbf->timeout,
-                                 rb->fname)) {
+                                 false, rb->rbf->max_consumers,
+                                 rb->rbf->mmap_flags, rb->fname)) {
     goto err0;
   }
 
+  // Prepare the one after:
+  if (rb->rbf->mmap_flags & RB_MMAP_PRECREATE) start_precreation(rb);
+
   ret = 0;
 
 err0:
@@ -575,19 +851,15 @@ err0:
   return err;
 }
 
-/* ringbuf will have:
- *  word n: num_words
- *  word n+1..n+num_words: allocated.
- *  tx->record_start will point at word n+1 above. */
-extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx, uint32_t num_words)
+/* Reserve tot_words consecutive words in the producers section, avoiding
+ * wrapping inside of them, and set tx->record_start to the first of them.
+ * Writing the record(s) size(s) is left to the caller. */
+static enum ringbuf_error enqueue_reserve(struct ringbuf *rb, struct ringbuf_tx *tx, uint32_t tot_words)
 {
-  // It is currently not possible to have an empty record:
-  ASSERT_RB(num_words > 0);
-
   uint32_t cons_tail;
   uint32_t need_eof = 0;  // 0 never needs an EOF
 
-  enum ringbuf_error err = may_rotate(rb, num_words);
+  enum ringbuf_error err = may_rotate(rb, tot_words - 1);
   if (err != RB_OK) return err;
 
   struct ringbuf_file *rbf = rb->rbf;
@@ -599,16 +871,16 @@ extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringb
   tx->seen = atomic_load(&rbf->prod_head);
   cons_tail = rbf->cons_tail;
   tx->record_start = tx->seen;
-  // We will write the size then the data:
-  tx->next = tx->record_start + 1 + num_words;
-  uint32_t alloced = 1 + num_words;
+  // We will write the size(s) then the data:
+  tx->next = tx->record_start + tot_words;
+  uint32_t alloced = tot_words;
 
   // Avoid wrapping inside the record
   if (tx->next > rbf->num_words) {
     need_eof = tx->seen;
     alloced += rbf->num_words - tx->seen;
     tx->record_start = 0;
-    tx->next = 1 + num_words;
+    tx->next = tot_words;
     ASSERT_RB(tx->next < rbf->num_words);
   } else if (tx->next == rbf->num_words) {
     //printf("tx->next == rbf->num_words\n");
@@ -629,8 +901,6 @@ extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringb
   atomic_store(&rbf->prod_head, tx->next);
 
   if (need_eof) atomic_store(rbf->data + need_eof, UINT32_MAX);
-  ASSERT_RB(num_words < MAX_RINGBUF_MSG_WORDS);
-  atomic_store(rbf->data + (tx->record_start ++), num_words);
   ringbuf_head_unlock(rb);
 
 # else
@@ -641,9 +911,9 @@ extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringb
   do {
     cons_tail = atomic_load(&rbf->cons_tail);
     tx->record_start = tx->seen;
-    // We will write the size then the data:
-    tx->next = tx->record_start + 1 + num_words;
-    uint32_t alloced = 1 + num_words;
+    // We will write the size(s) then the data:
+    tx->next = tx->record_start + tot_words;
+    uint32_t alloced = tot_words;
     need_eof = 0;  // 0 never needs an EOF
 
     // Avoid wrapping inside the record
@@ -651,7 +921,7 @@ extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringb
       need_eof = tx->seen;
       alloced += rbf->num_words - tx->seen;
       tx->record_start = 0;
-      tx->next = 1 + num_words;
+      tx->next = tot_words;
       ASSERT_RB(tx->next < rbf->num_words);
     } else if (tx->next == rbf->num_words) {
       //printf("tx->next == rbf->num_words\n");
@@ -677,14 +947,264 @@ extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringb
    * process in such a short amount of time. */
 
   if (need_eof) atomic_store(rbf->data + need_eof, UINT32_MAX);
-  ASSERT_RB(num_words < MAX_RINGBUF_MSG_WORDS);
-  atomic_store(rbf->data + (tx->record_start ++), num_words);
 
 # endif
 
   return RB_OK;
 }
 
+/* ringbuf will have:
+ *  word n: num_words
+ *  word n+1..n+num_words: allocated.
+ *  tx->record_start will point at word n+1 above. */
+extern enum ringbuf_error ringbuf_enqueue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx, uint32_t num_words)
+{
+  // It is currently not possible to have an empty record:
+  ASSERT_RB(num_words > 0);
+  ASSERT_RB(num_words < MAX_RINGBUF_MSG_WORDS);
+
+  enum ringbuf_error err = enqueue_reserve(rb, tx, 1 + num_words);
+  if (err != RB_OK) return err;
+
+  atomic_store(rb->rbf->data + (tx->record_start ++), num_words);
+
+  return RB_OK;
+}
+
+/* Same as above, for num_records consecutive records which sizes are given
+ * in num_words. Only one update of prod_head is required.
+ * tx->record_start will point at the first record (and can then be moved
+ * from record to record with ringbuf_batch_next). */
+extern enum ringbuf_error ringbuf_enqueue_alloc_batch(struct ringbuf *rb, struct ringbuf_tx *tx, unsigned num_records, uint32_t const *num_words)
+{
+  ASSERT_RB(num_records > 0);
+
+  uint32_t tot_words = 0;
+  for (unsigned r = 0; r < num_records; r++) {
+    ASSERT_RB(num_words[r] > 0);
+    ASSERT_RB(num_words[r] < MAX_RINGBUF_MSG_WORDS);
+    tot_words += 1 + num_words[r];
+  }
+
+  /* A batch that could never fit (leaving room for the EOF mark) would
+   * be retried forever: */
+  if (tot_words + 1 >= rb->rbf->num_words) {
+    fprintf(stderr, "%d: Batch of %u records (%"PRIu32" words) too large "
+                    "for ringbuf '%s' (%"PRIu32" words)\n",
+            getpid(), num_records, tot_words, rb->fname, rb->rbf->num_words);
+    fflush(stderr);
+    return RB_ERR_FAILURE;
+  }
+
+  enum ringbuf_error err = enqueue_reserve(rb, tx, tot_words);
+  if (err != RB_OK) return err;
+
+  uint32_t w = tx->record_start;
+  for (unsigned r = 0; r < num_records; r++) {
+    atomic_store(rb->rbf->data + w, num_words[r]);
+    w += 1 + num_words[r];
+  }
+  tx->record_start ++;
+
+  return RB_OK;
+}
+
+/* The read cursors of this reader, which are those of its consumer slot in
+ * broadcast ring buffers: */
+static uint32_t _Atomic *cons_head_of(struct ringbuf *rb)
+{
+  if (rb->consumer >= 0)
+    return &ringbuf_file_consumers(rb->rbf)[rb->consumer].head;
+  // Only registered consumers can read from broadcast ring buffers:
+  ASSERT_RB(0 == rb->rbf->max_consumers);
+  return &rb->rbf->cons_head;
+}
+
+static uint32_t _Atomic *cons_tail_of(struct ringbuf *rb)
+{
+  if (rb->consumer >= 0)
+    return &ringbuf_file_consumers(rb->rbf)[rb->consumer].tail;
+  ASSERT_RB(0 == rb->rbf->max_consumers);
+  return &rb->rbf->cons_tail;
+}
+
+/*
+ * Broadcast ring buffers
+ *
+ * Each registered consumer moves its own cursors in its slot, and the
+ * global cons_tail (that's all producers look at) is kept at the tail of
+ * the slowest consumer. Only a consumer that was at cons_tail can move it,
+ * so the others commit without taking any lock.
+ */
+
+static void consumers_lock(struct ringbuf *rb)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+  unsigned loops = 0;
+  while (atomic_flag_test_and_set_explicit(&rbf->consumers_lock,
+                                           memory_order_acquire)) {
+    if (loops++ >= ASSUME_KIA_AFTER / 2) {
+      sched_yield();
+      if (loops >= ASSUME_KIA_AFTER) {
+        fprintf(stderr, "%d: Cannot lock consumers of '%s': assuming KIA\n",
+                getpid(), rb->fname);
+        fflush(stderr);
+        loops = 0;
+        atomic_flag_clear_explicit(&rbf->consumers_lock, memory_order_release);
+      }
+    }
+  }
+}
+
+static void consumers_unlock(struct ringbuf *rb)
+{
+  atomic_flag_clear_explicit(&rb->rbf->consumers_lock, memory_order_release);
+}
+
+/* Move cons_tail (and cons_head) up to the tail of the slowest consumer.
+ * Must be called with the consumers lock. Returns true if it moved. */
+static bool reclaim_locked(struct ringbuf_file *rbf)
+{
+  struct ringbuf_consumer *cons = ringbuf_file_consumers(rbf);
+  uint32_t const cons_tail = atomic_load(&rbf->cons_tail);
+  uint32_t min_done = UINT32_MAX;
+
+  for (uint32_t c = 0; c < rbf->max_consumers; c++) {
+    if (0 == atomic_load(&cons[c].pid)) continue;
+    // Consumers tails are all between cons_tail and prod_tail:
+    uint32_t const done =
+      ringbuf_file_num_entries(rbf, atomic_load(&cons[c].tail), cons_tail);
+    if (done < min_done) min_done = done;
+  }
+
+  if (min_done == UINT32_MAX || min_done == 0) return false;
+
+  uint32_t const new_tail = (cons_tail + min_done) % rbf->num_words;
+  atomic_store(&rbf->cons_head, new_tail);
+  atomic_store(&rbf->cons_tail, new_tail);
+  return true;
+}
+
+/* Free the slots of the consumers which process is gone.
+ * Must be called with the consumers lock. Returns the number of consumers
+ * left. */
+static unsigned reap_consumers_locked(struct ringbuf *rb)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+  struct ringbuf_consumer *cons = ringbuf_file_consumers(rbf);
+  unsigned num_consumers = 0;
+
+  for (uint32_t c = 0; c < rbf->max_consumers; c++) {
+    uint32_t const pid = atomic_load(&cons[c].pid);
+    if (0 == pid) continue;
+    if (kill((pid_t)pid, 0) < 0 && errno == ESRCH) {
+      fprintf(stderr, "%d: Reclaiming consumer slot %"PRIu32" of '%s' "
+                      "from dead pid %"PRIu32"\n",
+              getpid(), c, rb->fname, pid);
+      fflush(stderr);
+      atomic_store(&cons[c].pid, 0);
+    } else {
+      num_consumers ++;
+    }
+  }
+
+  return num_consumers;
+}
+
+/*
+ * Blocking waits
+ *
+ * Rather than polling an empty (or full) ringbuf, readers (or writers) can
+ * block on a futex word of the mmapped header. To save a syscall on every
+ * commit, the other side only bumps and wakes that futex when somebody
+ * declared to be waiting. The waiter increments the waiting count *before*
+ * checking the condition for the last time, while the other side changes
+ * the condition *before* reading the waiting count; with sequentially
+ * consistent atomics at least one of them sees the other.
+ */
+
+static void futex_wait(uint32_t _Atomic *addr, uint32_t expected, double timeout)
+{
+  if (timeout <= 0.) return;
+  struct timespec ts;
+  ts.tv_sec = (time_t)timeout;
+  ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+# ifdef __linux__
+  /* The ringbuf is shared amongst processes so no FUTEX_PRIVATE_FLAG here.
+   * Errors (EAGAIN when *addr has changed already, EINTR, ETIMEDOUT) are
+   * all equivalent to a spurious wake up: */
+  (void)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, expected, &ts, NULL, 0);
+# else
+  // No futexes, merely sleep (up to 1ms) and let the caller check again:
+  (void)addr; (void)expected;
+  if (ts.tv_sec > 0 || ts.tv_nsec > 1000000L) {
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000L;
+  }
+  nanosleep(&ts, NULL);
+# endif
+}
+
+static void futex_wake_all(uint32_t _Atomic *addr)
+{
+# ifdef __linux__
+  (void)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+# else
+  (void)addr;
+# endif
+}
+
+static void wake_readers(struct ringbuf_file *rbf)
+{
+  if (atomic_load(&rbf->num_readers_waiting) > 0) {
+    atomic_fetch_add(&rbf->data_seq, 1);
+    futex_wake_all(&rbf->data_seq);
+  }
+}
+
+static void wake_writers(struct ringbuf_file *rbf)
+{
+  if (atomic_load(&rbf->num_writers_waiting) > 0) {
+    atomic_fetch_add(&rbf->room_seq, 1);
+    futex_wake_all(&rbf->room_seq);
+  }
+}
+
+void ringbuf_wait_for_data(struct ringbuf *rb, double timeout)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+
+  uint32_t _Atomic *cons_head = cons_head_of(rb);
+  uint32_t const seq = atomic_load(&rbf->data_seq);
+  atomic_fetch_add(&rbf->num_readers_waiting, 1);
+  if (0 == ringbuf_file_num_entries(rbf, atomic_load(&rbf->prod_tail),
+                                         atomic_load(cons_head)))
+    futex_wait(&rbf->data_seq, seq, timeout);
+  atomic_fetch_sub(&rbf->num_readers_waiting, 1);
+}
+
+// Tells if a record of num_words would fit (see enqueue_reserve):
+static bool has_room(struct ringbuf_file const *rbf, uint32_t num_words)
+{
+  uint32_t const prod_head = atomic_load(&rbf->prod_head);
+  uint32_t alloced = 1 + num_words;
+  if (prod_head + alloced > rbf->num_words)
+    alloced += rbf->num_words - prod_head;
+  return
+    ringbuf_file_num_free(rbf, atomic_load(&rbf->cons_tail), prod_head) > alloced;
+}
+
+void ringbuf_wait_for_room(struct ringbuf *rb, uint32_t num_words, double timeout)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+
+  uint32_t const seq = atomic_load(&rbf->room_seq);
+  atomic_fetch_add(&rbf->num_writers_waiting, 1);
+  if (! has_room(rbf, num_words))
+    futex_wait(&rbf->room_seq, seq, timeout);
+  atomic_fetch_sub(&rbf->num_writers_waiting, 1);
+}
+
 /* So we have reserved a TX in the prod area, remembering what the former
  * head of the prod area was before adding our TX on top, and we are now
  * finished serializing the message in that TX and would like to "commit"
@@ -748,7 +1268,33 @@ static int prepare_timeouts(struct ringbuf_file const *rbf, uint32_t current, ui
 }
 #endif
 
-void ringbuf_enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, double t_start, double t_stop)
+/* Account for the num_records committed at tx->seen in the index of a non
+ * wrapping ringbuf. Called by the committer once all previous records have
+ * been committed, so that index buckets have a single writer: */
+static void update_index(struct ringbuf_file *rbf, struct ringbuf_tx const *tx, unsigned num_records, uint32_t prev_num_allocs, double t_start, double t_stop)
+{
+  if (0 == rbf->num_buckets) return;
+
+  struct ringbuf_bucket *b =
+    ringbuf_file_buckets(rbf) + tx->seen / ringbuf_file_bucket_words(rbf);
+
+  if (0 == b->num_records) {
+    b->first_record = tx->seen;
+    b->first_seq_offs = prev_num_allocs;
+  }
+
+  if (t_start > 0. || t_stop > 0.) {
+    bool const first_timed = b->num_records == b->num_untimed;
+    if (first_timed || t_start < b->tmin) b->tmin = t_start;
+    if (first_timed || t_stop > b->tmax) b->tmax = t_stop;
+  } else {
+    b->num_untimed += num_records;
+  }
+
+  b->num_records += num_records;
+}
+
+static void enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, unsigned num_records, double t_start, double t_stop)
 {
   struct ringbuf_file *rbf = rb->rbf;
 
@@ -783,7 +1329,7 @@ void ringbuf_enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, dou
       // All we need is for the following prod_tail change to always
       // be visible after the changes to num_allocs and min/max observed t:
       uint32_t prev_num_allocs =
-        atomic_fetch_add_explicit(&rbf->num_allocs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&rbf->num_allocs, num_records, memory_order_relaxed);
       if (t_start > 0. || t_stop > 0.) {
         double const tmin = atomic_load_explicit(&rbf->tmin, memory_order_relaxed);
         double const tmax = atomic_load_explicit(&rbf->tmax, memory_order_relaxed);
@@ -796,6 +1342,7 @@ void ringbuf_enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, dou
             //fprintf(stderr, "tmax = %f\n", t_stop);
         }
       }
+      update_index(rbf, tx, num_records, prev_num_allocs, t_start, t_stop);
 
       ringbuf_head_unlock(rb);
       break;
@@ -893,7 +1440,7 @@ void ringbuf_enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, dou
   //printf("enqueue commit, set prod_tail=%"PRIu32" while cons_head=%"PRIu32"\n", tx->next, rbf->cons_head);
   /* All we need is for the following prod_tail change to always
    * be visible after the changes to num_allocs and tmin/tmax: */
-  uint32_t prev_num_allocs = atomic_fetch_add_explicit(&rbf->num_allocs, 1, memory_order_relaxed);
+  uint32_t prev_num_allocs = atomic_fetch_add_explicit(&rbf->num_allocs, num_records, memory_order_relaxed);
   if (t_start > 0. || t_stop > 0.) {
     double const tmin = atomic_load_explicit(&rbf->tmin, memory_order_relaxed);
     double const tmax = atomic_load_explicit(&rbf->tmax, memory_order_relaxed);
@@ -902,15 +1449,29 @@ void ringbuf_enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, dou
     if (0 == prev_num_allocs || t_stop > tmax)
         atomic_store_explicit(&rbf->tmax, t_stop, memory_order_relaxed);
   }
+  update_index(rbf, tx, num_records, prev_num_allocs, t_start, t_stop);
   atomic_store(&rbf->prod_tail, tx->next);
   //print_rb(rb);
 
 # endif
+
+  wake_readers(rbf);
+}
+
+void ringbuf_enqueue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx, double t_start, double t_stop)
+{
+  enqueue_commit(rb, tx, 1, t_start, t_stop);
+}
+
+void ringbuf_enqueue_commit_batch(struct ringbuf *rb, struct ringbuf_tx const *tx, unsigned num_records, double t_start, double t_stop)
+{
+  enqueue_commit(rb, tx, num_records, t_start, t_stop);
 }
 
 ssize_t ringbuf_dequeue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx)
 {
   struct ringbuf_file *rbf = rb->rbf;
+  uint32_t _Atomic *cons_head = cons_head_of(rb);
 
 # if defined(LOCK_WITH_SPINLOCK) || defined(LOCK_WITH_LOCKF)
 
@@ -918,7 +1479,7 @@ ssize_t ringbuf_dequeue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx)
    * after it */
   ringbuf_head_lock(rb);
 
-  tx->seen = atomic_load(&rbf->cons_head);
+  tx->seen = atomic_load(cons_head);
   uint32_t seen_prod_tail = atomic_load(&rbf->prod_tail);
   tx->record_start = tx->seen;
 
@@ -958,7 +1519,7 @@ ssize_t ringbuf_dequeue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx)
     ASSERT_RB(dequeued <= ringbuf_file_num_entries(rbf, seen_prod_tail, tx->seen));
   }
 
-  atomic_store(&rbf->cons_head, tx->next);
+  atomic_store(cons_head, tx->next);
   ringbuf_head_unlock(rb);
 # else
 
@@ -968,7 +1529,7 @@ ssize_t ringbuf_dequeue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx)
 
    /* Try to "reserve" the next record after cons_head by moving rbf->cons_head
     * after it */
-  tx->seen = atomic_load(&rbf->cons_head); // compare_exchange will update this
+  tx->seen = atomic_load(cons_head); // compare_exchange will update this
   do {
     seen_prod_tail = atomic_load(&rbf->prod_tail);
     tx->record_start = tx->seen;
@@ -995,7 +1556,7 @@ ssize_t ringbuf_dequeue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx)
 
     /* So far we have only read stuff. Now we are all set, *if* no other thread
      * changed anything. Let's find out: */
-  } while (! atomic_compare_exchange_weak(&rbf->cons_head, &tx->seen, tx->next));
+  } while (! atomic_compare_exchange_weak(cons_head, &tx->seen, tx->next));
 
   /* It is possible that by the time we've read num_words and computed dequeued
    * and record_start, other readers have entirely emptied the ringbuffer and
@@ -1029,9 +1590,112 @@ ssize_t ringbuf_dequeue_alloc(struct ringbuf *rb, struct ringbuf_tx *tx)
   return num_words*sizeof(uint32_t);
 }
 
+/* Walk the committed records following tx->seen, up to max_records and
+ * max_words (the first record being always taken), and set tx->record_start
+ * and tx->next accordingly. A wrap around marker ends the batch unless it's
+ * met first, so that the records of a batch are always contiguous.
+ * Returns the number of records, 0 if there are none, or -1 if the records
+ * sizes are inconsistent with prod_tail (which is only possible while
+ * somebody else is moving cons_head). */
+static ssize_t dequeue_scan(struct ringbuf_file const *rbf, struct ringbuf_tx *tx, uint32_t seen_prod_tail, unsigned max_records, uint32_t max_words, uint32_t *first_num_words)
+{
+  uint32_t const avail = ringbuf_file_num_entries(rbf, seen_prod_tail, tx->seen);
+  if (avail < 1) return 0;
+
+  uint32_t w = tx->seen;
+  uint32_t dequeued = 0;
+  uint32_t num_words = atomic_load(rbf->data + w);
+
+  if (num_words == UINT32_MAX) { // A wrap around marker
+    dequeued = rbf->num_words - w;
+    w = 0;
+    num_words = atomic_load(rbf->data + w);
+  }
+
+  *first_num_words = num_words;
+  tx->record_start = w + 1;
+  ssize_t count = 0;
+  uint32_t words = 0;
+
+  while (true) {
+    if (num_words == 0 || num_words >= MAX_RINGBUF_MSG_WORDS ||
+        dequeued + 1 + num_words > avail) {
+      if (count == 0) return -1;
+      break;
+    }
+    dequeued += 1 + num_words;
+    words += num_words;
+    w += 1 + num_words;
+    count ++;
+    if ((unsigned)count >= max_records || dequeued >= avail ||
+        w >= rbf->num_words) break;
+    num_words = atomic_load(rbf->data + w);
+    if (num_words == UINT32_MAX || words + num_words > max_words) break;
+  }
+
+  tx->next = w % rbf->num_words;
+  return count;
+}
+
+ssize_t ringbuf_dequeue_alloc_batch(struct ringbuf *rb, struct ringbuf_tx *tx, unsigned max_records, uint32_t max_words)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+  uint32_t _Atomic *cons_head = cons_head_of(rb);
+  uint32_t num_words;
+  ssize_t count;
+
+  ASSERT_RB(max_records > 0);
+
+# if defined(LOCK_WITH_SPINLOCK) || defined(LOCK_WITH_LOCKF)
+
+  ringbuf_head_lock(rb);
+
+  tx->seen = atomic_load(cons_head);
+  uint32_t seen_prod_tail = atomic_load(&rbf->prod_tail);
+  count = dequeue_scan(rbf, tx, seen_prod_tail, max_records, max_words, &num_words);
+  if (count == 0) {
+    ringbuf_head_unlock(rb);
+    return -1;
+  }
+  ASSERT_RB(count > 0);
+
+  atomic_store(cons_head, tx->next);
+  ringbuf_head_unlock(rb);
+
+# else
+
+  /* Lock-less version */
+
+  tx->seen = atomic_load(cons_head); // compare_exchange will update this
+  while (true) {
+    uint32_t const seen_prod_tail = atomic_load(&rbf->prod_tail);
+    count = dequeue_scan(rbf, tx, seen_prod_tail, max_records, max_words, &num_words);
+    if (count == 0) return -1;
+    if (count < 0) {
+      // Speculative reads went wrong, unless nobody moved cons_head:
+      uint32_t const seen = tx->seen;
+      tx->seen = atomic_load(cons_head);
+      ASSERT_RB(tx->seen != seen);
+      continue;
+    }
+    /* So far we have only read stuff. Now we are all set, *if* no other thread
+     * changed anything. Let's find out: */
+    if (atomic_compare_exchange_weak(cons_head, &tx->seen, tx->next)) break;
+  }
+
+  // See ringbuf_dequeue_alloc:
+  uint32_t num_words2 = atomic_load(rbf->data + tx->seen);
+  ASSERT_RB(num_words2 == num_words || num_words2 == UINT32_MAX);
+
+# endif
+
+  return count;
+}
+
 void ringbuf_dequeue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx)
 {
   struct ringbuf_file *rbf = rb->rbf;
+  uint32_t _Atomic *tail = cons_tail_of(rb);
 
 # if defined(LOCK_WITH_SPINLOCK) || defined(LOCK_WITH_LOCKF)
 
@@ -1039,7 +1703,7 @@ void ringbuf_dequeue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx)
   while (true) {
     ringbuf_head_lock(rb);
     uint32_t seen_copy = tx->seen;
-    if (atomic_compare_exchange_weak(&rbf->cons_tail, &seen_copy, tx->next)) {
+    if (atomic_compare_exchange_weak(tail, &seen_copy, tx->next)) {
       ringbuf_head_unlock(rb);
       break;
     } else {
@@ -1047,7 +1711,7 @@ void ringbuf_dequeue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx)
       if (++ loops > ASSUME_KIA_AFTER / 2) {
         fprintf(stderr, "%d: cons_tail still %"PRIu32", waiting for seen=%"PRIu32
                         " for too long, aborting!\n",
-                getpid(), rbf->cons_tail, tx->seen);
+                getpid(), atomic_load(tail), tx->seen);
         abort();
       }
       release_cpu();
@@ -1059,7 +1723,7 @@ void ringbuf_dequeue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx)
   unsigned loops = 0;
   uint32_t cons_tail, prev_cons_tail;
   struct timespec start_to_worry, declared_dead;
-  while ((cons_tail = atomic_load(&rbf->cons_tail)) != tx->seen) {
+  while ((cons_tail = atomic_load(tail)) != tx->seen) {
     if (++loops >= WAIT_LOOP_YIELD_AFTER) {
       if (loops == WAIT_LOOP_YIELD_AFTER) {
         prev_cons_tail = cons_tail;
@@ -1083,7 +1747,7 @@ void ringbuf_dequeue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx)
                * the risk of having another blocked reader scheduled now */
               if (prev_num_words != new_num_words)
                 atomic_store(rbf->data + cons_tail, new_num_words);
-              atomic_store(&rbf->cons_tail, tx->seen);
+              atomic_store(tail, tx->seen);
               // Note: no need to mask it as invalid, the consumer is already dead
               if (prev_num_words != new_num_words) {
                 fprintf(stderr, "%d: Invalidating frozen msg in cons section @%d, "
@@ -1109,10 +1773,22 @@ void ringbuf_dequeue_commit(struct ringbuf *rb, struct ringbuf_tx const *tx)
   }
 
   //printf("dequeue commit, set const_tail=%"PRIu32" while prod_head=%"PRIu32"\n", tx->next, rbf->prod_head);
-  atomic_store(&rbf->cons_tail, tx->next);
+  atomic_store(tail, tx->next);
   //print_rb(rb);
 
 # endif
+
+  /* In broadcast ring buffers the space is given back to writers only when
+   * the slowest consumer moves, which we might be (see reclaim_locked): */
+  if (rb->consumer >= 0) {
+    if (tx->seen != atomic_load(&rbf->cons_tail)) return;
+    consumers_lock(rb);
+    bool const reclaimed = reclaim_locked(rbf);
+    consumers_unlock(rb);
+    if (! reclaimed) return;
+  }
+
+  wake_writers(rbf);
 }
 
 ssize_t ringbuf_read_first(struct ringbuf *rb, struct ringbuf_tx *tx)
@@ -1131,6 +1807,21 @@ ssize_t ringbuf_read_first(struct ringbuf *rb, struct ringbuf_tx *tx)
   return num_words*sizeof(uint32_t);
 }
 
+ssize_t ringbuf_read_at(struct ringbuf *rb, struct ringbuf_tx *tx, uint32_t offs)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+
+  if (offs >= atomic_load(&rbf->prod_tail)) return -1;
+  tx->seen = 0; // unused
+  tx->record_start = offs + 1;
+  uint32_t num_words = atomic_load(rbf->data + offs);
+  // Sanity checks:
+  if (num_words == 0 || num_words == UINT32_MAX ||
+      tx->record_start + num_words > rbf->num_words) return -2;
+  tx->next = tx->record_start + num_words;
+  return num_words*sizeof(uint32_t);
+}
+
 ssize_t ringbuf_read_next(struct ringbuf *rb, struct ringbuf_tx *tx)
 {
   struct ringbuf_file *rbf = rb->rbf;
@@ -1194,10 +1885,99 @@ bool ringbuf_repair(struct ringbuf *rb)
     was_needed = true;
   }
 
-  // Just in case, clear the lock as well:
+  struct ringbuf_consumer *cons = ringbuf_file_consumers(rbf);
+  for (uint32_t c = 0; c < rbf->max_consumers; c++) {
+    if (really_are_different(&cons[c].head, &cons[c].tail)) {
+      atomic_store(&cons[c].head, atomic_load(&cons[c].tail));
+      was_needed = true;
+    }
+  }
+
+  // Just in case, clear the locks as well:
   if (was_needed) {
     atomic_flag_clear_explicit(&rbf->lock, memory_order_release);
+    atomic_flag_clear_explicit(&rbf->consumers_lock, memory_order_release);
   }
 
+  if (rbf->max_consumers > 0) (void)ringbuf_reap_consumers(rb);
+
+  /* Do not reset num_readers/writers_waiting: live waiters will decrement
+   * them when woken up. Dead waiters only cost useless wake ups. */
+
   return was_needed;
 }
+
+enum ringbuf_error ringbuf_register_consumer(struct ringbuf *rb)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+
+  if (0 == rbf->max_consumers) {
+    fprintf(stderr, "%d: Cannot register as a consumer of '%s': "
+                    "not a broadcast ring buffer\n",
+            getpid(), rb->fname);
+    fflush(stderr);
+    return RB_ERR_FAILURE;
+  }
+
+  if (rb->consumer >= 0) return RB_OK;
+
+  enum ringbuf_error err = RB_ERR_NO_MORE_ROOM;
+  struct ringbuf_consumer *cons = ringbuf_file_consumers(rbf);
+
+  consumers_lock(rb);
+  /* Dead consumers might have been the slowest ones, so reclaim before
+   * the new consumer starts from cons_tail: */
+  (void)reap_consumers_locked(rb);
+  bool const reclaimed = reclaim_locked(rbf);
+
+  for (uint32_t c = 0; c < rbf->max_consumers; c++) {
+    if (0 != atomic_load(&cons[c].pid)) continue;
+    uint32_t const cons_tail = atomic_load(&rbf->cons_tail);
+    atomic_store(&cons[c].head, cons_tail);
+    atomic_store(&cons[c].tail, cons_tail);
+    atomic_store(&cons[c].pid, (uint32_t)getpid());
+    rb->consumer = c;
+    err = RB_OK;
+    break;
+  }
+  consumers_unlock(rb);
+
+  if (reclaimed) wake_writers(rbf);
+
+  if (err != RB_OK) {
+    fprintf(stderr, "%d: All %"PRIu32" consumer slots of '%s' are taken\n",
+            getpid(), rbf->max_consumers, rb->fname);
+    fflush(stderr);
+  }
+
+  return err;
+}
+
+void ringbuf_unregister_consumer(struct ringbuf *rb)
+{
+  if (rb->consumer < 0) return;
+
+  struct ringbuf_file *rbf = rb->rbf;
+
+  consumers_lock(rb);
+  atomic_store(&ringbuf_file_consumers(rbf)[rb->consumer].pid, 0);
+  bool const reclaimed = reclaim_locked(rbf);
+  consumers_unlock(rb);
+
+  rb->consumer = -1;
+  if (reclaimed) wake_writers(rbf);
+}
+
+unsigned ringbuf_reap_consumers(struct ringbuf *rb)
+{
+  struct ringbuf_file *rbf = rb->rbf;
+  if (0 == rbf->max_consumers) return 0;
+
+  consumers_lock(rb);
+  unsigned const num_consumers = reap_consumers_locked(rb);
+  bool const reclaimed = reclaim_locked(rbf);
+  consumers_unlock(rb);
+
+  if (reclaimed) wake_writers(rbf);
+  return num_consumers;
+}
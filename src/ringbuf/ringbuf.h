@@ -5,8 +5,11 @@
  *
  * - possibly multiple readers but single reader most of the times; When there
  * are several readers we may want each reader to see each tuple or each tuple
- * to be read only once. For the former we will merely use several ring buffer
- * since it's much easier and avoid non-trivial inter blockages.
+ * to be read only once. The later is the default. For the former, the ring
+ * buffer must be created with some consumer slots ("broadcast" ring buffer),
+ * that readers register into. Each registered consumer then has its own
+ * read cursors and the space is given back to the writers only once the
+ * slowest consumer is done with it;
  *
  * - variable length messages;
  *
@@ -50,38 +53,112 @@
 #define MAX_RINGBUF_MSG_WORDS 8192
 #define MAX_RINGBUF_MSG_SIZE (MAX_RINGBUF_MSG_WORDS * sizeof(uint32_t))
 
+/* Producers and consumers indices are kept on distinct cache lines so that
+ * writers committing a record do not invalidate the line readers are
+ * spinning on, and the other way around. 128 bytes rather than 64 because
+ * adjacent-line prefetchers would otherwise pull the other half anyway: */
+#define RINGBUF_CACHE_LINE_SIZE 128
+
+/* Per consumer cursors of broadcast ring buffers, each on its own cache
+ * line. Each slot is used by a single reader: */
+struct ringbuf_consumer {
+  // Same as cons_head and cons_tail, but for that consumer only:
+  _Alignas(RINGBUF_CACHE_LINE_SIZE) uint32_t _Atomic head;
+  uint32_t _Atomic tail;
+  // The pid of the consumer, or 0 if this slot is free:
+  uint32_t _Atomic pid;
+};
+
+/* Non wrapping ring buffers (ie. archives) also come with a sparse index
+ * of their content, so that readers looking for a given time range need
+ * not read the whole file: the data is divided into num_buckets buckets of
+ * equal size, and for each we remember where the first record starting in
+ * that bucket is, how many records start in it and their time range.
+ * Buckets are only ever updated by the committing producer: */
+struct ringbuf_bucket {
+  double tmin, tmax;
+  // Index of the size word of the first record starting in this bucket:
+  uint32_t first_record;
+  uint32_t num_records;
+  // Records with no time information, that must be read regardless:
+  uint32_t num_untimed;
+  // Seqnum of the first record, relative to the file first_seq:
+  uint32_t first_seq_offs;
+};
+
+// How many buckets non-wrapping ring buffers are created with:
+#define RINGBUF_NUM_BUCKETS 128
+
+/* Options given at creation, that apply to every mapping of the file (and of
+ * the files it is rotated into): */
+enum ringbuf_mmap_flags {
+  // Allocate all pages at creation and populate the page tables when mapped:
+  RB_MMAP_PREFAULT = 1U << 0,
+  // Ask for transparent hugepages (effective on tmpfs/shmem):
+  RB_MMAP_HUGEPAGES = 1U << 1,
+  // Advise the kernel of sequential accesses (read-ahead):
+  RB_MMAP_SEQUENTIAL = 1U << 2,
+  /* For non-wrapping ring buffers, prepare the next file in the background
+   * after every rotation so that the next one is only a rename: */
+  RB_MMAP_PRECREATE = 1U << 3,
+};
+
 struct ringbuf_file {
   uint64_t version;  // As a null 0 right-padded ascii string (max 8 chars)
   uint64_t first_seq;
   // Fixed length of the ring buffer. mmapped file must be >= this.
   uint32_t num_words;
   uint32_t wrap:1;  // Does the ring buffer act as a ring?
+  /* Set of enum ringbuf_mmap_flags. Lies in what used to be padding so that
+   * older files read as having no option: */
+  uint32_t mmap_flags:4;
   // Protects globally prod_* and cons_*. Unused if none of LOCK_WITH_* is defined
   atomic_flag lock;
+  /* For how many seconds to retry writing on NoMoreRoom error
+   * (irrelevant for non-wrapping buffers): */
+  double timeout;
+  /* Number of consumer slots following the data, or 0 for normal ring
+   * buffers. Lies in what used to be padding so that older files read as
+   * normal ring buffers: */
+  uint32_t max_consumers;
+  /* Number of index buckets following the data, only for non wrapping ring
+   * buffers (see struct ringbuf_bucket). Also lies in what used to be
+   * padding: */
+  uint32_t num_buckets;
   /* Pointers to entries. We use uint32 indexes so that we do not have
    * to worry too much about modulos. */
   /* Bytes that are being added by producers lie between prod_tail and
    * prod_head. prod_head points to the next word to be allocated. */
-  uint32_t _Atomic prod_head;
+  _Alignas(RINGBUF_CACHE_LINE_SIZE) uint32_t _Atomic prod_head;
   uint32_t _Atomic prod_tail;
+  /* We count the number of tuples (actually, of allocations), and keep
+   * the range of some observed "t" values. Those are only ever updated by
+   * producers so they belong to their cache line: */
+  uint32_t _Atomic num_allocs;
+  double _Atomic tmin;
+  double _Atomic tmax;
+  /* Readers waiting for data on an empty ringbuf block on the data_seq
+   * futex, that producers bump (and wake) whenever num_readers_waiting is
+   * not 0: */
+  uint32_t _Atomic data_seq;
+  uint32_t _Atomic num_readers_waiting;
   /* Bytes that are being read by consumers are between cons_tail and
    * cons_head. cons_head points to the next word to be read.
    * The ring buffer is empty when prod_tail == cons_head and full whenever
    * prod_head == cons_tail - 1. */
-  uint32_t _Atomic cons_head;
+  _Alignas(RINGBUF_CACHE_LINE_SIZE) uint32_t _Atomic cons_head;
   uint32_t _Atomic cons_tail;
-  /* We count the number of tuples (actually, of allocations), and keep
-   * the range of some observed "t" values: */
-  uint32_t _Atomic num_allocs;
-  double _Atomic tmin;
-  double _Atomic tmax;
-  /* For how many seconds to retry writing on NoMoreRoom error
-   * (irrelevant for non-wrapping buffers): */
-  double timeout;
+  /* Same as above for writers waiting for room in a full ringbuf: */
+  uint32_t _Atomic room_seq;
+  uint32_t _Atomic num_writers_waiting;
+  /* In broadcast ring buffers, cons_head and cons_tail both track the tail
+   * of the slowest consumer, and are moved with that lock held. The lock
+   * also protects the allocation of consumer slots: */
+  atomic_flag consumers_lock;
   /* The actual tuples start here: */
   _Static_assert(ATOMIC_INT_LOCK_FREE,
                  "uint32_t must be lock-free atomics");
-  uint32_t _Atomic data[];
+  _Alignas(RINGBUF_CACHE_LINE_SIZE) uint32_t _Atomic data[];
 };
 
 struct ringbuf {
@@ -91,8 +168,47 @@ struct ringbuf {
   /* Only used if LOCK_WITH_LOCKF, but present anyway to keep the same version
    * number: */
   int lock_fd;
+  // The consumer slot we are registered into, or -1:
+  int consumer;
 };
 
+// Consumer slots start at the first cache line after the data:
+inline size_t ringbuf_file_consumers_offset(uint32_t num_words)
+{
+  size_t const data_size = num_words * sizeof(uint32_t);
+  return
+    (data_size + RINGBUF_CACHE_LINE_SIZE - 1) & ~(RINGBUF_CACHE_LINE_SIZE - 1);
+}
+
+inline struct ringbuf_consumer *ringbuf_file_consumers(struct ringbuf_file const *rbf)
+{
+  return (struct ringbuf_consumer *)
+    ((char *)rbf->data + ringbuf_file_consumers_offset(rbf->num_words));
+}
+
+// Likewise, the index buckets start at the first cache line after the data:
+inline struct ringbuf_bucket *ringbuf_file_buckets(struct ringbuf_file const *rbf)
+{
+  return (struct ringbuf_bucket *)
+    ((char *)rbf->data + ringbuf_file_consumers_offset(rbf->num_words));
+}
+
+// How many words of data each index bucket covers:
+inline uint32_t ringbuf_file_bucket_words(struct ringbuf_file const *rbf)
+{
+  return (rbf->num_words + rbf->num_buckets - 1) / rbf->num_buckets;
+}
+
+// The expected size of a ring buffer file:
+inline size_t ringbuf_file_size(uint32_t num_words, uint32_t max_consumers, uint32_t num_buckets)
+{
+  if (0 == max_consumers && 0 == num_buckets)
+    return sizeof(struct ringbuf_file) + num_words * sizeof(uint32_t);
+  return sizeof(struct ringbuf_file) + ringbuf_file_consumers_offset(num_words)
+         + max_consumers * sizeof(struct ringbuf_consumer)
+         + num_buckets * sizeof(struct ringbuf_bucket);
+}
+
 // Error codes
 enum ringbuf_error {
   RB_OK = 0,
@@ -256,6 +372,31 @@ extern ssize_t ringbuf_dequeue_alloc(struct ringbuf *, struct ringbuf_tx *);
 
 extern void ringbuf_dequeue_commit(struct ringbuf *, struct ringbuf_tx const *);
 
+/* Batched versions of the above, with a single update of the indices for
+ * a whole run of consecutive records.
+ * Once allocated, the TX points at the first record of the batch and
+ * ringbuf_batch_next moves it to the next one. The batch is then committed
+ * as a whole with ringbuf_enqueue_commit_batch or the usual
+ * ringbuf_dequeue_commit. */
+extern enum ringbuf_error ringbuf_enqueue_alloc_batch(struct ringbuf *, struct ringbuf_tx *, unsigned num_records, uint32_t const *num_words);
+
+extern void ringbuf_enqueue_commit_batch(struct ringbuf *, struct ringbuf_tx const *, unsigned num_records, double t_start, double t_stop);
+
+// Returns the number of records dequeued (>= 1), or -1 if empty:
+extern ssize_t ringbuf_dequeue_alloc_batch(struct ringbuf *, struct ringbuf_tx *, unsigned max_records, uint32_t max_words);
+
+// Returns the size of the record (in words) the TX currently points to:
+inline uint32_t ringbuf_batch_record_words(struct ringbuf const *rb, struct ringbuf_tx const *tx)
+{
+  return atomic_load(rb->rbf->data + tx->record_start - 1);
+}
+
+// Move the TX to the next record of the batch:
+inline void ringbuf_batch_next(struct ringbuf const *rb, struct ringbuf_tx *tx)
+{
+  tx->record_start += 1 + ringbuf_batch_record_words(rb, tx);
+}
+
 // Combine all of the above:
 inline enum ringbuf_error ringbuf_enqueue(
       struct ringbuf *rb, uint32_t const *data, uint32_t num_words,
@@ -298,27 +439,70 @@ inline ssize_t ringbuf_dequeue(struct ringbuf *rb, uint32_t *data, size_t max_si
   return sz;
 }
 
+/* Block until the ringbuf is not empty any longer (or until timeout
+ * seconds have passed), instead of polling. Returns immediately if the
+ * ringbuf is not empty already. */
+extern void ringbuf_wait_for_data(struct ringbuf *, double timeout);
+
+/* Block until there is room to enqueue a message of num_words (or until
+ * timeout seconds have passed). Returns immediately if there is room
+ * already. */
+extern void ringbuf_wait_for_room(struct ringbuf *, uint32_t num_words, double timeout);
+
 // Initialize the given TX to point to the first record and return its size
 // Returns -1 if the file is empty, -2 on error
 extern ssize_t ringbuf_read_first(struct ringbuf *, struct ringbuf_tx *);
 
+/* Same as above, for the record which size is at word offs, typically the
+ * first_record of an index bucket. Returns -1 if that record has not been
+ * committed yet: */
+extern ssize_t ringbuf_read_at(struct ringbuf *, struct ringbuf_tx *, uint32_t offs);
+
 // Advance the given TX to the next record and return its size,
 // or -1 if we've reached the end of what's been written, and 0 on EOF
 extern ssize_t ringbuf_read_next(struct ringbuf *, struct ringbuf_tx *);
 
-/* Create a new ring buffer of the specified size. */
-extern enum ringbuf_error ringbuf_create(uint64_t version, bool wrap, uint32_t tot_words, double timeout, char const *fname);
+/* Create a new ring buffer of the specified size.
+ * If legacy_layout then the header is written with the former layout (all
+ * indices packed together), for the benefit of older readers/writers during
+ * a migration. Such a file can not be loaded with ringbuf_load.
+ * If max_consumers is not 0 then the ring buffer is a broadcast one, that
+ * can be read only by registered consumers (which implies wrap and not
+ * legacy_layout).
+ * Non wrapping ring buffers using the current layout are indexed (see
+ * struct ringbuf_bucket).
+ * mmap_flags is a set of enum ringbuf_mmap_flags, ignored for legacy
+ * layouts. */
+extern enum ringbuf_error ringbuf_create(uint64_t version, bool wrap, uint32_t tot_words, double timeout, bool legacy_layout, uint32_t max_consumers, unsigned mmap_flags, char const *fname);
 
 /* Mmap the ring buffer present in that file. Fails if the file does not exist
  * already. Returns NULL on error. */
 extern enum ringbuf_error ringbuf_load(struct ringbuf *, uint64_t version, char const *fname);
 
+/* Same as ringbuf_load, for archives that were compressed with zstd (see
+ * compress.c), that are decompressed into an anonymous mapping. */
+extern enum ringbuf_error ringbuf_load_compressed(struct ringbuf *, uint64_t version, char const *fname);
+
 /* Unmap the ringbuffer. */
 extern enum ringbuf_error ringbuf_unload(struct ringbuf *);
 
 /* Rotate the underlying disk file: */
 extern enum ringbuf_error rotate_file(struct ringbuf *);
 
+/* Register the calling process as a new consumer of that broadcast ring
+ * buffer, that will then see every records committed after, and those that
+ * have not been read by all other consumers yet. Slots of consumers which
+ * process is gone are reclaimed first.
+ * Returns RB_ERR_NO_MORE_ROOM if all slots are taken. */
+extern enum ringbuf_error ringbuf_register_consumer(struct ringbuf *);
+
+/* Free the consumer slot (also done by ringbuf_unload): */
+extern void ringbuf_unregister_consumer(struct ringbuf *);
+
+/* Free the slots of consumers which process is gone and return how many
+ * remain. */
+extern unsigned ringbuf_reap_consumers(struct ringbuf *);
+
 /* When one stops/crash with an allocated tx then the ringbuffer will remains
  * unusable (since the next process that tries to commit will wait forever
  * until the cons catch up with the observed head. So whenever it is certain
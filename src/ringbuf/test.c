@@ -12,7 +12,9 @@
 #define RB_WORDS 50
 #define RB_VERSION 42
 #define RB_MSG_SZ_MAX 20 // in words
+#define RB_BATCH_MAX 3 // in records
 #define NUM_LOOPS 100000
+#define NUM_BROADCAST_MSGS 20000 // per writer
 
 char fname[PATH_MAX];
 
@@ -26,6 +28,21 @@ static void load(struct ringbuf *rb)
 
 static struct timespec const quick = { .tv_sec = 0, .tv_nsec = 666 };
 
+static void check_msg(uint32_t const *data, ssize_t sz)
+{
+  assert(sz >= 4);
+  assert(sz <= 4 * RB_MSG_SZ_MAX);
+
+  // Every message is supposed to end with newline:
+  size_t const str_len = data[0];
+  assert(str_len <= (size_t)sz - 4);
+  char const *str = (char const *)(data + 1);
+  assert(str[str_len - 1] == '\n');
+
+  printf("%d: Reader: str_len=%zd, %.*s",
+         getpid(), str_len, (int)str_len, str);
+}
+
 static void read_once(struct ringbuf *rb)
 {
   uint32_t data[RB_MSG_SZ_MAX];
@@ -33,18 +50,28 @@ static void read_once(struct ringbuf *rb)
   if (sz < 0) {
     nanosleep(&quick, NULL);
   } else {
-    assert(sz >= 4);
-    assert(sz <= 4 * RB_MSG_SZ_MAX);
+    check_msg(data, sz);
+  }
+}
 
-    // Every message is supposed to end with newline:
-    size_t const str_len = data[0];
-    assert(str_len <= (size_t)sz - 4);
-    char *str = (char *)(data + 1);
-    assert(str[str_len - 1] == '\n');
+static void read_batch(struct ringbuf *rb)
+{
+  struct ringbuf_tx tx;
+  ssize_t const num_records =
+    ringbuf_dequeue_alloc_batch(rb, &tx, RB_BATCH_MAX, RB_WORDS);
+  if (num_records < 0) {
+    nanosleep(&quick, NULL);
+    return;
+  }
 
-    printf("%d: Reader: str_len=%zd, %.*s",
-           getpid(), str_len, (int)str_len, str);
+  struct ringbuf_tx cursor = tx;
+  for (ssize_t r = 0; r < num_records; r++) {
+    if (r > 0) ringbuf_batch_next(rb, &cursor);
+    ssize_t const sz = 4 * ringbuf_batch_record_words(rb, &cursor);
+    check_msg((uint32_t const *)(rb->rbf->data + cursor.record_start), sz);
   }
+
+  ringbuf_dequeue_commit(rb, &tx);
 }
 
 static void reader(int c)
@@ -53,8 +80,10 @@ static void reader(int c)
   struct ringbuf rb;
   load(&rb);
 
-  for (unsigned loop = 0; loop < NUM_LOOPS; loop++)
-    read_once(&rb);
+  for (unsigned loop = 0; loop < NUM_LOOPS; loop++) {
+    if (random() & 1) read_once(&rb);
+    else read_batch(&rb);
+  }
 
   ringbuf_unload(&rb);
 }
@@ -76,21 +105,59 @@ static char const *random_str(void)
   return strs[random() % (sizeof(strs)/sizeof(*strs))];
 }
 
-static void write_once(struct ringbuf *rb)
+static size_t make_msg(uint32_t *data, char const **str)
 {
-  char const *str = random_str();
-  size_t const str_len = strlen(str);
+  *str = random_str();
+  size_t const str_len = strlen(*str);
 
-  uint32_t data[RB_MSG_SZ_MAX];
   data[0] = str_len;
-  memcpy(data + 1, str, str_len);
+  memcpy(data + 1, *str, str_len);
+
+  return 1 + (str_len + 3) / 4;
+}
 
-  size_t const num_words = 1 + (str_len + 3) / 4;
+static void write_once(struct ringbuf *rb)
+{
+  uint32_t data[RB_MSG_SZ_MAX];
+  char const *str;
+  size_t const num_words = make_msg(data, &str);
 
   switch (ringbuf_enqueue(rb, data, num_words, 0., 0.)) {
     case RB_OK:
-      printf("%d: Writer: str_len=%zu, num_words=%zd, %.*s",
-             getpid(), str_len, num_words, (int)str_len, str);
+      printf("%d: Writer: str_len=%"PRIu32", num_words=%zd, %.*s",
+             getpid(), data[0], num_words, (int)data[0], str);
+      break;
+    case RB_ERR_NO_MORE_ROOM:
+      nanosleep(&quick, NULL);
+      break;
+    default:
+      assert(false);
+  }
+}
+
+static void write_batch(struct ringbuf *rb)
+{
+  unsigned const num_records = 1 + random() % RB_BATCH_MAX;
+  uint32_t data[RB_BATCH_MAX][RB_MSG_SZ_MAX];
+  uint32_t num_words[RB_BATCH_MAX];
+  char const *str;
+  for (unsigned r = 0; r < num_records; r++)
+    num_words[r] = make_msg(data[r], &str);
+
+  struct ringbuf_tx tx;
+  switch (ringbuf_enqueue_alloc_batch(rb, &tx, num_records, num_words)) {
+    case RB_OK:
+      {
+        struct ringbuf_tx cursor = tx;
+        for (unsigned r = 0; r < num_records; r++) {
+          if (r > 0) ringbuf_batch_next(rb, &cursor);
+          assert(ringbuf_batch_record_words(rb, &cursor) == num_words[r]);
+          memcpy(rb->rbf->data + cursor.record_start, data[r],
+                 num_words[r] * sizeof(uint32_t));
+        }
+        ringbuf_enqueue_commit_batch(rb, &tx, num_records, 0., 0.);
+        printf("%d: Writer: batch of %u records\n", getpid(), num_records);
+      }
       break;
     case RB_ERR_NO_MORE_ROOM:
       nanosleep(&quick, NULL);
@@ -107,44 +174,165 @@ static void writer(int c)
   load(&rb);
   srandom(time(NULL));
 
-  for (unsigned loop = 0; loop < NUM_LOOPS; loop++)
-    write_once(&rb);
+  for (unsigned loop = 0; loop < NUM_LOOPS; loop++) {
+    if (random() & 1) write_once(&rb);
+    else write_batch(&rb);
+  }
 
   ringbuf_unload(&rb);
 }
 
+/* In broadcast mode, every reader must see every message of every writer,
+ * in order. Messages are made of the writer number and a sequence number,
+ * padded with the sequence number to a random length: */
+
+static void broadcast_writer(int c)
+{
+  struct ringbuf rb;
+  load(&rb);
+  srandom(time(NULL) + c);
+
+  for (uint32_t seq = 0; seq < NUM_BROADCAST_MSGS; ) {
+    uint32_t data[RB_MSG_SZ_MAX];
+    uint32_t const num_words = 2 + random() % (RB_MSG_SZ_MAX - 2);
+    data[0] = c;
+    for (uint32_t w = 1; w < num_words; w++) data[w] = seq;
+    switch (ringbuf_enqueue(&rb, data, num_words, 0., 0.)) {
+      case RB_OK:
+        seq ++;
+        break;
+      case RB_ERR_NO_MORE_ROOM:
+        ringbuf_wait_for_room(&rb, num_words, 0.01);
+        break;
+      default:
+        assert(false);
+    }
+  }
+
+  ringbuf_unload(&rb);
+}
+
+static void check_broadcast_msg(uint32_t *next_seqs, int num_writers, uint32_t const *data, ssize_t sz)
+{
+  assert(sz >= 8 && sz <= 4 * RB_MSG_SZ_MAX);
+  assert(data[0] < (uint32_t)num_writers);
+  for (ssize_t w = 1; w < sz / 4; w++) assert(data[w] == next_seqs[data[0]]);
+  next_seqs[data[0]] ++;
+}
+
+static void broadcast_reader(int c, int num_writers)
+{
+  struct ringbuf rb;
+  load(&rb);
+  srandom(time(NULL) + c);
+  if (RB_OK != ringbuf_register_consumer(&rb)) {
+    fprintf(stderr, "Reader %d cannot register\n", c);
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t next_seqs[num_writers];
+  memset(next_seqs, 0, sizeof(next_seqs));
+  unsigned num_msgs = 0;
+
+  while (num_msgs < (unsigned)num_writers * NUM_BROADCAST_MSGS) {
+    struct ringbuf_tx tx;
+    ssize_t const num_records =
+      ringbuf_dequeue_alloc_batch(&rb, &tx, 1 + random() % RB_BATCH_MAX, RB_WORDS);
+    if (num_records < 0) {
+      ringbuf_wait_for_data(&rb, 0.01);
+      continue;
+    }
+    struct ringbuf_tx cursor = tx;
+    for (ssize_t r = 0; r < num_records; r++) {
+      if (r > 0) ringbuf_batch_next(&rb, &cursor);
+      ssize_t const sz = 4 * ringbuf_batch_record_words(&rb, &cursor);
+      check_broadcast_msg(next_seqs, num_writers,
+                          (uint32_t const *)(rb.rbf->data + cursor.record_start), sz);
+    }
+    ringbuf_dequeue_commit(&rb, &tx);
+    num_msgs += num_records;
+  }
+
+  for (int w = 0; w < num_writers; w++)
+    assert(next_seqs[w] == NUM_BROADCAST_MSGS);
+  printf("%d: Reader %d got all %u messages\n", getpid(), c, num_msgs);
+
+  ringbuf_unload(&rb);
+}
+
+static int broadcast(int num_writers, int num_readers)
+{
+  for (int c = 0; c < num_readers; c++) {
+    pid_t p = fork();
+    if (! p) {
+      broadcast_reader(c, num_writers);
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  // Wait for all readers to be registered before writing anything:
+  struct ringbuf rb;
+  load(&rb);
+  while (ringbuf_reap_consumers(&rb) < (unsigned)num_readers)
+    nanosleep(&quick, NULL);
+  ringbuf_unload(&rb);
+
+  for (int c = 0; c < num_writers; c++) {
+    pid_t p = fork();
+    if (! p) {
+      broadcast_writer(c);
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  int ret = EXIT_SUCCESS;
+  for (int c = 0; c < num_readers + num_writers; c++) {
+    int status;
+    if (wait(&status) < 0 || ! WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) ret = EXIT_FAILURE;
+  }
+  return ret;
+}
+
 int main(int num_args, char const **args)
 {
   if (num_args != 4) {
 syntax:
-    printf("%s [mono|multi] [num_writers] [num_readers]\n", args[0]);
+    printf("%s [mono|multi|broadcast] [num_writers] [num_readers]\n", args[0]);
     return EXIT_FAILURE;
   }
 
   bool mono = strcmp("mono", args[1]) == 0;
-  if (! mono && strcmp("multi", args[1]) != 0) goto syntax;
+  bool bcast = strcmp("broadcast", args[1]) == 0;
+  if (! mono && ! bcast && strcmp("multi", args[1]) != 0) goto syntax;
   int num_writers = strtol(args[2], NULL, 10);
   int num_readers = strtol(args[3], NULL, 10);
 
   if (num_writers <= 0 || num_readers <= 0) goto syntax;
 
   snprintf(fname, sizeof(fname), "/tmp/ringbuf_test.%d.rb", (int)getpid());
-  if (RB_OK != ringbuf_create(RB_VERSION, true, RB_WORDS, fname)) {
+  if (RB_OK != ringbuf_create(RB_VERSION, true, RB_WORDS, 0., false,
+                              bcast ? num_readers : 0, 0, fname)) {
     fprintf(stderr, "Cannot create ringbuffer in %s\n", fname);
     return EXIT_FAILURE;
   }
 
-  if (mono) {
+  if (bcast) {
+    return broadcast(num_writers, num_readers);
+  } else if (mono) {
     struct ringbuf rb;
     load(&rb);
 
     srandom(time(NULL));
 
     while (true) {
+      bool const batch = random() & 1;
       if (random() % (num_writers + num_readers) < num_writers) {
-        write_once(&rb);
+        if (batch) write_batch(&rb);
+        else write_once(&rb);
       } else {
-        read_once(&rb);
+        if (batch) read_batch(&rb);
+        else read_once(&rb);
       }
     }
   } else {
@@ -0,0 +1,139 @@
+// vim: ft=c bs=2 ts=2 sts=2 sw=2 expandtab
+/* Batched reception of UDP datagrams, for the collectd and netflow
+ * listeners (see RamenHelpers.udp_server). */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+
+#define MAX_BATCH 64
+
+/* Allow several sockets of the same process to bind the same port (so that
+ * the kernel spreads the datagrams amongst them), and ask for the count of
+ * dropped datagrams to be attached to every received one. Must be called
+ * before bind: */
+CAMLprim value wrap_udp_setup_socket(value fd_)
+{
+  CAMLparam1(fd_);
+  int const fd = Int_val(fd_);
+  int const one = 1;
+  if (0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+    caml_failwith(strerror(errno));
+# ifdef SO_RXQ_OVFL
+  if (0 != setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)))
+    caml_failwith(strerror(errno));
+# endif
+  CAMLreturn(Val_unit);
+}
+
+static value alloc_sender(struct sockaddr_storage const *addr)
+{
+  CAMLparam0();
+  CAMLlocal2(res, ip);
+  switch (addr->ss_family) {
+    case AF_INET:
+      {
+        struct sockaddr_in const *sin = (struct sockaddr_in const *)addr;
+        // Same representation as Unix.inet_addr:
+        ip = caml_alloc_string(sizeof(sin->sin_addr));
+        memcpy(Bytes_val(ip), &sin->sin_addr, sizeof(sin->sin_addr));
+      }
+      break;
+    case AF_INET6:
+      {
+        struct sockaddr_in6 const *sin6 = (struct sockaddr_in6 const *)addr;
+        ip = caml_alloc_string(sizeof(sin6->sin6_addr));
+        memcpy(Bytes_val(ip), &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+      }
+      break;
+    default:
+      CAMLreturn(Val_int(0)); // None
+  }
+  res = caml_alloc(1, 0);
+  Store_field(res, 0, ip);
+  CAMLreturn(res);
+}
+
+/* Receive as many datagrams as there are slots of [slot_size] bytes in
+ * [buffer] (up to MAX_BATCH), waiting only for the first one.
+ * Returns one pair of datagram size and sender per datagram, the i-th
+ * datagram being copied in the i-th slot. The array is empty if the wait
+ * was interrupted or timed out.
+ * The last count of dropped datagrams reported by the kernel, if any, is
+ * stored in [drops.(0)]. */
+CAMLprim value wrap_udp_recv_batch(
+  value fd_, value buffer_, value slot_size_, value drops_)
+{
+  CAMLparam4(fd_, buffer_, slot_size_, drops_);
+  CAMLlocal2(res, pair);
+  int const fd = Int_val(fd_);
+  size_t const slot_size = Long_val(slot_size_);
+  if (slot_size == 0) caml_invalid_argument("recv_batch: null slot size");
+  size_t num_slots = caml_string_length(buffer_) / slot_size;
+  if (num_slots > MAX_BATCH) num_slots = MAX_BATCH;
+  if (num_slots == 0) caml_invalid_argument("recv_batch: buffer too small");
+
+  /* Receive into C memory since the OCaml buffer may be moved by another
+   * thread while the runtime is released: */
+  char *data = malloc(num_slots * slot_size);
+  if (! data) caml_raise_out_of_memory();
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  struct sockaddr_storage addrs[MAX_BATCH];
+  char ctrls[MAX_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+  memset(msgs, 0, sizeof(msgs));
+  for (size_t i = 0; i < num_slots; i++) {
+    iovs[i].iov_base = data + i * slot_size;
+    iovs[i].iov_len = slot_size;
+    msgs[i].msg_hdr.msg_name = addrs + i;
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    msgs[i].msg_hdr.msg_iov = iovs + i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = ctrls[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i]);
+  }
+
+  caml_enter_blocking_section();
+  int const n = recvmmsg(fd, msgs, num_slots, MSG_WAITFORONE, NULL);
+  int const err = errno;
+  caml_leave_blocking_section();
+
+  if (n < 0) {
+    free(data);
+    if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+      CAMLreturn(Atom(0));
+    caml_failwith(strerror(err));
+  }
+
+  res = caml_alloc(n, 0);
+  for (int i = 0; i < n; i++) {
+    memcpy(Bytes_val(buffer_) + i * slot_size, data + i * slot_size,
+           msgs[i].msg_len);
+#   ifdef SO_RXQ_OVFL
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+        Store_field(drops_, 0, Val_long(drops));
+      }
+    }
+#   endif
+    pair = caml_alloc_tuple(2);
+    Store_field(pair, 0, Val_long(msgs[i].msg_len));
+    Store_field(pair, 1, alloc_sender(addrs + i));
+    Store_field(res, i, pair);
+  }
+  free(data);
+  CAMLreturn(res);
+}
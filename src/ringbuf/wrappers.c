@@ -16,11 +16,13 @@
 #include <caml/custom.h>
 #include <caml/fail.h>
 #include <caml/callback.h>
+#include <caml/signals.h>
 
 #include <uint64.h>
 #include <uint128.h>
 
 #include "ringbuf.h"
+#include "archive.h"
 
 static bool debug = false;
 
@@ -76,7 +78,11 @@ struct wrap_ringbuf_tx {
   struct ringbuf_tx tx;
   // Number of bytes allocated either in the RB transaction or in *bytes
   // above; just to check we do not overflow.
+  // For batches, this is the size of the current record.
   size_t alloced;
+  // For batches, how many records and which one tx.record_start points to:
+  unsigned num_records;
+  unsigned record_idx;
 };
 
 static void wrtx_finalize(value);
@@ -111,6 +117,8 @@ static value alloc_tx(void)
   struct wrap_ringbuf_tx *wrtx = RingbufTx_val(res);
   wrtx->rb = NULL;
   wrtx->bytes = NULL;
+  wrtx->num_records = 1;
+  wrtx->record_idx = 0;
   CAMLreturn(res);
 }
 
@@ -134,20 +142,32 @@ static uint64_t uint64_of_version(char const *str)
   return v;
 }
 
-CAMLprim value wrap_ringbuf_create(value version_, value wrap_, value tot_words_, value timeout_, value fname_)
+CAMLprim value wrap_ringbuf_create(value version_, value wrap_, value tot_words_, value timeout_, value legacy_layout_, value max_consumers_, value mmap_flags_, value fname_)
 {
-  CAMLparam4(version_, wrap_, fname_, tot_words_);
+  CAMLparam5(version_, wrap_, tot_words_, timeout_, legacy_layout_);
+  CAMLxparam3(max_consumers_, mmap_flags_, fname_);
   char *version_str = String_val(version_);
   uint64_t version = uint64_of_version(version_str);
   bool wrap = Bool_val(wrap_);
   char *fname = String_val(fname_);
   unsigned tot_words = Long_val(tot_words_);
   double timeout = Double_val(timeout_);
-  enum ringbuf_error err = ringbuf_create(version, wrap, tot_words, timeout, fname);
+  bool legacy_layout = Bool_val(legacy_layout_);
+  unsigned max_consumers = Long_val(max_consumers_);
+  unsigned mmap_flags = Long_val(mmap_flags_);
+  enum ringbuf_error err =
+    ringbuf_create(version, wrap, tot_words, timeout, legacy_layout,
+                   max_consumers, mmap_flags, fname);
   if (RB_OK != err) caml_failwith("Cannot create ring buffer");
   CAMLreturn(Val_unit);
 }
 
+CAMLprim value wrap_ringbuf_create_bytecode(value *argv, int argn)
+{
+  assert(argn == 8);
+  return wrap_ringbuf_create(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
+}
+
 CAMLprim value wrap_ringbuf_load(value version_, value fname_)
 {
   CAMLparam2(version_, fname_);
@@ -156,7 +176,23 @@ CAMLprim value wrap_ringbuf_load(value version_, value fname_)
   char *version_str = String_val(version_);
   uint64_t version = uint64_of_version(version_str);
   char *fname = String_val(fname_);
-  if (RB_OK != ringbuf_load(Ringbuf_val(res), version, fname))
+  char const *ext = extension_of_fname(fname);
+  enum ringbuf_error err;
+  char zst_fname[PATH_MAX];
+  if (0 == strcmp(ext, ".zst")) {
+    err = ringbuf_load_compressed(Ringbuf_val(res), version, fname);
+  } else if (
+    // The archive might have been compressed since it's been listed:
+    0 == strcmp(ext, ".b") && 0 != access(fname, F_OK) &&
+    (size_t)snprintf(zst_fname, sizeof(zst_fname), "%s.zst", fname) <
+      sizeof(zst_fname) &&
+    0 == access(zst_fname, F_OK)
+  ) {
+    err = ringbuf_load_compressed(Ringbuf_val(res), version, zst_fname);
+  } else {
+    err = ringbuf_load(Ringbuf_val(res), version, fname);
+  }
+  if (RB_OK != err)
     caml_failwith("Cannot load ring buffer");
   CAMLreturn(res);
 }
@@ -184,11 +220,11 @@ CAMLprim value wrap_ringbuf_may_archive(value rb_)
 CAMLprim value wrap_ringbuf_stats(value rb_)
 {
   CAMLparam1(rb_);
-  CAMLlocal1(ret);
+  CAMLlocal3(ret, consumers, consumer);
   struct ringbuf *rb = Ringbuf_val(rb_);
   struct ringbuf_file *rbf = rb->rbf;
   // See type stats in RingBuf.ml
-  ret = caml_alloc_tuple(13);
+  ret = caml_alloc_tuple(15);
   /* "Rule 6   Direct assignment to a field of a block, as in `Field(v, n) = w;`
    *  is safe only if v is a block newly allocated by caml_alloc_small; that is,
    *  if no allocation took place between the allocation of v and the assignment
@@ -210,9 +246,85 @@ CAMLprim value wrap_ringbuf_stats(value rb_)
   Store_field(ret, 10, Val_long(rbf->cons_tail));
   Store_field(ret, 11, Val_long(rbf->first_seq));
   Store_field(ret, 12, caml_copy_double(rbf->timeout));
+  Store_field(ret, 13, Val_long(rbf->max_consumers));
+  // Registered consumers, with the number of words they have yet to read:
+  struct ringbuf_consumer const *cons = ringbuf_file_consumers(rbf);
+  uint32_t const prod_tail = atomic_load(&rbf->prod_tail);
+  unsigned num_consumers = 0;
+  for (uint32_t c = 0; c < rbf->max_consumers; c++)
+    if (0 != atomic_load(&cons[c].pid)) num_consumers ++;
+  consumers = caml_alloc_tuple(num_consumers);
+  for (uint32_t c = 0, i = 0; c < rbf->max_consumers && i < num_consumers; c++) {
+    uint32_t const pid = atomic_load(&cons[c].pid);
+    if (0 == pid) continue;
+    consumer = caml_alloc_tuple(2);
+    Store_field(consumer, 0, Val_long(pid));
+    Store_field(consumer, 1,
+      Val_long(ringbuf_file_num_entries(rbf, prod_tail,
+                                        atomic_load(&cons[c].head))));
+    Store_field(consumers, i++, consumer);
+  }
+  Store_field(ret, 14, consumers);
   CAMLreturn(ret);
 }
 
+// Returns the non empty buckets of the index (see type bucket in RingBuf.ml):
+CAMLprim value wrap_ringbuf_index(value rb_)
+{
+  CAMLparam1(rb_);
+  CAMLlocal2(ret, bucket);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  struct ringbuf_file *rbf = rb->rbf;
+  struct ringbuf_bucket const *buckets = ringbuf_file_buckets(rbf);
+  unsigned num_used = 0;
+  for (uint32_t b = 0; b < rbf->num_buckets; b++)
+    if (buckets[b].num_records > 0) num_used ++;
+  ret = caml_alloc_tuple(num_used);
+  for (uint32_t b = 0, i = 0; b < rbf->num_buckets && i < num_used; b++) {
+    struct ringbuf_bucket const *bk = buckets + b;
+    if (0 == bk->num_records) continue;
+    bucket = caml_alloc_tuple(6);
+    Store_field(bucket, 0, caml_copy_double(bk->tmin));
+    Store_field(bucket, 1, caml_copy_double(bk->tmax));
+    Store_field(bucket, 2, Val_long(bk->first_record));
+    Store_field(bucket, 3, Val_long(bk->num_records));
+    Store_field(bucket, 4, Val_long(bk->num_untimed));
+    Store_field(bucket, 5, Val_long(rbf->first_seq + bk->first_seq_offs));
+    Store_field(ret, i++, bucket);
+  }
+  CAMLreturn(ret);
+}
+
+CAMLprim value wrap_ringbuf_register_consumer(value rb_)
+{
+  CAMLparam1(rb_);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  switch (ringbuf_register_consumer(rb)) {
+    case RB_OK:
+      break;
+    case RB_ERR_NO_MORE_ROOM:
+      caml_failwith("No consumer slot left in ring buffer");
+      break;
+    default:
+      caml_failwith("Not a broadcast ring buffer");
+      break;
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value wrap_ringbuf_unregister_consumer(value rb_)
+{
+  CAMLparam1(rb_);
+  ringbuf_unregister_consumer(Ringbuf_val(rb_));
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value wrap_ringbuf_reap_consumers(value rb_)
+{
+  CAMLparam1(rb_);
+  CAMLreturn(Val_long(ringbuf_reap_consumers(Ringbuf_val(rb_))));
+}
+
 CAMLprim value wrap_ringbuf_repair(value rb_)
 {
   CAMLparam1(rb_);
@@ -320,6 +432,31 @@ CAMLprim value wrap_ringbuf_read_first(value rb_)
   }
 }
 
+// Same as above but from the record which size is at the given word offset:
+CAMLprim value wrap_ringbuf_read_at(value rb_, value offs_)
+{
+  CAMLparam2(rb_, offs_);
+  CAMLlocal1(tx);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  long const offs = Long_val(offs_);
+  if (offs < 0 || offs >= rb->rbf->num_words)
+    caml_invalid_argument("read_at: invalid offset");
+  tx = alloc_tx();
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  wrtx->rb = rb;
+  ssize_t const size = ringbuf_read_at(rb, &wrtx->tx, offs);
+  if (size == -2) {
+    caml_failwith("Invalid buffer file");
+  } else if (size == -1) {
+    assert(exceptions_inited);
+    caml_raise_constant(*exn_Empty);
+  } else {
+    assert(size < (ssize_t)MAX_RINGBUF_MSG_SIZE);
+    wrtx->alloced = (size_t)size;
+    CAMLreturn(tx);
+  }
+}
+
 // Same as wrap_ringbuf_dequeue_alloc but does not change the reader pointer
 // in ringbuffer header:
 CAMLprim value wrap_ringbuf_read_next(value tx)
@@ -440,10 +577,148 @@ CAMLprim value wrap_ringbuf_enqueue_commit(value tx, value tmin_, value tmax_)
   struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
   double tmin = Double_val(tmin_);
   double tmax = Double_val(tmax_);
-  ringbuf_enqueue_commit(wrtx->rb, &wrtx->tx, tmin, tmax);
+  // Works for batches as well since only tx.seen and tx.next matter:
+  ringbuf_enqueue_commit_batch(wrtx->rb, &wrtx->tx, wrtx->num_records, tmin, tmax);
   CAMLreturn(Val_unit);
 }
 
+#define MAX_BATCH_RECORDS 4096
+
+CAMLprim value wrap_ringbuf_enqueue_alloc_batch(value rb_, value sizes_)
+{
+  CAMLparam2(rb_, sizes_);
+  CAMLlocal1(tx);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  mlsize_t const num_records = Wosize_val(sizes_);
+  if (num_records == 0 || num_records > MAX_BATCH_RECORDS) {
+    caml_invalid_argument(
+      "enqueue_alloc_batch: number of records must be within 1.." STR(MAX_BATCH_RECORDS));
+  }
+  uint32_t num_words[num_records];
+  for (mlsize_t r = 0; r < num_records; r++) {
+    int const size = Long_val(Field(sizes_, r));
+    check_size(size);
+    num_words[r] = size / sizeof(uint32_t);
+  }
+  tx = alloc_tx();
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  wrtx->rb = rb;
+  wrtx->alloced = num_words[0] * sizeof(uint32_t);
+  wrtx->num_records = num_records;
+  check_error(
+    ringbuf_enqueue_alloc_batch(rb, &wrtx->tx, num_records, num_words),
+    "Cannot ringbuf_enqueue_alloc_batch",
+    "Ringbuf version mismatch in ringbuf_enqueue_alloc_batch");
+  CAMLreturn(tx);
+}
+
+/* Enqueue, straight from the given bytes, as many of the records found in
+ * there (each prefixed with its size in bytes as a little endian 32 bits
+ * integer) as can fit in a single batch. Returns how many bytes have been
+ * consumed, or raises NoMoreRoom if not even the first record fits. */
+CAMLprim value wrap_ringbuf_enqueue_records(value rb_, value bytes_, value offs_, value len_)
+{
+  CAMLparam4(rb_, bytes_, offs_, len_);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  long const offs = Long_val(offs_);
+  long const len = Long_val(len_);
+  if (offs < 0 || len < 0 || offs + len > (long)caml_string_length(bytes_))
+    caml_invalid_argument("enqueue_records: invalid range");
+  uint8_t const *const start = (uint8_t const *)Bytes_val(bytes_) + offs;
+
+  /* Stop before the batch gets too large for the ringbuf to ever accept it,
+   * or to wait for it to be almost empty: */
+  uint32_t const max_words = rb->rbf->num_words / 2;
+  uint32_t num_words[MAX_BATCH_RECORDS];
+  long ends[MAX_BATCH_RECORDS];
+  unsigned num_records = 0;
+  uint32_t tot_words = 0;
+  long o = 0;
+  while (o < len && num_records < MAX_BATCH_RECORDS) {
+    if (o + 4 > len)
+      caml_invalid_argument("enqueue_records: truncated record size");
+    uint32_t const size =
+      (uint32_t)start[o] | (uint32_t)start[o+1] << 8 |
+      (uint32_t)start[o+2] << 16 | (uint32_t)start[o+3] << 24;
+    check_size(size);
+    if (o + 4 + (long)size > len)
+      caml_invalid_argument("enqueue_records: truncated record");
+    uint32_t const w = size / sizeof(uint32_t);
+    if (num_records > 0 && tot_words + 1 + w > max_words) break;
+    num_words[num_records] = w;
+    tot_words += 1 + w;
+    o += 4 + size;
+    ends[num_records++] = o;
+  }
+  if (num_records == 0) CAMLreturn(Val_long(0));
+
+  /* Shorten the batch until it fits: */
+  struct ringbuf_tx tx;
+  enum ringbuf_error err;
+  while (RB_ERR_NO_MORE_ROOM ==
+           (err = ringbuf_enqueue_alloc_batch(rb, &tx, num_records, num_words)) &&
+         num_records > 1) {
+    num_records /= 2;
+  }
+  check_error(err,
+    "Cannot ringbuf_enqueue_alloc_batch",
+    "Ringbuf version mismatch in ringbuf_enqueue_alloc_batch");
+
+  uint8_t const *src = start;
+  uint32_t record_start = tx.record_start;
+  for (unsigned r = 0; r < num_records; r++) {
+    src += 4;
+    memcpy(rb->rbf->data + record_start, src, num_words[r] * sizeof(uint32_t));
+    src += num_words[r] * sizeof(uint32_t);
+    // Records of a batch are contiguous:
+    record_start += 1 + num_words[r];
+  }
+  ringbuf_enqueue_commit_batch(rb, &tx, num_records, 0., 0.);
+
+  CAMLreturn(Val_long(ends[num_records - 1]));
+}
+
+CAMLprim value wrap_ringbuf_dequeue_alloc_batch(value rb_, value max_records_)
+{
+  CAMLparam2(rb_, max_records_);
+  CAMLlocal1(tx);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  long const max_records = Long_val(max_records_);
+  if (max_records <= 0)
+    caml_invalid_argument("dequeue_alloc_batch: max_records must be > 0");
+  tx = alloc_tx();
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  wrtx->rb = rb;
+  ssize_t const num_records =
+    ringbuf_dequeue_alloc_batch(rb, &wrtx->tx, max_records, rb->rbf->num_words);
+  if (num_records < 0) {
+    assert(exceptions_inited);
+    caml_raise_constant(*exn_Empty);
+  }
+  wrtx->num_records = num_records;
+  wrtx->alloced = ringbuf_batch_record_words(rb, &wrtx->tx) * sizeof(uint32_t);
+  assert(wrtx->alloced < MAX_RINGBUF_MSG_SIZE);
+  CAMLreturn(tx);
+}
+
+CAMLprim value wrap_ringbuf_tx_num_records(value tx)
+{
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  return Val_long(wrtx->num_records);
+}
+
+// Move to the next record of a batch, returning false if there are none:
+CAMLprim value wrap_ringbuf_batch_next(value tx)
+{
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  if (wrtx->record_idx + 1 >= wrtx->num_records) return Val_false;
+  wrtx->record_idx ++;
+  ringbuf_batch_next(wrtx->rb, &wrtx->tx);
+  wrtx->alloced =
+    ringbuf_batch_record_words(wrtx->rb, &wrtx->tx) * sizeof(uint32_t);
+  return Val_true;
+}
+
 CAMLprim value wrap_ringbuf_dequeue_alloc(value rb_)
 {
   CAMLparam1(rb_);
@@ -472,6 +747,35 @@ CAMLprim value wrap_ringbuf_dequeue_commit(value tx)
   CAMLreturn(Val_unit);
 }
 
+/* Blocking waits. Other threads are allowed to run meanwhile since the
+ * ringbuf is not going to be unloaded by another thread while we wait: */
+
+CAMLprim value wrap_ringbuf_wait_for_data(value rb_, value timeout_)
+{
+  CAMLparam2(rb_, timeout_);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  double const timeout = Double_val(timeout_);
+  caml_enter_blocking_section();
+  ringbuf_wait_for_data(rb, timeout);
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value wrap_ringbuf_wait_for_room(value rb_, value size_, value timeout_)
+{
+  CAMLparam3(rb_, size_, timeout_);
+  struct ringbuf *rb = Ringbuf_val(rb_);
+  long const size = Long_val(size_);
+  // Might be larger than a single message when waiting for a batch:
+  if (size <= 0 || (size & 3))
+    caml_invalid_argument("wait_for_room: size must be a positive multiple of 4 bytes");
+  double const timeout = Double_val(timeout_);
+  caml_enter_blocking_section();
+  ringbuf_wait_for_room(rb, size / sizeof(uint32_t), timeout);
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
+}
+
 // WRITES
 
 static void *where_to(struct wrap_ringbuf_tx const *wrtx, size_t offs)
@@ -686,8 +990,10 @@ extern struct custom_operations int128_ops;
 extern struct custom_operations caml_int64_ops;
 extern struct custom_operations caml_int32_ops;
 
-#define READ_BOXED(int_type, bits, ops, custom_sz, dst_offset) \
-CAMLprim value read_##int_type##bits(value tx, value off_) \
+/* Boxed integers are copied into a custom block by [copy_words], either
+ * read_words or peek_words (see below): */
+#define ACCESS_BOXED(prefix, copy_words, int_type, bits, ops, custom_sz, dst_offset) \
+CAMLprim value prefix##_##int_type##bits(value tx, value off_) \
 { \
   CAMLparam2(tx, off_); \
   CAMLlocal1(v); \
@@ -696,10 +1002,13 @@ CAMLprim value read_##int_type##bits(value tx, value off_) \
   v = caml_alloc_custom(&ops, custom_sz, 0, 1); \
   char *dst = Data_custom_val(v); \
   if (dst_offset > 0) memset(dst, 0, dst_offset); \
-  read_words(wrtx, offs, dst + dst_offset, custom_sz - dst_offset); \
+  copy_words(wrtx, offs, dst + dst_offset, custom_sz - dst_offset); \
   CAMLreturn(v); \
 }
 
+#define READ_BOXED(int_type, bits, ops, custom_sz, dst_offset) \
+  ACCESS_BOXED(read, read_words, int_type, bits, ops, custom_sz, dst_offset)
+
 #define READ_UNBOXED_INT(int_type, bits, int_bits) \
 CAMLprim value read_##int_type##bits(value tx, value off_) \
 { \
@@ -712,24 +1021,28 @@ CAMLprim value read_##int_type##bits(value tx, value off_) \
   CAMLreturn(Val_long(v)); \
 }
 
-READ_BOXED(uint, 128, uint128_ops, 16, 0);
-READ_BOXED(uint, 64, uint64_ops, 8, 0);
-READ_BOXED(uint, 56, uint64_ops, 8, 1);
-READ_BOXED(uint, 48, uint64_ops, 8, 2);
-READ_BOXED(uint, 40, uint64_ops, 8, 3);
-READ_BOXED(uint, 32, uint32_ops, 4, 0);
-READ_UNBOXED_INT(uint, 24, 32);
-READ_UNBOXED_INT(uint, 16, 16);
-READ_UNBOXED_INT(uint, 8, 8);
-READ_BOXED(int, 128, int128_ops, 16, 0);
-READ_BOXED(int, 64, caml_int64_ops, 8, 0);
-READ_BOXED(int, 56, caml_int64_ops, 8, 1);
-READ_BOXED(int, 48, caml_int64_ops, 8, 2);
-READ_BOXED(int, 40, caml_int64_ops, 8, 3);
-READ_BOXED(int, 32, caml_int32_ops, 4, 0);
-READ_UNBOXED_INT(int, 24, 32);
-READ_UNBOXED_INT(int, 16, 16);
-READ_UNBOXED_INT(int, 8, 8);
+// All the integer types, for both the read_* and the peek_* accessors:
+#define FOR_ALL_INTS(BOXED, UNBOXED_INT) \
+  BOXED(uint, 128, uint128_ops, 16, 0) \
+  BOXED(uint, 64, uint64_ops, 8, 0) \
+  BOXED(uint, 56, uint64_ops, 8, 1) \
+  BOXED(uint, 48, uint64_ops, 8, 2) \
+  BOXED(uint, 40, uint64_ops, 8, 3) \
+  BOXED(uint, 32, uint32_ops, 4, 0) \
+  UNBOXED_INT(uint, 24, 32) \
+  UNBOXED_INT(uint, 16, 16) \
+  UNBOXED_INT(uint, 8, 8) \
+  BOXED(int, 128, int128_ops, 16, 0) \
+  BOXED(int, 64, caml_int64_ops, 8, 0) \
+  BOXED(int, 56, caml_int64_ops, 8, 1) \
+  BOXED(int, 48, caml_int64_ops, 8, 2) \
+  BOXED(int, 40, caml_int64_ops, 8, 3) \
+  BOXED(int, 32, caml_int32_ops, 4, 0) \
+  UNBOXED_INT(int, 24, 32) \
+  UNBOXED_INT(int, 16, 16) \
+  UNBOXED_INT(int, 8, 8)
+
+FOR_ALL_INTS(READ_BOXED, READ_UNBOXED_INT)
 
 CAMLprim value read_ip(value tx, value off_)
 {
@@ -873,6 +1186,81 @@ CAMLprim value read_str(value tx, value off_)
   CAMLreturn(v);
 }
 
+/* Zero-copy accessors.
+ * The peek_* functions read a value straight from the mmapped record without
+ * any bound check. The caller is supposed to have validated once for the
+ * whole tx, with wrap_ringbuf_tx_check_range, the range of bytes it is going
+ * to peek into. Those reading small integers neither allocate nor raise. */
+
+CAMLprim value wrap_ringbuf_tx_check_range(value tx, value offs_, value size_)
+{
+  CAMLparam3(tx, offs_, size_);
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  size_t const offs = Long_val(offs_);
+  size_t const size = Long_val(size_);
+  if (offs + size > wrtx->alloced) {
+    TIMED_PRINT("%d: ERROR while checking %s: offs (%zu) + size (%zu) > alloced (%zu)\n", (int)getpid(), wrtx->rb ? wrtx->rb->fname : "bytes", offs, size, wrtx->alloced);
+    fflush(stdout);
+    assert(exceptions_inited);
+    caml_raise_constant(*exn_Damaged);
+  }
+  CAMLreturn(Val_unit);
+}
+
+/* For natively compiled code that wants to peek into the current record by
+ * itself (see CodeGen_CPP): returns the start of the record and sets *size to
+ * its length. Neither allocates nor raises. */
+uint8_t const *wrap_ringbuf_tx_record(value tx, size_t *size)
+{
+  struct wrap_ringbuf_tx const *wrtx = RingbufTx_val(tx);
+  *size = wrtx->alloced;
+  return where_to(wrtx, 0);
+}
+
+static inline void peek_words(struct wrap_ringbuf_tx const *wrtx, size_t offs, char *dst, size_t size)
+{
+  assert(offs + size <= wrtx->alloced);
+  memcpy(dst, where_to(wrtx, offs), size);
+}
+
+#define PEEK_BOXED(int_type, bits, ops, custom_sz, dst_offset) \
+  ACCESS_BOXED(peek, peek_words, int_type, bits, ops, custom_sz, dst_offset)
+
+/* Small integers are read in place, from the (word aligned) word they start
+ * in, and sign extended if needed. No CAMLparam since those are noalloc: */
+#define PEEK_UNBOXED_INT(int_type, bits, int_bits) \
+CAMLprim value peek_##int_type##bits(value tx, value off_) \
+{ \
+  struct wrap_ringbuf_tx const *wrtx = RingbufTx_val(tx); \
+  size_t offs = Long_val(off_); \
+  assert(offs + bits / 8 <= wrtx->alloced); \
+  uint32_t const w = *(uint32_t const *)where_to(wrtx, offs); \
+  /* In little endian: */ \
+  int_type##32_t const v = (int_type##32_t)(w << (32 - bits)) >> (32 - bits); \
+  return Val_long(v); \
+}
+
+FOR_ALL_INTS(PEEK_BOXED, PEEK_UNBOXED_INT)
+
+CAMLprim value peek_word(value tx, value off_)
+{
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  size_t offs = Long_val(off_);
+  uint32_t v;
+  peek_words(wrtx, offs, (char *)&v, sizeof v);
+  return Val_long(v);
+}
+
+CAMLprim value peek_float(value tx, value off_)
+{
+  CAMLparam2(tx, off_);
+  struct wrap_ringbuf_tx *wrtx = RingbufTx_val(tx);
+  size_t offs = Long_val(off_);
+  double v;
+  peek_words(wrtx, offs, (char *)&v, sizeof v);
+  CAMLreturn(caml_copy_double(v));
+}
+
 /* These four should not be here but in an additional misc lib. */
 
 CAMLprim value wrap_strtod(value str_)
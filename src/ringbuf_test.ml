@@ -36,6 +36,140 @@ let test1 () =
   write_string tx 0 str ;
   enqueue_commit tx 0. 0.
 
+(* Batched enqueue/dequeue *)
+let test_batch () =
+  if debug then Printf.printf "Batch test...\n%!" ;
+  ignore_exceptions Files.unlink rb_fname ;
+  create ~words:100 rb_fname ;
+  let rb = load rb_fname in
+  let sizes = [| 4 ; 8 ; 4 |] in
+  let tx = enqueue_alloc_batch rb sizes in
+  assert (tx_num_records tx = 3) ;
+  let rec write i =
+    assert (tx_size tx = sizes.(i)) ;
+    write_u32 tx 0 (Uint32.of_int i) ;
+    if batch_next tx then write (i + 1) else i in
+  assert (write 0 = 2) ;
+  enqueue_commit tx 0. 0. ;
+  assert ((stats rb).alloc_count = 3) ;
+  (* Dequeue the first two only: *)
+  let tx = dequeue_alloc_batch rb 2 in
+  assert (tx_num_records tx = 2) ;
+  assert (read_u32 tx 0 = Uint32.of_int 0) ;
+  assert (batch_next tx) ;
+  assert (tx_size tx = 8) ;
+  assert (read_u32 tx 0 = Uint32.of_int 1) ;
+  assert (not (batch_next tx)) ;
+  dequeue_commit tx ;
+  (* Then the last one, with the non batched API: *)
+  let tx = dequeue_alloc rb in
+  assert (read_u32 tx 0 = Uint32.of_int 2) ;
+  dequeue_commit tx ;
+  (match dequeue_alloc_batch rb 10 with
+  | exception Empty -> ()
+  | _ -> assert false) ;
+  unload rb
+
+(* Records enqueued straight from a buffer, as tunneld does with the frames
+ * it receives: *)
+let test_enqueue_records () =
+  if debug then Printf.printf "Enqueue records test...\n%!" ;
+  ignore_exceptions Files.unlink rb_fname ;
+  create ~words:100 rb_fname ;
+  let rb = load rb_fname in
+  let set_u32 b offs v =
+    for i = 0 to 3 do
+      Bytes.set b (offs + i) (Char.chr ((v lsr (8 * i)) land 0xff))
+    done in
+  (* 20 records of 8 bytes, each taking 3 words in the ringbuf: *)
+  let num_records = 20 in
+  let frame = Bytes.create (num_records * 12) in
+  for i = 0 to num_records - 1 do
+    set_u32 frame (i * 12) 8 ;
+    set_u32 frame (i * 12 + 4) i ;
+    set_u32 frame (i * 12 + 8) (-i)
+  done ;
+  (* Batches are limited to half the ringbuf: *)
+  let consumed = enqueue_records rb frame 0 (Bytes.length frame) in
+  assert (consumed = 16 * 12) ;
+  assert (enqueue_records rb frame consumed (Bytes.length frame - consumed) =
+          Bytes.length frame - consumed) ;
+  assert ((stats rb).alloc_count = num_records) ;
+  for i = 0 to num_records - 1 do
+    let tx = dequeue_alloc rb in
+    assert (tx_size tx = 8) ;
+    assert (read_u32 tx 0 = Uint32.of_int i) ;
+    dequeue_commit tx
+  done ;
+  (* Truncated records are rejected: *)
+  (match enqueue_records rb frame 0 10 with
+  | exception Invalid_argument _ -> ()
+  | _ -> assert false) ;
+  unload rb
+
+(* Broadcast ringbuffers: every consumer reads every message, and space is
+ * given back to writers only after the slowest one: *)
+let test_broadcast () =
+  if debug then Printf.printf "Broadcast test...\n%!" ;
+  ignore_exceptions Files.unlink rb_fname ;
+  create ~words:100 ~consumers:2 rb_fname ;
+  let writer = load rb_fname
+  and reader1 = load rb_fname
+  and reader2 = load rb_fname in
+  register_consumer reader1 ;
+  register_consumer reader2 ;
+  (* Only two slots: *)
+  let reader3 = load rb_fname in
+  (match register_consumer reader3 with
+  | exception Failure _ -> ()
+  | () -> assert false) ;
+  unload reader3 ;
+  let st = stats writer in
+  assert (st.max_consumers = 2) ;
+  assert (Array.length st.consumers = 2) ;
+  let enqueue_u32 i =
+    let tx = enqueue_alloc writer 4 in
+    write_u32 tx 0 (Uint32.of_int i) ;
+    enqueue_commit tx 0. 0. in
+  let dequeue_u32 rb =
+    let tx = dequeue_alloc rb in
+    let i = read_u32 tx 0 |> Uint32.to_int in
+    dequeue_commit tx ;
+    i in
+  enqueue_u32 1 ;
+  enqueue_u32 2 ;
+  assert (dequeue_u32 reader1 = 1) ;
+  assert (dequeue_u32 reader1 = 2) ;
+  (match dequeue_alloc reader1 with
+  | exception Empty -> ()
+  | _ -> assert false) ;
+  (* Nothing has been reclaimed yet: *)
+  assert ((stats writer).alloced_words = 4) ;
+  assert (dequeue_u32 reader2 = 1) ;
+  assert ((stats writer).alloced_words = 2) ;
+  assert (dequeue_u32 reader2 = 2) ;
+  assert ((stats writer).alloced_words = 0) ;
+  (* A slow consumer eventually blocks the writer: *)
+  let rec fill n =
+    match enqueue_u32 n with
+    | exception NoMoreRoom -> n
+    | () -> fill (n + 1) in
+  let n = fill 0 in
+  assert (n > 0) ;
+  for i = 0 to n - 1 do assert (dequeue_u32 reader1 = i) done ;
+  (match enqueue_u32 n with
+  | exception NoMoreRoom -> ()
+  | () -> assert false) ;
+  (* Until it leaves: *)
+  unregister_consumer reader2 ;
+  enqueue_u32 n ;
+  assert (dequeue_u32 reader1 = n) ;
+  assert (reap_consumers writer = 1) ;
+  unload reader1 ;
+  unload reader2 ;
+  assert (reap_consumers writer = 0) ;
+  unload writer
+
 (* Concurrent access tests *)
 let test2 () =
   if debug then Printf.printf "Concurrency test...\n%!" ;
@@ -123,4 +257,7 @@ let test2 () =
 let () =
   Random.self_init () ;
   test1 () ;
+  test_batch () ;
+  test_enqueue_records () ;
+  test_broadcast () ;
   test2 ()